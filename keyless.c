@@ -28,6 +28,7 @@
 #include <openssl/engine.h>
 
 #include <stdarg.h>
+#include <string.h>
 
 #include "kssl_getopt.h"
 
@@ -35,6 +36,21 @@
 #include "kssl_private_key.h"
 #include "kssl_core.h"
 #include "kssl_thread.h"
+#include "kssl_metrics.h"
+#include "kssl_trace.h"
+#include "kssl_binlog.h"
+#include "kssl_capture.h"
+#include "kssl_probes.h"
+#include "kssl_locks.h"
+#include "kssl_memory.h"
+#include "kssl_perf.h"
+#include "kssl_timestamp.h"
+#include "kssl_upgrade.h"
+#include "kssl_process.h"
+#include "kssl_clients.h"
+#include "kssl_admin.h"
+#include "kssl_stats.h"
+#include "kssl_health.h"
 
 // This defines argv[0] without the calling path
 #define PROGRAM_NAME "keyless"
@@ -94,39 +110,22 @@ const char *error_string(int e)
 pk_list privates = 0;
 char *pk_dir = NULL;
 uv_rwlock_t *pk_lock;
-SSL_CTX *g_ctx;
 
-// Load all the private keys found in the pk_dir. This only
-// looks for files that end with .key and the part before the .key is taken
-// to be the DNS name.
-static void load_private_keys(SSL_CTX *ctx)
+// load_key_files: load every private key file matching pattern. Returns
+// a new list or NULL, having logged the reason, if they could not all be
+// loaded.
+static pk_list load_key_files(const char *pattern)
 {
-  char *pattern;
+  pk_list list;
   int privates_count, i;
 #if PLATFORM_WINDOWS
   WIN32_FIND_DATA FindFileData;
   HANDLE hFind;
-  const char *starkey = "\\*.key";
-#else
-  int rc;
-  glob_t g;
-  const char *starkey = "/*.key";
-#endif
-  uv_rwlock_wrlock(pk_lock);
-
-  pattern = (char *)malloc(strlen(pk_dir) + strlen(starkey) + 1);
-  if (pattern == NULL) {
-    SSL_CTX_free(ctx);
-    fatal_error("Memory allocatione error");
-  }
-  strcpy(pattern, pk_dir);
-  strcat(pattern, starkey);
 
-#if PLATFORM_WINDOWS
   hFind = FindFirstFile(pattern, &FindFileData);
   if (hFind == INVALID_HANDLE_VALUE) {
-    SSL_CTX_free(ctx);
-    fatal_error("Error %d finding private keys in %s", hFind, pk_dir);
+    write_log(1, "Error %d finding private keys in %s", hFind, pk_dir);
+    return NULL;
   }
 
   // count the number of files
@@ -136,63 +135,112 @@ static void load_private_keys(SSL_CTX *ctx)
   }
   FindClose(hFind);
 
-  privates = new_pk_list(privates_count);
-  if (privates == NULL) {
-    SSL_CTX_free(ctx);
-    fatal_error("Failed to allocate room for private keys");
+  list = new_pk_list(privates_count);
+  if (list == NULL) {
+    write_log(1, "Failed to allocate room for private keys");
+    return NULL;
   }
 
   hFind = FindFirstFile(pattern, &FindFileData);
   for (i = 0; i < privates_count; ++i) {
     char *path = (char *)malloc(strlen(pk_dir) + 1 +
                                 strlen(FindFileData.cFileName) + 1);
+    if (path == NULL) {
+      write_log(1, "Memory allocation error");
+      break;
+    }
     strcpy(path, pk_dir);
     strcat(path, "\\");
     strcat(path, FindFileData.cFileName);
-    if (add_key_from_file(path, privates) != 0) {
-      SSL_CTX_free(ctx);
-      fatal_error("Failed to add private keys");
+    if (add_key_from_file(path, list) != 0) {
+      write_log(1, "Failed to add private key %s", path);
+      free(path);
+      break;
     }
     FindNextFile(hFind, &FindFileData);
     free(path);
   }
   FindClose(hFind);
 #else
+  int rc;
+  glob_t g;
+
   g.gl_pathc  = 0;
   g.gl_offs   = 0;
 
   rc = glob(pattern, GLOB_NOSORT, 0, &g);
 
-  if (rc != 0) {
-    SSL_CTX_free(ctx);
-    fatal_error("Error %d finding private keys in %s", rc, pk_dir);
+  if (rc == GLOB_NOMATCH || (rc == 0 && g.gl_pathc == 0)) {
+    write_log(1, "Failed to find any private keys in %s", pk_dir);
+    globfree(&g);
+    return NULL;
   }
 
-  if (g.gl_pathc == 0) {
-    SSL_CTX_free(ctx);
-    fatal_error("Failed to find any private keys in %s", pk_dir);
+  if (rc != 0) {
+    write_log(1, "Error %d finding private keys in %s", rc, pk_dir);
+    globfree(&g);
+    return NULL;
   }
 
   privates_count = g.gl_pathc;
-  privates = new_pk_list(privates_count);
-  if (privates == NULL) {
-    SSL_CTX_free(ctx);
-    fatal_error("Failed to allocate room for private keys");
+  list = new_pk_list(privates_count);
+  if (list == NULL) {
+    write_log(1, "Failed to allocate room for private keys");
+    globfree(&g);
+    return NULL;
   }
 
   for (i = 0; i < privates_count; ++i) {
     write_log(0, "loading key: %s", g.gl_pathv[i]);
-    if (add_key_from_file(g.gl_pathv[i], privates) != 0) {
-      SSL_CTX_free(ctx);
-      fatal_error("Failed to add private keys");
+    if (add_key_from_file(g.gl_pathv[i], list) != 0) {
+      write_log(1, "Failed to add private key %s", g.gl_pathv[i]);
+      break;
     }
   }
 
   globfree(&g);
 #endif
 
-  free(pattern);
-  uv_rwlock_wrunlock(pk_lock);
+  // A partial list is never installed
+
+  if (i < privates_count) {
+    free_pk_list(list);
+    return NULL;
+  }
+
+  return list;
+}
+
+// Load all the private keys found in the pk_dir. This only
+// looks for files that end with .key and the part before the .key is taken
+// to be the DNS name. Returns a new list (see install_private_keys) or
+// NULL, having logged the reason, if the keys could not all be loaded.
+// Failing is not fatal here so that a reload cannot take down a keyless
+// that is serving with its current keys.
+static pk_list load_private_keys(void)
+{
+  char *pattern;
+  pk_list list = NULL;
+#if PLATFORM_WINDOWS
+  const char *starkey = "\\*.key";
+#else
+  const char *starkey = "/*.key";
+#endif
+  KSSL_PROBE0(reload__start);
+
+  pattern = (char *)malloc(strlen(pk_dir) + strlen(starkey) + 1);
+  if (pattern == NULL) {
+    write_log(1, "Memory allocation error");
+  } else {
+    strcpy(pattern, pk_dir);
+    strcat(pattern, starkey);
+    list = load_key_files(pattern);
+    free(pattern);
+  }
+
+  KSSL_PROBE1(reload__done, (list != NULL)?key_count(list):0);
+
+  return list;
 }
 
 // This defines the maximum number of workers to create
@@ -204,44 +252,846 @@ int num_workers = DEFAULT_WORKERS;
 
 worker_data worker[MAX_WORKERS];
 
+// One metrics shard per worker and the endpoint (if enabled by
+// --metrics-port or --metrics-socket) that serves them
+
+kssl_metrics *metrics = NULL;
+metrics_server *metrics_endpoint = NULL;
+int metrics_port = 0;
+char *metrics_socket = 0;
+
+// Per worker counters published for keylesstop (if --stats-file is
+// used)
+
+char *stats_file = 0;
+kssl_live_stats *live_stats = NULL;
+
+// The health endpoint (if enabled by --health-port or --health-socket).
+// The port is on the --ip address so that load balancers can reach it.
+
+health_server *health_endpoint = NULL;
+int health_port = 0;
+char *health_socket = 0;
+struct sockaddr_in health_addr;
+
+// One table of per client totals per worker (if --client-accounting is
+// used)
+
+kssl_client_table *clients = NULL;
+
 // This is the TCP connection on which we listen for TLS connections
 
 uv_tcp_t tcp_server;
 
-// sighup_cb: handle SIGHUP and reload files on disk.
+// Watches for SIGHUP in the main thread
+
+uv_signal_t sighup_watcher;
+
+// Watches for SIGTERM in the main thread
+
+uv_signal_t sigterm_watcher;
+
+#if !PLATFORM_WINDOWS
+// Watches for SIGUSR2, which starts an upgrade, in the main thread
+
+uv_signal_t sigusr2_watcher;
+
+// A copy of the listening socket kept to pass on in an upgrade, and the
+// executable and arguments the new keyless is started with
+
+int listen_fd = -1;
+char *upgrade_file = 0;
+char **upgrade_args = 0;
+#endif
+
+// With --processes the number of child processes and, in a child, its
+// index (see kssl_process.h). A child's metrics shards are its slice of
+// the shared shards.
+
+int num_processes = 0;
+int process_index = -1;
+kssl_metrics *shared_metrics = NULL;
+
+// Seconds over which connections are closed once a new keyless has
+// taken over (--drain-seconds)
+
+int drain_seconds = 30;
+
+// Number of keys to report per key statistics for (--key-stats-top). 0
+// disables per key statistics.
+
+int key_stats_top = 0;
+
+// install_private_keys: make list the current set of private keys. The
+// old list is only replaced and freed once no worker can be using it;
+// per key statistics of keys that are in both lists are carried over.
+static void install_private_keys(pk_list list)
+{
+  pk_list old;
+
+  if (key_stats_top > 0 && key_stats_enable(list, num_workers) != 0) {
+    write_log(1, "Failed to allocate per key statistics");
+  }
+
+  uv_rwlock_wrlock(pk_lock);
+  old = privates;
+  if (old != NULL) {
+    key_stats_migrate(list, old);
+  }
+  privates = list;
+  uv_rwlock_wrunlock(pk_lock);
+
+  free_pk_list(old);
+}
+
+// sighup_cb: handle SIGHUP and reload files on disk. If the keys cannot
+// all be loaded the current ones are kept.
 void sighup_cb(uv_signal_t *w, int signum)
 {
-  free_pk_list(privates);
-  load_private_keys(g_ctx);
+  pk_list list = load_private_keys();
+
+  if (list == NULL) {
+    write_log(1, "Keeping the current private keys");
+    return;
+  }
+
+  install_private_keys(list);
 }
 
-// sigterm_cb: handle SIGTERM and terminates program cleanly. The
-// actual termination is handled in main once the uv_run has
-// exited. That will happen when this is called because we call
-// uv_signal_stop which is the last event handler running in the main
-// thread.
-void sigterm_cb(uv_signal_t *w, int signum)
+// render_metrics: produce the body of a response to a metrics scrape
+void render_metrics(metrics_buffer *b)
+{
+  metrics_render(b, metrics, num_workers);
+  metrics_render_log(b);
+  locks_render(b);
+  memory_render(b);
+  clients_render(b, clients, num_workers);
+
+  if (key_stats_top > 0) {
+    uv_rwlock_rdlock(pk_lock);
+    metrics_render_keys(b, privates, key_stats_top);
+    uv_rwlock_rdunlock(pk_lock);
+  }
+}
+
+// check_health: answer a health check from the workers' shards and the
+// keys loaded. Only the main thread replaces privates so it is read here
+// without pk_lock.
+int check_health(metrics_buffer *b)
+{
+  int ready = health_check_workers(b, metrics, num_workers);
+
+  if (privates == NULL || key_count(privates) == 0) {
+    metrics_printf(b, "no private keys loaded\n");
+    ready = 0;
+  }
+
+  return ready;
+}
+
+// health_start: start the health endpoint answering with check on the
+// listening sockets in fds (if not NULL) or ones bound here
+health_server *health_start(uv_loop_t *loop, const int *fds,
+                            health_check_cb check)
+{
+  return health_listen(loop, (health_port != 0)?&health_addr:NULL,
+                       health_socket, fds, check);
+}
+
+#ifdef SIGUSR1
+// Watches for SIGUSR1 in the main thread when --lock-profile or
+// --perf-counters is used
+
+uv_signal_t sigusr1_watcher;
+
+// sigusr1_cb: handle SIGUSR1 by logging the OpenSSL lock profile and the
+// performance counters per request
+void sigusr1_cb(uv_signal_t *w, int signum)
+{
+  locks_dump();
+  metrics_dump_perf(metrics, num_workers);
+}
+#endif
+
+// The admin socket (--admin-socket) and, while a command is waiting for
+// the workers to carry out a worker_request, the command and the
+// function to continue it with once they have
+
+admin_server *admin_endpoint = NULL;
+char *admin_socket = 0;
+uv_async_t admin_async;
+admin_request *admin_waiting = NULL;
+void (*admin_then)(admin_request *r) = NULL;
+
+// Which workers the waiting command was sent to and the reports they
+// write. The reports are only freed at exit because a worker may still be
+// writing one when a command is abandoned at shutdown.
+
+int admin_asked[MAX_WORKERS];
+metrics_buffer admin_reports[MAX_WORKERS];
+
+// admin_ask: send worker i a request for report that closes up to close
+// quiet connections. The accept setting is left as it is.
+static void admin_ask(int i, int report, int close)
+{
+  worker_request *q = &worker[i].request;
+
+  admin_reports[i].len = 0;
+  q->report = report;
+  q->close = close;
+  q->out = &admin_reports[i];
+  KSSL_STORE_RELEASE(&q->finished, 0);
+  admin_asked[i] = 1;
+
+  if (worker_control(&worker[i]) != 0) {
+    write_log(1, "Failed to send admin request to worker %d", i);
+    q->finished = 1;
+  }
+}
+
+// admin_wait: continue r with then once every worker asked has answered
+static void admin_wait(admin_request *r, void (*then)(admin_request *r))
+{
+  admin_waiting = r;
+  admin_then = then;
+  uv_async_send(&admin_async);
+}
+
+// admin_async_cb: a worker has carried out its request
+void admin_async_cb(uv_async_t *handle)
+{
+  admin_request *r = admin_waiting;
+  void (*then)(admin_request *r) = admin_then;
+  int i;
+
+  if (r == NULL) {
+    return;
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    if (admin_asked[i] && !KSSL_LOAD_ACQUIRE(&worker[i].request.finished)) {
+      return;
+    }
+  }
+
+  admin_waiting = NULL;
+  admin_then = NULL;
+  then(r);
+}
+
+// admin_reports_done: answer r with the reports written by the workers
+static void admin_reports_done(admin_request *r)
+{
+  int i;
+
+  for (i = 0; i < num_workers; i++) {
+    if (admin_asked[i] && admin_reports[i].len > 0) {
+      admin_printf(r, "%s", admin_reports[i].data);
+    }
+  }
+  admin_done(r, NULL);
+}
+
+// admin_rebalance_done: answer r with the number of connections closed
+static void admin_rebalance_done(admin_request *r)
+{
+  int i, closed = 0;
+
+  for (i = 0; i < num_workers; i++) {
+    if (admin_asked[i]) {
+      closed += worker[i].request.closed;
+    }
+  }
+  admin_printf(r, "closed %d\n", closed);
+  admin_done(r, NULL);
+}
+
+// admin_rebalance_close: with the count of connections on each worker
+// known, close quiet connections on workers that have more than their
+// share so that their clients reconnect and are accepted by a worker
+// with fewer. Workers that are not accepting have no share.
+static void admin_rebalance_close(admin_request *r)
+{
+  int i, open = 0, accepting = 0, share, excess, asked = 0;
+
+  for (i = 0; i < num_workers; i++) {
+    open += worker[i].request.open;
+    accepting += worker[i].request.accept;
+  }
+
+  if (accepting == 0) {
+    admin_done(r, "no worker is accepting connections");
+    return;
+  }
+
+  share = (open + accepting - 1) / accepting;
+  for (i = 0; i < num_workers; i++) {
+    admin_asked[i] = 0;
+    excess = worker[i].request.open;
+    if (worker[i].request.accept) {
+      excess -= share;
+    }
+    if (excess > 0 && worker[i].request.quiet > 0) {
+      admin_ask(i, WORKER_REPORT_NONE, excess);
+      asked += 1;
+    }
+  }
+
+  if (asked == 0) {
+    admin_rebalance_done(r);
+    return;
+  }
+  admin_wait(r, admin_rebalance_done);
+}
+
+// admin_ski_hex: write the SKI of key_id in list in hex into hex
+static char *admin_ski_hex(pk_list list, int key_id, char *hex)
+{
+  BYTE *ski = key_ski(list, key_id);
+  int i;
+
+  for (i = 0; i < KSSL_SKI_SIZE; i++) {
+    snprintf(&hex[i * 2], 3, "%02x", ski[i]);
+  }
+  return hex;
+}
+
+// admin_keys: list the keys with their statistics if --key-stats-top is
+// used. The main thread is the only one that replaces the keys so no
+// lock is needed to read them here.
+static void admin_keys(admin_request *r)
+{
+  char hex[KSSL_SKI_SIZE * 2 + 1];
+  kssl_key_stats stats;
+  uint64_t ops;
+  int i, j;
+
+  for (i = 0; i < key_count(privates); i++) {
+    admin_printf(r, "key %s bits %d", admin_ski_hex(privates, i, hex),
+                 key_bits(privates, i));
+    if (key_stats_get(privates, i, &stats) == 0) {
+      ops = 0;
+      for (j = 0; j < KSSL_KEY_OPS; j++) {
+        ops += stats.ops[j];
+      }
+      admin_printf(r, " requests %llu errors %llu crypto_ms %llu",
+                   (unsigned long long)ops,
+                   (unsigned long long)stats.errors,
+                   (unsigned long long)(stats.crypto_ns / 1000000));
+    }
+    admin_printf(r, "\n");
+  }
+  admin_done(r, NULL);
+}
+
+// admin_key_add: load the key in path and add it to the current keys
+static void admin_key_add(admin_request *r, const char *path)
+{
+  char hex[KSSL_SKI_SIZE * 2 + 1];
+  pk_list list = copy_pk_list(privates, 1);
+  int id;
+
+  if (list == NULL) {
+    admin_done(r, "out of memory");
+    return;
+  }
+
+  if (add_key_from_file(path, list) != KSSL_ERROR_NONE) {
+    free_pk_list(list);
+    admin_done(r, "failed to load key (see log)");
+    return;
+  }
+
+  id = key_count(list) - 1;
+  if (find_private_key(list, key_ski(list, id), NULL) != id) {
+    free_pk_list(list);
+    admin_done(r, "key already loaded");
+    return;
+  }
+
+  admin_printf(r, "key %s added\n", admin_ski_hex(list, id, hex));
+  write_log(0, "Admin added key %s from %s", hex, path);
+  install_private_keys(list);
+  admin_done(r, NULL);
+}
+
+// admin_key_remove: remove the key whose SKI is the hex string ski
+static void admin_key_remove(admin_request *r, const char *ski)
+{
+  BYTE bytes[KSSL_SKI_SIZE];
+  unsigned int b;
+  pk_list list;
+  int i;
+
+  if (strlen(ski) != KSSL_SKI_SIZE * 2 ||
+      strspn(ski, "0123456789abcdefABCDEF") != KSSL_SKI_SIZE * 2) {
+    admin_done(r, "SKI must be 40 hex digits");
+    return;
+  }
+  for (i = 0; i < KSSL_SKI_SIZE; i++) {
+    sscanf(&ski[i * 2], "%2x", &b);
+    bytes[i] = (BYTE)b;
+  }
+
+  list = copy_pk_list(privates, 0);
+  if (list == NULL) {
+    admin_done(r, "out of memory");
+    return;
+  }
+
+  if (remove_private_key(list, bytes) != 0) {
+    free_pk_list(list);
+    admin_done(r, "no such key");
+    return;
+  }
+
+  write_log(0, "Admin removed key %s", ski);
+  install_private_keys(list);
+  admin_done(r, NULL);
+}
+
+// admin_number: parse a non-negative number from s into *n. Returns 0 on
+// success.
+static int admin_number(const char *s, int *n)
+{
+  char *end;
+  long v = strtol(s, &end, 10);
+
+  if (*s == '\0' || *end != '\0' || v < 0 || v > 1000000000) {
+    return -1;
+  }
+  *n = (int)v;
+  return 0;
+}
+
+// admin_command: handle a command from the admin socket (see the Admin
+// Socket section of README.md)
+void admin_command(admin_request *r, int argc, char **argv)
+{
+  int i, n;
+
+  if (strcmp(argv[0], "help") == 0) {
+    admin_printf(r,
+"workers [N]            Show the workers, or accept on only the first N\n"
+"connections [WORKER]   Show the connections of one or every worker\n"
+"rebalance              Close quiet connections on busy workers\n"
+"keys                   Show the private keys\n"
+"key add FILE           Load a private key\n"
+"key remove SKI         Remove a private key\n"
+"reload                 Reload the private key directory (as SIGHUP)\n"
+"log silent|normal|verbose\n"
+"log sample N           Write one in N access log records\n"
+"trace slow MS          Log requests slower than MS (0 turns it off)\n"
+"trace sample N         Write one in N requests to the trace file\n");
+    admin_done(r, NULL);
+    return;
+  }
+
+  // Commands carried out by the workers are one at a time across every
+  // connection because the workers have a single request each
+
+  if (strcmp(argv[0], "workers") == 0 ||
+      strcmp(argv[0], "connections") == 0 ||
+      strcmp(argv[0], "rebalance") == 0) {
+    if (admin_waiting != NULL) {
+      admin_done(r, "busy");
+      return;
+    }
+
+    if (strcmp(argv[0], "workers") == 0) {
+      if (argc > 2 || (argc == 2 && (admin_number(argv[1], &n) != 0 ||
+                                     n < 1 || n > num_workers))) {
+        admin_printf(r, "usage: workers [1-%d]\n", num_workers);
+        admin_done(r, "bad arguments");
+        return;
+      }
+      for (i = 0; i < num_workers; i++) {
+        if (argc == 2) {
+          worker[i].request.accept = (i < n);
+        }
+        admin_ask(i, WORKER_REPORT_SUMMARY, 0);
+      }
+      admin_wait(r, admin_reports_done);
+    } else if (strcmp(argv[0], "connections") == 0) {
+      if (argc > 2 || (argc == 2 && (admin_number(argv[1], &n) != 0 ||
+                                     n >= num_workers))) {
+        admin_printf(r, "usage: connections [0-%d]\n", num_workers - 1);
+        admin_done(r, "bad arguments");
+        return;
+      }
+      for (i = 0; i < num_workers; i++) {
+        admin_asked[i] = 0;
+        if (argc == 1 || i == n) {
+          admin_ask(i, WORKER_REPORT_CONNECTIONS, 0);
+        }
+      }
+      admin_wait(r, admin_reports_done);
+    } else {
+      for (i = 0; i < num_workers; i++) {
+        admin_ask(i, WORKER_REPORT_NONE, 0);
+      }
+      admin_wait(r, admin_rebalance_close);
+    }
+    return;
+  }
+
+  if (strcmp(argv[0], "keys") == 0 && argc == 1) {
+    admin_keys(r);
+  } else if (strcmp(argv[0], "key") == 0 && argc == 3 &&
+             strcmp(argv[1], "add") == 0) {
+    admin_key_add(r, argv[2]);
+  } else if (strcmp(argv[0], "key") == 0 && argc == 3 &&
+             strcmp(argv[1], "remove") == 0) {
+    admin_key_remove(r, argv[2]);
+  } else if (strcmp(argv[0], "reload") == 0 && argc == 1) {
+    pk_list list = load_private_keys();
+
+    if (list == NULL) {
+      admin_done(r, "failed to load keys, current keys kept (see log)");
+    } else {
+      install_private_keys(list);
+      admin_printf(r, "%d keys\n", key_count(privates));
+      admin_done(r, NULL);
+    }
+  } else if (strcmp(argv[0], "log") == 0 && argc == 2 &&
+             strcmp(argv[1], "silent") == 0) {
+    silent = 1;
+    verbose = 0;
+    admin_done(r, NULL);
+  } else if (strcmp(argv[0], "log") == 0 && argc == 2 &&
+             strcmp(argv[1], "normal") == 0) {
+    silent = 0;
+    verbose = 0;
+    admin_done(r, NULL);
+  } else if (strcmp(argv[0], "log") == 0 && argc == 2 &&
+             strcmp(argv[1], "verbose") == 0) {
+    silent = 0;
+    verbose = 1;
+    admin_done(r, NULL);
+  } else if (strcmp(argv[0], "log") == 0 && argc == 3 &&
+             strcmp(argv[1], "sample") == 0) {
+    if (admin_number(argv[2], &n) != 0 || n < 1) {
+      admin_done(r, "the sample must be at least 1");
+      return;
+    }
+    log_sample = n;
+    admin_done(r, NULL);
+  } else if (strcmp(argv[0], "trace") == 0 && argc == 3 &&
+             strcmp(argv[1], "slow") == 0) {
+    if (admin_number(argv[2], &n) != 0) {
+      admin_done(r, "the threshold must be a number of milliseconds");
+      return;
+    }
+    trace_set_slow((unsigned int)n);
+    admin_done(r, NULL);
+  } else if (strcmp(argv[0], "trace") == 0 && argc == 3 &&
+             strcmp(argv[1], "sample") == 0) {
+    if (admin_number(argv[2], &n) != 0 || n < 1) {
+      admin_done(r, "the sample must be at least 1");
+      return;
+    }
+    trace_set_sample(n);
+    admin_done(r, NULL);
+  } else {
+    admin_done(r, "unknown command (try help)");
+  }
+}
+
+// admin_stop: answer any command waiting for the workers and close the
+// admin socket
+static void admin_stop(void)
+{
+  admin_request *r = admin_waiting;
+
+  if (r != NULL) {
+    admin_waiting = NULL;
+    admin_then = NULL;
+    admin_done(r, "shutting down");
+  }
+
+  admin_close(admin_endpoint);
+  admin_endpoint = NULL;
+}
+
+// stop_main_loop: stop and close every handle that is running in the
+// main thread (the signal watchers, the metrics and health endpoints and
+// the admin socket) so that uv_run returns in main, which then stops the
+// workers
+void stop_main_loop(void)
 {
-  int rc = uv_signal_stop(w);
-  uv_close((uv_handle_t *)w, NULL);
+  int rc = uv_signal_stop(&sigterm_watcher);
+  uv_close((uv_handle_t *)&sigterm_watcher, NULL);
   if (rc != 0) {
     write_log(1, "Failed to stop SIGTERM handler: %s",
               error_string(rc));
   }
+
+  uv_close((uv_handle_t *)&sighup_watcher, NULL);
+
+#ifdef SIGUSR1
+  if (uv_is_active((uv_handle_t *)&sigusr1_watcher)) {
+    uv_close((uv_handle_t *)&sigusr1_watcher, NULL);
+  }
+#endif
+
+#if !PLATFORM_WINDOWS
+  if (uv_is_active((uv_handle_t *)&sigusr2_watcher)) {
+    uv_close((uv_handle_t *)&sigusr2_watcher, NULL);
+  }
+#endif
+
+  metrics_close(metrics_endpoint);
+  metrics_endpoint = NULL;
+  health_close(health_endpoint);
+  health_endpoint = NULL;
+
+  admin_stop();
+  if (uv_is_active((uv_handle_t *)&admin_async)) {
+    uv_close((uv_handle_t *)&admin_async, NULL);
+  }
 }
 
+// sigterm_cb: handle SIGTERM and terminates program cleanly. The
+// actual termination is handled in main once the uv_run has exited.
+void sigterm_cb(uv_signal_t *w, int signum)
+{
+  stop_main_loop();
+}
+
+#if !PLATFORM_WINDOWS
+// upgrade_done_cb: called when the keyless started by sigusr2_cb is
+// accepting connections or has failed. If it is running this process
+// stops accepting and drains its connections before exiting.
+void upgrade_done_cb(int ok)
+{
+  int i;
+
+  if (!ok) {
+    write_log(1, "Upgrade failed: the new keyless exited before it was "
+              "ready. Continuing to serve.");
+    if (admin_socket != 0) {
+      admin_endpoint = admin_listen(sigusr2_watcher.loop, admin_socket,
+                                    admin_command);
+    }
+    return;
+  }
+
+  write_log(1, "Upgrade complete: draining connections over %d seconds",
+            drain_seconds);
+  metrics_release_path(metrics_endpoint);
+  health_release_path(health_endpoint);
+  for (i = 0; i < num_workers; i++) {
+    worker[i].drain_ns = (uint64_t)drain_seconds * 1000000000ULL;
+  }
+  stop_main_loop();
+}
+
+// sigusr2_cb: handle SIGUSR2 by starting a new keyless from the same
+// executable with the same arguments and handing it the listening
+// sockets. The metrics and health endpoints are passed on too and both
+// processes answer on them until the upgrade is done. The admin socket
+// is closed so that the new process can listen on the same path.
+void sigusr2_cb(uv_signal_t *w, int signum)
+{
+  int rc;
+  int fds[UPGRADE_FDS];
+
+  write_log(1, "Upgrade requested: starting %s", upgrade_file);
+  admin_close(admin_endpoint);
+  admin_endpoint = NULL;
+
+  fds[UPGRADE_LISTEN] = listen_fd;
+  metrics_fds(metrics_endpoint, &fds[UPGRADE_METRICS]);
+  health_fds(health_endpoint, &fds[UPGRADE_HEALTH]);
+
+  rc = upgrade_start(w->loop, upgrade_file, upgrade_args, fds,
+                     upgrade_done_cb);
+  if (rc != 0) {
+    write_log(1, "Failed to start upgrade: %s", strerror(rc));
+    if (rc != EALREADY) {
+      upgrade_done_cb(0);
+    }
+  }
+}
+#endif
+
 void sigpipe_cb(uv_signal_t *w, int signum)
 {
   write_log(1, "Received SIGPIPE signal");
 }
 
+#if !PLATFORM_WINDOWS
+// self_path: returns the path to start another copy of this executable
+// with, which must not depend on the working directory
+char *self_path(char *argv0)
+{
+  char *path;
+
+  if (strchr(argv0, '/') == NULL) {
+    return argv0;
+  }
+
+  path = realpath(argv0, NULL);
+  return (path == NULL)?argv0:path;
+}
+
+// render_supervisor_metrics: produce the body of a response to a metrics
+// scrape in the supervisor. Only the shards are shared by the children;
+// the rest of the metrics are per process.
+void render_supervisor_metrics(metrics_buffer *b)
+{
+  metrics_render(b, metrics, num_processes * num_workers);
+}
+
+// check_supervisor_health: answer a health check in the supervisor from
+// the shards of every child. A child that has exited shows up as workers
+// whose loops have stalled.
+int check_supervisor_health(metrics_buffer *b)
+{
+  return health_check_workers(b, metrics, num_processes * num_workers);
+}
+
+// Set when a child could not start (see supervisor_failed_cb)
+
+int supervisor_failed = 0;
+
+// supervisor_stop: stop the children and close every handle in the
+// supervisor's loop so that it exits once they have
+void supervisor_stop(void)
+{
+  process_stop();
+
+  uv_close((uv_handle_t *)&sigterm_watcher, NULL);
+  uv_close((uv_handle_t *)&sighup_watcher, NULL);
+  if (uv_is_active((uv_handle_t *)&sigusr1_watcher)) {
+    uv_close((uv_handle_t *)&sigusr1_watcher, NULL);
+  }
+
+  metrics_close(metrics_endpoint);
+  metrics_endpoint = NULL;
+  health_close(health_endpoint);
+  health_endpoint = NULL;
+}
+
+// supervisor_sigterm_cb: handle SIGTERM in the supervisor
+void supervisor_sigterm_cb(uv_signal_t *w, int signum)
+{
+  supervisor_stop();
+}
+
+// supervisor_failed_cb: a child could not start. The others are
+// stopped too and the supervisor exits with an error.
+void supervisor_failed_cb(int index)
+{
+  if (!supervisor_failed) {
+    supervisor_failed = 1;
+    supervisor_stop();
+  }
+}
+
+// supervisor_forward_cb: pass SIGHUP (reload keys) or SIGUSR1 (dump
+// profiles) on to the children
+void supervisor_forward_cb(uv_signal_t *w, int signum)
+{
+  process_signal(signum);
+}
+
+// supervise: run as the supervisor of --processes children until
+// SIGTERM. The listening sockets have already been made by
+// process_listen. forward_sigusr1 is set if the children handle SIGUSR1.
+void supervise(char *argv[], int forward_sigusr1)
+{
+  uv_loop_t *loop = uv_loop_new();
+  int metrics_fd;
+  int rc;
+
+  // Writes to metrics clients that have gone must not kill the
+  // supervisor (and with it the children). Upgrading is not supported
+  // with --processes so SIGUSR2 is ignored rather than fatal.
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+
+  metrics = metrics_new_shared(num_processes * num_workers, &metrics_fd);
+  if (metrics == NULL) {
+    fatal_error("Failed to allocate shared metrics");
+  }
+
+  rc = uv_signal_init(loop, &sigterm_watcher);
+  if (rc == 0) {
+    rc = uv_signal_start(&sigterm_watcher, supervisor_sigterm_cb, SIGTERM);
+  }
+  if (rc != 0) {
+    fatal_error("Failed to start SIGTERM watcher: %s", error_string(rc));
+  }
+
+  rc = uv_signal_init(loop, &sighup_watcher);
+  if (rc == 0) {
+    rc = uv_signal_start(&sighup_watcher, supervisor_forward_cb, SIGHUP);
+  }
+  if (rc != 0) {
+    fatal_error("Failed to start SIGHUP watcher: %s", error_string(rc));
+  }
+
+  if (forward_sigusr1) {
+    rc = uv_signal_init(loop, &sigusr1_watcher);
+    if (rc == 0) {
+      rc = uv_signal_start(&sigusr1_watcher, supervisor_forward_cb,
+                           SIGUSR1);
+    }
+    if (rc != 0) {
+      fatal_error("Failed to start SIGUSR1 watcher: %s", error_string(rc));
+    }
+  }
+
+  if (metrics_port != 0 || metrics_socket != 0) {
+    metrics_endpoint = metrics_listen(loop, metrics_port, metrics_socket,
+                                      NULL, render_supervisor_metrics);
+    if (metrics_endpoint == NULL) {
+      fatal_error("Failed to start metrics endpoint");
+    }
+  }
+
+  if (health_port != 0 || health_socket != 0) {
+    health_endpoint = health_start(loop, NULL, check_supervisor_health);
+    if (health_endpoint == NULL) {
+      fatal_error("Failed to start health endpoint");
+    }
+  }
+
+  rc = process_start(loop, self_path(argv[0]), argv, metrics_fd,
+                     supervisor_failed_cb);
+  if (rc != 0) {
+    fatal_error("Failed to start processes: %s", strerror(rc));
+  }
+
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  uv_loop_delete(loop);
+  metrics_unmap(metrics, num_processes * num_workers);
+  close(metrics_fd);
+
+  if (supervisor_failed) {
+    fatal_error("A child process could not start");
+  }
+}
+#endif
+
 // thread_stop_cb: called via async_* to stop a thread
 void thread_stop_cb(uv_async_t *handle)
 {
   worker_data *worker = (worker_data *)handle->data;
 
-  uv_close((uv_handle_t *)&worker->server, NULL);
+  worker_control_stop(worker);
   uv_close((uv_handle_t *)&worker->stopper, NULL);
+  loop_monitor_stop(&worker->monitor);
+
+  // After an upgrade the connections are closed gradually so that
+  // their clients reconnect to the new keyless
+
+  if (worker->drain_ns != 0) {
+    worker_drain(worker, handle->loop);
+  }
 }
 
 typedef struct {
@@ -312,6 +1162,11 @@ void ipc_connect_cb(uv_connect_t *req, int status)
 #define PIPE_NAME "/tmp/cloudflare-keyless"
 #endif
 
+// The name of the pipe the listening socket is passed to the workers
+// on. Each child of --processes adds its pid.
+
+char pipe_name[sizeof(PIPE_NAME) + 16] = PIPE_NAME;
+
 // get_handle: retrieves the handle of the TCP server. Returns 0 on
 // failure.
 int get_handle(uv_loop_t *loop, uv_tcp_t *server)
@@ -331,7 +1186,7 @@ int get_handle(uv_loop_t *loop, uv_tcp_t *server)
 
   client->pipe.data = (void *)client;
   uv_pipe_connect(&client->connect_req, &client->pipe,
-                  PIPE_NAME, ipc_connect_cb);
+                  pipe_name, ipc_connect_cb);
   uv_run(loop, UV_RUN_DEFAULT);
 
   return 0;
@@ -346,6 +1201,8 @@ void thread_entry(void *data)
   uv_loop_t *loop = uv_loop_new();
   int rc;
 
+  log_thread_init(loop);
+
   // The stopper is used to terminate the thread gracefully. The
   // uv_unref is here so that if the thread has terminated the
   // async event doesn't keep the loop alive.
@@ -360,6 +1217,14 @@ void thread_entry(void *data)
   }
   uv_unref((uv_handle_t *)&worker->stopper);
 
+  // The control handle carries requests from the admin socket
+
+  rc = worker_control_init(worker, loop);
+  if (rc != 0) {
+    write_log(1, "Failed to create control async in thread: %s",
+              error_string(rc));
+  }
+
   // Wait for the main thread to be ready and obtain the
   // server handle
 
@@ -370,6 +1235,7 @@ void thread_entry(void *data)
   if (rc == 0) {
     worker->server.data = (void *)worker;
     worker->active = 0;
+    worker->listening = 1;
 
     rc = uv_listen((uv_stream_t *)&worker->server, SOMAXCONN,
                    new_connection_cb);
@@ -378,10 +1244,27 @@ void thread_entry(void *data)
                 error_string(rc));
     }
 
+    rc = loop_monitor_start(&worker->monitor, loop, worker->metrics,
+                            worker->live, worker->id);
+    if (rc != 0) {
+      write_log(1, "Failed to start loop monitor in thread: %s",
+                error_string(rc));
+    }
+
+    if (perf_enabled()) {
+      rc = perf_thread_start();
+      if (rc != 0) {
+        write_log(1, "Failed to open performance counters in thread: %s",
+                  strerror(rc));
+      }
+    }
+
     uv_run(loop, UV_RUN_DEFAULT);
   }
 
   uv_loop_delete(loop);
+  perf_thread_stop();
+  memory_thread_cleanup();
 }
 
 // cleanup: clean up state.
@@ -483,25 +1366,6 @@ void ipc_connection_cb(uv_stream_t *pipe, int status)
   }
 }
 
-uv_mutex_t *locks;
-
-// thread_id_cb: used by OpenSSL to get the currently running thread's
-// ID
-unsigned long thread_id_cb(void)
-{
-  return uv_thread_self();
-}
-
-// locking_cb: used by OpenSSL to lock its internal data
-void locking_cb(int mode, int type, const char *file, int line)
-{
-  if (mode & CRYPTO_LOCK) {
-    uv_mutex_lock(&locks[type]);
-  } else {
-    uv_mutex_unlock(&locks[type]);
-  }
-}
-
 // write_pid: write the current process PID to the file in
 // pid_file. This can be null.
 void write_pid(char *pid_file, int pid, int write)
@@ -528,6 +1392,25 @@ void write_pid(char *pid_file, int pid, int write)
   }
 }
 
+// process_path: in a child of --processes replace *path with path.N
+// where N is the child's index so that each child has its own
+void process_path(char **path)
+{
+  char *indexed;
+
+  if (process_index == -1 || *path == 0) {
+    return;
+  }
+
+  indexed = (char *)malloc(strlen(*path) + 16);
+  if (indexed == NULL) {
+    fatal_error("Memory allocation error");
+  }
+  sprintf(indexed, "%s.%d", *path, process_index);
+  free(*path);
+  *path = indexed;
+}
+
 int main(int argc, char *argv[])
 {
   int port = 2407;
@@ -540,10 +1423,27 @@ int main(int argc, char *argv[])
 
   char *ca_file = 0;
   char *pid_file = 0;
+  int slow_request_ms = 0;
+  char *trace_file = 0;
+  int trace_sample = 1000;
+  char *binary_log = 0;
+  int binary_log_size = 256;
+  char *capture_file = 0;
+  int capture_seconds = 60;
+  int loop_lag_warn_ms = 0;
+  int loop_lag_reject_ms = 0;
+  int health_lag_ms = 500;
+  int health_queue = 1024;
+  int lock_profile = 0;
+  int openssl_memory = KSSL_MEMORY_DEFAULT;
+  int client_accounting = KSSL_CLIENTS_OFF;
+  int perf_counters = 0;
+  int rx_timestamps = 0;
   int parsed;
 
   const SSL_METHOD *method;
   SSL_CTX *ctx;
+  pk_list list;
 #if !PLATFORM_WINDOWS
   char *usergroup = 0;
   char *user = 0;
@@ -557,9 +1457,8 @@ int main(int argc, char *argv[])
   struct sockaddr_in addr;
   STACK_OF(X509_NAME) *cert_names;
   uv_loop_t *loop;
-  uv_signal_t sigterm_watcher;
-  uv_signal_t sighup_watcher;
   ipc_server *p;
+  int inherited[UPGRADE_FDS];
 
   // If this is set to 1 (by the --test command-line option) then the program
   // will do all work necessary to start but not actually start. The return
@@ -586,6 +1485,32 @@ int main(int argc, char *argv[])
     {"version",               no_argument,       0, 14},
 #endif
     {"test",                  no_argument,       0, 15},
+    {"metrics-port",          required_argument, 0, 16},
+    {"metrics-socket",        required_argument, 0, 17},
+    {"slow-request-ms",       required_argument, 0, 18},
+    {"trace-file",            required_argument, 0, 19},
+    {"trace-sample",          required_argument, 0, 20},
+    {"log-sample",            required_argument, 0, 21},
+    {"binary-log",            required_argument, 0, 22},
+    {"binary-log-size",       required_argument, 0, 23},
+    {"loop-lag-warn-ms",      required_argument, 0, 24},
+    {"loop-lag-reject-ms",    required_argument, 0, 25},
+    {"lock-profile",          no_argument,       0, 26},
+    {"openssl-memory",        required_argument, 0, 27},
+    {"key-stats-top",         required_argument, 0, 28},
+    {"client-accounting",     required_argument, 0, 29},
+    {"capture",               required_argument, 0, 30},
+    {"capture-seconds",       required_argument, 0, 31},
+    {"perf-counters",         no_argument,       0, 32},
+    {"rx-timestamps",         no_argument,       0, 33},
+    {"drain-seconds",         required_argument, 0, 34},
+    {"processes",             required_argument, 0, 35},
+    {"admin-socket",          required_argument, 0, 36},
+    {"stats-file",            required_argument, 0, 37},
+    {"health-port",           required_argument, 0, 38},
+    {"health-socket",         required_argument, 0, 39},
+    {"health-lag-ms",         required_argument, 0, 40},
+    {"health-queue",          required_argument, 0, 41},
     {0,                       0,                 0, 0}
   };
 
@@ -607,115 +1532,243 @@ int main(int argc, char *argv[])
       exit(1);
       break;
 
-    case 0:
-      port = atoi(optarg);
+    case 0:
+      port = atoi(optarg);
+      break;
+
+    case 1:
+      server_cert = (char *)malloc(strlen(optarg)+1);
+      strcpy(server_cert, optarg);
+      break;
+
+    case 2:
+      server_key = (char *)malloc(strlen(optarg)+1);
+      strcpy(server_key, optarg);
+      break;
+
+    case 3:
+      private_key_directory = (char *)malloc(strlen(optarg)+1);
+      strcpy(private_key_directory, optarg);
+      break;
+
+    case 4:
+      ca_file = (char *)malloc(strlen(optarg)+1);
+      strcpy(ca_file, optarg);
+      break;
+
+    case 5:
+      silent = 1;
+      break;
+
+    case 6:
+      verbose = 1;
+      break;
+
+    case 7:
+      pid_file = (char *)malloc(strlen(optarg)+1);
+      strcpy(pid_file, optarg);
+      break;
+
+    case 8:
+      num_workers = atoi(optarg);
+      break;
+
+    case 9:
+      help = 1;
+      break;
+
+    case 10:
+      if (inet_pton(AF_INET, optarg, &addr.sin_addr) != 1) {
+        fatal_error("The --ip parameter must be a valid IPv4 address");
+      }
+      break;
+
+#if !PLATFORM_WINDOWS
+
+      // The --user parameter can be in the form username:group or
+      // username. The latter will be equivalent to username:username.
+
+    case 11:
+      usergroup = (char *)malloc(strlen(optarg)+1);
+      strcpy(usergroup, optarg);
+      user = usergroup;
+      group = strstr(user, ":");
+      if (group == 0) {
+        group = user;
+      } else {
+        *group = '\0';
+        group += 1;
+
+        // This is checking for a : at the end of the parameter (e.g.
+        // username:) and treats it as username:username
+
+        if (*group == '\0') {
+          group = user;
+        }
+      }
+
+      // Verify that the user and group are valid and obtain the IDs that
+      // will be necessary for switching to them.
+
+      pwd = getpwnam(user);
+      if (pwd == 0) {
+        fatal_error("Unable to find user %s", user);
+      }
+
+      grp = getgrnam(group);
+      if (grp == 0) {
+        fatal_error("Unable to find group %s", group);
+      }
+
+      // A keyless started by an upgrade or by the --processes supervisor
+      // has the same arguments as its parent, which has already switched
+      // to the user
+
+      if (geteuid() != 0 &&
+          (geteuid() != pwd->pw_uid || getegid() != grp->gr_gid)) {
+        fatal_error("The --user can only be used by the root user");
+      }
+      break;
+
+    case 12:
+      daemon = 1;
+      break;
+
+    case 13:
+      use_syslog = 1;
+      break;
+
+#endif
+
+    case 14:
+      fatal_error("keyless: %s", KSSL_VERSION);
+      break;
+
+    case 15:
+      test_mode = 1;
+      break;
+
+    case 16:
+      metrics_port = atoi(optarg);
+      break;
+
+    case 17:
+      metrics_socket = (char *)malloc(strlen(optarg)+1);
+      strcpy(metrics_socket, optarg);
+      break;
+
+    case 18:
+      slow_request_ms = atoi(optarg);
+      break;
+
+    case 19:
+      trace_file = (char *)malloc(strlen(optarg)+1);
+      strcpy(trace_file, optarg);
       break;
 
-    case 1:
-      server_cert = (char *)malloc(strlen(optarg)+1);
-      strcpy(server_cert, optarg);
+    case 20:
+      trace_sample = atoi(optarg);
       break;
 
-    case 2:
-      server_key = (char *)malloc(strlen(optarg)+1);
-      strcpy(server_key, optarg);
+    case 21:
+      log_sample = atoi(optarg);
       break;
 
-    case 3:
-      private_key_directory = (char *)malloc(strlen(optarg)+1);
-      strcpy(private_key_directory, optarg);
+    case 22:
+      binary_log = (char *)malloc(strlen(optarg)+1);
+      strcpy(binary_log, optarg);
       break;
 
-    case 4:
-      ca_file = (char *)malloc(strlen(optarg)+1);
-      strcpy(ca_file, optarg);
+    case 23:
+      binary_log_size = atoi(optarg);
       break;
 
-    case 5:
-      silent = 1;
+    case 24:
+      loop_lag_warn_ms = atoi(optarg);
       break;
 
-    case 6:
-      verbose = 1;
+    case 25:
+      loop_lag_reject_ms = atoi(optarg);
       break;
 
-    case 7:
-      pid_file = (char *)malloc(strlen(optarg)+1);
-      strcpy(pid_file, optarg);
+    case 26:
+      lock_profile = 1;
       break;
 
-    case 8:
-      num_workers = atoi(optarg);
+    case 27:
+      if (strcmp(optarg, "count") == 0) {
+        openssl_memory = KSSL_MEMORY_COUNT;
+      } else if (strcmp(optarg, "cache") == 0) {
+        openssl_memory = KSSL_MEMORY_CACHE;
+      } else {
+        fatal_error("The --openssl-memory parameter must be count or cache");
+      }
       break;
 
-    case 9:
-      help = 1;
+    case 28:
+      key_stats_top = atoi(optarg);
       break;
 
-    case 10:
-      if (inet_pton(AF_INET, optarg, &addr.sin_addr) != 1) {
-        fatal_error("The --ip parameter must be a valid IPv4 address");
+    case 29:
+      if (strcmp(optarg, "subject") == 0) {
+        client_accounting = KSSL_CLIENTS_SUBJECT;
+      } else if (strcmp(optarg, "fingerprint") == 0) {
+        client_accounting = KSSL_CLIENTS_FINGERPRINT;
+      } else {
+        fatal_error("The --client-accounting parameter must be subject or fingerprint");
       }
       break;
 
-#if !PLATFORM_WINDOWS
-
-      // The --user parameter can be in the form username:group or
-      // username. The latter will be equivalent to username:username.
+    case 30:
+      capture_file = (char *)malloc(strlen(optarg)+1);
+      strcpy(capture_file, optarg);
+      break;
 
-    case 11:
-      if (geteuid() == 0) {
-        usergroup = (char *)malloc(strlen(optarg)+1);
-        strcpy(usergroup, optarg);
-        user = usergroup;
-        group = strstr(user, ":");
-        if (group == 0) {
-          group = user;
-        } else {
-          *group = '\0';
-          group += 1;
+    case 31:
+      capture_seconds = atoi(optarg);
+      break;
 
-          // This is checking for a : at the end of the parameter (e.g.
-          // username:) and treats it as username:username
+    case 32:
+      perf_counters = 1;
+      break;
 
-          if (*group == '\0') {
-            group = 0;
-          }
-        }
+    case 33:
+      rx_timestamps = 1;
+      break;
 
-        // Verify that the user and group are valid and obtain the IDs that
-        // will be necessary for switching to them.
+    case 34:
+      drain_seconds = atoi(optarg);
+      break;
 
-        pwd = getpwnam(user);
-        if (pwd == 0) {
-          fatal_error("Unable to find user %s", user);
-        }
+    case 35:
+      num_processes = atoi(optarg);
+      break;
 
-        grp = getgrnam(group);
-        if (grp == 0) {
-          fatal_error("Unable to find group %s", group);
-        }
-      } else {
-        fatal_error("The --user can only be used by the root user");
-      }
+    case 36:
+      admin_socket = (char *)malloc(strlen(optarg)+1);
+      strcpy(admin_socket, optarg);
       break;
 
-    case 12:
-      daemon = 1;
+    case 37:
+      stats_file = (char *)malloc(strlen(optarg)+1);
+      strcpy(stats_file, optarg);
       break;
 
-    case 13:
-      use_syslog = 1;
+    case 38:
+      health_port = atoi(optarg);
       break;
 
-#endif
+    case 39:
+      health_socket = (char *)malloc(strlen(optarg)+1);
+      strcpy(health_socket, optarg);
+      break;
 
-    case 14:
-      fatal_error("keyless: %s", KSSL_VERSION);
+    case 40:
+      health_lag_ms = atoi(optarg);
       break;
 
-    case 15:
-      test_mode = 1;
+    case 41:
+      health_queue = atoi(optarg);
       break;
     }
   }
@@ -782,6 +1835,131 @@ OPTIONAL\n\
     --test\n\
               Run through start up and check all parameters for validity.\n\
               Returns 0 if configuration is good.\n\
+\n\
+    --metrics-port\n\
+\n\
+              Serve metrics in Prometheus text format over HTTP on this\n\
+              port on 127.0.0.1.\n\
+\n\
+    --metrics-socket\n\
+\n\
+              Serve metrics in Prometheus text format over HTTP on a Unix\n\
+              socket at this path.\n\
+\n\
+    --admin-socket\n\
+\n\
+              Accept admin commands (statistics, adding and removing\n\
+              keys, changing log levels) on a Unix socket at this path.\n\
+              Each child of --processes adds .N for its index N.\n\
+\n\
+    --health-port\n\
+\n\
+              Answer health checks in plain text or over HTTP on this\n\
+              port on the --ip address, without TLS.\n\
+\n\
+    --health-socket\n\
+\n\
+              Answer health checks on a Unix socket at this path.\n\
+\n\
+    --health-lag-ms\n\
+\n\
+              Report degraded when a worker's event loop is this many\n\
+              milliseconds behind or has been stuck for this long.\n\
+              Defaults to 500.\n\
+\n\
+    --health-queue\n\
+\n\
+              Report degraded when a worker has more than this many\n\
+              responses waiting to be written. Defaults to 1024. 0\n\
+              disables the check.\n\
+\n\
+    --slow-request-ms\n\
+\n\
+              Log any request that takes longer than this number of\n\
+              milliseconds with a breakdown of where the time went.\n\
+\n\
+    --trace-file\n\
+\n\
+              Write a sample of requests to this file in Chrome trace\n\
+              event format.\n\
+\n\
+    --trace-sample\n\
+\n\
+              Write one in this many requests to --trace-file.\n\
+              Defaults to 1000.\n\
+\n\
+    --log-sample\n\
+\n\
+              Only write one in this many requests to the access log\n\
+              (see --verbose). Defaults to 1 (every request).\n\
+\n\
+    --binary-log\n\
+\n\
+              Write a compact binary record of every request to this\n\
+              file. Use keyless-logdump to read it.\n\
+\n\
+    --binary-log-size\n\
+\n\
+              Rotate the --binary-log file when it reaches this many\n\
+              megabytes. Defaults to 256. 0 disables rotation.\n\
+\n\
+    --loop-lag-warn-ms\n\
+\n\
+              Log a warning when a worker's event loop falls this many\n\
+              milliseconds behind.\n\
+\n\
+    --loop-lag-reject-ms\n\
+\n\
+              Close new connections without a handshake on any worker\n\
+              whose event loop is this many milliseconds behind.\n\
+\n\
+    --lock-profile\n\
+\n\
+              Count acquisitions, contended acquisitions and wait time\n\
+              for each OpenSSL lock. The profile is served as metrics,\n\
+              logged on SIGUSR1 and logged at exit.\n\
+\n\
+    --openssl-memory\n\
+\n\
+              count: count the allocations OpenSSL makes for each type\n\
+              of request. cache: as count but also serve small\n\
+              allocations from per-thread caches.\n\
+\n\
+    --key-stats-top\n\
+\n\
+              Count operations, errors and crypto time for each private\n\
+              key and serve them as metrics for this many of the busiest\n\
+              keys.\n\
+\n\
+    --client-accounting\n\
+\n\
+              Count connections, requests, bytes and crypto CPU time for\n\
+              each client certificate identified by its subject or its\n\
+              SHA256 fingerprint and serve them as metrics.\n\
+\n\
+    --capture\n\
+\n\
+              Record connections and requests (without their payloads)\n\
+              to this file for replay with kssl_bench --replay.\n\
+\n\
+    --capture-seconds\n\
+\n\
+              Stop capturing after this many seconds. Defaults to 60.\n\
+              0 captures until keyless exits.\n\
+\n\
+    --perf-counters\n\
+\n\
+              Count cycles, instructions, cache misses and branch misses\n\
+              (or software counters where those are not available) for\n\
+              the TLS read, private key operation and TLS write of each\n\
+              request. Served as metrics, logged on SIGUSR1 and logged\n\
+              at exit. Linux only.\n\
+\n\
+    --rx-timestamps\n\
+\n\
+              Use the kernel's receive timestamps to measure the time\n\
+              requests wait in the socket before they are read. Linux\n\
+              only.\n\
 \n\
 \n\
 The following options are not available on Windows systems:\n\
@@ -794,6 +1972,26 @@ The following options are not available on Windows systems:\n\
     --daemon\n\
 \n\
             Forks and abandons the parent process.\n\
+\n\
+    --drain-seconds\n\
+\n\
+            After SIGUSR2 has started a new keyless, the time over which\n\
+            this one closes its connections. Defaults to 30. 0 leaves\n\
+            them open until their clients close them.\n\
+\n\
+    --processes\n\
+\n\
+            Run this many child processes, each with --num-workers\n\
+            workers and its own OpenSSL state and keys, sharing the port\n\
+            with SO_REUSEPORT. This process supervises them, restarts\n\
+            any that exit and serves their merged metrics. Cannot be\n\
+            used with --binary-log or --capture.\n\
+\n\
+    --stats-file\n\
+\n\
+            Publish live per worker counters in shared memory in a file\n\
+            at this path for keylesstop to read. Each child of\n\
+            --processes adds .N for its index N.\n\
 \n\
     --syslog\n\
 \n\
@@ -814,9 +2012,79 @@ The following options are not available on Windows systems:\n\
   if (num_workers <= 0 || num_workers > MAX_WORKERS) {
     fatal_error("The --num-workers parameter must between 1 and %d", MAX_WORKERS);
   }
+  if (metrics_port < 0 || metrics_port > 65535) {
+    fatal_error("The --metrics-port parameter must be a valid port number");
+  }
+  if (slow_request_ms < 0) {
+    fatal_error("The --slow-request-ms parameter must not be negative");
+  }
+  if (trace_sample <= 0) {
+    fatal_error("The --trace-sample parameter must be greater than 0");
+  }
+  if (log_sample <= 0) {
+    fatal_error("The --log-sample parameter must be greater than 0");
+  }
+  if (binary_log_size < 0) {
+    fatal_error("The --binary-log-size parameter must not be negative");
+  }
+  if (loop_lag_warn_ms < 0) {
+    fatal_error("The --loop-lag-warn-ms parameter must not be negative");
+  }
+  if (loop_lag_reject_ms < 0) {
+    fatal_error("The --loop-lag-reject-ms parameter must not be negative");
+  }
+  if (health_port < 0 || health_port > 65535) {
+    fatal_error("The --health-port parameter must be a valid port number");
+  }
+  if (health_lag_ms <= 0) {
+    fatal_error("The --health-lag-ms parameter must be greater than 0");
+  }
+  if (health_queue < 0) {
+    fatal_error("The --health-queue parameter must not be negative");
+  }
+  if (capture_seconds < 0) {
+    fatal_error("The --capture-seconds parameter must not be negative");
+  }
+  if (key_stats_top < 0) {
+    fatal_error("The --key-stats-top parameter must not be negative");
+  }
+  if (drain_seconds < 0) {
+    fatal_error("The --drain-seconds parameter must not be negative");
+  }
+  if (num_processes < 0 || num_processes > MAX_PROCESSES) {
+    fatal_error("The --processes parameter must be between 0 and %d",
+                MAX_PROCESSES);
+  }
+  if (num_processes > 0 && (binary_log != 0 || capture_file != 0)) {
+    fatal_error("The --binary-log and --capture parameters cannot be used "
+                "with --processes");
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  memset(&(addr.sin_zero), 0, 8);
+
+  health_addr = addr;
+  health_addr.sin_port = htons(health_port);
+  health_init(health_lag_ms, health_queue);
+
+  // A child of --processes finds its listening socket and metrics on
+  // descriptors passed by the supervisor. The supervisor binds one
+  // socket per child before switching user.
+
+  process_index = process_child();
+  if (num_processes > 0 && process_index == -1 && !test_mode) {
+    rc = process_listen(&addr, num_processes);
+    if (rc != 0) {
+      fatal_error("Can't bind to port %d with SO_REUSEPORT: %s", port,
+                  strerror(rc));
+    }
+  }
 
 #if !PLATFORM_WINDOWS
-  if (daemon && !test_mode) {
+  if (process_index != -1) {
+    // The supervisor has already daemonized and written the pid file
+  } else if (daemon && !test_mode) {
     int pid = fork();
     if (pid == -1) {
       fatal_error("Failed to fork");
@@ -829,7 +2097,10 @@ The following options are not available on Windows systems:\n\
     write_pid(pid_file, getpid(), !test_mode);
   }
 
-  if (usergroup != 0) {
+  // A keyless started by an upgrade or as a child of --processes is
+  // already running as the user
+
+  if (usergroup != 0 && geteuid() != pwd->pw_uid) {
     if (setgid(grp->gr_gid) == -1) {
       fatal_error("Failed to set group %d (%s)", grp->gr_gid, group);
     }
@@ -844,6 +2115,65 @@ The following options are not available on Windows systems:\n\
   write_pid(pid_file, getpid(), !test_mode);
 #endif
 
+  // From here on worker threads queue log lines for a background thread
+  // rather than writing them directly
+
+  if (!test_mode && log_start() != 0) {
+    fatal_error("Failed to start logging thread");
+  }
+
+  if (!test_mode && binary_log != 0 &&
+      binlog_open(binary_log, (uint64_t)binary_log_size * 1024 * 1024) != 0) {
+    fatal_error("Failed to open binary log %s", binary_log);
+  }
+
+  if (!test_mode && capture_file != 0 &&
+      capture_open(capture_file, (unsigned int)capture_seconds) != 0) {
+    fatal_error("Failed to open capture file %s", capture_file);
+  }
+
+  // This must come before anything that makes OpenSSL allocate memory
+
+  if (memory_init(openssl_memory) != 0) {
+    fatal_error("Failed to install OpenSSL memory functions");
+  }
+
+  if (perf_counters) {
+    rc = perf_init();
+    if (rc != 0) {
+      fatal_error("Failed to open performance counters: %s", strerror(rc));
+    }
+  }
+
+  rc = timestamp_init(rx_timestamps);
+  if (rc != 0) {
+    fatal_error("Failed to enable receive timestamps: %s", strerror(rc));
+  }
+
+#if !PLATFORM_WINDOWS
+  // The supervisor of --processes never initializes OpenSSL or loads
+  // keys: the children do that for themselves
+
+  if (num_processes > 0 && process_index == -1 && !test_mode) {
+    supervise(argv, lock_profile || perf_enabled());
+
+    free(usergroup);
+    free(pid_file);
+    free(metrics_socket);
+    free(admin_socket);
+    free(stats_file);
+    free(health_socket);
+    free(trace_file);
+    log_stop();
+    exit(0);
+  }
+
+  if (process_index != -1) {
+    snprintf(pipe_name, sizeof(pipe_name), "%s-%d", PIPE_NAME,
+             (int)getpid());
+  }
+#endif
+
   SSL_library_init();
   SSL_load_error_strings();
   ERR_load_BIO_strings();
@@ -855,6 +2185,12 @@ The following options are not available on Windows systems:\n\
     ssl_error();
   }
 
+  // Most connections are idle most of the time so let OpenSSL free each
+  // connection's read and write buffers (around 34KB) when they are
+  // empty
+
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
   // Set the context to ask for a peer (i.e. client certificate on connection)
   // and to refuse connections that do not have a client certificate. The client
   // certificate must be signed by the CA in the --ca-file parameter.
@@ -931,7 +2267,12 @@ The following options are not available on Windows systems:\n\
     fatal_error("Can't initialize lock");
   }
   pk_dir = private_key_directory;
-  load_private_keys(ctx);
+  list = load_private_keys();
+  if (list == NULL) {
+    SSL_CTX_free(ctx);
+    fatal_error("Failed to load private keys from %s", pk_dir);
+  }
+  install_private_keys(list);
 
   // Begin application loop
   loop = uv_loop_new();
@@ -943,18 +2284,95 @@ The following options are not available on Windows systems:\n\
                 error_string(rc));
   }
 
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  memset(&(addr.sin_zero), 0, 8);
+  // When started by an upgrade the listening sockets are inherited from
+  // the previous keyless rather than bound
 
-  rc = uv_tcp_bind(&tcp_server, (const struct sockaddr*)&addr, 0);
+  rc = upgrade_inherit(inherited);
   if (rc != 0) {
     SSL_CTX_free(ctx);
-    fatal_error("Can't bind to port %d: %s", port, error_string(rc));
+    fatal_error("Failed to receive listening sockets: %s", strerror(rc));
+  }
+
+  if (process_index != -1) {
+    rc = uv_tcp_open(&tcp_server, KSSL_PROCESS_LISTEN_FD);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Can't use listening socket from supervisor: %s",
+                  error_string(rc));
+    }
+  } else if (inherited[UPGRADE_LISTEN] != -1) {
+    rc = uv_tcp_open(&tcp_server, inherited[UPGRADE_LISTEN]);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Can't use inherited socket: %s", error_string(rc));
+    }
+  } else {
+    rc = uv_tcp_bind(&tcp_server, (const struct sockaddr*)&addr, 0);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Can't bind to port %d: %s", port, error_string(rc));
+    }
   }
 
   tcp_server.data = (void *)ctx;
 
+  if (trace_init(slow_request_ms, test_mode?NULL:trace_file,
+                 trace_sample) != 0) {
+    SSL_CTX_free(ctx);
+    fatal_error("Failed to open trace file %s", trace_file);
+  }
+
+  loop_monitor_init(loop_lag_warn_ms, loop_lag_reject_ms);
+
+  if (process_index != -1) {
+    shared_metrics = metrics_map(KSSL_PROCESS_METRICS_FD,
+                                 num_processes * num_workers);
+    if (shared_metrics != NULL) {
+      metrics = shared_metrics + process_index * num_workers;
+
+      // A child that has been restarted takes over the shards of the
+      // one that exited, whose queue and loop state no longer apply
+
+      for (i = 0; i < num_workers; i++) {
+        metrics[i].queued = 0;
+        metrics[i].loop_measured = 0;
+      }
+    }
+  } else {
+    metrics = metrics_new(num_workers);
+  }
+  if (metrics == NULL) {
+    SSL_CTX_free(ctx);
+    fatal_error("Failed to allocate metrics");
+  }
+
+  // Each child of --processes publishes its own workers
+
+  if (!test_mode && stats_file != 0) {
+    BYTE opcodes[KSSL_METRICS_OPS];
+
+    for (i = 0; i < KSSL_METRICS_OPS; i++) {
+      opcodes[i] = metrics_slot_opcode(i);
+    }
+
+    process_path(&stats_file);
+    live_stats = stats_open(stats_file, num_workers, opcodes);
+    if (live_stats == NULL) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to create statistics file %s: %s", stats_file,
+                  strerror(errno));
+    }
+  }
+
+  clients_init(client_accounting);
+  if (clients_enabled()) {
+    clients = clients_new(num_workers);
+    if (clients == NULL) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to allocate client accounting");
+    }
+  }
+
   // Make the worker threads
   for (i = 0; i < num_workers; i++) {
     rc = uv_sem_init(&worker[i].semaphore, 0);
@@ -965,6 +2383,14 @@ The following options are not available on Windows systems:\n\
     }
 
     worker[i].ctx = ctx;
+    worker[i].metrics = &metrics[i];
+    worker[i].clients = (clients != NULL)?&clients[i]:NULL;
+    worker[i].live = (live_stats != NULL)?&live_stats[i]:NULL;
+    worker[i].id = i;
+    worker[i].trace_countdown = trace_sample;
+    worker[i].request.accept = 1;
+    worker[i].request.done = &admin_async;
+    worker[i].request.finished = 1;
 
     rc = uv_thread_create(&worker[i].thread, thread_entry,
                           &worker[i]);
@@ -989,10 +2415,10 @@ The following options are not available on Windows systems:\n\
       fatal_error("Failed to create parent pipe: %s",
                   error_string(rc));
   }
-  rc = uv_pipe_bind(&p->pipe, PIPE_NAME);
+  rc = uv_pipe_bind(&p->pipe, pipe_name);
   if (rc != 0) {
       SSL_CTX_free(ctx);
-      fatal_error("Failed to bind pipe to name %s: %s", PIPE_NAME,
+      fatal_error("Failed to bind pipe to name %s: %s", pipe_name,
                   error_string(rc));
   }
   p->pipe.data = (void *)p;
@@ -1011,6 +2437,14 @@ The following options are not available on Windows systems:\n\
     uv_sem_post(&worker[i].semaphore);
   }
   uv_run(loop, UV_RUN_DEFAULT);
+
+#if !PLATFORM_WINDOWS
+  // Keep a copy of the listening socket to hand to a new keyless on
+  // SIGUSR2
+
+  listen_fd = fcntl(tcp_server.io_watcher.fd, F_DUPFD_CLOEXEC, 0);
+#endif
+
   uv_close((uv_handle_t *)&tcp_server, NULL);
   uv_run(loop, UV_RUN_DEFAULT);
   for (i = 0; i < num_workers; i++) {
@@ -1049,7 +2483,6 @@ The following options are not available on Windows systems:\n\
       fatal_error("Failed to create SIGHUP watcher: %s",
                   error_string(rc));
     }
-    g_ctx = ctx;
     rc = uv_signal_start(&sighup_watcher, sighup_cb, SIGHUP);
     if (rc != 0) {
       SSL_CTX_free(ctx);
@@ -1061,24 +2494,109 @@ The following options are not available on Windows systems:\n\
   // Since we'll be running multiple threads OpenSSL needs mutexes as its
   // state is shared across them.
 
-  locks = (uv_mutex_t *)malloc(CRYPTO_num_locks() * sizeof(uv_mutex_t));
+  if (locks_init(lock_profile) != 0) {
+    SSL_CTX_free(ctx);
+    fatal_error("Failed to create OpenSSL mutexes");
+  }
+
+#ifdef SIGUSR1
+  // With --lock-profile or --perf-counters SIGUSR1 writes the lock
+  // profile and the performance counters to the log
+
+  if (!test_mode && (lock_profile || perf_enabled())) {
+    rc = uv_signal_init(loop, &sigusr1_watcher);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to create SIGUSR1 watcher: %s",
+                  error_string(rc));
+    }
+    rc = uv_signal_start(&sigusr1_watcher, sigusr1_cb, SIGUSR1);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to start SIGUSR1 watcher: %s",
+                  error_string(rc));
+    }
+    uv_unref((uv_handle_t *)&sigusr1_watcher);
+  }
+#endif
+
+#if !PLATFORM_WINDOWS
+  // SIGUSR2 starts a new keyless and hands it the listening socket
+
+  if (!test_mode && listen_fd != -1 && process_index == -1) {
+    upgrade_file = self_path(argv[0]);
+    upgrade_args = argv;
 
-  for (i = 0; i < CRYPTO_num_locks(); i++) {
-    rc = uv_mutex_init(&locks[i]);
+    rc = uv_signal_init(loop, &sigusr2_watcher);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to create SIGUSR2 watcher: %s",
+                  error_string(rc));
+    }
+    rc = uv_signal_start(&sigusr2_watcher, sigusr2_cb, SIGUSR2);
     if (rc != 0) {
       SSL_CTX_free(ctx);
-      fatal_error("Failed to create mutex: %s",
+      fatal_error("Failed to start SIGUSR2 watcher: %s",
                   error_string(rc));
     }
+    uv_unref((uv_handle_t *)&sigusr2_watcher);
+  }
+#endif
+
+  // The metrics endpoint is served from the main thread so that scraping
+  // never interferes with the workers
+
+  if (!test_mode && process_index == -1 &&
+      (metrics_port != 0 || metrics_socket != 0)) {
+    metrics_endpoint = metrics_listen(loop, metrics_port, metrics_socket,
+                                      &inherited[UPGRADE_METRICS],
+                                      render_metrics);
+    if (metrics_endpoint == NULL) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to start metrics endpoint");
+    }
+  }
+
+  // Health checks are answered from the main thread too, from what the
+  // workers publish in their shards, so a worker whose loop is stuck
+  // cannot hold up the answer. With --processes the supervisor answers
+  // for all the children.
+
+  if (!test_mode && process_index == -1 &&
+      (health_port != 0 || health_socket != 0)) {
+    health_endpoint = health_start(loop, &inherited[UPGRADE_HEALTH],
+                                   check_health);
+    if (health_endpoint == NULL) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to start health endpoint");
+    }
   }
 
-  CRYPTO_set_id_callback(thread_id_cb);
-  CRYPTO_set_locking_callback(locking_cb);
+  // The admin socket is also served from the main thread. Each child of
+  // --processes has its own so that its workers can be reached.
+
+  if (!test_mode && admin_socket != 0) {
+    process_path(&admin_socket);
+
+    rc = uv_async_init(loop, &admin_async, admin_async_cb);
+    if (rc != 0) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to create admin async: %s", error_string(rc));
+    }
+    uv_unref((uv_handle_t *)&admin_async);
+
+    admin_endpoint = admin_listen(loop, admin_socket, admin_command);
+    if (admin_endpoint == NULL) {
+      SSL_CTX_free(ctx);
+      fatal_error("Failed to start admin socket on %s", admin_socket);
+    }
+  }
 
   // If in test mode never run this loop. This will cause the program to stop
   // immediately.
 
   if (!test_mode) {
+    upgrade_ready();
     uv_run(loop, UV_RUN_DEFAULT);
   }
 
@@ -1099,17 +2617,40 @@ The following options are not available on Windows systems:\n\
   }
 
   cleanup(loop, ctx, privates);
+  metrics_dump_perf(metrics, num_workers);
+  if (shared_metrics != NULL) {
+    metrics_unmap(shared_metrics, num_processes * num_workers);
+  } else {
+    metrics_free(metrics);
+  }
+  clients_free(clients);
+  stats_close(live_stats, stats_file);
+  trace_cleanup();
 
-  for (i = 0; i < CRYPTO_num_locks(); i++) {
-    uv_mutex_destroy(&locks[i]);
+  if (lock_profile) {
+    locks_dump();
   }
-  free(locks);
+  locks_cleanup();
 
 #if !PLATFORM_WINDOWS
   free(usergroup);
 #endif
 
   free(pid_file);
+  free(metrics_socket);
+  free(admin_socket);
+  free(stats_file);
+  free(health_socket);
+  free(trace_file);
+  for (i = 0; i < num_workers; i++) {
+    free(admin_reports[i].data);
+  }
+
+  log_stop();
+  binlog_close();
+  free(binary_log);
+  capture_close();
+  free(capture_file);
 
   exit(0);
 }
@@ -0,0 +1,373 @@
+// keyless_logdump.c: decoder for keyless binary access logs
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: keyless-logdump [--format=text|json|summary] FILE...
+//
+// Reads one or more files written with the --binary-log option of keyless
+// and writes them out in one of the following formats:
+//
+// text
+//
+// One line per request (the default)
+//
+// json
+//
+// One JSON object per line per request
+//
+// summary
+//
+// Total requests and ops/s, requests by opcode and per key request
+// counts, ops/s, errors and total latency percentiles
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_getopt.h"
+#include "kssl_histogram.h"
+#include "kssl_binlog.h"
+
+#if PLATFORM_WINDOWS
+#include <ws2tcpip.h>
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 46
+#endif
+#else
+#include <arpa/inet.h>
+#endif
+
+#define FORMAT_TEXT    0
+#define FORMAT_JSON    1
+#define FORMAT_SUMMARY 2
+
+// Records are read this many at a time
+
+#define READ_RECORDS 4096
+
+static const char *stage_names[KSSL_BINLOG_STAGES] = KSSL_STEP_NAMES;
+
+// Statistics gathered for the summary. Per key statistics are allocated
+// when the key is first seen; keys[0] is used for requests with no key.
+
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t max;
+  kssl_histogram total;
+} key_stats;
+
+static key_stats **keys = NULL;
+static int key_slots = 0;
+static uint64_t records = 0;
+static uint64_t errors = 0;
+static uint64_t first = 0;
+static uint64_t last = 0;
+static uint64_t ops[256];
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+// total: returns the total latency of a request in nanoseconds
+static uint64_t total(kssl_binlog_record *r)
+{
+  uint64_t t = 0;
+  int i;
+
+  for (i = 0; i < KSSL_BINLOG_STAGES; i++) {
+    t += r->stage[i];
+  }
+
+  return t;
+}
+
+// format_time: write the record's time as an ISO 8601 UTC timestamp with
+// milliseconds
+static void format_time(kssl_binlog_record *r, char *s, size_t len)
+{
+  time_t t = (time_t)(r->time / 1000);
+  struct tm tm;
+  size_t n;
+
+#if PLATFORM_WINDOWS
+  gmtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &tm);
+#endif
+  n = strftime(s, len, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(s + n, len - n, ".%03dZ", (int)(r->time % 1000));
+}
+
+// dump_text: write a record as a single line of text
+static void dump_text(kssl_binlog_record *r)
+{
+  char when[64];
+  char ip_string[INET6_ADDRSTRLEN] = {0};
+  int i;
+
+  format_time(r, when, sizeof(when));
+  print_ip(r->ip, r->ip_len, ip_string);
+
+  printf("%s id:%u, op:%s, key:%d, ip <%s>, error:%s, worker:%d, "
+         "total:%.1fus", when, r->id, opstring(r->opcode), r->key,
+         ip_string, errstring(r->error), r->worker,
+         (double)total(r) / 1000.0);
+  for (i = 0; i < KSSL_BINLOG_STAGES; i++) {
+    printf(", %s:%.1fus", stage_names[i], (double)r->stage[i] / 1000.0);
+  }
+  printf("\n");
+}
+
+// dump_json: write a record as a JSON object on a single line
+static void dump_json(kssl_binlog_record *r)
+{
+  char ip_string[INET6_ADDRSTRLEN] = {0};
+  int i;
+
+  print_ip(r->ip, r->ip_len, ip_string);
+
+  printf("{\"time\":%llu,\"id\":%u,\"op\":\"%s\",\"key\":%d,\"ip\":\"%s\","
+         "\"error\":\"%s\",\"worker\":%d,\"total_ns\":%llu",
+         (unsigned long long)r->time, r->id, opstring(r->opcode), r->key,
+         ip_string, errstring(r->error), r->worker,
+         (unsigned long long)total(r));
+  for (i = 0; i < KSSL_BINLOG_STAGES; i++) {
+    printf(",\"%s_ns\":%u", stage_names[i], r->stage[i]);
+  }
+  printf("}\n");
+}
+
+// add_record: add a record to the summary statistics
+static void add_record(kssl_binlog_record *r)
+{
+  int k = (r->key < 0)?0:r->key + 1;
+  uint64_t t = total(r);
+  key_stats *s;
+
+  if (records == 0 || r->time < first) {
+    first = r->time;
+  }
+  if (r->time > last) {
+    last = r->time;
+  }
+  records += 1;
+  ops[r->opcode] += 1;
+
+  if (k >= key_slots) {
+    int grow = (k + 1) * 2;
+    keys = (key_stats **)realloc(keys, grow * sizeof(key_stats *));
+    if (keys == NULL) {
+      fatal_error("Failed to allocate memory for key statistics");
+    }
+    memset(&keys[key_slots], 0, (grow - key_slots) * sizeof(key_stats *));
+    key_slots = grow;
+  }
+
+  if (keys[k] == NULL) {
+    keys[k] = (key_stats *)calloc(1, sizeof(key_stats));
+    if (keys[k] == NULL) {
+      fatal_error("Failed to allocate memory for key statistics");
+    }
+  }
+
+  s = keys[k];
+  s->count += 1;
+  if (r->error != KSSL_ERROR_NONE) {
+    s->errors += 1;
+    errors += 1;
+  }
+  if (t > s->max) {
+    s->max = t;
+  }
+  histogram_record(&s->total, t);
+}
+
+// percentile: returns a latency percentile in microseconds. Histogram
+// estimates are bucket midpoints so they are capped at the true maximum.
+static double percentile(key_stats *s, double p)
+{
+  uint64_t v = histogram_percentile(&s->total, p);
+
+  return (double)((v > s->max)?s->max:v) / 1000.0;
+}
+
+// dump_summary: write out the summary statistics
+static void dump_summary(void)
+{
+  double seconds = (double)(last - first) / 1000.0;
+  int i;
+
+  // Avoid dividing by zero if all the records are from the same
+  // millisecond
+
+  if (seconds <= 0) {
+    seconds = 0.001;
+  }
+
+  printf("records: %llu\n", (unsigned long long)records);
+  printf("errors: %llu\n", (unsigned long long)errors);
+  printf("duration: %.3fs\n", seconds);
+  printf("ops/s: %.1f\n", (double)records / seconds);
+
+  printf("\n%-32s %12s %12s\n", "opcode", "requests", "ops/s");
+  for (i = 0; i < 256; i++) {
+    if (ops[i] != 0) {
+      printf("%-32s %12llu %12.1f\n", opstring((BYTE)i),
+             (unsigned long long)ops[i], (double)ops[i] / seconds);
+    }
+  }
+
+  printf("\n%-8s %12s %12s %8s %10s %10s %10s %10s\n", "key", "requests",
+         "ops/s", "errors", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+  for (i = 0; i < key_slots; i++) {
+    key_stats *s = keys[i];
+    char name[16];
+
+    if (s == NULL) {
+      continue;
+    }
+
+    if (i == 0) {
+      strcpy(name, "none");
+    } else {
+      snprintf(name, sizeof(name), "%d", i - 1);
+    }
+
+    printf("%-8s %12llu %12.1f %8llu %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long)s->count, (double)s->count / seconds,
+           (unsigned long long)s->errors,
+           percentile(s, 50), percentile(s, 90), percentile(s, 99),
+           (double)s->max / 1000.0);
+    free(s);
+  }
+  free(keys);
+}
+
+// read_file: read every record in a binary log file
+static void read_file(const char *path, int format)
+{
+  kssl_binlog_header header;
+  kssl_binlog_record *block;
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fatal_error("Failed to open %s", path);
+  }
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, KSSL_BINLOG_MAGIC, sizeof(header.magic)) != 0) {
+    fatal_error("%s is not a keyless binary log", path);
+  }
+  if (header.byte_order != KSSL_BINLOG_BYTE_ORDER) {
+    fatal_error("%s was written on a machine with a different byte order",
+                path);
+  }
+  if (header.version != KSSL_BINLOG_VERSION ||
+      header.record_size != sizeof(kssl_binlog_record)) {
+    fatal_error("%s has unsupported version %d (record size %d)", path,
+                header.version, header.record_size);
+  }
+
+  block = (kssl_binlog_record *)malloc(READ_RECORDS *
+                                       sizeof(kssl_binlog_record));
+  if (block == NULL) {
+    fatal_error("Failed to allocate memory to read %s", path);
+  }
+
+  while ((n = fread(block, sizeof(kssl_binlog_record), READ_RECORDS, fp))
+         > 0) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+      switch (format) {
+      case FORMAT_TEXT:
+        dump_text(&block[i]);
+        break;
+
+      case FORMAT_JSON:
+        dump_json(&block[i]);
+        break;
+
+      case FORMAT_SUMMARY:
+        add_record(&block[i]);
+        break;
+      }
+    }
+  }
+
+  free(block);
+  fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+  int format = FORMAT_TEXT;
+  int help = 0;
+  int opt;
+  int i;
+
+  const struct option long_options[] = {
+    {"format", required_argument, 0, 0},
+    {"help",   no_argument,       0, 1},
+    {0,        0,                 0, 0}
+  };
+
+  optind = 1;
+  while (1) {
+    opt = getopt_long(argc, argv, "", long_options, 0);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 0:
+      if (strcmp(optarg, "text") == 0) {
+        format = FORMAT_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        format = FORMAT_JSON;
+      } else if (strcmp(optarg, "summary") == 0) {
+        format = FORMAT_SUMMARY;
+      } else {
+        fatal_error("The --format parameter must be text, json or summary");
+      }
+      break;
+
+    case 1:
+      help = 1;
+      break;
+
+    default:
+      help = 1;
+      break;
+    }
+  }
+
+  if (help || optind == argc) {
+    fatal_error("Usage: keyless-logdump [--format=text|json|summary] "
+                "FILE...");
+  }
+
+  for (i = optind; i < argc; i++) {
+    read_file(argv[i], format);
+  }
+
+  if (format == FORMAT_SUMMARY) {
+    dump_summary();
+  }
+
+  return 0;
+}
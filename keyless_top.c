@@ -0,0 +1,340 @@
+// keyless_top.c: live view of a running keyless
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: keylesstop [--interval=MS] [--sample-ms=MS] [--count=N] FILE
+//
+// Reads the file written by the --stats-file option of keyless and
+// shows, every interval, the rates per worker and per opcode. The file
+// is sampled more often than it is shown so that a stall shorter than
+// the interval is still seen:
+//
+// stall_ms
+//
+// The longest time seen during the interval since the worker's loop
+// last measured its lag. A worker measures lag every 100ms, so much
+// more than that means its loop was blocked.
+//
+// max_queued
+//
+// The most responses seen waiting to be written during the interval
+//
+// Reading the file never involves keyless: it is a memory mapping that
+// the workers update and this reads.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <uv.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_getopt.h"
+#include "kssl_stats.h"
+
+#if PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// What is kept for each worker between screens
+
+typedef struct {
+  kssl_live_stats last;    // Snapshot at the last screen
+  kssl_live_stats now;     // Most recent snapshot
+  uint64_t stall;          // Longest stall seen this interval (ns)
+  uint64_t queued;         // Most responses queued this interval
+  int valid;               // 1 once last has been taken
+} worker_view;
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+// sleep_ms: wait for ms milliseconds
+static void sleep_ms(int ms)
+{
+#if PLATFORM_WINDOWS
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+// file_id: returns a number that changes when path is replaced or 0 if
+// it cannot be found
+static uint64_t file_id(const char *path)
+{
+#if !PLATFORM_WINDOWS
+  struct stat st;
+
+  if (stat(path, &st) == 0) {
+    return (uint64_t)st.st_ino;
+  }
+#endif
+  return 0;
+}
+
+// op_name: returns the name of the opcode counted in slot without its
+// KSSL_OP_ prefix
+static const char *op_name(const kssl_stats_header *h, int slot)
+{
+  const char *name = opstring(h->opcodes[slot]);
+
+  if (strncmp(name, "KSSL_OP_", 8) == 0) {
+    name += 8;
+  }
+  return name;
+}
+
+// rate: returns the change from before to after per second over ns
+static double rate(uint64_t before, uint64_t after, uint64_t ns)
+{
+  if (ns == 0 || after < before) {
+    return 0;
+  }
+  return (double)(after - before) * 1e9 / (double)ns;
+}
+
+// requests: returns the total requests in s
+static uint64_t requests(kssl_live_stats *s)
+{
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < KSSL_METRICS_OPS; i++) {
+    total += s->requests[i];
+  }
+  return total;
+}
+
+// sample: take a snapshot of every worker and note stalls and queues
+static void sample(const kssl_stats_header *h, worker_view *views)
+{
+  const kssl_live_stats *stats = (const kssl_live_stats *)(h + 1);
+  uint64_t now = uv_hrtime();
+  uint32_t i;
+
+  for (i = 0; i < h->workers; i++) {
+    worker_view *v = &views[i];
+
+    if (stats_snapshot(&stats[i], &v->now) != 0) {
+      continue;
+    }
+
+    if (v->now.updated != 0 && now > v->now.updated &&
+        now - v->now.updated > v->stall) {
+      v->stall = now - v->now.updated;
+    }
+    if (v->now.queued > v->queued) {
+      v->queued = v->now.queued;
+    }
+  }
+}
+
+// start_interval: make the latest snapshots the base for the next rates
+static void start_interval(const kssl_stats_header *h, worker_view *views)
+{
+  uint32_t i;
+
+  for (i = 0; i < h->workers; i++) {
+    views[i].last = views[i].now;
+    views[i].valid = 1;
+    views[i].stall = 0;
+    views[i].queued = views[i].now.queued;
+  }
+}
+
+// show: print the rates over the ns since the last screen and start a
+// new interval
+static void show(const kssl_stats_header *h, worker_view *views,
+                 uint64_t ns, int clear)
+{
+  worker_view *v;
+  uint64_t busy, idle;
+  double total;
+  uint32_t i;
+  int slot;
+
+  if (clear) {
+    printf("\033[H\033[2J");
+  }
+
+  printf("keyless pid %u, %u workers\n\n", h->pid, h->workers);
+  printf("worker  open  queued max_queued  conn/s    hs/s     req/s   "
+         "err/s  lag_ms  busy%%  stall_ms\n");
+
+  for (i = 0; i < h->workers; i++) {
+    v = &views[i];
+    if (!v->valid) {
+      continue;
+    }
+
+    busy = v->now.loop_busy - v->last.loop_busy;
+    idle = v->now.loop_idle - v->last.loop_idle;
+    printf("%6u %5llu %7llu %10llu %7.1f %7.1f %9.1f %7.1f %7.1f %6.1f "
+           "%9.1f\n", i,
+           (unsigned long long)v->now.open,
+           (unsigned long long)v->now.queued,
+           (unsigned long long)v->queued,
+           rate(v->last.connections, v->now.connections, ns),
+           rate(v->last.handshakes, v->now.handshakes, ns),
+           rate(requests(&v->last), requests(&v->now), ns),
+           rate(v->last.errors, v->now.errors, ns),
+           (double)v->now.loop_lag / 1e6,
+           (busy + idle == 0)?0.0:100.0 * busy / (busy + idle),
+           (double)v->stall / 1e6);
+  }
+
+  printf("\nopcode               total/s");
+  for (i = 0; i < h->workers; i++) {
+    char name[16];
+
+    snprintf(name, sizeof(name), "w%u", i);
+    printf(" %9s", name);
+  }
+  printf("\n");
+
+  for (slot = 0; slot < KSSL_METRICS_OPS; slot++) {
+    total = 0;
+    for (i = 0; i < h->workers; i++) {
+      v = &views[i];
+      if (v->valid) {
+        total += rate(v->last.requests[slot], v->now.requests[slot], ns);
+      }
+    }
+    if (total == 0) {
+      continue;
+    }
+
+    printf("%-20s %8.1f", op_name(h, slot), total);
+    for (i = 0; i < h->workers; i++) {
+      v = &views[i];
+      printf(" %9.1f", v->valid?
+             rate(v->last.requests[slot], v->now.requests[slot], ns):0.0);
+    }
+    printf("\n");
+  }
+
+  fflush(stdout);
+  start_interval(h, views);
+}
+
+int main(int argc, char *argv[])
+{
+  int interval = 1000;
+  int sample_ms = 10;
+  int count = 0;
+  int help = 0;
+  int opt, shown, clear;
+  const char *path;
+  const kssl_stats_header *h;
+  worker_view *views;
+  uint64_t id, started, now;
+
+  const struct option long_options[] = {
+    {"interval",  required_argument, 0, 0},
+    {"sample-ms", required_argument, 0, 1},
+    {"count",     required_argument, 0, 2},
+    {"help",      no_argument,       0, 3},
+    {0,           0,                 0, 0}
+  };
+
+  optind = 1;
+  while (1) {
+    opt = getopt_long(argc, argv, "", long_options, 0);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 0:
+      interval = atoi(optarg);
+      break;
+
+    case 1:
+      sample_ms = atoi(optarg);
+      break;
+
+    case 2:
+      count = atoi(optarg);
+      break;
+
+    default:
+      help = 1;
+      break;
+    }
+  }
+
+  if (help || optind != argc - 1) {
+    fatal_error("Usage: keylesstop [--interval=MS] [--sample-ms=MS] "
+                "[--count=N] FILE");
+  }
+  if (interval <= 0 || sample_ms <= 0 || sample_ms > interval) {
+    fatal_error("The --sample-ms parameter must be between 1 and "
+                "--interval");
+  }
+  if (count < 0) {
+    fatal_error("The --count parameter must not be negative");
+  }
+
+  path = argv[optind];
+  clear = (count == 0);
+#if !PLATFORM_WINDOWS
+  clear = clear && isatty(1);
+#endif
+
+  shown = 0;
+  while (count == 0 || shown < count) {
+
+    // The file is mapped again whenever it is replaced by a keyless
+    // that has been restarted or upgraded
+
+    id = file_id(path);
+    h = stats_map(path);
+    if (h == NULL) {
+      fatal_error("Can't read statistics from %s: %s", path,
+                  strerror(errno));
+    }
+
+    views = (worker_view *)calloc(h->workers, sizeof(worker_view));
+    if (views == NULL) {
+      fatal_error("Memory allocation error");
+    }
+
+    sample(h, views);
+    start_interval(h, views);
+    started = uv_hrtime();
+
+    while ((count == 0 || shown < count) && file_id(path) == id) {
+      do {
+        sleep_ms(sample_ms);
+        sample(h, views);
+        now = uv_hrtime();
+      } while (now - started < (uint64_t)interval * 1000000);
+
+      show(h, views, now - started, clear);
+      if (!clear) {
+        printf("\n");
+      }
+      started = now;
+      shown += 1;
+    }
+
+    free(views);
+    stats_unmap(h);
+  }
+
+  return 0;
+}
@@ -0,0 +1,353 @@
+// kssl_admin.c: the admin control socket
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_admin.h"
+
+struct admin_server_ {
+  uv_pipe_t pipe;           // Listener
+  int listening;            // 1 until the listener is closed
+  int open;                 // Listener and connections not yet closed
+  admin_command_cb command;
+  admin_request *requests;  // Open connections
+};
+
+// There is one of these per connection. It holds the command being
+// handled and any further commands already read.
+
+struct admin_request_ {
+  struct admin_request_ **prev;
+  struct admin_request_ *next;
+  uv_pipe_t pipe;           // Connection to the client
+  uv_write_t write_req;
+  admin_server *server;
+  char line[ADMIN_MAX_LINE];
+  size_t len;               // Bytes read into line
+  size_t used;              // Length of the current command and its \n
+  metrics_buffer response;
+  int reading;
+  int busy;                 // A command is being handled or answered
+  int closing;              // Close once the current command is done
+};
+
+static void admin_next(admin_request *r);
+
+// admin_free_server: count a closed handle and free the server once
+// they are all closed
+static void admin_free_server(admin_server *server)
+{
+  server->open -= 1;
+  if (server->open == 0) {
+    free(server);
+  }
+}
+
+// admin_request_close_cb: frees a connection once its handle is closed
+static void admin_request_close_cb(uv_handle_t *handle)
+{
+  admin_request *r = (admin_request *)handle->data;
+  admin_server *server = r->server;
+
+  free(r->response.data);
+  free(r);
+  admin_free_server(server);
+}
+
+// admin_request_close: close a connection
+static void admin_request_close(admin_request *r)
+{
+  *(r->prev) = r->next;
+  if (r->next) {
+    r->next->prev = r->prev;
+  }
+
+  uv_close((uv_handle_t *)&r->pipe, admin_request_close_cb);
+}
+
+// admin_write_cb: the response has been sent so handle the next command
+static void admin_write_cb(uv_write_t *req, int status)
+{
+  admin_request *r = (admin_request *)req->data;
+
+  if (status != 0 || r->closing) {
+    admin_request_close(r);
+    return;
+  }
+
+  r->response.len = 0;
+  r->len -= r->used;
+  memmove(r->line, r->line + r->used, r->len);
+  r->used = 0;
+  r->busy = 0;
+
+  admin_next(r);
+}
+
+// admin_alloc_cb: read into the space left in the connection's line
+static void admin_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  admin_request *r = (admin_request *)handle->data;
+
+  buf->base = r->line + r->len;
+  buf->len = sizeof(r->line) - 1 - r->len;
+}
+
+// admin_read_cb: collect commands. A client that has gone is closed once
+// its current command (if any) is done.
+static void admin_read_cb(uv_stream_t *stream, ssize_t nread,
+                          const uv_buf_t *buf)
+{
+  admin_request *r = (admin_request *)stream->data;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    uv_read_stop(stream);
+    r->reading = 0;
+    if (r->busy) {
+      r->closing = 1;
+    } else {
+      admin_request_close(r);
+    }
+    return;
+  }
+
+  r->len += nread;
+  admin_next(r);
+}
+
+// admin_next: handle the next complete command read on r, or read more
+static void admin_next(admin_request *r)
+{
+  char *argv[ADMIN_MAX_ARGS];
+  int argc;
+  char *nl, *word, *save;
+
+  while (!r->busy && !r->closing) {
+    nl = (char *)memchr(r->line, '\n', r->len);
+    if (nl == NULL) {
+      break;
+    }
+
+    *nl = '\0';
+    if (nl > r->line && nl[-1] == '\r') {
+      nl[-1] = '\0';
+    }
+    r->used = nl - r->line + 1;
+
+    argc = 0;
+    for (word = strtok_r(r->line, " \t", &save);
+         word != NULL && argc < ADMIN_MAX_ARGS;
+         word = strtok_r(NULL, " \t", &save)) {
+      argv[argc++] = word;
+    }
+
+    // Blank lines are ignored so that a client can test the connection
+
+    if (argc == 0) {
+      r->len -= r->used;
+      memmove(r->line, r->line + r->used, r->len);
+      r->used = 0;
+      continue;
+    }
+
+    if (r->reading) {
+      uv_read_stop((uv_stream_t *)&r->pipe);
+      r->reading = 0;
+    }
+
+    r->busy = 1;
+    r->server->command(r, argc, argv);
+    return;
+  }
+
+  if (r->busy || r->closing) {
+    return;
+  }
+
+  if (r->len == sizeof(r->line) - 1) {
+    r->busy = 1;
+    r->closing = 1;
+    admin_done(r, "command too long");
+    return;
+  }
+
+  if (!r->reading) {
+    if (uv_read_start((uv_stream_t *)&r->pipe, admin_alloc_cb,
+                      admin_read_cb) == 0) {
+      r->reading = 1;
+    } else {
+      admin_request_close(r);
+    }
+  }
+}
+
+// admin_connection_cb: a client has connected
+static void admin_connection_cb(uv_stream_t *listener, int status)
+{
+  admin_server *server = (admin_server *)listener->data;
+  admin_request *r;
+  int rc;
+
+  if (status != 0) {
+    return;
+  }
+
+  r = (admin_request *)calloc(1, sizeof(admin_request));
+  if (r == NULL) {
+    write_log(1, "Memory allocation error");
+    return;
+  }
+
+  rc = uv_pipe_init(listener->loop, &r->pipe, 0);
+  if (rc != 0) {
+    write_log(1, "Failed to create admin connection: %s", error_string(rc));
+    free(r);
+    return;
+  }
+
+  r->pipe.data = (void *)r;
+  r->server = server;
+  server->open += 1;
+
+  r->next = server->requests;
+  r->prev = &server->requests;
+  if (r->next) {
+    r->next->prev = &r->next;
+  }
+  server->requests = r;
+
+  rc = uv_accept(listener, (uv_stream_t *)&r->pipe);
+  if (rc != 0) {
+    write_log(1, "Failed to accept admin connection: %s", error_string(rc));
+    admin_request_close(r);
+    return;
+  }
+
+  admin_next(r);
+}
+
+// admin_server_close_cb: the listener has been closed
+static void admin_server_close_cb(uv_handle_t *handle)
+{
+  admin_free_server((admin_server *)handle->data);
+}
+
+// admin_listen: start accepting commands on a Unix socket
+admin_server *admin_listen(uv_loop_t *loop, const char *path,
+                           admin_command_cb command)
+{
+  admin_server *server;
+  int rc;
+
+  server = (admin_server *)calloc(1, sizeof(admin_server));
+  if (server == NULL) {
+    return NULL;
+  }
+
+  server->command = command;
+
+  // A socket left behind by a previous run would stop the bind from
+  // succeeding
+
+  remove(path);
+
+  rc = uv_pipe_init(loop, &server->pipe, 0);
+  if (rc != 0) {
+    write_log(1, "Failed to create admin socket: %s", error_string(rc));
+    free(server);
+    return NULL;
+  }
+
+  server->pipe.data = (void *)server;
+  server->listening = 1;
+  server->open = 1;
+
+  rc = uv_pipe_bind(&server->pipe, path);
+  if (rc == 0) {
+    rc = uv_listen((uv_stream_t *)&server->pipe, SOMAXCONN,
+                   admin_connection_cb);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to listen for admin commands on %s: %s", path,
+              error_string(rc));
+    admin_close(server);
+    return NULL;
+  }
+
+  return server;
+}
+
+// admin_close: stop listening and close every connection that is not
+// in the middle of a command
+void admin_close(admin_server *server)
+{
+  admin_request *r, *next;
+
+  if (server == NULL) {
+    return;
+  }
+
+  for (r = server->requests; r != NULL; r = next) {
+    next = r->next;
+    if (r->busy) {
+      r->closing = 1;
+    } else {
+      admin_request_close(r);
+    }
+  }
+
+  if (server->listening) {
+    server->listening = 0;
+    uv_close((uv_handle_t *)&server->pipe, admin_server_close_cb);
+  }
+}
+
+// admin_printf: append printf formatted text to the response to r
+void admin_printf(admin_request *r, const char *fmt, ...)
+{
+  va_list l;
+
+  va_start(l, fmt);
+  metrics_vprintf(&r->response, fmt, l);
+  va_end(l);
+}
+
+// admin_done: finish and send the response to r
+void admin_done(admin_request *r, const char *error)
+{
+  uv_buf_t buf;
+  int rc;
+
+  if (error == NULL) {
+    admin_printf(r, "OK\n");
+  } else {
+    admin_printf(r, "ERR %s\n", error);
+  }
+
+  // If the client has gone there is no one to answer, but a command
+  // too long to read is still answered before closing
+
+  if (r->closing && r->used != 0) {
+    admin_request_close(r);
+    return;
+  }
+
+  buf = uv_buf_init(r->response.data, r->response.len);
+  r->write_req.data = (void *)r;
+  rc = uv_write(&r->write_req, (uv_stream_t *)&r->pipe, &buf, 1,
+                admin_write_cb);
+  if (rc != 0) {
+    write_log(1, "Failed to write admin response: %s", error_string(rc));
+    admin_request_close(r);
+  }
+}
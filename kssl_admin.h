@@ -0,0 +1,58 @@
+// kssl_admin.h: the admin control socket
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_ADMIN
+#define INCLUDED_KSSL_ADMIN 1
+
+#include <uv.h>
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// The admin socket is a Unix socket served by the main thread. Clients
+// send one command per line; the response to each is zero or more lines
+// of text followed by a line that is either OK or ERR and a reason.
+// Commands are handled one at a time per connection. A handler may
+// finish after it returns (for example once the workers have answered
+// it, see worker_command) so nothing here waits for the request path.
+
+// The longest command line accepted
+
+#define ADMIN_MAX_LINE 1024
+
+// The most words a command is split into
+
+#define ADMIN_MAX_ARGS 8
+
+// A command being handled
+
+typedef struct admin_request_ admin_request;
+
+// Called with each command split into words (argc is at least 1). The
+// handler writes its response with admin_printf and must call
+// admin_done exactly once, now or later.
+
+typedef void (*admin_command_cb)(admin_request *r, int argc, char **argv);
+
+// Opaque handle for a listening admin socket
+
+typedef struct admin_server_ admin_server;
+
+// admin_listen: start accepting commands on the Unix socket path.
+// Returns NULL on failure.
+admin_server *admin_listen(uv_loop_t *loop, const char *path,
+                           admin_command_cb command);
+
+// admin_close: stop accepting connections. Connections already open are
+// closed once their current command has finished.
+void admin_close(admin_server *server);
+
+// admin_printf: append printf formatted text to the response to r
+void admin_printf(admin_request *r, const char *fmt, ...);
+
+// admin_done: finish the response to r with OK if error is NULL or ERR
+// and error otherwise
+void admin_done(admin_request *r, const char *error);
+
+#endif // INCLUDED_KSSL_ADMIN
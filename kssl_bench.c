@@ -0,0 +1,1967 @@
+// kssl_bench.c: open-loop load generator for a keyserver
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: kssl_bench [OPTIONS]
+//
+// Opens --connections mutually authenticated TLS connections to a
+// keyserver and, once they are all established, sends requests at a fixed
+// rate of --rate requests per second spread across the connections. The
+// requests sent are drawn at random from the --mix of opcodes and the
+// --key public keys.
+//
+// Each request has an intended send time fixed by the arrival rate.
+// Latency is measured from that intended time rather than from when the
+// request was actually written, so a server (or connection) that stalls
+// is charged for the requests that queued up behind the stall instead of
+// silently lowering the offered load (coordinated omission). The time
+// from write to response is reported separately as service latency.
+//
+// Results are written to stdout as a single JSON object.
+//
+// --server, --port
+//
+// Address of the keyserver.
+//
+// --client-cert, --client-key, --ca-file
+//
+// Client certificate and key presented to the server and the CA used to
+// verify the server certificate (as for testclient).
+//
+// --key=FILE[:WEIGHT]
+//
+// A PEM public (or private) RSA or EC key the server holds. May be given
+// more than once; each request picks a key with probability proportional
+// to its weight (default 1).
+//
+// --mix=OP:WEIGHT,...
+//
+// Opcodes to send and their relative weights. OP is one of ping,
+// rsa-decrypt, rsa-decrypt-raw, rsa-sign-md5sha1, rsa-sign-sha1,
+// rsa-sign-sha224, rsa-sign-sha256, rsa-sign-sha384, rsa-sign-sha512 and
+// the ecdsa-sign-* equivalents. Defaults to ping:1.
+//
+// --connections
+//
+// Number of connections (default 1).
+//
+// --rate
+//
+// Requests per second across all connections (default 1000).
+//
+// --depth
+//
+// Most requests outstanding on a connection. Requests that are due when
+// every connection is full wait (and are charged for waiting). 0, the
+// default, is unlimited.
+//
+// --warmup, --duration
+//
+// Seconds of load before measuring starts (default 1) and seconds of load
+// measured (default 10).
+//
+// --timeout
+//
+// Seconds to wait for outstanding responses after the load stops
+// (default 5).
+//
+// --seed
+//
+// Seed for the random choice of requests (default from the time)
+//
+// --replay=FILE
+//
+// Instead of generating load, replay a capture written by keyless
+// --capture. Every captured connection is opened, used and closed at the
+// time it was in the capture and each request is sent on its connection
+// at its captured time with the same opcode and key. Payloads are
+// synthetic. Keys are matched to the --key files by digest; requests for
+// keys that were not given are sent for a --key of the same type and
+// counted as remapped. --mix, --connections, --rate, --depth and
+// --duration are ignored.
+//
+// --speed
+//
+// Replay this many times faster than the capture (default 1)
+//
+// --storm=RATE
+//
+// While the --rate load continues on the established connections, open
+// RATE new connections per second, each closed as soon as its (full,
+// mutually authenticated) handshake completes. This simulates clients
+// reconnecting en masse. Handshake throughput and latency (measured from
+// each connection's intended open time) are reported together with the
+// latency of requests on the established connections before and during
+// the storm. Ignored with --replay.
+//
+// --storm-start
+//
+// Seconds into the measurement period at which the storm starts (default
+// half of --duration). The storm lasts until the end of the measurement.
+//
+// --idle=SECONDS
+//
+// Instead of generating load, measure the cost of idle connections:
+// open --connections connections, send one request from the --mix on
+// each, then hold them all open and idle for SECONDS. With --server-pid
+// the keyserver's resident memory is read (from /proc, so the server
+// must be on the same machine) before the connections are opened and at
+// the end of the idle period and reported per connection.
+//
+// --server-pid
+//
+// Process id of the keyserver (see --idle)
+//
+// --source=IP, --sources=N
+//
+// Bind connections to N consecutive source addresses starting at IP in
+// turn (default a single address chosen by the system). A single source
+// address can only make around 28,000 connections to one server port;
+// against a local server use, for example, --source=127.0.0.2
+// --sources=8.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <uv.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_getopt.h"
+#include "kssl_histogram.h"
+#include "kssl_capture.h"
+
+// Most keys and opcodes in a mix
+
+#define MAX_KEYS 64
+#define MAX_OPS  16
+
+// Requests in flight are tracked in a table indexed by the low bits of
+// their id
+
+#define PENDING_BITS 20
+#define PENDING_SIZE (1 << PENDING_BITS)
+#define PENDING_MASK (PENDING_SIZE - 1)
+
+// The schedule is checked this often (ms)
+
+#define TICK_MS 1
+
+// Bytes read from the network at a time
+
+#define READ_SIZE 16384
+
+// Phases of a run
+
+#define PHASE_CONNECT 0 // Establishing connections
+#define PHASE_LOAD    1 // Sending requests (warmup and measurement)
+#define PHASE_DRAIN   2 // Waiting for outstanding responses
+#define PHASE_IDLE    3 // Holding connections open (--idle)
+#define PHASE_DONE    4
+
+// Most handshakes in progress at once while connecting
+
+#define MAX_OPENING 256
+
+// A key requests can be sent for
+
+typedef struct {
+  char *path;
+  int weight;
+  EVP_PKEY *key;
+  BYTE digest[KSSL_DIGEST_SIZE];
+} bench_key;
+
+// An opcode that can appear in --mix
+
+typedef struct {
+  const char *name;
+  BYTE opcode;
+  int type;        // EVP_PKEY_RSA, EVP_PKEY_EC or 0 for no key
+  int digest_len;  // Length of a sign payload (0 for decrypt and ping)
+} bench_opcode;
+
+static const bench_opcode opcodes[] = {
+  {"ping",               KSSL_OP_PING,               0,            0},
+  {"rsa-decrypt",        KSSL_OP_RSA_DECRYPT,        EVP_PKEY_RSA, 0},
+  {"rsa-decrypt-raw",    KSSL_OP_RSA_DECRYPT_RAW,    EVP_PKEY_RSA, 0},
+  {"rsa-sign-md5sha1",   KSSL_OP_RSA_SIGN_MD5SHA1,   EVP_PKEY_RSA, 36},
+  {"rsa-sign-sha1",      KSSL_OP_RSA_SIGN_SHA1,      EVP_PKEY_RSA, 20},
+  {"rsa-sign-sha224",    KSSL_OP_RSA_SIGN_SHA224,    EVP_PKEY_RSA, 28},
+  {"rsa-sign-sha256",    KSSL_OP_RSA_SIGN_SHA256,    EVP_PKEY_RSA, 32},
+  {"rsa-sign-sha384",    KSSL_OP_RSA_SIGN_SHA384,    EVP_PKEY_RSA, 48},
+  {"rsa-sign-sha512",    KSSL_OP_RSA_SIGN_SHA512,    EVP_PKEY_RSA, 64},
+  {"ecdsa-sign-md5sha1", KSSL_OP_ECDSA_SIGN_MD5SHA1, EVP_PKEY_EC,  36},
+  {"ecdsa-sign-sha1",    KSSL_OP_ECDSA_SIGN_SHA1,    EVP_PKEY_EC,  20},
+  {"ecdsa-sign-sha224",  KSSL_OP_ECDSA_SIGN_SHA224,  EVP_PKEY_EC,  28},
+  {"ecdsa-sign-sha256",  KSSL_OP_ECDSA_SIGN_SHA256,  EVP_PKEY_EC,  32},
+  {"ecdsa-sign-sha384",  KSSL_OP_ECDSA_SIGN_SHA384,  EVP_PKEY_EC,  48},
+  {"ecdsa-sign-sha512",  KSSL_OP_ECDSA_SIGN_SHA512,  EVP_PKEY_EC,  64},
+  {NULL,                 0,                          0,            0}
+};
+
+// A serialized request for one opcode and key. Only the id in the header
+// changes between requests. Results are kept per template.
+
+typedef struct {
+  const bench_opcode *op;
+  bench_key *key;          // NULL for ping
+  BYTE *bytes;
+  int len;
+  uint64_t cumulative;     // Sum of weights up to and including this one
+  uint64_t completed;
+  uint64_t errors;
+  kssl_histogram latency;  // From intended send time (ns)
+  kssl_histogram service;  // From actual send time (ns)
+  uint64_t max;
+} bench_template;
+
+// A request in flight
+
+typedef struct bench_conn_ bench_conn;
+
+typedef struct {
+  DWORD id;
+  int tmpl;           // Index into templates or -1 if the slot is free
+  bench_conn *conn;   // Connection it was sent on
+  int measured;       // 1 if sent during the measurement period
+  uint64_t intended;  // uv_hrtime() at which it should have been sent
+  uint64_t sent;      // uv_hrtime() at which it was written
+} bench_pending;
+
+// A captured event being replayed
+
+typedef struct {
+  uint64_t time;      // From the capture (ns)
+  int conn;           // Index into conns
+  int type;           // KSSL_CAPTURE_*
+  int tmpl;           // Request: index into templates
+} replay_event;
+
+// A replayed request waiting for its connection's handshake
+
+typedef struct {
+  int tmpl;
+  uint64_t intended;
+} replay_wait;
+
+// A connection to the server
+
+struct bench_conn_ {
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+  SSL *ssl;
+  BIO *read_bio;
+  BIO *write_bio;
+  int opened;          // conn_open has been called
+  int connected;       // TLS handshake complete
+  int closed;
+  int closing;         // Replay: close once outstanding requests finish
+  int dirty;           // Replay: written to since the last flush
+  int outstanding;     // Requests sent without a response
+  int storm;           // Opened by the storm and closed after the handshake
+  uint64_t intended;   // Storm: uv_hrtime() at which it should have opened
+  BYTE *in;            // Decrypted bytes not yet parsed
+  int in_len;
+  int in_size;
+  replay_wait *waiting; // Replay: requests due before the handshake ended
+  int waiting_len;
+  int waiting_size;
+};
+
+// A write of encrypted bytes to the network
+
+typedef struct {
+  uv_write_t req;
+  uv_buf_t buf;
+} bench_write;
+
+static char *server = NULL;
+static int port = 0;
+static int connections = 1;
+static double rate = 1000;
+static int depth = 0;
+static double warmup = 1;
+static double duration = 10;
+static double timeout = 5;
+static uint64_t seed = 0;
+
+static bench_key keys[MAX_KEYS];
+static int bench_key_count = 0;
+
+static const bench_opcode *mix_ops[MAX_OPS];
+static int mix_weights[MAX_OPS];
+static int mix_count = 0;
+
+static bench_template *templates = NULL;
+static int template_count = 0;
+
+static bench_pending *pending = NULL;
+static bench_conn *conns = NULL;
+static int connected = 0;
+static int next_conn = 0;
+
+static uv_loop_t *loop;
+static uv_timer_t timer;
+static struct sockaddr_in addr;
+static SSL_CTX *ctx;
+
+static int phase = PHASE_CONNECT;
+static uint64_t started = 0;   // uv_hrtime() at which load started
+static uint64_t measure_from = 0;
+static uint64_t measure_to = 0;
+static uint64_t drain_until = 0;
+static uint64_t connect_until = 0;
+static uint64_t issued = 0;    // Requests whose intended time has passed
+static uint64_t sent = 0;      // Measured requests sent
+static uint64_t outstanding = 0;
+static uint64_t failed_conns = 0;
+static uint64_t closed_lost = 0; // Measured requests whose connection closed
+static uint64_t unsent = 0;      // Requests that were due but could not
+                                 // be sent
+static DWORD next_id = 1;
+
+// Replay state (see --replay)
+
+static char *replay = NULL;
+static double speed = 1;
+static replay_event *events = NULL;
+static int event_count = 0;
+static int next_event = 0;
+static int request_count = 0;
+static uint64_t replay_span = 0;   // Capture time from first to last event
+static uint64_t remapped = 0;      // Requests sent for a substitute key
+static uint64_t skipped = 0;       // Requests that could not be replayed
+static int *dirty = NULL;          // Connections written to this tick
+static int dirty_count = 0;
+
+static double storm = 0;
+static double storm_start = -1;
+static uint64_t storm_from = 0;    // uv_hrtime() at which the storm starts
+static uint64_t storm_opened = 0;  // Storm connections opened
+static uint64_t storm_pending = 0; // Storm connections still handshaking
+static uint64_t storm_done = 0;    // Storm handshakes completed
+static uint64_t storm_failed = 0;
+static uint64_t storm_max = 0;
+static kssl_histogram storm_handshake; // From intended open time (ns)
+static kssl_histogram quiet_latency;   // Measured requests before the storm
+static kssl_histogram storm_latency;   // Measured requests during it
+
+static double idle = 0;
+static int server_pid = 0;
+static uint64_t idle_until = 0;
+static uint64_t idle_connections = 0;
+static uint64_t rss_before = 0;    // Server resident memory (bytes)
+static uint64_t rss_after = 0;
+static struct sockaddr_in source;
+static int sources = 0;
+static uint64_t opens = 0;         // Calls to conn_open
+static int next_open = 0;          // Next of conns to open
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+// ssl_error: print the OpenSSL error queue and exit
+static void ssl_error(void)
+{
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+// random64: xorshift64* pseudo random number generator
+static uint64_t random64(void)
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return seed * 2685821657736338717ULL;
+}
+
+// digest_key: calculate the SHA256 digest the server uses to identify a
+// key: the hex of the RSA modulus or of the compressed EC point (see
+// digest_public_key in kssl_private_key.c)
+static void digest_key(EVP_PKEY *key, BYTE *digest)
+{
+  char *hex = NULL;
+  EVP_MD_CTX *md;
+
+  if (key->type == EVP_PKEY_RSA) {
+    RSA *rsa = EVP_PKEY_get1_RSA(key);
+    hex = BN_bn2hex(rsa->n);
+    RSA_free(rsa);
+  } else {
+    EC_KEY *ec_key = EVP_PKEY_get1_EC_KEY(key);
+    hex = EC_POINT_point2hex(EC_KEY_get0_group(ec_key),
+                             EC_KEY_get0_public_key(ec_key),
+                             POINT_CONVERSION_COMPRESSED, NULL);
+    EC_KEY_free(ec_key);
+  }
+  if (hex == NULL) {
+    ssl_error();
+  }
+
+  md = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(md, EVP_sha256(), 0);
+  EVP_DigestUpdate(md, hex, strlen(hex));
+  EVP_DigestFinal_ex(md, digest, 0);
+  EVP_MD_CTX_destroy(md);
+  OPENSSL_free(hex);
+}
+
+// add_key: parse a --key argument and load the key
+static void add_key(const char *arg)
+{
+  bench_key *k;
+  char *colon;
+  BIO *bio;
+
+  if (bench_key_count == MAX_KEYS) {
+    fatal_error("At most %d --key parameters may be given", MAX_KEYS);
+  }
+
+  k = &keys[bench_key_count++];
+  k->path = (char *)malloc(strlen(arg)+1);
+  strcpy(k->path, arg);
+  k->weight = 1;
+  colon = strrchr(k->path, ':');
+  if (colon != NULL) {
+    *colon = '\0';
+    k->weight = atoi(colon + 1);
+    if (k->weight <= 0) {
+      fatal_error("The weight of --key %s must be positive", k->path);
+    }
+  }
+
+  bio = BIO_new(BIO_s_file());
+  if (bio == NULL || BIO_read_filename(bio, k->path) <= 0) {
+    fatal_error("Failed to open key file %s", k->path);
+  }
+  k->key = PEM_read_bio_PUBKEY(bio, 0, 0, 0);
+  if (k->key == NULL) {
+    (void)BIO_reset(bio);
+    k->key = PEM_read_bio_PrivateKey(bio, 0, 0, 0);
+  }
+  BIO_free(bio);
+  if (k->key == NULL ||
+      (k->key->type != EVP_PKEY_RSA && k->key->type != EVP_PKEY_EC)) {
+    fatal_error("%s is not a PEM RSA or EC key", k->path);
+  }
+  ERR_clear_error();
+
+  digest_key(k->key, k->digest);
+}
+
+// parse_mix: parse the --mix argument
+static void parse_mix(const char *arg)
+{
+  char *copy = (char *)malloc(strlen(arg)+1);
+  char *item;
+
+  strcpy(copy, arg);
+  mix_count = 0;
+  for (item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+    char *colon = strchr(item, ':');
+    int weight = 1;
+    int i;
+
+    if (colon != NULL) {
+      *colon = '\0';
+      weight = atoi(colon + 1);
+    }
+    if (weight <= 0) {
+      fatal_error("The weight of %s in --mix must be positive", item);
+    }
+    if (mix_count == MAX_OPS) {
+      fatal_error("At most %d opcodes may be given in --mix", MAX_OPS);
+    }
+
+    for (i = 0; opcodes[i].name != NULL; i++) {
+      if (strcmp(opcodes[i].name, item) == 0) {
+        break;
+      }
+    }
+    if (opcodes[i].name == NULL) {
+      fatal_error("Unknown opcode %s in --mix", item);
+    }
+
+    mix_ops[mix_count] = &opcodes[i];
+    mix_weights[mix_count] = weight;
+    mix_count++;
+  }
+
+  free(copy);
+}
+
+// build_template: serialize a request for op using key
+static void build_template(bench_template *t, const bench_opcode *op,
+                           bench_key *key)
+{
+  static BYTE ip[4] = {127, 0, 0, 1};
+  kssl_header header;
+  kssl_operation req;
+  BYTE *payload;
+  int payload_len;
+
+  header.version_maj = KSSL_VERSION_MAJ;
+  header.version_min = KSSL_VERSION_MIN;
+  header.id = 0;
+
+  zero_operation(&req);
+  req.is_opcode_set = 1;
+  req.opcode = op->opcode;
+  req.is_ip_set = 1;
+  req.ip = ip;
+  req.ip_len = sizeof(ip);
+
+  if (key == NULL) {
+    payload_len = 32;
+    payload = (BYTE *)calloc(payload_len, 1);
+  } else if (op->digest_len != 0) {
+    int i;
+
+    payload_len = op->digest_len;
+    payload = (BYTE *)malloc(payload_len);
+    for (i = 0; i < payload_len; i++) {
+      payload[i] = (BYTE)random64();
+    }
+  } else {
+    RSA *rsa = EVP_PKEY_get1_RSA(key->key);
+    BYTE secret[48];
+    int i;
+
+    payload_len = RSA_size(rsa);
+    payload = (BYTE *)malloc(payload_len);
+    for (i = 0; i < (int)sizeof(secret); i++) {
+      secret[i] = (BYTE)random64();
+    }
+
+    // Both decrypt opcodes are sent an encrypted secret. A raw decrypt
+    // returns it with the PKCS#1 padding still in place.
+
+    if (RSA_public_encrypt(sizeof(secret), secret, payload, rsa,
+                           RSA_PKCS1_PADDING) != payload_len) {
+      ssl_error();
+    }
+    RSA_free(rsa);
+  }
+
+  req.is_payload_set = 1;
+  req.payload = payload;
+  req.payload_len = payload_len;
+  if (key != NULL) {
+    req.is_digest_set = 1;
+    req.digest = key->digest;
+  }
+
+  if (flatten_operation(&header, &req, &t->bytes, &t->len) !=
+      KSSL_ERROR_NONE) {
+    fatal_error("Failed to serialize %s request", op->name);
+  }
+
+  free(payload);
+  t->op = op;
+  t->key = key;
+}
+
+// build_templates: make a template for every combination of opcode in the
+// mix and key of the right type. Each is weighted by the product of the
+// opcode and key weights.
+static void build_templates(void)
+{
+  uint64_t total = 0;
+  int i, j;
+
+  templates = (bench_template *)calloc(mix_count * (bench_key_count + 1),
+                                       sizeof(bench_template));
+  if (templates == NULL) {
+    fatal_error("Failed to allocate request templates");
+  }
+
+  for (i = 0; i < mix_count; i++) {
+    const bench_opcode *op = mix_ops[i];
+    int found = 0;
+
+    if (op->type == 0) {
+      bench_template *t = &templates[template_count++];
+
+      build_template(t, op, NULL);
+      total += mix_weights[i];
+      t->cumulative = total;
+      continue;
+    }
+
+    for (j = 0; j < bench_key_count; j++) {
+      if (keys[j].key->type == op->type) {
+        bench_template *t = &templates[template_count++];
+
+        build_template(t, op, &keys[j]);
+        total += (uint64_t)mix_weights[i] * keys[j].weight;
+        t->cumulative = total;
+        found = 1;
+      }
+    }
+
+    if (!found) {
+      fatal_error("No --key of the right type was given for %s", op->name);
+    }
+  }
+}
+
+// choose_template: pick a template at random by weight
+static int choose_template(void)
+{
+  uint64_t r = random64() % templates[template_count-1].cumulative;
+  int lo = 0;
+  int hi = template_count - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (templates[mid].cumulative > r) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return lo;
+}
+
+// replay_template: returns the template for opcode op (an index into
+// opcodes) and key k (an index into keys or -1), building it if needed
+static int replay_template(int op, int k)
+{
+  static int *index = NULL;
+  int slot = op * (bench_key_count + 1) + (k + 1);
+
+  if (index == NULL) {
+    int i, count = 0;
+
+    while (opcodes[count].name != NULL) {
+      count++;
+    }
+    index = (int *)malloc(count * (bench_key_count + 1) * sizeof(int));
+    templates = (bench_template *)calloc(count * (bench_key_count + 1),
+                                         sizeof(bench_template));
+    if (index == NULL || templates == NULL) {
+      fatal_error("Failed to allocate request templates");
+    }
+    for (i = 0; i < count * (bench_key_count + 1); i++) {
+      index[i] = -1;
+    }
+  }
+
+  if (index[slot] == -1) {
+    index[slot] = template_count;
+    build_template(&templates[template_count++], &opcodes[op],
+                   (k == -1)?NULL:&keys[k]);
+  }
+
+  return index[slot];
+}
+
+// replay_key: returns the --key to send a captured request for. Keys are
+// matched by digest; otherwise a key of the right type is chosen using
+// the digest so that each captured key is always sent for the same
+// substitute. Returns -1 if there is no key of the right type.
+static int replay_key(kssl_capture_record *r, int type)
+{
+  int matching = 0;
+  int i;
+
+  for (i = 0; i < bench_key_count; i++) {
+    if (r->has_key &&
+        memcmp(keys[i].digest, r->digest, KSSL_DIGEST_SIZE) == 0) {
+      return i;
+    }
+    if (keys[i].key->type == type) {
+      matching++;
+    }
+  }
+
+  if (matching == 0) {
+    return -1;
+  }
+
+  remapped++;
+  matching = r->digest[0] % matching;
+  for (i = 0; i < bench_key_count; i++) {
+    if (keys[i].key->type == type && matching-- == 0) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+// compare_events: order replay events by time. Events at the same time
+// are ordered open, request, close so that a connection is never used
+// before it is opened.
+static int compare_events(const void *a, const void *b)
+{
+  const replay_event *x = (const replay_event *)a;
+  const replay_event *y = (const replay_event *)b;
+
+  if (x->time != y->time) {
+    return (x->time > y->time)?1:-1;
+  }
+
+  return x->type - y->type;
+}
+
+// connection_slot: returns the index into conns for a captured connection
+// identifier using an open addressing table of size mask + 1
+static int connection_slot(uint32_t *ids, int *slots, uint32_t mask,
+                           uint32_t id)
+{
+  uint32_t h = (id * 2654435761U) & mask;
+
+  while (ids[h] != 0 && ids[h] != id) {
+    h = (h + 1) & mask;
+  }
+  if (ids[h] == 0) {
+    ids[h] = id;
+    slots[h] = connections++;
+  }
+
+  return slots[h];
+}
+
+// load_replay: read the capture file and turn it into events
+static void load_replay(void)
+{
+  kssl_capture_header header;
+  kssl_capture_record r;
+  uint32_t *ids;
+  int *slots;
+  uint32_t mask;
+  long size;
+  int capacity;
+  FILE *f = fopen(replay, "rb");
+
+  if (f == NULL) {
+    fatal_error("Failed to open capture %s", replay);
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, KSSL_CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+    fatal_error("%s is not a capture file", replay);
+  }
+  if (header.byte_order != KSSL_CAPTURE_BYTE_ORDER ||
+      header.version != KSSL_CAPTURE_VERSION ||
+      header.record_size != sizeof(kssl_capture_record)) {
+    fatal_error("%s was written by an incompatible keyless", replay);
+  }
+
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, sizeof(header), SEEK_SET);
+  capacity = (int)((size - (long)sizeof(header)) / sizeof(r)) + 1;
+
+  mask = 1;
+  while (mask < (uint32_t)capacity * 2) {
+    mask <<= 1;
+  }
+  mask -= 1;
+
+  events = (replay_event *)malloc(capacity * sizeof(replay_event));
+  ids = (uint32_t *)calloc(mask + 1, sizeof(uint32_t));
+  slots = (int *)malloc((mask + 1) * sizeof(int));
+  if (events == NULL || ids == NULL || slots == NULL) {
+    fatal_error("Failed to allocate memory for %s", replay);
+  }
+
+  connections = 0;
+  while (event_count < capacity && fread(&r, sizeof(r), 1, f) == 1) {
+    replay_event *e = &events[event_count];
+    int op;
+
+    e->time = r.time;
+    e->type = r.type;
+    e->tmpl = -1;
+
+    if (r.type == KSSL_CAPTURE_REQUEST) {
+      for (op = 0; opcodes[op].name != NULL; op++) {
+        if (opcodes[op].opcode == r.opcode) {
+          break;
+        }
+      }
+      if (opcodes[op].name == NULL) {
+        skipped++;
+        continue;
+      }
+      if (opcodes[op].type == 0) {
+        e->tmpl = replay_template(op, -1);
+      } else {
+        int k = replay_key(&r, opcodes[op].type);
+
+        if (k == -1) {
+          skipped++;
+          continue;
+        }
+        e->tmpl = replay_template(op, k);
+      }
+      request_count++;
+    } else if (r.type != KSSL_CAPTURE_OPEN && r.type != KSSL_CAPTURE_CLOSE) {
+      continue;
+    }
+
+    e->conn = connection_slot(ids, slots, mask, r.connection);
+    event_count++;
+  }
+  fclose(f);
+  free(ids);
+  free(slots);
+
+  if (event_count == 0) {
+    fatal_error("%s contains nothing to replay", replay);
+  }
+
+  qsort(events, event_count, sizeof(replay_event), compare_events);
+  replay_span = events[event_count-1].time - events[0].time;
+}
+
+static void conn_close(bench_conn *c);
+
+// write_cb: free a completed write
+static void write_cb(uv_write_t *req, int status)
+{
+  bench_write *w = (bench_write *)req;
+
+  if (status != 0) {
+    conn_close((bench_conn *)req->handle->data);
+  }
+  free(w->buf.base);
+  free(w);
+}
+
+// conn_flush: send anything OpenSSL has written to the write BIO
+static void conn_flush(bench_conn *c)
+{
+  int pending_bytes = BIO_pending(c->write_bio);
+  bench_write *w;
+
+  if (pending_bytes <= 0 || c->closed) {
+    return;
+  }
+
+  w = (bench_write *)malloc(sizeof(bench_write));
+  if (w == NULL) {
+    fatal_error("Failed to allocate write");
+  }
+  w->buf.base = (char *)malloc(pending_bytes);
+  if (w->buf.base == NULL) {
+    fatal_error("Failed to allocate write buffer");
+  }
+  w->buf.len = BIO_read(c->write_bio, w->buf.base, pending_bytes);
+
+  if (uv_write(&w->req, (uv_stream_t *)&c->tcp, &w->buf, 1, write_cb) != 0) {
+    free(w->buf.base);
+    free(w);
+    conn_close(c);
+  }
+}
+
+// close_cb: a connection's handle has closed
+static void close_cb(uv_handle_t *handle)
+{
+  bench_conn *c = (bench_conn *)handle->data;
+
+  SSL_free(c->ssl);
+  c->ssl = NULL;
+  if (c->storm) {
+    free(c->in);
+    free(c);
+  }
+}
+
+// release_pending: free the slots of the requests outstanding on c. They
+// will never be answered so the measured ones are counted as lost.
+static void release_pending(bench_conn *c)
+{
+  int i;
+
+  for (i = 0; i < PENDING_SIZE && c->outstanding > 0; i++) {
+    bench_pending *p = &pending[i];
+
+    if (p->tmpl != -1 && p->conn == c) {
+      if (p->measured) {
+        closed_lost++;
+      }
+      p->tmpl = -1;
+      p->conn = NULL;
+      c->outstanding--;
+      outstanding--;
+    }
+  }
+}
+
+// conn_close: give up on a connection. Its outstanding requests are
+// never answered and are counted as lost.
+static void conn_close(bench_conn *c)
+{
+  if (c->closed || !c->opened) {
+    return;
+  }
+
+  c->closed = 1;
+  release_pending(c);
+  if (c->storm) {
+    if (!c->connected) {
+      storm_pending--;
+      if (phase != PHASE_DONE) {
+        storm_failed++;
+      }
+    }
+  } else if (c->connected) {
+    connected--;
+  } else {
+    failed_conns++;
+  }
+  uv_close((uv_handle_t *)&c->tcp, close_cb);
+}
+
+// finish: record a response
+static void finish(bench_conn *c, kssl_header *h, BYTE *payload)
+{
+  bench_pending *p = &pending[h->id & PENDING_MASK];
+  bench_template *t;
+  kssl_operation resp;
+  uint64_t now = uv_hrtime();
+  uint64_t latency;
+
+  if (p->tmpl == -1 || p->id != h->id || p->conn != c) {
+    fprintf(stderr, "Unexpected response id %08x\n", h->id);
+    return;
+  }
+
+  c->outstanding--;
+  outstanding--;
+  t = &templates[p->tmpl];
+  p->tmpl = -1;
+  p->conn = NULL;
+
+  if (c->closing && c->outstanding == 0) {
+    conn_close(c);
+  }
+
+  if (!p->measured) {
+    return;
+  }
+
+  zero_operation(&resp);
+  if (parse_message_payload(payload, h->length, &resp) != KSSL_ERROR_NONE ||
+      resp.opcode == KSSL_OP_ERROR) {
+    t->errors++;
+  }
+
+  latency = now - p->intended;
+  if (storm > 0) {
+    histogram_record((p->intended >= storm_from)?&storm_latency:
+                     &quiet_latency, latency);
+  }
+  t->completed++;
+  histogram_record(&t->latency, latency);
+  histogram_record(&t->service, now - p->sent);
+  if (latency > t->max) {
+    t->max = latency;
+  }
+}
+
+// conn_parse: handle every complete response in a connection's buffer
+static void conn_parse(bench_conn *c)
+{
+  int used = 0;
+
+  while (!c->closed && c->in_len - used >= (int)KSSL_HEADER_SIZE) {
+    kssl_header h;
+
+    parse_header(c->in + used, &h);
+    if (c->in_len - used < (int)KSSL_HEADER_SIZE + h.length) {
+      break;
+    }
+
+    finish(c, &h, c->in + used + KSSL_HEADER_SIZE);
+    used += KSSL_HEADER_SIZE + h.length;
+  }
+
+  if (used > 0) {
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+  }
+}
+
+static int send_on(bench_conn *c, int tmpl, uint64_t intended);
+
+// conn_established: a connection's handshake has completed. Replayed
+// requests that were due during the handshake are sent now.
+static void conn_established(bench_conn *c)
+{
+  int i;
+
+  c->connected = 1;
+  if (c->storm) {
+    uint64_t latency = uv_hrtime() - c->intended;
+
+    storm_pending--;
+    storm_done++;
+    histogram_record(&storm_handshake, latency);
+    if (latency > storm_max) {
+      storm_max = latency;
+    }
+    conn_close(c);
+    return;
+  }
+  connected++;
+
+  for (i = 0; i < c->waiting_len && !c->closed; i++) {
+    send_on(c, c->waiting[i].tmpl, c->waiting[i].intended);
+  }
+  free(c->waiting);
+  c->waiting = NULL;
+  c->waiting_len = 0;
+  c->waiting_size = 0;
+
+  if (c->closing && c->outstanding == 0) {
+    conn_close(c);
+  }
+}
+
+// conn_ssl: drive OpenSSL after bytes have arrived
+static void conn_ssl(bench_conn *c)
+{
+  if (!c->connected) {
+    int rc = SSL_do_handshake(c->ssl);
+
+    if (rc != 1) {
+      int err = SSL_get_error(c->ssl, rc);
+
+      conn_flush(c);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        ERR_print_errors_fp(stderr);
+        conn_close(c);
+      }
+      return;
+    }
+
+    conn_established(c);
+    if (c->closed) {
+      return;
+    }
+  }
+
+  while (1) {
+    int n;
+
+    if (c->in_size - c->in_len < READ_SIZE) {
+      c->in_size = c->in_len + READ_SIZE;
+      c->in = (BYTE *)realloc(c->in, c->in_size);
+      if (c->in == NULL) {
+        fatal_error("Failed to allocate read buffer");
+      }
+    }
+
+    n = SSL_read(c->ssl, c->in + c->in_len, c->in_size - c->in_len);
+    if (n <= 0) {
+      int err = SSL_get_error(c->ssl, n);
+
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        conn_close(c);
+      }
+      break;
+    }
+
+    c->in_len += n;
+    conn_parse(c);
+    if (c->closed) {
+      return;
+    }
+  }
+
+  // An idle connection keeps no read buffer
+
+  if (idle > 0 && c->in_len == 0) {
+    free(c->in);
+    c->in = NULL;
+    c->in_size = 0;
+  }
+
+  conn_flush(c);
+}
+
+// alloc_cb: allocate a buffer for reading from the network
+static void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  buf->base = (char *)malloc(READ_SIZE);
+  buf->len = (buf->base == NULL)?0:READ_SIZE;
+}
+
+// read_cb: encrypted bytes have arrived
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+  bench_conn *c = (bench_conn *)stream->data;
+
+  if (nread < 0) {
+    conn_close(c);
+  } else if (nread > 0 && !c->closed) {
+    BIO_write(c->read_bio, buf->base, (int)nread);
+    conn_ssl(c);
+  }
+
+  free(buf->base);
+}
+
+// connect_cb: the TCP connection is established so start the handshake
+static void connect_cb(uv_connect_t *req, int status)
+{
+  bench_conn *c = (bench_conn *)req->handle->data;
+
+  if (status != 0) {
+    fprintf(stderr, "Failed to connect: %s\n", uv_strerror(status));
+    conn_close(c);
+    return;
+  }
+
+  uv_tcp_nodelay(&c->tcp, 1);
+  uv_read_start((uv_stream_t *)&c->tcp, alloc_cb, read_cb);
+  conn_ssl(c);
+}
+
+// conn_open: start connecting. c must be zeroed apart from storm and
+// intended.
+static void conn_open(bench_conn *c)
+{
+  c->opened = 1;
+  c->ssl = SSL_new(ctx);
+  c->read_bio = BIO_new(BIO_s_mem());
+  c->write_bio = BIO_new(BIO_s_mem());
+  if (c->ssl == NULL || c->read_bio == NULL || c->write_bio == NULL) {
+    ssl_error();
+  }
+  BIO_set_mem_eof_return(c->read_bio, -1);
+  BIO_set_mem_eof_return(c->write_bio, -1);
+  SSL_set_bio(c->ssl, c->read_bio, c->write_bio);
+  SSL_set_connect_state(c->ssl);
+
+  uv_tcp_init(loop, &c->tcp);
+  c->tcp.data = c;
+  if (sources > 0) {
+    struct sockaddr_in from = source;
+
+    from.sin_addr.s_addr = htonl(ntohl(source.sin_addr.s_addr) +
+                                 (uint32_t)(opens % sources));
+    if (uv_tcp_bind(&c->tcp, (const struct sockaddr *)&from, 0) != 0) {
+      fatal_error("Failed to bind to --source address");
+    }
+  }
+  opens++;
+  if (uv_tcp_connect(&c->connect, &c->tcp, (const struct sockaddr *)&addr,
+                     connect_cb) != 0) {
+    conn_close(c);
+  }
+}
+
+// send_on: write a request from template tmpl with intended send time
+// intended to c. Returns 1.
+static int send_on(bench_conn *c, int tmpl, uint64_t intended)
+{
+  bench_pending *p;
+  bench_template *t;
+
+  p = &pending[next_id & PENDING_MASK];
+  if (p->tmpl != -1) {
+    fatal_error("More than %d requests outstanding", PENDING_SIZE);
+  }
+
+  p->tmpl = tmpl;
+  p->conn = c;
+  p->id = next_id++;
+  p->intended = intended;
+  p->sent = uv_hrtime();
+  p->measured = (intended >= measure_from && intended < measure_to);
+  t = &templates[p->tmpl];
+
+  t->bytes[4] = (BYTE)(p->id >> 24);
+  t->bytes[5] = (BYTE)(p->id >> 16);
+  t->bytes[6] = (BYTE)(p->id >> 8);
+  t->bytes[7] = (BYTE)p->id;
+
+  if (SSL_write(c->ssl, t->bytes, t->len) != t->len) {
+    p->tmpl = -1;
+    p->conn = NULL;
+    conn_close(c);
+    return 1;
+  }
+
+  c->outstanding++;
+  outstanding++;
+  if (p->measured) {
+    sent++;
+  }
+
+  return 1;
+}
+
+// send_request: write the next request (with intended send time
+// intended) to a connection that has room for it. Returns 0 if every
+// connection is busy.
+static int send_request(uint64_t intended)
+{
+  bench_conn *c = NULL;
+  int i;
+
+  for (i = 0; i < connections; i++) {
+    bench_conn *candidate = &conns[next_conn];
+
+    next_conn = (next_conn + 1) % connections;
+    if (candidate->connected && !candidate->closed &&
+        (depth == 0 || candidate->outstanding < depth)) {
+      c = candidate;
+      break;
+    }
+  }
+
+  if (c == NULL) {
+    return 0;
+  }
+
+  return send_on(c, choose_template(), intended);
+}
+
+// storm_open: open a storm connection that should have been opened at
+// intended
+static void storm_open(uint64_t intended)
+{
+  bench_conn *c = (bench_conn *)calloc(1, sizeof(bench_conn));
+
+  if (c == NULL) {
+    fatal_error("Failed to allocate connection");
+  }
+
+  c->storm = 1;
+  c->intended = intended;
+  storm_opened++;
+  storm_pending++;
+  conn_open(c);
+}
+
+// close_all: close every connection that is still open (including storm
+// connections, which are only reachable through the loop)
+static void close_all(uv_handle_t *handle, void *arg)
+{
+  if (handle->type == UV_TCP && !uv_is_closing(handle)) {
+    conn_close((bench_conn *)handle->data);
+  }
+}
+
+// server_rss: returns the resident memory of --server-pid in bytes or 0
+// if it is not known
+static uint64_t server_rss(void)
+{
+  unsigned long long size = 0, resident = 0;
+  char path[64];
+  FILE *f;
+
+  if (server_pid == 0) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/statm", server_pid);
+  f = fopen(path, "r");
+  if (f == NULL) {
+    fatal_error("Failed to read memory use of --server-pid %d", server_pid);
+  }
+  if (fscanf(f, "%llu %llu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+
+  return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+// start_idle: every connection has been attempted (or --timeout has
+// passed), send a request on each so that every connection has used its
+// buffers and then wait for the responses
+static void start_idle(void)
+{
+  int i;
+
+  if (connected == 0) {
+    fatal_error("No connections could be established");
+  }
+
+  started = uv_hrtime();
+  measure_from = started;
+  measure_to = started + (uint64_t)(timeout * 1e9);
+  for (i = 0; i < connections; i++) {
+    if (conns[i].connected && !conns[i].closed) {
+      send_on(&conns[i], choose_template(), started);
+      conn_flush(&conns[i]);
+    }
+  }
+
+  phase = PHASE_DRAIN;
+  drain_until = started + (uint64_t)(timeout * 1e9);
+}
+
+// stop: end the run, closing every connection
+static void stop(void)
+{
+  int i;
+
+  phase = PHASE_DONE;
+  uv_timer_stop(&timer);
+  for (i = 0; i < connections; i++) {
+    unsent += conns[i].waiting_len;
+  }
+  uv_walk(loop, close_all, NULL);
+  uv_close((uv_handle_t *)&timer, NULL);
+}
+
+// start_load: every connection has been attempted (or --timeout has
+// passed), start sending
+static void start_load(void)
+{
+  if (connected == 0) {
+    fatal_error("No connections could be established");
+  }
+
+  phase = PHASE_LOAD;
+  started = uv_hrtime();
+  measure_from = started + (uint64_t)(warmup * 1e9);
+  measure_to = measure_from + (uint64_t)(duration * 1e9);
+  storm_from = measure_from + (uint64_t)(storm_start * 1e9);
+}
+
+// start_replay: start replaying the capture. The whole capture is
+// measured apart from --warmup at the start.
+static void start_replay(void)
+{
+  double span = (double)replay_span / 1e9 / speed;
+
+  if (warmup >= span) {
+    fatal_error("--warmup is longer than the capture");
+  }
+
+  phase = PHASE_LOAD;
+  started = uv_hrtime();
+  measure_from = started + (uint64_t)(warmup * 1e9);
+  measure_to = started + (uint64_t)(span * 1e9) + 1;
+  duration = span - warmup;
+  rate = (double)request_count / span;
+}
+
+// replay_wait_for: queue a request on a connection whose handshake has
+// not finished
+static void replay_wait_for(bench_conn *c, int tmpl, uint64_t intended)
+{
+  if (c->waiting_len == c->waiting_size) {
+    c->waiting_size = (c->waiting_size == 0)?8:c->waiting_size * 2;
+    c->waiting = (replay_wait *)realloc(c->waiting,
+                                        c->waiting_size * sizeof(replay_wait));
+    if (c->waiting == NULL) {
+      fatal_error("Failed to allocate replay queue");
+    }
+  }
+
+  c->waiting[c->waiting_len].tmpl = tmpl;
+  c->waiting[c->waiting_len].intended = intended;
+  c->waiting_len++;
+}
+
+// replay_tick: replay every event whose time has passed. Connections
+// written to are flushed once at the end so that requests captured
+// together are sent together.
+static void replay_tick(uint64_t now)
+{
+  int i;
+
+  while (next_event < event_count) {
+    replay_event *e = &events[next_event];
+    bench_conn *c = &conns[e->conn];
+    uint64_t intended = started +
+      (uint64_t)((double)(e->time - events[0].time) / speed);
+
+    if (intended > now) {
+      break;
+    }
+    next_event++;
+
+    switch (e->type) {
+    case KSSL_CAPTURE_OPEN:
+      if (!c->opened) {
+        conn_open(c);
+      }
+      break;
+
+    case KSSL_CAPTURE_REQUEST:
+
+      // The open of a connection established before the capture started
+      // is missing so it is opened by its first request
+
+      if (!c->opened) {
+        conn_open(c);
+      }
+      if (c->closed) {
+        unsent++;
+      } else if (!c->connected) {
+        replay_wait_for(c, e->tmpl, intended);
+      } else {
+        send_on(c, e->tmpl, intended);
+        if (!c->dirty) {
+          c->dirty = 1;
+          dirty[dirty_count++] = e->conn;
+        }
+      }
+      break;
+
+    case KSSL_CAPTURE_CLOSE:
+      if (c->connected && c->outstanding == 0) {
+        conn_close(c);
+      } else {
+        c->closing = 1;
+      }
+      break;
+    }
+  }
+
+  for (i = 0; i < dirty_count; i++) {
+    conns[dirty[i]].dirty = 0;
+    conn_flush(&conns[dirty[i]]);
+  }
+  dirty_count = 0;
+
+  if (next_event == event_count) {
+    phase = PHASE_DRAIN;
+    drain_until = now + (uint64_t)(timeout * 1e9);
+  }
+}
+
+// skip_request: give up on the request intended to be sent at intended,
+// counting it as unsent if it would have been measured
+static void skip_request(uint64_t intended)
+{
+  if (intended >= measure_from && intended < measure_to) {
+    unsent++;
+  }
+}
+
+// tick_cb: send every request whose intended time has passed
+static void tick_cb(uv_timer_t *handle)
+{
+  uint64_t now = uv_hrtime();
+  int i;
+
+  switch (phase) {
+  case PHASE_CONNECT:
+    while (next_open < connections &&
+           (uint64_t)next_open < connected + failed_conns + MAX_OPENING) {
+      conn_open(&conns[next_open++]);
+      connect_until = now + (uint64_t)(timeout * 1e9);
+    }
+    if (connected + failed_conns == (uint64_t)connections ||
+        now >= connect_until) {
+      if (idle > 0) {
+        start_idle();
+      } else {
+        start_load();
+      }
+    }
+    return;
+
+  case PHASE_LOAD:
+    if (replay != NULL) {
+      replay_tick(now);
+      return;
+    }
+
+    while (1) {
+      uint64_t intended = started + (uint64_t)((double)issued * 1e9 / rate);
+
+      if (intended > now || intended >= measure_to) {
+        break;
+      }
+
+      // Requests wait while every connection is full, but with no
+      // connection left they can never be sent
+
+      if (!send_request(intended)) {
+        if (connected > 0) {
+          break;
+        }
+        skip_request(intended);
+      }
+      issued++;
+    }
+
+    while (storm > 0) {
+      uint64_t intended = storm_from +
+        (uint64_t)((double)storm_opened * 1e9 / storm);
+
+      if (intended > now || intended >= measure_to) {
+        break;
+      }
+      storm_open(intended);
+    }
+
+    for (i = 0; i < connections; i++) {
+      if (conns[i].connected && !conns[i].closed) {
+        conn_flush(&conns[i]);
+      }
+    }
+
+    // The load ends on time even if requests are still waiting for room
+    // on a connection. They are counted as unsent.
+
+    if (now >= measure_to) {
+      while (1) {
+        uint64_t intended = started +
+          (uint64_t)((double)issued * 1e9 / rate);
+
+        if (intended >= measure_to) {
+          break;
+        }
+        skip_request(intended);
+        issued++;
+      }
+    }
+    if (started + (uint64_t)((double)issued * 1e9 / rate) >= measure_to) {
+      phase = PHASE_DRAIN;
+      drain_until = now + (uint64_t)(timeout * 1e9);
+    }
+    return;
+
+  case PHASE_DRAIN:
+    if ((outstanding == 0 && storm_pending == 0) || now >= drain_until) {
+      if (idle > 0) {
+        phase = PHASE_IDLE;
+        idle_until = now + (uint64_t)(idle * 1e9);
+        return;
+      }
+      stop();
+    }
+    return;
+
+  case PHASE_IDLE:
+    if (now >= idle_until) {
+      idle_connections = connected;
+      rss_after = server_rss();
+      stop();
+    }
+    return;
+  }
+}
+
+// print_latency: write a JSON object of latency percentiles in
+// microseconds. Percentiles are capped at the maximum.
+static void print_latency(const char *name, kssl_histogram *h, uint64_t max)
+{
+  static const double percentiles[] = {50, 90, 99, 99.9};
+  static const char *labels[] = {"p50", "p90", "p99", "p999"};
+  int i;
+
+  printf("\"%s\":{\"mean\":%.1f", name,
+         (h->count == 0)?0.0:(double)h->sum / h->count / 1000.0);
+  for (i = 0; i < 4; i++) {
+    uint64_t v = histogram_percentile(h, percentiles[i]);
+
+    if (max != 0 && v > max) {
+      v = max;
+    }
+    printf(",\"%s\":%.1f", labels[i], (double)v / 1000.0);
+  }
+  if (max != 0) {
+    printf(",\"max\":%.1f", (double)max / 1000.0);
+  }
+  printf("}");
+}
+
+// report: write the results as JSON
+static void report(void)
+{
+  kssl_histogram latency, service;
+  uint64_t completed = 0;
+  uint64_t errors = 0;
+  uint64_t max = 0;
+  int i;
+
+  memset(&latency, 0, sizeof(latency));
+  memset(&service, 0, sizeof(service));
+  for (i = 0; i < template_count; i++) {
+    completed += templates[i].completed;
+    errors += templates[i].errors;
+    histogram_merge(&latency, &templates[i].latency);
+    histogram_merge(&service, &templates[i].service);
+    if (templates[i].max > max) {
+      max = templates[i].max;
+    }
+  }
+
+  printf("{\"server\":\"%s\",\"port\":%d,\"connections\":%d,"
+         "\"failed_connections\":%llu,\"rate\":%.1f,\"depth\":%d,"
+         "\"warmup\":%.3f,\"duration\":%.3f,\"sent\":%llu,"
+         "\"completed\":%llu,\"errors\":%llu,\"lost\":%llu,"
+         "\"lost_on_close\":%llu,\"throughput\":%.1f,", server, port,
+         connections, (unsigned long long)failed_conns, rate, depth, warmup,
+         duration, (unsigned long long)sent, (unsigned long long)completed,
+         (unsigned long long)errors,
+         (unsigned long long)(sent - completed),
+         (unsigned long long)closed_lost,
+         (double)completed / duration);
+  printf("\"unsent\":%llu,", (unsigned long long)unsent);
+  if (replay != NULL) {
+    printf("\"replay\":\"%s\",\"speed\":%.3f,\"remapped\":%llu,"
+           "\"skipped\":%llu,", replay, speed,
+           (unsigned long long)remapped, (unsigned long long)skipped);
+  }
+  print_latency("latency_us", &latency, max);
+  printf(",");
+  print_latency("service_latency_us", &service, 0);
+  if (idle > 0) {
+    printf(",\"idle\":{\"seconds\":%.3f,\"connections\":%llu,"
+           "\"server_rss_before\":%llu,\"server_rss_after\":%llu,"
+           "\"server_bytes_per_connection\":%.1f}", idle,
+           (unsigned long long)idle_connections,
+           (unsigned long long)rss_before, (unsigned long long)rss_after,
+           (idle_connections == 0 || rss_after < rss_before)?0.0:
+           (double)(rss_after - rss_before) / idle_connections);
+  }
+  if (storm > 0) {
+    double window = duration - storm_start;
+
+    printf(",\"storm\":{\"rate\":%.1f,\"start\":%.3f,\"opened\":%llu,"
+           "\"handshakes\":%llu,\"failed\":%llu,\"incomplete\":%llu,"
+           "\"handshake_rate\":%.1f,", storm, storm_start,
+           (unsigned long long)storm_opened, (unsigned long long)storm_done,
+           (unsigned long long)storm_failed,
+           (unsigned long long)(storm_opened - storm_done - storm_failed),
+           (double)storm_done / window);
+    print_latency("handshake_latency_us", &storm_handshake, storm_max);
+    printf(",");
+    print_latency("quiet_latency_us", &quiet_latency, 0);
+    printf(",");
+    print_latency("storm_latency_us", &storm_latency, 0);
+    printf(",\"p99_increase\":%.3f}",
+           (histogram_percentile(&quiet_latency, 99) == 0)?0.0:
+           (double)histogram_percentile(&storm_latency, 99) /
+           histogram_percentile(&quiet_latency, 99));
+  }
+  printf(",\"requests\":[");
+  for (i = 0; i < template_count; i++) {
+    bench_template *t = &templates[i];
+
+    printf("%s{\"op\":\"%s\",\"key\":\"%s\",\"completed\":%llu,"
+           "\"errors\":%llu,", (i == 0)?"":",", t->op->name,
+           (t->key == NULL)?"":t->key->path,
+           (unsigned long long)t->completed, (unsigned long long)t->errors);
+    print_latency("latency_us", &t->latency, t->max);
+    printf(",");
+    print_latency("service_latency_us", &t->service, 0);
+    printf("}");
+  }
+  printf("]}\n");
+}
+
+// raise_fd_limit: allow as many open files as the hard limit allows so
+// that large --connections work without changing ulimit -n
+static void raise_fd_limit(void)
+{
+  struct rlimit l;
+
+  if (getrlimit(RLIMIT_NOFILE, &l) == 0 && l.rlim_cur < l.rlim_max) {
+    l.rlim_cur = l.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &l);
+  }
+}
+
+// setup_ctx: create the client SSL_CTX
+static void setup_ctx(const char *client_cert, const char *client_key,
+                      const char *ca_file)
+{
+  ctx = SSL_CTX_new(TLSv1_2_client_method());
+  if (ctx == NULL) {
+    ssl_error();
+  }
+
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                     0);
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+  if (SSL_CTX_load_verify_locations(ctx, ca_file, 0) != 1) {
+    fatal_error("Failed to load CA file %s", ca_file);
+  }
+  if (SSL_CTX_use_certificate_file(ctx, client_cert, SSL_FILETYPE_PEM) != 1) {
+    fatal_error("Failed to load client certificate from %s", client_cert);
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, client_key, SSL_FILETYPE_PEM) != 1) {
+    fatal_error("Failed to load client private key from %s", client_key);
+  }
+  if (SSL_CTX_check_private_key(ctx) != 1) {
+    fatal_error("SSL_CTX_check_private_key failed");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  char *client_cert = NULL;
+  char *client_key = NULL;
+  char *ca_file = NULL;
+  int help = 0;
+  int opt;
+  int i;
+
+  const struct option long_options[] = {
+    {"server",      required_argument, 0, 0},
+    {"port",        required_argument, 0, 1},
+    {"client-cert", required_argument, 0, 2},
+    {"client-key",  required_argument, 0, 3},
+    {"ca-file",     required_argument, 0, 4},
+    {"key",         required_argument, 0, 5},
+    {"mix",         required_argument, 0, 6},
+    {"connections", required_argument, 0, 7},
+    {"rate",        required_argument, 0, 8},
+    {"depth",       required_argument, 0, 9},
+    {"warmup",      required_argument, 0, 10},
+    {"duration",    required_argument, 0, 11},
+    {"timeout",     required_argument, 0, 12},
+    {"seed",        required_argument, 0, 13},
+    {"help",        no_argument,       0, 14},
+    {"replay",      required_argument, 0, 15},
+    {"speed",       required_argument, 0, 16},
+    {"storm",       required_argument, 0, 17},
+    {"storm-start", required_argument, 0, 18},
+    {"idle",        required_argument, 0, 19},
+    {"server-pid",  required_argument, 0, 20},
+    {"source",      required_argument, 0, 21},
+    {"sources",     required_argument, 0, 22},
+    {0,             0,                 0, 0}
+  };
+
+  seed = (uint64_t)time(NULL);
+  parse_mix("ping:1");
+
+  optind = 1;
+  while (1) {
+    opt = getopt_long(argc, argv, "", long_options, 0);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 0:
+      server = optarg;
+      break;
+
+    case 1:
+      port = atoi(optarg);
+      break;
+
+    case 2:
+      client_cert = optarg;
+      break;
+
+    case 3:
+      client_key = optarg;
+      break;
+
+    case 4:
+      ca_file = optarg;
+      break;
+
+    case 5:
+      add_key(optarg);
+      break;
+
+    case 6:
+      parse_mix(optarg);
+      break;
+
+    case 7:
+      connections = atoi(optarg);
+      break;
+
+    case 8:
+      rate = atof(optarg);
+      break;
+
+    case 9:
+      depth = atoi(optarg);
+      break;
+
+    case 10:
+      warmup = atof(optarg);
+      break;
+
+    case 11:
+      duration = atof(optarg);
+      break;
+
+    case 12:
+      timeout = atof(optarg);
+      break;
+
+    case 13:
+      seed = strtoull(optarg, NULL, 10);
+      break;
+
+    case 15:
+      replay = optarg;
+      break;
+
+    case 16:
+      speed = atof(optarg);
+      break;
+
+    case 17:
+      storm = atof(optarg);
+      break;
+
+    case 18:
+      storm_start = atof(optarg);
+      break;
+
+    case 19:
+      idle = atof(optarg);
+      break;
+
+    case 20:
+      server_pid = atoi(optarg);
+      break;
+
+    case 21:
+      if (uv_ip4_addr(optarg, 0, &source) != 0) {
+        fatal_error("--source must be an IPv4 address");
+      }
+      if (sources == 0) {
+        sources = 1;
+      }
+      break;
+
+    case 22:
+      sources = atoi(optarg);
+      break;
+
+    default:
+      help = 1;
+      break;
+    }
+  }
+
+  if (help) {
+    fatal_error("Usage: kssl_bench --server=HOST --port=PORT "
+                "--client-cert=FILE --client-key=FILE --ca-file=FILE "
+                "[--key=FILE[:WEIGHT]]... [--mix=OP:WEIGHT,...] "
+                "[--connections=N] [--rate=R] [--depth=N] [--warmup=S] "
+                "[--duration=S] [--timeout=S] [--seed=N] [--replay=FILE] "
+                "[--speed=X] [--storm=R] [--storm-start=S] [--idle=S] "
+                "[--server-pid=PID] [--source=IP] [--sources=N]");
+  }
+  if (server == NULL || port <= 0 || port > 65535) {
+    fatal_error("The --server and --port parameters must be specified");
+  }
+  if (client_cert == NULL || client_key == NULL || ca_file == NULL) {
+    fatal_error("The --client-cert, --client-key and --ca-file parameters "
+                "must be specified");
+  }
+  if (replay != NULL) {
+    if (speed <= 0 || warmup < 0 || timeout < 0) {
+      fatal_error("The --speed parameter must be positive and --warmup and "
+                  "--timeout must not be negative");
+    }
+  } else if (connections <= 0 || rate <= 0 || depth < 0 || warmup < 0 ||
+             duration <= 0 || timeout < 0) {
+    fatal_error("The --connections, --rate and --duration parameters must "
+                "be positive and --depth, --warmup and --timeout must not "
+                "be negative");
+  }
+  if (idle < 0 || server_pid < 0 || sources < 0 ||
+      (sources > 0 && source.sin_family != AF_INET)) {
+    fatal_error("The --idle, --server-pid and --sources parameters must not "
+                "be negative and --sources requires --source");
+  }
+  if (replay != NULL || idle > 0) {
+    storm = 0;
+  }
+  if (storm_start < 0) {
+    storm_start = duration / 2;
+  }
+  if (storm < 0 || storm_start >= duration) {
+    fatal_error("The --storm parameter must not be negative and "
+                "--storm-start must be less than --duration");
+  }
+  if (seed == 0) {
+    seed = 1;
+  }
+
+  if (uv_ip4_addr(server, port, &addr) != 0) {
+    fatal_error("--server must be an IPv4 address");
+  }
+  raise_fd_limit();
+
+  SSL_library_init();
+  SSL_load_error_strings();
+  setup_ctx(client_cert, client_key, ca_file);
+  if (replay != NULL) {
+    load_replay();
+  } else {
+    build_templates();
+  }
+
+  pending = (bench_pending *)malloc(PENDING_SIZE * sizeof(bench_pending));
+  conns = (bench_conn *)calloc(connections, sizeof(bench_conn));
+  dirty = (int *)malloc(connections * sizeof(int));
+  if (pending == NULL || conns == NULL || dirty == NULL) {
+    fatal_error("Failed to allocate connections");
+  }
+  for (i = 0; i < PENDING_SIZE; i++) {
+    pending[i].tmpl = -1;
+  }
+
+  loop = uv_default_loop();
+  if (replay != NULL) {
+    start_replay();
+  } else {
+    rss_before = server_rss();
+    connect_until = uv_hrtime() + (uint64_t)(timeout * 1e9);
+  }
+
+  uv_timer_init(loop, &timer);
+  uv_timer_start(&timer, tick_cb, TICK_MS, TICK_MS);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  report();
+
+  for (i = 0; i < connections; i++) {
+    free(conns[i].in);
+    free(conns[i].waiting);
+  }
+  for (i = 0; i < template_count; i++) {
+    free(templates[i].bytes);
+  }
+  free(conns);
+  free(dirty);
+  free(events);
+  free(pending);
+  free(templates);
+  SSL_CTX_free(ctx);
+
+  return 0;
+}
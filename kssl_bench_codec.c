@@ -0,0 +1,677 @@
+// kssl_bench_codec.c: microbenchmarks for the KSSL wire format
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: kssl_bench_codec [OPTIONS]
+//
+// Times the functions that parse and build KSSL messages (parse_header,
+// parse_item, parse_message_payload, flatten_operation, kssl_error and
+// add_padding) in process against a fixed corpus of messages: a ping, an
+// RSA decrypt request, an ECDSA sign request and malformed payloads. No
+// network or keys are involved so the numbers isolate the cost of the
+// codec itself.
+//
+// For each benchmark one line is printed giving the iterations run, the
+// time per call and, when built with the malloc wrappers (see Makefile),
+// the allocations and bytes allocated per call.
+//
+// --bench=STRING
+//
+// Only run benchmarks whose name contains STRING
+//
+// --time=MS
+//
+// Approximate time to spend measuring each benchmark (default 200). Each
+// benchmark is run three times for this long and the fastest run is
+// reported.
+//
+// --baseline=FILE
+//
+// Compare the allocations with those in FILE (as written by
+// --write-baseline). A benchmark regresses if it allocates more, or more
+// bytes, per call than the baseline. Times in FILE are ignored so FILE
+// can be shared between machines. The exit status is 1 if any benchmark
+// regressed.
+//
+// --time-baseline=FILE
+//
+// Compare the times with those in FILE, which must have been written
+// with --write-baseline on the same machine. A benchmark regresses if it
+// is more than --tolerance percent slower.
+//
+// --tolerance=PERCENT
+//
+// Slowdown allowed by --time-baseline before a benchmark is reported as
+// a regression (default 50)
+//
+// --write-baseline=FILE
+//
+// Write the results to FILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+#include "kssl_getopt.h"
+
+#if PLATFORM_WINDOWS
+#include <winsock2.h>
+#endif
+
+// Allocation counting. When linked with -Wl,--wrap=malloc (and calloc,
+// realloc and free) every call to those functions from the objects being
+// benchmarked comes here first.
+
+static unsigned long long allocs = 0;
+static unsigned long long alloc_bytes = 0;
+
+#if KSSL_WRAP_MALLOC
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t size)
+{
+  allocs += 1;
+  alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  allocs += 1;
+  alloc_bytes += n * size;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+  allocs += 1;
+  alloc_bytes += size;
+  return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p)
+{
+  __real_free(p);
+}
+#endif
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+
+  exit(1);
+}
+
+// now_ns: monotonic time in ns
+static unsigned long long now_ns(void)
+{
+#if PLATFORM_WINDOWS
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (unsigned long long)(count.QuadPart * 1e9 / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// The corpus. Each message is flattened once at startup. Payloads are
+// fixed bytes of the size a real request would carry.
+
+typedef struct {
+  BYTE *bytes;   // Whole message (header and payload)
+  int len;
+} message;
+
+static message ping;
+static message rsa_decrypt;
+static message ecdsa_sign;
+
+static BYTE ping_payload[16];
+static BYTE rsa_payload[256];   // An RSA 2048 ciphertext
+static BYTE ecdsa_payload[32];  // A SHA256 digest
+static BYTE ski[KSSL_SKI_SIZE];
+static BYTE digest[KSSL_DIGEST_SIZE];
+static BYTE ip[4] = {192, 0, 2, 1};
+
+// A payload whose last item is cut short and one whose item claims more
+// bytes than the payload has
+
+static BYTE truncated[KSSL_PAD_TO];
+static int truncated_len;
+static BYTE overrun[] = {KSSL_TAG_OPCODE, 0x00, 0x01, KSSL_OP_PING,
+                         KSSL_TAG_PAYLOAD, 0x10, 0x00, 0x00, 0x00};
+
+// Results are accumulated here so that the compiler cannot discard the
+// calls being timed
+
+static volatile unsigned long long sink = 0;
+
+// make_message: flatten op into m
+static void make_message(message *m, BYTE opcode, BYTE *payload,
+                         int payload_len, int with_key)
+{
+  kssl_header h;
+  kssl_operation op;
+
+  h.version_maj = KSSL_VERSION_MAJ;
+  h.version_min = KSSL_VERSION_MIN;
+  h.id = 0x12345678;
+
+  zero_operation(&op);
+  op.is_opcode_set = 1;
+  op.opcode = opcode;
+  op.is_payload_set = 1;
+  op.payload = payload;
+  op.payload_len = payload_len;
+  if (with_key) {
+    op.is_ski_set = 1;
+    op.ski = ski;
+    op.is_digest_set = 1;
+    op.digest = digest;
+    op.is_ip_set = 1;
+    op.ip = ip;
+    op.ip_len = sizeof(ip);
+  }
+
+  if (flatten_operation(&h, &op, &m->bytes, &m->len) != KSSL_ERROR_NONE) {
+    fatal_error("Failed to build corpus");
+  }
+}
+
+// make_corpus: build the messages used by the benchmarks
+static void make_corpus(void)
+{
+  int i;
+
+  for (i = 0; i < (int)sizeof(ping_payload); i++) {
+    ping_payload[i] = (BYTE)i;
+  }
+  for (i = 0; i < (int)sizeof(rsa_payload); i++) {
+    rsa_payload[i] = (BYTE)(i * 7 + 1);
+  }
+  for (i = 0; i < (int)sizeof(ecdsa_payload); i++) {
+    ecdsa_payload[i] = (BYTE)(i * 13 + 5);
+  }
+  memset(ski, 0xAB, sizeof(ski));
+  memset(digest, 0xCD, sizeof(digest));
+
+  make_message(&ping, KSSL_OP_PING, ping_payload, sizeof(ping_payload), 0);
+  make_message(&rsa_decrypt, KSSL_OP_RSA_DECRYPT, rsa_payload,
+               sizeof(rsa_payload), 1);
+  make_message(&ecdsa_sign, KSSL_OP_ECDSA_SIGN_SHA256, ecdsa_payload,
+               sizeof(ecdsa_payload), 1);
+
+  // Everything of the RSA decrypt request up to the middle of its
+  // payload item
+
+  truncated_len = KSSL_OPCODE_ITEM_SIZE + KSSL_ITEM_HEADER_SIZE +
+                  sizeof(rsa_payload) / 2;
+  memcpy(truncated, rsa_decrypt.bytes + KSSL_HEADER_SIZE, truncated_len);
+}
+
+// The benchmarks. Each runs its operation n times.
+
+static void bench_parse_header(int n)
+{
+  kssl_header h;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    parse_header(rsa_decrypt.bytes, &h);
+    sink += h.length;
+  }
+}
+
+static void bench_parse_item(int n)
+{
+  BYTE *payload = rsa_decrypt.bytes + KSSL_HEADER_SIZE;
+  int len = rsa_decrypt.len - KSSL_HEADER_SIZE;
+  kssl_item item;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    int offset = 0;
+    while (offset < len) {
+      parse_item(payload, &offset, &item);
+      sink += item.length;
+    }
+  }
+}
+
+static void parse_payload(message *m, int n)
+{
+  kssl_operation op;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sink += parse_message_payload(m->bytes + KSSL_HEADER_SIZE,
+                                  m->len - KSSL_HEADER_SIZE, &op);
+    sink += op.payload_len;
+  }
+}
+
+static void bench_parse_ping(int n)
+{
+  parse_payload(&ping, n);
+}
+
+static void bench_parse_rsa_decrypt(int n)
+{
+  parse_payload(&rsa_decrypt, n);
+}
+
+static void bench_parse_ecdsa_sign(int n)
+{
+  parse_payload(&ecdsa_sign, n);
+}
+
+static void bench_parse_truncated(int n)
+{
+  kssl_operation op;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sink += parse_message_payload(truncated, truncated_len, &op);
+  }
+}
+
+static void bench_parse_overrun(int n)
+{
+  kssl_operation op;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sink += parse_message_payload(overrun, sizeof(overrun), &op);
+  }
+}
+
+static void flatten(message *m, int n)
+{
+  kssl_header h;
+  kssl_operation op;
+  BYTE *out;
+  int len;
+  int i;
+
+  parse_header(m->bytes, &h);
+  parse_message_payload(m->bytes + KSSL_HEADER_SIZE,
+                        m->len - KSSL_HEADER_SIZE, &op);
+
+  for (i = 0; i < n; i++) {
+    flatten_operation(&h, &op, &out, &len);
+    sink += out[len - 1];
+    free(out);
+  }
+}
+
+static void bench_flatten_ping(int n)
+{
+  flatten(&ping, n);
+}
+
+static void bench_flatten_rsa_decrypt(int n)
+{
+  flatten(&rsa_decrypt, n);
+}
+
+static void bench_flatten_ecdsa_sign(int n)
+{
+  flatten(&ecdsa_sign, n);
+}
+
+static void bench_error(int n)
+{
+  BYTE *out;
+  int len;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    kssl_error(0x12345678, KSSL_ERROR_KEY_NOT_FOUND, &out, &len);
+    sink += out[len - 1];
+    free(out);
+  }
+}
+
+static void bench_padding(int n)
+{
+  static BYTE buffer[KSSL_ITEM_HEADER_SIZE];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    add_padding((WORD)i, buffer, NULL);
+    sink += buffer[2];
+  }
+}
+
+typedef struct {
+  const char *name;
+  void (*run)(int n);
+} benchmark;
+
+static benchmark benchmarks[] = {
+  {"parse_header",                  bench_parse_header},
+  {"parse_item/rsa-decrypt",        bench_parse_item},
+  {"parse_message_payload/ping",    bench_parse_ping},
+  {"parse_message_payload/rsa-decrypt", bench_parse_rsa_decrypt},
+  {"parse_message_payload/ecdsa-sign",  bench_parse_ecdsa_sign},
+  {"parse_message_payload/truncated",   bench_parse_truncated},
+  {"parse_message_payload/overrun",     bench_parse_overrun},
+  {"flatten_operation/ping",        bench_flatten_ping},
+  {"flatten_operation/rsa-decrypt", bench_flatten_rsa_decrypt},
+  {"flatten_operation/ecdsa-sign",  bench_flatten_ecdsa_sign},
+  {"kssl_error",                    bench_error},
+  {"add_padding",                   bench_padding},
+};
+
+#define BENCHMARKS ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+typedef struct {
+  const char *name;
+  unsigned long long n;
+  double ns;        // Per call
+  double allocs;    // Per call
+  double bytes;     // Per call
+} result;
+
+// measure: run b for roughly ms milliseconds, three times, and keep the
+// fastest run
+static void measure(benchmark *b, int ms, result *r)
+{
+  unsigned long long target = (unsigned long long)ms * 1000000ULL;
+  unsigned long long n = 1;
+  unsigned long long start, took = 0;
+  int run;
+
+  // Find an iteration count that takes about ms
+
+  while (n < (1ULL << 30)) {
+    start = now_ns();
+    b->run((int)n);
+    took = now_ns() - start;
+    if (took >= target / 10) {
+      break;
+    }
+    n *= 2;
+  }
+  if (took > 0 && took < target) {
+    n = n * target / took;
+    if (n > (1ULL << 30)) {
+      n = 1ULL << 30;
+    }
+  }
+
+  r->name = b->name;
+  r->n = n;
+  r->ns = 0;
+  for (run = 0; run < 3; run++) {
+    unsigned long long a = allocs, ab = alloc_bytes;
+    double ns;
+
+    start = now_ns();
+    b->run((int)n);
+    ns = (double)(now_ns() - start) / n;
+    if (run == 0 || ns < r->ns) {
+      r->ns = ns;
+    }
+    r->allocs = (double)(allocs - a) / n;
+    r->bytes = (double)(alloc_bytes - ab) / n;
+  }
+}
+
+// A baseline entry read from a --baseline file
+
+typedef struct {
+  char name[128];
+  double ns;
+  double allocs;
+  double bytes;
+} baseline;
+
+// read_baseline: read up to max entries from path. Returns the number
+// read.
+static int read_baseline(const char *path, baseline *base, int max)
+{
+  FILE *f = fopen(path, "r");
+  char line[256];
+  int count = 0;
+
+  if (f == NULL) {
+    fatal_error("Can't open baseline %s", path);
+  }
+
+  while (count < max && fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "%127s %lf %lf %lf", base[count].name, &base[count].ns,
+               &base[count].allocs, &base[count].bytes) == 4) {
+      count += 1;
+    }
+  }
+
+  fclose(f);
+  return count;
+}
+
+// write_baseline: write count results to path
+static void write_baseline(const char *path, result *results, int count)
+{
+  FILE *f = fopen(path, "w");
+  int i;
+
+  if (f == NULL) {
+    fatal_error("Can't write baseline %s", path);
+  }
+
+  fprintf(f, "# kssl_bench_codec baseline: name ns/op allocs/op B/op\n");
+  fprintf(f, "# Times are only comparable on the machine that wrote this "
+          "file and are only\n# checked with --time-baseline\n");
+  for (i = 0; i < count; i++) {
+    fprintf(f, "%s %.1f %.2f %.1f\n", results[i].name, results[i].ns,
+            results[i].allocs, results[i].bytes);
+  }
+
+  fclose(f);
+}
+
+// find_baseline: returns the entry for name in base or NULL
+static baseline *find_baseline(const char *name, baseline *base, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (strcmp(base[i].name, name) == 0) {
+      return &base[i];
+    }
+  }
+
+  return NULL;
+}
+
+// compare_allocs: check the allocations of r against the baseline.
+// Returns 1 if it regressed and writes a description into note.
+static int compare_allocs(result *r, baseline *base, int count, char *note,
+                          size_t note_len)
+{
+  baseline *b = find_baseline(r->name, base, count);
+
+  if (b == NULL) {
+    snprintf(note, note_len, "not in baseline");
+    return 0;
+  }
+
+  // Allocation counts are deterministic so any increase is a
+  // regression. The small slack absorbs rounding in the file.
+
+  if (r->allocs > b->allocs + 0.005 || r->bytes > b->bytes + 0.05) {
+    snprintf(note, note_len, "REGRESSION allocs %.2f -> %.2f B %.1f -> %.1f",
+             b->allocs, r->allocs, b->bytes, r->bytes);
+    return 1;
+  }
+
+  return 0;
+}
+
+// compare_time: check the time of r against a baseline written on this
+// machine. Returns 1 if it regressed and writes a description into note.
+static int compare_time(result *r, baseline *base, int count, int tolerance,
+                        char *note, size_t note_len)
+{
+  baseline *b = find_baseline(r->name, base, count);
+
+  if (b == NULL) {
+    snprintf(note, note_len, "not in time baseline");
+    return 0;
+  }
+
+  if (r->ns > b->ns * (100 + tolerance) / 100) {
+    snprintf(note, note_len, "REGRESSION %.1f -> %.1f ns/op (%+.0f%%)",
+             b->ns, r->ns, (r->ns / b->ns - 1) * 100);
+    return 1;
+  }
+
+  snprintf(note, note_len, "%+.0f%%", (r->ns / b->ns - 1) * 100);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *filter = NULL;
+  const char *baseline_file = NULL;
+  const char *time_file = NULL;
+  const char *write_file = NULL;
+  int ms = 200;
+  int tolerance = 50;
+  result results[BENCHMARKS];
+  baseline base[BENCHMARKS * 2];
+  baseline times[BENCHMARKS * 2];
+  int base_count = 0;
+  int time_count = 0;
+  int count = 0;
+  int regressed = 0;
+  int i;
+
+  const struct option long_options[] = {
+    {"bench",          required_argument, 0, 0},
+    {"time",           required_argument, 0, 1},
+    {"baseline",       required_argument, 0, 2},
+    {"tolerance",      required_argument, 0, 3},
+    {"write-baseline", required_argument, 0, 4},
+    {"help",           no_argument,       0, 5},
+    {"time-baseline",  required_argument, 0, 6},
+    {0, 0, 0, 0}
+  };
+
+  optind = 1;
+  while (1) {
+    int c = getopt_long(argc, argv, "", long_options, 0);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      filter = optarg;
+      break;
+
+    case 1:
+      ms = atoi(optarg);
+      if (ms <= 0) {
+        fatal_error("--time must be a positive number of ms");
+      }
+      break;
+
+    case 2:
+      baseline_file = optarg;
+      break;
+
+    case 3:
+      tolerance = atoi(optarg);
+      if (tolerance < 0) {
+        fatal_error("--tolerance must not be negative");
+      }
+      break;
+
+    case 4:
+      write_file = optarg;
+      break;
+
+    case 6:
+      time_file = optarg;
+      break;
+
+    case 5:
+    default:
+      fprintf(stderr, "Usage: kssl_bench_codec [--bench=STRING] "
+              "[--time=MS] [--baseline=FILE] [--time-baseline=FILE] "
+              "[--tolerance=PERCENT] [--write-baseline=FILE]\n");
+      exit(c == 5 ? 0 : 1);
+    }
+  }
+
+  if (baseline_file != NULL) {
+    base_count = read_baseline(baseline_file, base,
+                               (int)(sizeof(base) / sizeof(base[0])));
+  }
+  if (time_file != NULL) {
+    time_count = read_baseline(time_file, times,
+                               (int)(sizeof(times) / sizeof(times[0])));
+  }
+
+  make_corpus();
+
+#if !KSSL_WRAP_MALLOC
+  printf("# Allocations are not counted in this build\n");
+#endif
+
+  for (i = 0; i < BENCHMARKS; i++) {
+    result *r = &results[count];
+    char note[128] = "";
+
+    if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL) {
+      continue;
+    }
+
+    measure(&benchmarks[i], ms, r);
+    count += 1;
+
+    if (baseline_file != NULL &&
+        compare_allocs(r, base, base_count, note, sizeof(note))) {
+      regressed = 1;
+    } else if (time_file != NULL) {
+      regressed |= compare_time(r, times, time_count, tolerance, note,
+                                sizeof(note));
+    }
+
+    printf("%-38s %11llu %9.1f ns/op %6.2f allocs/op %7.1f B/op  %s\n",
+           r->name, r->n, r->ns, r->allocs, r->bytes, note);
+    fflush(stdout);
+  }
+
+  if (write_file != NULL) {
+    write_baseline(write_file, results, count);
+  }
+
+  free(ping.bytes);
+  free(rsa_decrypt.bytes);
+  free(ecdsa_sign.bytes);
+
+  return regressed;
+}
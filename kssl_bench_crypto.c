@@ -0,0 +1,659 @@
+// kssl_bench_crypto.c: private key operation benchmark with thread scaling
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: kssl_bench_crypto [OPTIONS]
+//
+// Measures the capacity of the private key path on its own, without TLS
+// or networking. Keys are loaded with add_key_from_file and each
+// operation is a find_private_key (by SKI) followed by a
+// private_key_operation, exactly as kssl_operate does them.
+//
+// Every combination of key and opcode is run with 1, 2, 4 ... --threads
+// threads. Threads either share one pk_list (shared), as the server's
+// workers do, or each load their own copy of the keys (per-thread). For
+// each run the throughput, p50 and p99 latency and the scaling
+// efficiency (throughput divided by threads times the single thread
+// throughput) are reported. Efficiency well below 1 with spare cores
+// means the threads are serialized, typically on OpenSSL's locks; run
+// with --lock-profile to see which.
+//
+// Results are written to stdout as a single JSON object.
+//
+// --key=FILE
+//
+// A PEM private key to benchmark. May be given more than once. If no
+// --key is given keys are generated for each of --types.
+//
+// --types=TYPE,...
+//
+// Keys to generate: any of rsa-2048, rsa-3072, rsa-4096, p-256 and p-384
+// (default all of them)
+//
+// --ops=OP,...
+//
+// Opcodes to run (with the names used by kssl_bench) or all. Each opcode
+// is run against the keys of its type. Default rsa-decrypt,
+// rsa-sign-sha256,ecdsa-sign-sha256.
+//
+// --threads=N
+//
+// Largest number of threads (default the number of CPUs)
+//
+// --modes=MODE,...
+//
+// shared, per-thread or both (the default)
+//
+// --warmup=MS, --duration=MS
+//
+// Time each run spends before measuring (default 200) and measuring
+// (default 1000)
+//
+// --lock-profile
+//
+// Profile OpenSSL's locks (see --lock-profile in keyless) and log the
+// profile, summed over all runs, at the end
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_histogram.h"
+#include "kssl_private_key.h"
+#include "kssl_locks.h"
+#include "kssl_getopt.h"
+
+#define MAX_KEYS 16
+#define MAX_THREADS 256
+
+// Largest private key operation output (an RSA 4096 bit signature is
+// 512 bytes)
+
+#define MAX_OUTPUT 1024
+
+typedef struct {
+  const char *name;
+  BYTE opcode;
+  int type;        // EVP_PKEY_RSA or EVP_PKEY_EC
+  int length;      // Length of the digest to sign (0 for decrypt)
+} bench_op;
+
+static bench_op ops[] = {
+  {"rsa-decrypt",        KSSL_OP_RSA_DECRYPT,        EVP_PKEY_RSA, 0},
+  {"rsa-decrypt-raw",    KSSL_OP_RSA_DECRYPT_RAW,    EVP_PKEY_RSA, 0},
+  {"rsa-sign-md5sha1",   KSSL_OP_RSA_SIGN_MD5SHA1,   EVP_PKEY_RSA, 36},
+  {"rsa-sign-sha1",      KSSL_OP_RSA_SIGN_SHA1,      EVP_PKEY_RSA, 20},
+  {"rsa-sign-sha224",    KSSL_OP_RSA_SIGN_SHA224,    EVP_PKEY_RSA, 28},
+  {"rsa-sign-sha256",    KSSL_OP_RSA_SIGN_SHA256,    EVP_PKEY_RSA, 32},
+  {"rsa-sign-sha384",    KSSL_OP_RSA_SIGN_SHA384,    EVP_PKEY_RSA, 48},
+  {"rsa-sign-sha512",    KSSL_OP_RSA_SIGN_SHA512,    EVP_PKEY_RSA, 64},
+  {"ecdsa-sign-md5sha1", KSSL_OP_ECDSA_SIGN_MD5SHA1, EVP_PKEY_EC,  36},
+  {"ecdsa-sign-sha1",    KSSL_OP_ECDSA_SIGN_SHA1,    EVP_PKEY_EC,  20},
+  {"ecdsa-sign-sha224",  KSSL_OP_ECDSA_SIGN_SHA224,  EVP_PKEY_EC,  28},
+  {"ecdsa-sign-sha256",  KSSL_OP_ECDSA_SIGN_SHA256,  EVP_PKEY_EC,  32},
+  {"ecdsa-sign-sha384",  KSSL_OP_ECDSA_SIGN_SHA384,  EVP_PKEY_EC,  48},
+  {"ecdsa-sign-sha512",  KSSL_OP_ECDSA_SIGN_SHA512,  EVP_PKEY_EC,  64},
+};
+
+#define OPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+static int op_enabled[OPS];
+
+// Keys that can be generated
+
+typedef struct {
+  const char *name;
+  int type;
+  int bits;    // RSA modulus size
+  int nid;     // EC curve
+} key_type;
+
+static key_type key_types[] = {
+  {"rsa-2048", EVP_PKEY_RSA, 2048, 0},
+  {"rsa-3072", EVP_PKEY_RSA, 3072, 0},
+  {"rsa-4096", EVP_PKEY_RSA, 4096, 0},
+  {"p-256",    EVP_PKEY_EC,  0,    NID_X9_62_prime256v1},
+  {"p-384",    EVP_PKEY_EC,  0,    NID_secp384r1},
+};
+
+#define KEY_TYPES ((int)(sizeof(key_types) / sizeof(key_types[0])))
+
+typedef struct {
+  const char *name;
+  char path[256];       // File the key was loaded from
+  int generated;        // Set if path is a temporary file
+  int type;             // EVP_PKEY_RSA or EVP_PKEY_EC
+  BYTE ski[KSSL_SKI_SIZE];
+  BYTE ciphertext[MAX_OUTPUT]; // An encrypted premaster secret
+  int ciphertext_len;
+} bench_key;
+
+static bench_key keys[MAX_KEYS];
+static int key_total = 0;
+
+// The digest that is signed. Only its length matters.
+
+static BYTE digest[64];
+
+// What a run is doing
+
+typedef struct {
+  bench_key *key;
+  bench_op *op;
+  BYTE *message;
+  int length;
+} bench_case;
+
+// Per thread state. Each thread only writes its own entry and the
+// padding keeps entries on separate cachelines.
+
+typedef struct {
+  uv_thread_t thread;
+  pk_list list;         // List used by the current run
+  pk_list own;          // This thread's copy of the keys (per-thread)
+  bench_case *c;
+  kssl_histogram latency;
+  uint64_t ops;
+  uint64_t errors;
+  BYTE out[MAX_OUTPUT];
+  char padding[64];
+} bench_thread;
+
+static bench_thread threads[MAX_THREADS];
+
+// Set by the main thread to start, start counting and stop a run
+
+static unsigned int running = 0;
+static unsigned int measuring = 0;
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+
+  exit(1);
+}
+
+// ssl_error: print OpenSSL's errors and exit
+static void ssl_error(void)
+{
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+// error_string: converts an error return code from libuv into a string
+const char *error_string(int e)
+{
+  return uv_strerror(e);
+}
+
+// sleep_ms: sleep for ms milliseconds
+static void sleep_ms(int ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts) != 0) {
+  }
+}
+
+// generate_key: generate a key of type t and write it to a temporary
+// file
+static void generate_key(key_type *t, bench_key *k)
+{
+  EVP_PKEY *pkey = EVP_PKEY_new();
+  FILE *f;
+  int fd;
+
+  if (pkey == NULL) {
+    ssl_error();
+  }
+
+  if (t->type == EVP_PKEY_RSA) {
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+
+    if (rsa == NULL || e == NULL || BN_set_word(e, RSA_F4) != 1 ||
+        RSA_generate_key_ex(rsa, t->bits, e, NULL) != 1 ||
+        EVP_PKEY_assign_RSA(pkey, rsa) != 1) {
+      ssl_error();
+    }
+    BN_free(e);
+  } else {
+    EC_KEY *ec = EC_KEY_new_by_curve_name(t->nid);
+
+    if (ec == NULL) {
+      ssl_error();
+    }
+    EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+    if (EC_KEY_generate_key(ec) != 1 ||
+        EVP_PKEY_assign_EC_KEY(pkey, ec) != 1) {
+      ssl_error();
+    }
+  }
+
+  strcpy(k->path, "/tmp/kssl_bench_crypto.XXXXXX");
+  fd = mkstemp(k->path);
+  if (fd == -1) {
+    fatal_error("Failed to create a temporary key file");
+  }
+  f = fdopen(fd, "w");
+  if (f == NULL ||
+      PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL) != 1) {
+    fatal_error("Failed to write key to %s", k->path);
+  }
+  fclose(f);
+
+  k->name = t->name;
+  k->generated = 1;
+  EVP_PKEY_free(pkey);
+}
+
+// prepare_key: read the key back from its file and build what the
+// benchmark sends it
+static void prepare_key(bench_key *k)
+{
+  BYTE premaster[48];
+  EVP_PKEY *pkey;
+  FILE *f;
+
+  f = fopen(k->path, "r");
+  if (f == NULL) {
+    fatal_error("Failed to open key file %s", k->path);
+  }
+  pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+  fclose(f);
+  if (pkey == NULL) {
+    fatal_error("%s is not a PEM private key", k->path);
+  }
+
+  k->type = EVP_PKEY_type(pkey->type);
+  if (k->type == EVP_PKEY_RSA) {
+    RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+
+    memset(premaster, 0x42, sizeof(premaster));
+    k->ciphertext_len = RSA_public_encrypt(sizeof(premaster), premaster,
+                                           k->ciphertext, rsa,
+                                           RSA_PKCS1_PADDING);
+    RSA_free(rsa);
+    if (k->ciphertext_len <= 0) {
+      ssl_error();
+    }
+  } else if (k->type != EVP_PKEY_EC) {
+    fatal_error("%s is not an RSA or EC key", k->path);
+  }
+
+  EVP_PKEY_free(pkey);
+}
+
+// load_list: returns a new pk_list holding every key
+static pk_list load_list(void)
+{
+  pk_list list = new_pk_list(key_total);
+  int i;
+
+  if (list == NULL) {
+    fatal_error("Failed to allocate key list");
+  }
+  for (i = 0; i < key_total; i++) {
+    if (add_key_from_file(keys[i].path, list) != KSSL_ERROR_NONE) {
+      fatal_error("Failed to load key %s", keys[i].path);
+    }
+  }
+
+  return list;
+}
+
+// thread_entry: perform c's operation until the run stops
+static void thread_entry(void *data)
+{
+  bench_thread *t = (bench_thread *)data;
+  bench_case *c = t->c;
+
+  while (!KSSL_LOAD_ACQUIRE(&running)) {
+  }
+
+  while (KSSL_LOAD_ACQUIRE(&running)) {
+    int counted = KSSL_LOAD_ACQUIRE(&measuring);
+    uint64_t start = uv_hrtime();
+    unsigned int size = 0;
+    kssl_error_code err = KSSL_ERROR_KEY_NOT_FOUND;
+    int key_id;
+
+    key_id = find_private_key(t->list, c->key->ski, NULL);
+    if (key_id >= 0) {
+      err = private_key_operation(t->list, key_id, c->op->opcode, c->length,
+                                  c->message, t->out, &size);
+    }
+
+    if (counted) {
+      histogram_record(&t->latency, uv_hrtime() - start);
+      t->ops += 1;
+      if (err != KSSL_ERROR_NONE) {
+        t->errors += 1;
+      }
+    }
+  }
+}
+
+// run: run c on count threads, using the shared list or each thread's
+// own. Returns the operations per second and merges latencies into h.
+static double run(bench_case *c, int count, pk_list shared, int warmup,
+                  int duration, kssl_histogram *h, uint64_t *errors)
+{
+  uint64_t ops = 0;
+  uint64_t start, end;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    bench_thread *t = &threads[i];
+
+    t->c = c;
+    t->list = (shared != NULL)?shared:t->own;
+    t->ops = 0;
+    t->errors = 0;
+    memset(&t->latency, 0, sizeof(t->latency));
+    if (uv_thread_create(&t->thread, thread_entry, t) != 0) {
+      fatal_error("Failed to create thread");
+    }
+  }
+
+  KSSL_STORE_RELEASE(&running, 1);
+  sleep_ms(warmup);
+  start = uv_hrtime();
+  KSSL_STORE_RELEASE(&measuring, 1);
+  sleep_ms(duration);
+  KSSL_STORE_RELEASE(&measuring, 0);
+  end = uv_hrtime();
+  KSSL_STORE_RELEASE(&running, 0);
+
+  *errors = 0;
+  for (i = 0; i < count; i++) {
+    uv_thread_join(&threads[i].thread);
+    histogram_merge(h, &threads[i].latency);
+    ops += threads[i].ops;
+    *errors += threads[i].errors;
+  }
+
+  return (double)ops * 1e9 / (double)(end - start);
+}
+
+// next_count: returns the thread count to run after count: the next
+// power of two and finally max
+static int next_count(int count, int max)
+{
+  return (count * 2 < max)?count * 2:max;
+}
+
+// enable_ops: set op_enabled from a comma separated list
+static void enable_ops(char *list)
+{
+  char *item;
+  int i;
+
+  memset(op_enabled, 0, sizeof(op_enabled));
+  for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    int found = 0;
+
+    for (i = 0; i < OPS; i++) {
+      if (strcmp(item, "all") == 0 || strcmp(item, ops[i].name) == 0) {
+        op_enabled[i] = 1;
+        found = 1;
+      }
+    }
+    if (!found) {
+      fatal_error("Unknown opcode %s in --ops", item);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  char default_ops[] = "rsa-decrypt,rsa-sign-sha256,ecdsa-sign-sha256";
+  char *types = NULL;
+  char *modes = NULL;
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int warmup = 200;
+  int duration = 1000;
+  int lock_profile = 0;
+  int shared_mode = 1;
+  int per_thread_mode = 1;
+  pk_list shared;
+  int first = 1;
+  int i, j, m;
+
+  const struct option long_options[] = {
+    {"key",          required_argument, 0, 0},
+    {"types",        required_argument, 0, 1},
+    {"ops",          required_argument, 0, 2},
+    {"threads",      required_argument, 0, 3},
+    {"modes",        required_argument, 0, 4},
+    {"warmup",       required_argument, 0, 5},
+    {"duration",     required_argument, 0, 6},
+    {"lock-profile", no_argument,       0, 7},
+    {"help",         no_argument,       0, 8},
+    {0, 0, 0, 0}
+  };
+
+  enable_ops(default_ops);
+
+  optind = 1;
+  while (1) {
+    int c = getopt_long(argc, argv, "", long_options, 0);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      if (key_total == MAX_KEYS) {
+        fatal_error("At most %d --key parameters may be given", MAX_KEYS);
+      }
+      if (strlen(optarg) >= sizeof(keys[key_total].path)) {
+        fatal_error("--key path %s is too long", optarg);
+      }
+      strcpy(keys[key_total].path, optarg);
+      keys[key_total].name = keys[key_total].path;
+      key_total += 1;
+      break;
+
+    case 1:
+      types = optarg;
+      break;
+
+    case 2:
+      enable_ops(optarg);
+      break;
+
+    case 3:
+      max_threads = atoi(optarg);
+      if (max_threads <= 0 || max_threads > MAX_THREADS) {
+        fatal_error("--threads must be between 1 and %d", MAX_THREADS);
+      }
+      break;
+
+    case 4:
+      modes = optarg;
+      break;
+
+    case 5:
+      warmup = atoi(optarg);
+      if (warmup < 0) {
+        fatal_error("--warmup must not be negative");
+      }
+      break;
+
+    case 6:
+      duration = atoi(optarg);
+      if (duration <= 0) {
+        fatal_error("--duration must be positive");
+      }
+      break;
+
+    case 7:
+      lock_profile = 1;
+      break;
+
+    case 8:
+    default:
+      fprintf(stderr, "Usage: kssl_bench_crypto [--key=FILE] "
+              "[--types=TYPE,...] [--ops=OP,...|all] [--threads=N] "
+              "[--modes=shared,per-thread] [--warmup=MS] [--duration=MS] "
+              "[--lock-profile]\n");
+      exit(c == 8 ? 0 : 1);
+    }
+  }
+
+  if (max_threads <= 0) {
+    max_threads = 1;
+  }
+  if (max_threads > MAX_THREADS) {
+    max_threads = MAX_THREADS;
+  }
+
+  if (modes != NULL) {
+    shared_mode = (strstr(modes, "shared") != NULL);
+    per_thread_mode = (strstr(modes, "per-thread") != NULL);
+    if (!shared_mode && !per_thread_mode) {
+      fatal_error("--modes must include shared or per-thread");
+    }
+  }
+
+  SSL_library_init();
+  SSL_load_error_strings();
+  if (locks_init(lock_profile) != 0) {
+    fatal_error("Failed to initialize OpenSSL locks");
+  }
+
+  if (key_total == 0) {
+    for (i = 0; i < KEY_TYPES; i++) {
+      if (types != NULL && strstr(types, key_types[i].name) == NULL) {
+        continue;
+      }
+      generate_key(&key_types[i], &keys[key_total]);
+      key_total += 1;
+    }
+    if (key_total == 0) {
+      fatal_error("No known key type in --types %s", types);
+    }
+  }
+
+  for (i = 0; i < key_total; i++) {
+    prepare_key(&keys[i]);
+  }
+
+  shared = load_list();
+  for (i = 0; i < key_total; i++) {
+    memcpy(keys[i].ski, key_ski(shared, i), KSSL_SKI_SIZE);
+  }
+  if (per_thread_mode) {
+    for (i = 0; i < max_threads; i++) {
+      threads[i].own = load_list();
+    }
+  }
+
+  memset(digest, 0x5A, sizeof(digest));
+
+  printf("{\"threads\":%d,\"warmup\":%.3f,\"duration\":%.3f,\"results\":[",
+         max_threads, warmup / 1000.0, duration / 1000.0);
+
+  for (i = 0; i < key_total; i++) {
+    for (j = 0; j < OPS; j++) {
+      bench_case c;
+
+      if (!op_enabled[j] || ops[j].type != keys[i].type) {
+        continue;
+      }
+
+      c.key = &keys[i];
+      c.op = &ops[j];
+      if (ops[j].length == 0) {
+        c.message = keys[i].ciphertext;
+        c.length = keys[i].ciphertext_len;
+      } else {
+        c.message = digest;
+        c.length = ops[j].length;
+      }
+
+      for (m = 0; m < 2; m++) {
+        double single = 0;
+        int count;
+
+        if ((m == 0 && !shared_mode) || (m == 1 && !per_thread_mode)) {
+          continue;
+        }
+
+        // 1, 2, 4 ... threads and then max_threads
+
+        for (count = 1; ; count = next_count(count, max_threads)) {
+          kssl_histogram h;
+          uint64_t errors;
+          double rate;
+
+          memset(&h, 0, sizeof(h));
+          rate = run(&c, count, (m == 0)?shared:NULL, warmup, duration, &h,
+                     &errors);
+          if (count == 1) {
+            single = rate;
+          }
+
+          printf("%s{\"key\":\"%s\",\"op\":\"%s\",\"mode\":\"%s\","
+                 "\"threads\":%d,\"ops\":%llu,\"errors\":%llu,"
+                 "\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+                 "\"efficiency\":%.3f}", first?"":",", keys[i].name,
+                 ops[j].name, (m == 0)?"shared":"per-thread", count,
+                 (unsigned long long)h.count, (unsigned long long)errors,
+                 rate, histogram_percentile(&h, 50) / 1000.0,
+                 histogram_percentile(&h, 99) / 1000.0,
+                 (single == 0)?0.0:rate / (single * count));
+          fflush(stdout);
+          first = 0;
+
+          if (count == max_threads) {
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  printf("]}\n");
+
+  if (lock_profile) {
+    locks_dump();
+  }
+
+  if (per_thread_mode) {
+    for (i = 0; i < max_threads; i++) {
+      free_pk_list(threads[i].own);
+    }
+  }
+  free_pk_list(shared);
+  for (i = 0; i < key_total; i++) {
+    if (keys[i].generated) {
+      unlink(keys[i].path);
+    }
+  }
+  locks_cleanup();
+
+  return 0;
+}
@@ -0,0 +1,602 @@
+// kssl_bench_keys.c: key store scaling benchmark
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: kssl_bench_keys [OPTIONS]
+//
+// Measures how the private key store behaves as the number of keys
+// grows. A directory of synthetic keys is grown through each of --sizes
+// and at each size:
+//
+// load: the directory is loaded exactly as keyless loads
+// --private-key-directory (glob, new_pk_list and add_key_from_file for
+// each file). The key files have just been written so they are in the
+// page cache; the time is the CPU cost of a cold start.
+//
+// rss: the growth in resident memory from loading the keys, per key
+// (Linux only)
+//
+// reload: the directory is loaded again and installed as a SIGHUP does
+// (see install_private_keys in keyless.c) while --readers threads look
+// keys up under the read lock as workers do. The time to load the new
+// list, the time the write lock is held, the time to free the old list
+// and the longest any reader waited for a lookup during the reload are
+// reported.
+//
+// lookup: the time find_private_key takes to find a random key by
+// digest and to fail to find a key that is not loaded
+//
+// Results are written to stdout as a single JSON object with one entry
+// per size so that they can be plotted as curves.
+//
+// --sizes=N,...
+//
+// Key counts to measure, in increasing order (default
+// 10,100,1000,10000,100000,1000000). Generating a million EC keys takes
+// a few minutes.
+//
+// --rsa=PERCENT
+//
+// Percentage of the keys that are RSA 2048 bit (default 10). The rest are
+// P-256. Generating RSA keys is slow so RSA keys are drawn from a pool of
+// --rsa-pool distinct keys (default 16); EC keys are all distinct.
+//
+// --dir=DIR
+//
+// Write the keys to DIR, which should be empty, and leave them there.
+// Otherwise a temporary directory is used and removed at the end.
+//
+// --readers=N
+//
+// Threads looking up keys during the reload (default 2)
+//
+// --time=MS
+//
+// Time spent measuring lookups at each size (default 200)
+//
+// --key-stats
+//
+// Enable per key statistics (as --key-stats-top does in keyless) so that
+// the reload includes copying them to the new list
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <glob.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <uv.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_histogram.h"
+#include "kssl_private_key.h"
+#include "kssl_getopt.h"
+
+#define MAX_SIZES   32
+#define MAX_POOL    256
+#define MAX_READERS 64
+
+// A reader thread. Each thread only writes its own entry and the padding
+// keeps entries on separate cachelines.
+
+typedef struct {
+  uv_thread_t thread;
+  uint64_t seed;
+  uint64_t max;         // Longest lookup during the reload (ns)
+  uint64_t lookups;
+  char padding[64];
+} bench_reader;
+
+static bench_reader readers[MAX_READERS];
+
+// The installed key list and its lock, as in keyless.c
+
+static pk_list current = NULL;
+static uv_rwlock_t current_lock;
+
+// Set by the main thread while readers should run and while a reload is
+// in progress
+
+static unsigned int running = 0;
+static unsigned int reloading = 0;
+
+static char dir[1024];
+static int generated = 0;  // Keys written to dir so far
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+
+  exit(1);
+}
+
+// ssl_error: print OpenSSL's errors and exit
+static void ssl_error(void)
+{
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+// error_string: converts an error return code from libuv into a string
+const char *error_string(int e)
+{
+  return uv_strerror(e);
+}
+
+// random64: xorshift64* step
+static uint64_t random64(uint64_t *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
+
+// rss_bytes: returns the resident set size of the process or 0 if it is
+// not known
+static uint64_t rss_bytes(void)
+{
+  unsigned long long size = 0, resident = 0;
+  FILE *f;
+
+#if defined(__GLIBC__)
+  malloc_trim(0);
+#endif
+
+  f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%llu %llu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+
+  return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+// generate_rsa: returns a new RSA 2048 bit key
+static EVP_PKEY *generate_rsa(void)
+{
+  EVP_PKEY *pkey = EVP_PKEY_new();
+  RSA *rsa = RSA_new();
+  BIGNUM *e = BN_new();
+
+  if (pkey == NULL || rsa == NULL || e == NULL ||
+      BN_set_word(e, RSA_F4) != 1 ||
+      RSA_generate_key_ex(rsa, 2048, e, NULL) != 1 ||
+      EVP_PKEY_assign_RSA(pkey, rsa) != 1) {
+    ssl_error();
+  }
+  BN_free(e);
+
+  return pkey;
+}
+
+// generate_ec: returns a new P-256 key
+static EVP_PKEY *generate_ec(void)
+{
+  EVP_PKEY *pkey = EVP_PKEY_new();
+  EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+
+  if (pkey == NULL || ec == NULL) {
+    ssl_error();
+  }
+  EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+  if (EC_KEY_generate_key(ec) != 1 || EVP_PKEY_assign_EC_KEY(pkey, ec) != 1) {
+    ssl_error();
+  }
+
+  return pkey;
+}
+
+// key_path: write the path of key i to path
+static void key_path(int i, char *path, size_t size)
+{
+  snprintf(path, size, "%s/%07d.key", dir, i);
+}
+
+// is_rsa: returns 1 if key i is an RSA key. RSA keys are spread evenly
+// through the directory.
+static int is_rsa(int i, int percent)
+{
+  return ((long long)(i + 1) * percent / 100) > ((long long)i * percent / 100);
+}
+
+// grow: write keys to dir until it holds count
+static void grow(int count, int percent, EVP_PKEY **pool, int pool_size)
+{
+  static int rsa_written = 0;
+
+  for (; generated < count; generated++) {
+    char path[1100];
+    EVP_PKEY *pkey;
+    FILE *f;
+
+    if (is_rsa(generated, percent)) {
+      pkey = pool[rsa_written++ % pool_size];
+    } else {
+      pkey = generate_ec();
+    }
+
+    key_path(generated, path, sizeof(path));
+    f = fopen(path, "w");
+    if (f == NULL ||
+        PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL) != 1) {
+      fatal_error("Failed to write key to %s", path);
+    }
+    fclose(f);
+
+    if (!is_rsa(generated, percent)) {
+      EVP_PKEY_free(pkey);
+    }
+  }
+}
+
+// load: returns the keys in dir loaded the way load_private_keys in
+// keyless.c does
+static pk_list load(void)
+{
+  char pattern[1100];
+  pk_list list;
+  glob_t g;
+  size_t i;
+
+  snprintf(pattern, sizeof(pattern), "%s/*.key", dir);
+  g.gl_pathc = 0;
+  g.gl_offs = 0;
+  if (glob(pattern, GLOB_NOSORT, 0, &g) != 0 || g.gl_pathc == 0) {
+    fatal_error("Failed to find any private keys in %s", dir);
+  }
+
+  list = new_pk_list((int)g.gl_pathc);
+  if (list == NULL) {
+    fatal_error("Failed to allocate room for private keys");
+  }
+  for (i = 0; i < g.gl_pathc; i++) {
+    if (add_key_from_file(g.gl_pathv[i], list) != KSSL_ERROR_NONE) {
+      fatal_error("Failed to add private key %s", g.gl_pathv[i]);
+    }
+  }
+
+  globfree(&g);
+  return list;
+}
+
+// reader_entry: look up random keys in the current list under the read
+// lock until the run stops, recording the longest lookup during a reload
+static void reader_entry(void *data)
+{
+  bench_reader *r = (bench_reader *)data;
+
+  while (KSSL_LOAD_ACQUIRE(&running)) {
+    int during = KSSL_LOAD_ACQUIRE(&reloading);
+    uint64_t start = uv_hrtime();
+    uint64_t ns;
+
+    uv_rwlock_rdlock(&current_lock);
+    find_private_key(current, NULL,
+                     key_digest(current, (int)(random64(&r->seed) %
+                                               key_count(current))));
+    uv_rwlock_rdunlock(&current_lock);
+
+    ns = uv_hrtime() - start;
+    if (during && KSSL_LOAD_ACQUIRE(&reloading) && ns > r->max) {
+      r->max = ns;
+    }
+    r->lookups++;
+  }
+}
+
+// print_ns: write a JSON object summarizing h in ns
+static void print_ns(const char *name, kssl_histogram *h)
+{
+  printf("\"%s\":{\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu}", name,
+         (h->count == 0)?0.0:(double)h->sum / h->count,
+         (unsigned long long)histogram_percentile(h, 50),
+         (unsigned long long)histogram_percentile(h, 99));
+}
+
+// lookups: time find_private_key on list for time_ms, finding random
+// keys into hit and a missing key into miss
+static void lookups(pk_list list, int time_ms, kssl_histogram *hit,
+                    kssl_histogram *miss)
+{
+  BYTE missing[KSSL_DIGEST_SIZE];
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  uint64_t until = uv_hrtime() + (uint64_t)time_ms * 1000000ULL;
+  int count = key_count(list);
+
+  memset(missing, 0, sizeof(missing));
+
+  // At least a few lookups are made however slow they are
+
+  while (uv_hrtime() < until || miss->count < 10) {
+    BYTE *digest = key_digest(list, (int)(random64(&seed) % count));
+    uint64_t start = uv_hrtime();
+
+    if (find_private_key(list, NULL, digest) < 0) {
+      fatal_error("Failed to find a loaded key");
+    }
+    histogram_record(hit, uv_hrtime() - start);
+
+    start = uv_hrtime();
+    if (find_private_key(list, NULL, missing) >= 0) {
+      fatal_error("Found a key that is not loaded");
+    }
+    histogram_record(miss, uv_hrtime() - start);
+  }
+}
+
+// measure: load, reload and look up keys at the current size
+static void measure(int size, int first, int percent, int reader_count,
+                    int time_ms, int key_stats)
+{
+  kssl_histogram hit, miss;
+  uint64_t rss_before, rss_after;
+  uint64_t start, loaded, locked, unlocked, freed;
+  uint64_t reader_max = 0;
+  pk_list old, list;
+  int shards = (reader_count > 0)?reader_count:1;
+  int rsa = 0;
+  int i;
+
+  for (i = 0; i < size; i++) {
+    rsa += is_rsa(i, percent);
+  }
+
+  // Cold start
+
+  rss_before = rss_bytes();
+  start = uv_hrtime();
+  list = load();
+  loaded = uv_hrtime();
+  rss_after = rss_bytes();
+
+  if (key_stats && key_stats_enable(list, shards) != 0) {
+    fatal_error("Failed to allocate per key statistics");
+  }
+  current = list;
+
+  printf("%s{\"keys\":%d,\"rsa\":%d,\"ec\":%d,\"load_ms\":%.3f,"
+         "\"keys_per_sec\":%.1f,\"rss_bytes_per_key\":%.1f,",
+         first?"":",", size, rsa, size - rsa, (loaded - start) / 1e6,
+         size * 1e9 / (double)(loaded - start),
+         (rss_after > rss_before)?(double)(rss_after - rss_before) / size:0.0);
+
+  // Reload while readers look keys up
+
+  KSSL_STORE_RELEASE(&running, 1);
+  for (i = 0; i < reader_count; i++) {
+    readers[i].seed = (uint64_t)i * 0x2545F4914F6CDD1DULL + 1;
+    readers[i].max = 0;
+    readers[i].lookups = 0;
+    if (uv_thread_create(&readers[i].thread, reader_entry, &readers[i]) != 0) {
+      fatal_error("Failed to create thread");
+    }
+  }
+
+  KSSL_STORE_RELEASE(&reloading, 1);
+  start = uv_hrtime();
+  list = load();
+  if (key_stats && key_stats_enable(list, shards) != 0) {
+    fatal_error("Failed to allocate per key statistics");
+  }
+  loaded = uv_hrtime();
+
+  uv_rwlock_wrlock(&current_lock);
+  locked = uv_hrtime();
+  old = current;
+  key_stats_migrate(list, old);
+  current = list;
+  unlocked = uv_hrtime();
+  uv_rwlock_wrunlock(&current_lock);
+
+  free_pk_list(old);
+  freed = uv_hrtime();
+  KSSL_STORE_RELEASE(&reloading, 0);
+
+  KSSL_STORE_RELEASE(&running, 0);
+  for (i = 0; i < reader_count; i++) {
+    uv_thread_join(&readers[i].thread);
+    if (readers[i].max > reader_max) {
+      reader_max = readers[i].max;
+    }
+  }
+
+  printf("\"reload_ms\":%.3f,\"lock_held_us\":%.1f,\"free_ms\":%.3f,"
+         "\"reader_max_us\":%.1f,", (loaded - start) / 1e6,
+         (unlocked - locked) / 1e3, (freed - unlocked) / 1e6,
+         reader_max / 1e3);
+
+  // Lookups
+
+  memset(&hit, 0, sizeof(hit));
+  memset(&miss, 0, sizeof(miss));
+  lookups(current, time_ms, &hit, &miss);
+  print_ns("lookup_hit_ns", &hit);
+  printf(",");
+  print_ns("lookup_miss_ns", &miss);
+  printf("}");
+  fflush(stdout);
+
+  free_pk_list(current);
+  current = NULL;
+}
+
+// parse_sizes: fill sizes from a comma separated list. Returns the number
+// of sizes.
+static int parse_sizes(char *list, int *sizes)
+{
+  char *item;
+  int count = 0;
+
+  for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (count == MAX_SIZES) {
+      fatal_error("At most %d --sizes may be given", MAX_SIZES);
+    }
+    sizes[count] = atoi(item);
+    if (sizes[count] <= 0 || (count > 0 && sizes[count] <= sizes[count-1])) {
+      fatal_error("--sizes must be positive and increasing");
+    }
+    count++;
+  }
+
+  return count;
+}
+
+int main(int argc, char *argv[])
+{
+  char default_sizes[] = "10,100,1000,10000,100000,1000000";
+  int sizes[MAX_SIZES];
+  int size_count;
+  EVP_PKEY *pool[MAX_POOL];
+  int percent = 10;
+  int pool_size = 16;
+  int reader_count = 2;
+  int time_ms = 200;
+  int key_stats = 0;
+  int temporary = 1;
+  int i;
+
+  const struct option long_options[] = {
+    {"sizes",     required_argument, 0, 0},
+    {"rsa",       required_argument, 0, 1},
+    {"rsa-pool",  required_argument, 0, 2},
+    {"dir",       required_argument, 0, 3},
+    {"readers",   required_argument, 0, 4},
+    {"time",      required_argument, 0, 5},
+    {"key-stats", no_argument,       0, 6},
+    {"help",      no_argument,       0, 7},
+    {0, 0, 0, 0}
+  };
+
+  size_count = parse_sizes(default_sizes, sizes);
+
+  optind = 1;
+  while (1) {
+    int c = getopt_long(argc, argv, "", long_options, 0);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      size_count = parse_sizes(optarg, sizes);
+      break;
+
+    case 1:
+      percent = atoi(optarg);
+      if (percent < 0 || percent > 100) {
+        fatal_error("--rsa must be between 0 and 100");
+      }
+      break;
+
+    case 2:
+      pool_size = atoi(optarg);
+      if (pool_size <= 0 || pool_size > MAX_POOL) {
+        fatal_error("--rsa-pool must be between 1 and %d", MAX_POOL);
+      }
+      break;
+
+    case 3:
+      if (strlen(optarg) >= sizeof(dir)) {
+        fatal_error("--dir path %s is too long", optarg);
+      }
+      strcpy(dir, optarg);
+      temporary = 0;
+      break;
+
+    case 4:
+      reader_count = atoi(optarg);
+      if (reader_count < 0 || reader_count > MAX_READERS) {
+        fatal_error("--readers must be between 0 and %d", MAX_READERS);
+      }
+      break;
+
+    case 5:
+      time_ms = atoi(optarg);
+      if (time_ms <= 0) {
+        fatal_error("--time must be positive");
+      }
+      break;
+
+    case 6:
+      key_stats = 1;
+      break;
+
+    case 7:
+    default:
+      fprintf(stderr, "Usage: kssl_bench_keys [--sizes=N,...] "
+              "[--rsa=PERCENT] [--rsa-pool=N] [--dir=DIR] [--readers=N] "
+              "[--time=MS] [--key-stats]\n");
+      exit(c == 7 ? 0 : 1);
+    }
+  }
+
+  SSL_library_init();
+  SSL_load_error_strings();
+  if (uv_rwlock_init(&current_lock) != 0) {
+    fatal_error("Failed to initialize lock");
+  }
+
+  if (temporary) {
+    strcpy(dir, "/tmp/kssl_bench_keys.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+      fatal_error("Failed to create a temporary directory");
+    }
+  }
+
+  if (percent > 0) {
+    for (i = 0; i < pool_size; i++) {
+      pool[i] = generate_rsa();
+    }
+  } else {
+    pool_size = 0;
+  }
+
+  printf("{\"rsa_percent\":%d,\"rsa_pool\":%d,\"readers\":%d,"
+         "\"key_stats\":%d,\"results\":[", percent, pool_size, reader_count,
+         key_stats);
+
+  for (i = 0; i < size_count; i++) {
+    grow(sizes[i], percent, pool, pool_size);
+    measure(sizes[i], i == 0, percent, reader_count, time_ms, key_stats);
+  }
+
+  printf("]}\n");
+
+  for (i = 0; i < pool_size; i++) {
+    EVP_PKEY_free(pool[i]);
+  }
+
+  if (temporary) {
+    for (i = 0; i < generated; i++) {
+      char path[1100];
+
+      key_path(i, path, sizeof(path));
+      unlink(path);
+    }
+    rmdir(dir);
+  }
+
+  uv_rwlock_destroy(&current_lock);
+  return 0;
+}
@@ -0,0 +1,265 @@
+// kssl_binlog.c: compact binary access log
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <uv.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_binlog.h"
+
+// Records are gathered into blocks of this many records (256KB) which
+// are written with a single fwrite
+
+#define BINLOG_BLOCK_RECORDS 4096
+
+// A partially filled block is written after this many nanoseconds
+
+#define BINLOG_BLOCK_AGE 1000000000ULL
+
+// State of the log. Records are normally only written by the background
+// log thread but threads without a log queue write directly (see
+// log_binary), so binlog_lock serializes access.
+
+static int binlog_on = 0;
+static char *binlog_path = NULL;
+static uint64_t binlog_max = 0;
+static FILE *binlog_fp = NULL;
+static uint64_t binlog_size = 0;
+static int binlog_rotations = 0;
+static uv_mutex_t binlog_lock;
+
+static kssl_binlog_record *block = NULL;
+static int block_count = 0;
+static uint64_t block_started = 0;
+
+// start_file: open binlog_path and write the file header. Returns 0 on
+// success.
+static int start_file(void)
+{
+  kssl_binlog_header header;
+
+  binlog_fp = fopen(binlog_path, "wb");
+  if (binlog_fp == NULL) {
+    return 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KSSL_BINLOG_MAGIC, sizeof(header.magic));
+  header.version = KSSL_BINLOG_VERSION;
+  header.record_size = sizeof(kssl_binlog_record);
+  header.byte_order = KSSL_BINLOG_BYTE_ORDER;
+
+  if (fwrite(&header, sizeof(header), 1, binlog_fp) != 1) {
+    fclose(binlog_fp);
+    binlog_fp = NULL;
+    return 1;
+  }
+  binlog_size = sizeof(header);
+
+  return 0;
+}
+
+// rotate: move the current file aside and start a new one
+static void rotate(void)
+{
+  char *rotated;
+  size_t len = strlen(binlog_path) + 32;
+
+  fclose(binlog_fp);
+  binlog_fp = NULL;
+
+  rotated = (char *)malloc(len);
+  if (rotated == NULL) {
+    write_log(1, "Failed to allocate memory to rotate binary log");
+  } else {
+    snprintf(rotated, len, "%s.%lld.%d", binlog_path, (long long)time(NULL),
+             binlog_rotations++);
+    if (rename(binlog_path, rotated) != 0) {
+      write_log(1, "Failed to rename binary log %s to %s", binlog_path,
+                rotated);
+    }
+    free(rotated);
+  }
+
+  if (start_file() != 0) {
+    write_log(1, "Failed to reopen binary log %s", binlog_path);
+  }
+}
+
+// flush_block: write out the current block. Must be called with
+// binlog_lock held.
+static void flush_block(void)
+{
+  size_t bytes = block_count * sizeof(kssl_binlog_record);
+
+  if (block_count == 0) {
+    return;
+  }
+
+  if (binlog_fp != NULL && binlog_max != 0 &&
+      binlog_size + bytes > binlog_max) {
+    rotate();
+  }
+
+  if (binlog_fp != NULL) {
+    if (fwrite(block, sizeof(kssl_binlog_record), block_count, binlog_fp) !=
+        (size_t)block_count) {
+      write_log(1, "Failed to write %d records to binary log %s",
+                block_count, binlog_path);
+    }
+    fflush(binlog_fp);
+    binlog_size += bytes;
+  }
+
+  block_count = 0;
+}
+
+// binlog_write: append count records to the current block. Blocks are
+// written out when full.
+static void binlog_write(void *records, int count)
+{
+  kssl_binlog_record *r = (kssl_binlog_record *)records;
+
+  uv_mutex_lock(&binlog_lock);
+  while (count > 0) {
+    int n = BINLOG_BLOCK_RECORDS - block_count;
+
+    if (n > count) {
+      n = count;
+    }
+    if (block_count == 0) {
+      block_started = uv_hrtime();
+    }
+    memcpy(&block[block_count], r, n * sizeof(kssl_binlog_record));
+    block_count += n;
+    r += n;
+    count -= n;
+    if (block_count == BINLOG_BLOCK_RECORDS) {
+      flush_block();
+    }
+  }
+  uv_mutex_unlock(&binlog_lock);
+}
+
+// binlog_tick: write out a partially filled block if it has been waiting
+// for more than BINLOG_BLOCK_AGE
+static void binlog_tick(void)
+{
+  if (!binlog_on) {
+    return;
+  }
+
+  uv_mutex_lock(&binlog_lock);
+  if (block_count > 0 && uv_hrtime() - block_started >= BINLOG_BLOCK_AGE) {
+    flush_block();
+  }
+  uv_mutex_unlock(&binlog_lock);
+}
+
+// binlog_open: start writing records to path
+int binlog_open(const char *path, uint64_t max_size)
+{
+  block = (kssl_binlog_record *)malloc(BINLOG_BLOCK_RECORDS *
+                                       sizeof(kssl_binlog_record));
+  if (block == NULL) {
+    return 1;
+  }
+
+  binlog_path = (char *)malloc(strlen(path)+1);
+  if (binlog_path == NULL) {
+    free(block);
+    block = NULL;
+    return 1;
+  }
+  strcpy(binlog_path, path);
+  binlog_max = max_size;
+
+  if (uv_mutex_init(&binlog_lock) != 0 || start_file() != 0) {
+    free(binlog_path);
+    free(block);
+    binlog_path = NULL;
+    block = NULL;
+    return 1;
+  }
+
+  block_count = 0;
+  binlog_on = 1;
+  log_binary_writer(LOG_BINARY_ACCESS, binlog_write, binlog_tick);
+  return 0;
+}
+
+// binlog_close: write out any buffered records and close the log
+void binlog_close(void)
+{
+  if (!binlog_on) {
+    return;
+  }
+
+  log_binary_writer(LOG_BINARY_ACCESS, NULL, NULL);
+
+  uv_mutex_lock(&binlog_lock);
+  flush_block();
+  if (binlog_fp != NULL) {
+    fclose(binlog_fp);
+    binlog_fp = NULL;
+  }
+  binlog_on = 0;
+  uv_mutex_unlock(&binlog_lock);
+
+  uv_mutex_destroy(&binlog_lock);
+  free(binlog_path);
+  free(block);
+  binlog_path = NULL;
+  block = NULL;
+}
+
+// binlog_enabled: returns 1 if binlog_open has been called
+int binlog_enabled(void)
+{
+  return binlog_on;
+}
+
+// stage: returns the time between two uv_hrtime() values saturated to fit
+// in a record
+static uint32_t stage(uint64_t from, uint64_t to)
+{
+  uint64_t ns = elapsed_ns(from, to);
+
+  return (ns > 0xffffffff)?0xffffffff:(uint32_t)ns;
+}
+
+// binlog_request: build a record for a completed request and queue it
+void binlog_request(int worker, kssl_header *header, kssl_op_info *info,
+                    kssl_request_times *times)
+{
+  kssl_binlog_record r;
+  kssl_step steps[KSSL_STEPS];
+  int i;
+
+  if (!binlog_on) {
+    return;
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.time = (uint64_t)log_wall_time();
+  r.id = header->id;
+  r.key = info->key_id;
+  r.opcode = info->opcode;
+  r.error = (uint8_t)info->error;
+  r.worker = (uint8_t)worker;
+  r.ip_len = info->ip_len;
+  memcpy(r.ip, info->ip, sizeof(r.ip));
+
+  request_steps(info, times, steps);
+  for (i = 0; i < KSSL_STEPS; i++) {
+    r.stage[i] = stage(steps[i].from, steps[i].to);
+  }
+
+  log_binary(LOG_BINARY_ACCESS, &r);
+}
@@ -0,0 +1,73 @@
+// kssl_binlog.h: compact binary access log
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_BINLOG
+#define INCLUDED_KSSL_BINLOG 1
+
+#include "kssl.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+#include "kssl_metrics.h"
+
+// A binary log file is a kssl_binlog_header followed by any number of
+// kssl_binlog_records. Both are written in the byte order of the machine
+// running keyless; byte_order allows a reader to detect a mismatch.
+
+#define KSSL_BINLOG_MAGIC      "KSSLBLOG"
+#define KSSL_BINLOG_VERSION    1
+#define KSSL_BINLOG_BYTE_ORDER 0x01020304
+
+typedef struct {
+  char     magic[8];     // KSSL_BINLOG_MAGIC (not NUL terminated)
+  uint16_t version;      // KSSL_BINLOG_VERSION
+  uint16_t record_size;  // sizeof(kssl_binlog_record)
+  uint32_t byte_order;   // KSSL_BINLOG_BYTE_ORDER
+} kssl_binlog_header;
+
+// The stages of a request whose latency is recorded. These are the
+// steps from request_steps (see kssl_metrics.h) in the same order; the
+// total latency of a request is the sum of its stages.
+
+#define KSSL_BINLOG_QUEUE   KSSL_STEP_QUEUE
+#define KSSL_BINLOG_LOCK    KSSL_STEP_LOCK
+#define KSSL_BINLOG_PARSE   KSSL_STEP_PARSE
+#define KSSL_BINLOG_LOOKUP  KSSL_STEP_LOOKUP
+#define KSSL_BINLOG_CRYPTO  KSSL_STEP_CRYPTO
+#define KSSL_BINLOG_RESPOND KSSL_STEP_RESPOND
+#define KSSL_BINLOG_FLUSH   KSSL_STEP_FLUSH
+#define KSSL_BINLOG_STAGES  KSSL_STEPS
+
+// A single request. Exactly 64 bytes.
+
+typedef struct {
+  uint64_t time;        // Wall clock time in milliseconds since the epoch
+  uint32_t id;          // Request ID
+  int32_t  key;         // Index of the key used or -1 if none
+  uint8_t  opcode;      // Request opcode (0 if the request did not parse)
+  uint8_t  error;       // kssl_error_code returned
+  uint8_t  ip_len;      // Length of ip (0, 4 or 16)
+  uint8_t  worker;      // Worker that handled the request
+  uint8_t  ip[16];      // Client IP address
+  uint32_t stage[KSSL_BINLOG_STAGES]; // Nanoseconds spent in each stage
+                                      // (saturates at about 4.3s)
+} kssl_binlog_record;
+
+// binlog_open: start writing records to path. When the file would grow
+// beyond max_size bytes it is renamed to path.<seconds>.<n> and a new file
+// is started. Returns 0 on success.
+int binlog_open(const char *path, uint64_t max_size);
+
+// binlog_close: write out any buffered records and close the log
+void binlog_close(void);
+
+// binlog_enabled: returns 1 if binlog_open has been called
+int binlog_enabled(void);
+
+// binlog_request: build a record for a completed request and queue it
+// for the background log thread (see log_binary) which gathers records
+// into large blocks before writing them
+void binlog_request(int worker, kssl_header *header, kssl_op_info *info,
+                    kssl_request_times *times);
+
+#endif // INCLUDED_KSSL_BINLOG
@@ -0,0 +1,201 @@
+// kssl_capture.c: request stream capture for replay
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_capture.h"
+
+// Size of the stdio buffer records are gathered in before being written
+
+#define CAPTURE_BUFFER (256 * 1024)
+
+// Buffered records are written out at least this often (ns)
+
+#define CAPTURE_FLUSH_EVERY 1000000000ULL
+
+// State of the capture. Records are normally only written by the
+// background log thread but threads without a log queue write directly
+// (see log_binary), so capture_lock serializes access to the file.
+
+static int capture_on = 0;
+static FILE *capture_fp = NULL;
+static char *capture_buffer = NULL;
+static uint64_t capture_started = 0;  // uv_hrtime() when capture started
+static uint64_t capture_until = 0;    // uv_hrtime() when it stops or 0
+static uint64_t capture_flushed = 0;
+static uv_mutex_t capture_lock;
+
+// capture_write: append count records to the file
+static void capture_write(void *records, int count)
+{
+  uv_mutex_lock(&capture_lock);
+  if (capture_fp != NULL &&
+      fwrite(records, sizeof(kssl_capture_record), count, capture_fp) !=
+      (size_t)count) {
+    write_log(1, "Failed to write to capture file");
+    fclose(capture_fp);
+    capture_fp = NULL;
+  }
+  uv_mutex_unlock(&capture_lock);
+}
+
+// capture_tick: write out buffered records every CAPTURE_FLUSH_EVERY
+static void capture_tick(void)
+{
+  uint64_t now = uv_hrtime();
+
+  if (now - capture_flushed < CAPTURE_FLUSH_EVERY) {
+    return;
+  }
+
+  uv_mutex_lock(&capture_lock);
+  if (capture_fp != NULL) {
+    fflush(capture_fp);
+  }
+  capture_flushed = now;
+  uv_mutex_unlock(&capture_lock);
+}
+
+// capture_open: start capturing to path
+int capture_open(const char *path, unsigned int seconds)
+{
+  kssl_capture_header header;
+
+  capture_buffer = (char *)malloc(CAPTURE_BUFFER);
+  if (capture_buffer == NULL) {
+    return 1;
+  }
+
+  capture_fp = fopen(path, "wb");
+  if (capture_fp == NULL) {
+    free(capture_buffer);
+    capture_buffer = NULL;
+    return 1;
+  }
+  setvbuf(capture_fp, capture_buffer, _IOFBF, CAPTURE_BUFFER);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KSSL_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = KSSL_CAPTURE_VERSION;
+  header.record_size = sizeof(kssl_capture_record);
+  header.byte_order = KSSL_CAPTURE_BYTE_ORDER;
+  header.started = (uint64_t)log_wall_time();
+
+  if (fwrite(&header, sizeof(header), 1, capture_fp) != 1 ||
+      uv_mutex_init(&capture_lock) != 0) {
+    fclose(capture_fp);
+    free(capture_buffer);
+    capture_fp = NULL;
+    capture_buffer = NULL;
+    return 1;
+  }
+
+  capture_started = uv_hrtime();
+  capture_flushed = capture_started;
+  capture_until = 0;
+  if (seconds != 0) {
+    capture_until = capture_started + (uint64_t)seconds * 1000000000ULL;
+  }
+
+  capture_on = 1;
+  log_binary_writer(LOG_BINARY_CAPTURE, capture_write, capture_tick);
+  return 0;
+}
+
+// capture_close: write out any buffered records and close the capture
+void capture_close(void)
+{
+  if (!capture_on) {
+    return;
+  }
+
+  log_binary_writer(LOG_BINARY_CAPTURE, NULL, NULL);
+
+  uv_mutex_lock(&capture_lock);
+  if (capture_fp != NULL) {
+    fclose(capture_fp);
+    capture_fp = NULL;
+  }
+  capture_on = 0;
+  uv_mutex_unlock(&capture_lock);
+
+  uv_mutex_destroy(&capture_lock);
+  free(capture_buffer);
+  capture_buffer = NULL;
+}
+
+// capture_enabled: returns 1 if events are currently being captured
+int capture_enabled(void)
+{
+  return capture_on && (capture_until == 0 || uv_hrtime() < capture_until);
+}
+
+// capture_connection: record a connection being opened or closed.
+// Connection identifiers are the worker's count of captured connections
+// with the worker number in the low 8 bits.
+uint32_t capture_connection(int worker, unsigned int *seq, int type,
+                            uint32_t connection)
+{
+  kssl_capture_record r;
+
+  if (!capture_enabled()) {
+    return 0;
+  }
+
+  if (type == KSSL_CAPTURE_OPEN) {
+    *seq += 1;
+    connection = (*seq << 8) | (worker & 0xff);
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.time = uv_hrtime() - capture_started;
+  r.connection = connection;
+  r.type = (uint8_t)type;
+  r.worker = (uint8_t)worker;
+
+  log_binary(LOG_BINARY_CAPTURE, &r);
+  return connection;
+}
+
+// capture_request: record a processed request. The payload is parsed
+// again for the length of its payload item; the payload itself is not
+// recorded.
+void capture_request(int worker, uint32_t connection, kssl_header *header,
+                     BYTE *payload, kssl_op_info *info, pk_list privates)
+{
+  kssl_capture_record r;
+  kssl_operation request;
+
+  if (connection == 0 || !capture_enabled()) {
+    return;
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.time = uv_hrtime() - capture_started;
+  r.connection = connection;
+  r.type = KSSL_CAPTURE_REQUEST;
+  r.length = header->length;
+  r.opcode = info->opcode;
+  r.error = (uint8_t)info->error;
+  r.worker = (uint8_t)worker;
+
+  if (payload != NULL &&
+      parse_message_payload(payload, header->length, &request) ==
+      KSSL_ERROR_NONE && request.is_payload_set) {
+    r.payload_len = request.payload_len;
+  }
+
+  if (info->key_id >= 0) {
+    r.has_key = 1;
+    memcpy(r.digest, key_digest(privates, info->key_id), KSSL_DIGEST_SIZE);
+  }
+
+  log_binary(LOG_BINARY_CAPTURE, &r);
+}
@@ -0,0 +1,82 @@
+// kssl_capture.h: request stream capture for replay
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_CAPTURE
+#define INCLUDED_KSSL_CAPTURE 1
+
+#include "kssl.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+
+// A capture file records the shape of the traffic a keyserver receives
+// so that it can be replayed (see --replay in kssl_bench): when each
+// connection was established and closed and, for each request, its
+// connection, opcode, payload length and the key it used. Payloads are
+// never recorded.
+//
+// A capture file is a kssl_capture_header followed by any number of
+// kssl_capture_records. Both are written in the byte order of the
+// machine running keyless. Records are written as each worker's log
+// queue is drained so they are only in time order per worker; readers
+// must sort them.
+
+#define KSSL_CAPTURE_MAGIC      "KSSLCAPT"
+#define KSSL_CAPTURE_VERSION    1
+#define KSSL_CAPTURE_BYTE_ORDER 0x01020304
+
+typedef struct {
+  char     magic[8];     // KSSL_CAPTURE_MAGIC (not NUL terminated)
+  uint16_t version;      // KSSL_CAPTURE_VERSION
+  uint16_t record_size;  // sizeof(kssl_capture_record)
+  uint32_t byte_order;   // KSSL_CAPTURE_BYTE_ORDER
+  uint64_t started;      // Wall clock time capture started (ms since the
+                         // epoch)
+} kssl_capture_header;
+
+// Record types
+
+#define KSSL_CAPTURE_OPEN    1 // A connection completed its handshake
+#define KSSL_CAPTURE_REQUEST 2 // A request was processed
+#define KSSL_CAPTURE_CLOSE   3 // A connection was closed
+
+// A single event. Exactly 64 bytes.
+
+typedef struct {
+  uint64_t time;         // Nanoseconds since capture started
+  uint32_t connection;   // Identifies the connection within the capture
+  uint16_t length;       // Request: length from the header
+  uint16_t payload_len;  // Request: length of the payload item
+  uint8_t  type;         // One of KSSL_CAPTURE_*
+  uint8_t  opcode;       // Request: opcode (0 if the request did not parse)
+  uint8_t  error;        // Request: kssl_error_code returned
+  uint8_t  worker;       // Worker that handled the event
+  uint8_t  has_key;      // Request: 1 if digest identifies the key used
+  uint8_t  reserved[11];
+  uint8_t  digest[KSSL_DIGEST_SIZE]; // Request: digest of the key used
+} kssl_capture_record;
+
+// capture_open: start capturing to path for seconds seconds (0 captures
+// until capture_close). Returns 0 on success.
+int capture_open(const char *path, unsigned int seconds);
+
+// capture_close: write out any buffered records and close the capture
+void capture_close(void);
+
+// capture_enabled: returns 1 if events are currently being captured
+int capture_enabled(void);
+
+// capture_connection: record a connection event (KSSL_CAPTURE_OPEN or
+// KSSL_CAPTURE_CLOSE). For KSSL_CAPTURE_OPEN connection is ignored and a
+// new connection identifier is returned; seq is a counter owned by the
+// worker. Returns 0 if nothing was captured.
+uint32_t capture_connection(int worker, unsigned int *seq, int type,
+                            uint32_t connection);
+
+// capture_request: record a processed request with header on connection.
+// The key used (info->key_id) is looked up in privates, so this must be
+// called with the same pk_lock held as the operation.
+void capture_request(int worker, uint32_t connection, kssl_header *header,
+                     BYTE *payload, kssl_op_info *info, pk_list privates);
+
+#endif // INCLUDED_KSSL_CAPTURE
@@ -0,0 +1,258 @@
+// kssl_clients.c: per client request and CPU accounting
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#include "kssl_helpers.h"
+#include "kssl_clients.h"
+
+// Entries a table may use before further clients go to other
+
+#define CLIENTS_LIMIT (KSSL_CLIENTS / 4 * 3)
+
+static int clients_mode = KSSL_CLIENTS_OFF;
+
+// clients_init: set how clients are identified
+void clients_init(int mode)
+{
+  clients_mode = mode;
+  kssl_measure_cpu(mode != KSSL_CLIENTS_OFF);
+}
+
+// clients_enabled: returns 1 if client accounting is on
+int clients_enabled(void)
+{
+  return clients_mode != KSSL_CLIENTS_OFF;
+}
+
+// clients_new: allocate count zeroed tables
+kssl_client_table *clients_new(int count)
+{
+  return (kssl_client_table *)calloc(count, sizeof(kssl_client_table));
+}
+
+// clients_free: free tables allocated with clients_new
+void clients_free(kssl_client_table *tables)
+{
+  free(tables);
+}
+
+// client_name: write the identity of the client on ssl into name
+static void client_name(SSL *ssl, char *name)
+{
+  X509 *cert = SSL_get_peer_certificate(ssl);
+
+  strcpy(name, "none");
+  if (cert == NULL) {
+    return;
+  }
+
+  if (clients_mode == KSSL_CLIENTS_FINGERPRINT) {
+    BYTE md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    unsigned int i;
+
+    if (X509_digest(cert, EVP_sha256(), md, &len) == 1 &&
+        len * 2 < KSSL_CLIENT_NAME) {
+      for (i = 0; i < len; i++) {
+        snprintf(&name[i * 2], 3, "%02x", md[i]);
+      }
+    }
+  } else {
+    X509_NAME_oneline(X509_get_subject_name(cert), name, KSSL_CLIENT_NAME);
+  }
+
+  X509_free(cert);
+}
+
+// name_hash: FNV-1a hash of a client name
+static unsigned int name_hash(const char *name)
+{
+  unsigned int h = 2166136261U;
+
+  while (*name != '\0') {
+    h ^= (BYTE)*name++;
+    h *= 16777619U;
+  }
+
+  return h & (KSSL_CLIENTS - 1);
+}
+
+// find: returns the entry for name in t adding it if necessary. Entries
+// are added by the table's owner only; see kssl_client_table.
+static kssl_client_stats *find(kssl_client_table *t, const char *name)
+{
+  unsigned int h = name_hash(name);
+
+  while (KSSL_LOAD_ACQUIRE(&t->entries[h].used)) {
+    if (strcmp(t->entries[h].name, name) == 0) {
+      return &t->entries[h];
+    }
+    h = (h + 1) & (KSSL_CLIENTS - 1);
+  }
+
+  if (t->count >= CLIENTS_LIMIT) {
+    return &t->other;
+  }
+
+  strcpy(t->entries[h].name, name);
+  t->count += 1;
+  KSSL_STORE_RELEASE(&t->entries[h].used, 1);
+
+  return &t->entries[h];
+}
+
+// clients_find: returns the entry for the client on ssl
+kssl_client_stats *clients_find(kssl_client_table *t, SSL *ssl)
+{
+  char name[KSSL_CLIENT_NAME];
+  kssl_client_stats *c;
+
+  client_name(ssl, name);
+  c = find(t, name);
+  c->connections += 1;
+
+  return c;
+}
+
+// clients_record: count a request against a client
+void clients_record(kssl_client_stats *c, kssl_op_info *info,
+                    int request_len, int response_len)
+{
+  c->requests += 1;
+  if (info->error != KSSL_ERROR_NONE) {
+    c->errors += 1;
+  }
+  c->bytes_read += request_len;
+  c->bytes_written += response_len;
+  if (info->crypto_end != 0) {
+    c->crypto_ops += 1;
+    c->crypto_cpu += info->crypto_cpu;
+  }
+}
+
+// add: add the counters of one entry to another
+static void add(kssl_client_stats *to, kssl_client_stats *from)
+{
+  to->connections += from->connections;
+  to->requests += from->requests;
+  to->errors += from->errors;
+  to->bytes_read += from->bytes_read;
+  to->bytes_written += from->bytes_written;
+  to->crypto_ops += from->crypto_ops;
+  to->crypto_cpu += from->crypto_cpu;
+}
+
+// escape: copy name into label escaping it for use as a Prometheus label
+// value. label must have room for twice the length of name.
+static void escape(const char *name, char *label)
+{
+  while (*name != '\0') {
+    if (*name == '"' || *name == '\\') {
+      *label++ = '\\';
+    }
+    *label++ = *name++;
+  }
+  *label = '\0';
+}
+
+// The exported counters. Prometheus requires every sample of a metric
+// to be together so the clients are walked once per counter.
+
+typedef struct {
+  const char *name;
+  const char *help;
+  size_t offset;   // Offset of the counter in kssl_client_stats
+  double scale;    // Divisor applied to the counter
+} client_counter;
+
+static const client_counter counters[] = {
+  {"keyless_client_connections_total", "Connections by client certificate",
+   offsetof(kssl_client_stats, connections), 1},
+  {"keyless_client_requests_total", "Requests by client certificate",
+   offsetof(kssl_client_stats, requests), 1},
+  {"keyless_client_errors_total", "Error responses by client certificate",
+   offsetof(kssl_client_stats, errors), 1},
+  {"keyless_client_read_bytes_total", "Request bytes by client certificate",
+   offsetof(kssl_client_stats, bytes_read), 1},
+  {"keyless_client_written_bytes_total",
+   "Response bytes by client certificate",
+   offsetof(kssl_client_stats, bytes_written), 1},
+  {"keyless_client_crypto_operations_total",
+   "Private key operations by client certificate",
+   offsetof(kssl_client_stats, crypto_ops), 1},
+  {"keyless_client_crypto_cpu_seconds_total",
+   "Thread CPU time in private key operations by client certificate",
+   offsetof(kssl_client_stats, crypto_cpu), 1e9}
+};
+
+// render: write one counter of one client
+static void render(metrics_buffer *b, const client_counter *counter,
+                   const char *name, kssl_client_stats *c)
+{
+  char label[KSSL_CLIENT_NAME * 2];
+  uint64_t v = *(uint64_t *)((char *)c + counter->offset);
+
+  escape(name, label);
+  if (counter->scale == 1) {
+    metrics_printf(b, "%s{client=\"%s\"} %llu\n", counter->name, label,
+                   (unsigned long long)v);
+  } else {
+    metrics_printf(b, "%s{client=\"%s\"} %.9f\n", counter->name, label,
+                   (double)v / counter->scale);
+  }
+}
+
+// clients_render: merge count tables into a table owned by this thread
+// and render it. The merged table uses the same hashing and limit so the
+// same clients end up in other.
+void clients_render(metrics_buffer *b, kssl_client_table *tables,
+                    int count)
+{
+  kssl_client_table *merged;
+  int i, j;
+
+  if (!clients_enabled()) {
+    return;
+  }
+
+  merged = clients_new(1);
+  if (merged == NULL) {
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < KSSL_CLIENTS; j++) {
+      kssl_client_stats *c = &tables[i].entries[j];
+
+      if (KSSL_LOAD_ACQUIRE(&c->used)) {
+        add(find(merged, c->name), c);
+      }
+    }
+    add(&merged->other, &tables[i].other);
+  }
+
+  for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++) {
+    const client_counter *counter = &counters[i];
+
+    metrics_printf(b, "# HELP %s %s\n", counter->name, counter->help);
+    metrics_printf(b, "# TYPE %s counter\n", counter->name);
+    for (j = 0; j < KSSL_CLIENTS; j++) {
+      if (merged->entries[j].used) {
+        render(b, counter, merged->entries[j].name, &merged->entries[j]);
+      }
+    }
+    if (merged->other.connections != 0) {
+      render(b, counter, "other", &merged->other);
+    }
+  }
+
+  clients_free(merged);
+}
@@ -0,0 +1,82 @@
+// kssl_clients.h: per client request and CPU accounting
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_CLIENTS
+#define INCLUDED_KSSL_CLIENTS 1
+
+#include <openssl/ssl.h>
+
+#include "kssl.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+#include "kssl_metrics.h"
+
+// How clients are identified (see clients_init)
+
+#define KSSL_CLIENTS_OFF         0 // No accounting
+#define KSSL_CLIENTS_SUBJECT     1 // Client certificate subject
+#define KSSL_CLIENTS_FINGERPRINT 2 // SHA256 of the client certificate
+
+// Number of distinct clients each worker tracks. Must be a power of two.
+// Once three quarters are in use further clients are counted together.
+
+#define KSSL_CLIENTS 1024
+
+// Longest client name kept (including the NUL)
+
+#define KSSL_CLIENT_NAME 128
+
+// Totals for one client on one worker. Connections point at their
+// client's entry so requests are counted without a lookup.
+
+typedef struct {
+  unsigned int used;          // Set once name is filled in
+  char     name[KSSL_CLIENT_NAME];
+  uint64_t connections;       // Connections completing a handshake
+  uint64_t requests;          // Requests processed
+  uint64_t errors;            // Error responses sent
+  uint64_t bytes_read;        // Request bytes (header and payload)
+  uint64_t bytes_written;     // Response bytes
+  uint64_t crypto_ops;        // Private key operations
+  uint64_t crypto_cpu;        // Thread CPU time in private key operations
+} kssl_client_stats;
+
+// A worker's clients. Like a metrics shard it is only written by its
+// worker. Entries are never removed and an entry's used flag is set with
+// release semantics after its name so the scraper can read the table
+// while the worker adds to it.
+
+typedef struct {
+  int count;                              // Entries in use
+  kssl_client_stats other;                // Clients that did not fit
+  kssl_client_stats entries[KSSL_CLIENTS];
+} kssl_client_table;
+
+// clients_init: set how clients are identified (one of KSSL_CLIENTS_*)
+void clients_init(int mode);
+
+// clients_enabled: returns 1 if client accounting is on
+int clients_enabled(void);
+
+// clients_new: allocate count zeroed tables. Returns NULL on failure.
+kssl_client_table *clients_new(int count);
+
+// clients_free: free tables allocated with clients_new
+void clients_free(kssl_client_table *tables);
+
+// clients_find: returns the entry for the client on the other end of ssl
+// (which has completed its handshake) and counts the connection
+kssl_client_stats *clients_find(kssl_client_table *t, SSL *ssl);
+
+// clients_record: count a request of request_len bytes that was answered
+// with response_len bytes
+void clients_record(kssl_client_stats *c, kssl_op_info *info,
+                    int request_len, int response_len);
+
+// clients_render: merge count tables and render them in Prometheus text
+// format
+void clients_render(metrics_buffer *b, kssl_client_table *tables,
+                    int count);
+
+#endif // INCLUDED_KSSL_CLIENTS
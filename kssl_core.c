@@ -5,17 +5,40 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <uv.h>
 
 #include "kssl.h"
 #include "kssl_helpers.h"
 
 #include "kssl_private_key.h"
 #include "kssl_core.h"
+#include "kssl_probes.h"
+
+// Set by kssl_measure_cpu
+
+static int measure_cpu = 0;
+
+// elapsed_cpu: returns the CPU time between two thread_cpu_ns() readings
+// or 0 if either was not available
+static uint64_t elapsed_cpu(uint64_t from, uint64_t to)
+{
+  if (from == 0 || to < from) {
+    return 0;
+  }
 
-extern int silent;
+  return to - from;
+}
 
 // Public functions
 
+// kssl_measure_cpu: turn measurement of crypto CPU time on or off
+void kssl_measure_cpu(int enabled)
+{
+  measure_cpu = enabled;
+}
+
 // kssl_operate: create a serialized response from a KSSL request
 // header and payload
 kssl_error_code kssl_operate(kssl_header *header,
@@ -24,6 +47,20 @@ kssl_error_code kssl_operate(kssl_header *header,
                              BYTE **out_response,
                              int *out_response_len)
 {
+  return kssl_operate_ex(header, payload, privates, out_response,
+                         out_response_len, NULL);
+}
+
+// kssl_operate_ex: as kssl_operate but records the opcode, key, error
+// and timing of the private key operation in info
+kssl_error_code kssl_operate_ex(kssl_header *header,
+                                BYTE *payload,
+                                pk_list privates,
+                                BYTE **out_response,
+                                int *out_response_len,
+                                kssl_op_info *info)
+{
+  kssl_op_info local_info;
   kssl_error_code err = KSSL_ERROR_NONE;
   BYTE *local_resp = NULL;
   int local_resp_len = 0;
@@ -39,16 +76,36 @@ kssl_error_code kssl_operate(kssl_header *header,
   *out_response = 0;
   *out_response_len = 0;
 
+  if (info == NULL) {
+    info = &local_info;
+  }
+  info->opcode = 0;
+  info->key_id = -1;
+  info->error = KSSL_ERROR_NONE;
+  info->ip_len = 0;
+  info->parsed = 0;
+  info->lookup = 0;
+  info->crypto_start = 0;
+  info->crypto_end = 0;
+  info->crypto_cpu = 0;
+  info->crypto_counted = 0;
+
   // Extract the items from the payload
   err = parse_message_payload(payload, header->length, &request);
   if (err != KSSL_ERROR_NONE) {
     goto exit;
   }
 
-  if (silent == 0) {
-    log_operation(header, &request);
+  info->parsed = uv_hrtime();
+  info->opcode = request.opcode;
+  KSSL_PROBE3(request__parsed, header->id, request.opcode, header->length);
+  if (request.is_ip_set && (request.ip_len == 4 || request.ip_len == 16)) {
+    info->ip_len = (BYTE)request.ip_len;
+    memcpy(info->ip, request.ip, request.ip_len);
   }
 
+  log_operation(header, &request);
+
   switch (request.opcode) {
     // Other side sent response, error or pong: unexpected
     case KSSL_OP_RESPONSE:
@@ -91,6 +148,9 @@ kssl_error_code kssl_operate(kssl_header *header,
       unsigned int payload_size;
       int max_payload_size;
       int key_id;
+      uint64_t cpu_start = 0;
+      kssl_perf_sample perf_start;
+      int counted;
 
       if (request.is_ski_set) {
         // Identify private key from request ski
@@ -101,10 +161,13 @@ kssl_error_code kssl_operate(kssl_header *header,
         err = KSSL_ERROR_FORMAT;
         break;
       }
+      info->lookup = uv_hrtime();
+      KSSL_PROBE3(key__lookup, header->id, request.opcode, key_id);
       if (key_id < 0) {
         err = KSSL_ERROR_KEY_NOT_FOUND;
         break;
       }
+      info->key_id = key_id;
 
       // Allocate buffer to hold output of private key operation
       max_payload_size = key_size(privates, key_id);
@@ -115,9 +178,26 @@ kssl_error_code kssl_operate(kssl_header *header,
       }
 
       // Operate on payload
+      if (measure_cpu) {
+        cpu_start = thread_cpu_ns();
+      }
+      counted = perf_read(&perf_start);
+      info->crypto_start = uv_hrtime();
       err = private_key_operation(privates, key_id, request.opcode,
           request.payload_len, request.payload, out_payload,
           &payload_size);
+      info->crypto_end = uv_hrtime();
+      if (counted && perf_read(&info->crypto_counters)) {
+        kssl_perf_sample delta;
+
+        memset(&delta, 0, sizeof(delta));
+        perf_add(&delta, &perf_start, &info->crypto_counters);
+        info->crypto_counters = delta;
+        info->crypto_counted = 1;
+      }
+      if (measure_cpu) {
+        info->crypto_cpu = elapsed_cpu(cpu_start, thread_cpu_ns());
+      }
       if (err != KSSL_ERROR_NONE) {
         err = KSSL_ERROR_CRYPTO_FAILED;
         break;
@@ -141,6 +221,7 @@ kssl_error_code kssl_operate(kssl_header *header,
   }
 
 exit:
+  info->error = err;
   if (err != KSSL_ERROR_NONE) {
     err = kssl_error(header->id, err, &local_resp, &local_resp_len);
   } else {
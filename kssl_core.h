@@ -6,6 +6,32 @@
 #define INCLUDED_KSSL_CORE 1
 
 #include "kssl.h"
+#include "kssl_perf.h"
+
+// Information about a single request filled in by kssl_operate_ex for
+// use by instrumentation. Times are from uv_hrtime() and are zero if
+// the corresponding step was not reached.
+typedef struct {
+  BYTE            opcode;       // Opcode from the request (0 if unparsed)
+  int             key_id;       // Index of the key used or -1 if none
+  kssl_error_code error;        // Error returned to the client
+  BYTE            ip_len;       // Length of ip (0, 4 or 16)
+  BYTE            ip[16];       // Client IP address from the request
+  uint64_t        parsed;       // Request payload parsed
+  uint64_t        lookup;       // Key lookup complete
+  uint64_t        crypto_start; // Before the private key operation
+  uint64_t        crypto_end;   // After the private key operation
+  uint64_t        crypto_cpu;   // Thread CPU time (ns) of the private key
+                                // operation if enabled by kssl_measure_cpu
+  int             crypto_counted; // Set if crypto_counters is filled in
+  kssl_perf_sample crypto_counters; // Performance counters used by the
+                                // private key operation (see kssl_perf.h)
+} kssl_op_info;
+
+// Turn on measurement of the thread CPU time used by private key
+// operations (kssl_op_info.crypto_cpu). Off by default because reading
+// the thread CPU clock is a system call on most platforms.
+void kssl_measure_cpu(int enabled);
 
 // Allocate and populate a response to a keyless SSL request
 // using an opaque list of private keys response to be freed by caller
@@ -16,6 +42,16 @@ kssl_error_code kssl_operate(
     BYTE       **response,      // response to be freed by caller
     int         *response_len); // length of response
 
+// As kssl_operate but also fills in information about the request
+// for instrumentation. info may be NULL.
+kssl_error_code kssl_operate_ex(
+    kssl_header *header,        // pointer to the incoming header
+    BYTE        *payload,       // pointer to the incoming payload
+    pk_list      privates,      // reference to list of private keys
+    BYTE       **response,      // response to be freed by caller
+    int         *response_len,  // length of response
+    kssl_op_info *info);        // information about the request
+
 // Create a keyless SSL response message corresponding to an error
 // response to be freed by caller
 kssl_error_code kssl_error(
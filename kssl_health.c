@@ -0,0 +1,436 @@
+// kssl_health.c: plaintext health endpoint
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_loopmon.h"
+#include "kssl_health.h"
+#include "kssl_upgrade.h"
+
+// The longest request read from a client. Only the first line matters.
+
+#define HEALTH_MAX_REQUEST 1024
+
+// A client that has not sent a complete request after this many ms is
+// disconnected so that idle connections cannot pile up
+
+#define HEALTH_TIMEOUT 2000
+
+// Thresholds set by health_init
+
+static uint64_t lag_ns = 500000000ULL;
+static uint64_t max_queued = 1024;
+
+struct health_server_ {
+  uv_tcp_t tcp;             // Listener on addr (if tcp_active)
+  uv_pipe_t pipe;           // Listener on a Unix socket (if pipe_active)
+  int tcp_active;
+  int pipe_active;
+  int open;                 // Number of listeners not yet closed
+  char *path;               // Removed on close unless passed on
+  health_check_cb check;
+};
+
+typedef struct {
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  } handle;                 // Connection to the client
+  uv_timer_t timer;         // Disconnects a client that is too slow
+  uv_write_t write_req;
+  health_check_cb check;    // Copied so the server can close first
+  char request[HEALTH_MAX_REQUEST];
+  size_t request_len;
+  int open;                 // Number of handles not yet closed
+  int closing;
+  char header[128];         // HTTP status line and headers
+  metrics_buffer body;      // Response body
+} health_client;
+
+// health_init: set the thresholds at which a worker is degraded
+void health_init(unsigned int lag_ms, unsigned int queued)
+{
+  lag_ns = (uint64_t)lag_ms * 1000000;
+  max_queued = queued;
+}
+
+// health_check_workers: check each shard for a loop that is lagging or
+// has stopped measuring lag, and for responses piling up
+int health_check_workers(metrics_buffer *b, kssl_metrics *shards, int count)
+{
+  uint64_t now = uv_hrtime();
+  uint64_t measured, since;
+  int ready = 1;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    kssl_metrics *m = &shards[i];
+
+    // The loop monitor measures lag every KSSL_LOOPMON_INTERVAL ms. If
+    // it has not done so for much longer than that the loop is blocked
+    // now, which the last lag measured cannot show.
+
+    measured = m->loop_measured;
+    since = elapsed_ns(measured, now);
+    if (measured == 0) {
+      metrics_printf(b, "worker %d not started\n", i);
+      ready = 0;
+    } else if (since > lag_ns + KSSL_LOOPMON_INTERVAL * 1000000ULL) {
+      metrics_printf(b, "worker %d loop stalled for %llums\n", i,
+                     (unsigned long long)(since / 1000000));
+      ready = 0;
+    } else if (m->loop_lag > lag_ns) {
+      metrics_printf(b, "worker %d loop lag %llums\n", i,
+                     (unsigned long long)(m->loop_lag / 1000000));
+      ready = 0;
+    }
+
+    if (max_queued != 0 && m->queued > max_queued) {
+      metrics_printf(b, "worker %d has %llu responses queued\n", i,
+                     (unsigned long long)m->queued);
+      ready = 0;
+    }
+  }
+
+  return ready;
+}
+
+// health_client_close_cb: frees a client once its handles are closed
+static void health_client_close_cb(uv_handle_t *handle)
+{
+  health_client *client = (health_client *)handle->data;
+
+  client->open -= 1;
+  if (client->open == 0) {
+    free(client->body.data);
+    free(client);
+  }
+}
+
+// health_client_close: close a client's connection and timer
+static void health_client_close(health_client *client)
+{
+  if (client->closing) {
+    return;
+  }
+
+  client->closing = 1;
+  uv_close((uv_handle_t *)&client->timer, health_client_close_cb);
+  uv_close((uv_handle_t *)&client->handle, health_client_close_cb);
+}
+
+// health_write_cb: the response has been sent so close the connection
+static void health_write_cb(uv_write_t *req, int status)
+{
+  health_client_close((health_client *)req->data);
+}
+
+// health_respond: check health and answer the request read so far. An
+// HTTP request is answered with a status line, anything else with just
+// the body.
+static void health_respond(health_client *client)
+{
+  uv_buf_t bufs[2];
+  metrics_buffer reasons = {0};
+  int head = (strncmp(client->request, "HEAD ", 5) == 0);
+  int http = head || (strncmp(client->request, "GET ", 4) == 0);
+  int ready, n, rc;
+
+  uv_timer_stop(&client->timer);
+
+  ready = client->check(&reasons);
+  metrics_printf(&client->body, "%s\n%s", ready?"ready":"degraded",
+                 reasons.len?reasons.data:"");
+  free(reasons.data);
+
+  n = 0;
+  if (http) {
+    snprintf(client->header, sizeof(client->header),
+             "HTTP/1.0 %s\r\n"
+             "Content-Type: text/plain\r\n"
+             "Content-Length: %lu\r\n"
+             "Connection: close\r\n\r\n",
+             ready?"200 OK":"503 Service Unavailable",
+             (unsigned long)client->body.len);
+    bufs[n++] = uv_buf_init(client->header, strlen(client->header));
+  }
+  if (!head) {
+    bufs[n++] = uv_buf_init(client->body.data, client->body.len);
+  }
+
+  client->write_req.data = (void *)client;
+  rc = uv_write(&client->write_req, (uv_stream_t *)&client->handle, bufs,
+                n, health_write_cb);
+  if (rc != 0) {
+    write_log(1, "Failed to write health response: %s", error_string(rc));
+    health_client_close(client);
+  }
+}
+
+// health_timer_cb: the client took too long to send its request
+static void health_timer_cb(uv_timer_t *handle)
+{
+  health_client_close((health_client *)handle->data);
+}
+
+// health_alloc_cb: read directly into the client's request buffer
+static void health_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  health_client *client = (health_client *)handle->data;
+
+  buf->base = client->request + client->request_len;
+  buf->len = sizeof(client->request) - 1 - client->request_len;
+}
+
+// health_read_cb: wait for the end of the HTTP header, the end of the
+// first line of anything else or for the client to stop sending
+static void health_read_cb(uv_stream_t *stream, ssize_t nread,
+                           const uv_buf_t *buf)
+{
+  health_client *client = (health_client *)stream->data;
+  int complete;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    uv_read_stop(stream);
+    if (nread == UV_EOF) {
+      health_respond(client);
+    } else {
+      health_client_close(client);
+    }
+    return;
+  }
+
+  client->request_len += nread;
+  client->request[client->request_len] = '\0';
+
+  if (strncmp(client->request, "GET ", 4) == 0 ||
+      strncmp(client->request, "HEAD ", 5) == 0) {
+    complete = strstr(client->request, "\r\n\r\n") != NULL ||
+               strstr(client->request, "\n\n") != NULL;
+  } else {
+    complete = strchr(client->request, '\n') != NULL;
+  }
+
+  if (complete) {
+    uv_read_stop(stream);
+    health_respond(client);
+  } else if (client->request_len == sizeof(client->request) - 1) {
+    uv_read_stop(stream);
+    health_client_close(client);
+  }
+}
+
+// health_connection_cb: a client has connected to a listener
+static void health_connection_cb(uv_stream_t *listener, int status)
+{
+  health_server *server = (health_server *)listener->data;
+  health_client *client;
+  int rc;
+
+  if (status != 0) {
+    return;
+  }
+
+  client = (health_client *)calloc(1, sizeof(health_client));
+  if (client == NULL) {
+    write_log(1, "Memory allocation error");
+    return;
+  }
+
+  client->check = server->check;
+
+  if (listener->type == UV_TCP) {
+    rc = uv_tcp_init(listener->loop, &client->handle.tcp);
+  } else {
+    rc = uv_pipe_init(listener->loop, &client->handle.pipe, 0);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to create health connection: %s", error_string(rc));
+    free(client);
+    return;
+  }
+
+  client->handle.tcp.data = (void *)client;
+  client->open = 1;
+
+  rc = uv_timer_init(listener->loop, &client->timer);
+  if (rc != 0) {
+    write_log(1, "Failed to create health timer: %s", error_string(rc));
+    client->closing = 1;
+    uv_close((uv_handle_t *)&client->handle, health_client_close_cb);
+    return;
+  }
+
+  client->timer.data = (void *)client;
+  client->open = 2;
+
+  rc = uv_accept(listener, (uv_stream_t *)&client->handle);
+  if (rc == 0) {
+    rc = uv_timer_start(&client->timer, health_timer_cb, HEALTH_TIMEOUT, 0);
+  }
+  if (rc == 0) {
+    rc = uv_read_start((uv_stream_t *)&client->handle, health_alloc_cb,
+                       health_read_cb);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to accept health connection: %s", error_string(rc));
+    health_client_close(client);
+  }
+}
+
+// health_server_close_cb: frees the server once all listeners are
+// closed
+static void health_server_close_cb(uv_handle_t *handle)
+{
+  health_server *server = (health_server *)handle->data;
+
+  server->open -= 1;
+  if (server->open == 0) {
+    free(server);
+  }
+}
+
+// health_listen: start answering health checks on a TCP address and/or
+// Unix socket, bound here or inherited in fds
+health_server *health_listen(uv_loop_t *loop, const struct sockaddr_in *addr,
+                             const char *path, const int *fds,
+                             health_check_cb check)
+{
+  health_server *server;
+  int rc;
+
+  server = (health_server *)calloc(1, sizeof(health_server));
+  if (server == NULL) {
+    return NULL;
+  }
+
+  server->check = check;
+
+  if (addr != NULL) {
+    rc = uv_tcp_init(loop, &server->tcp);
+    if (rc == 0) {
+      server->tcp_active = 1;
+      server->open += 1;
+      server->tcp.data = (void *)server;
+      if (fds != NULL && fds[0] != -1) {
+        rc = uv_tcp_open(&server->tcp, fds[0]);
+      } else {
+        rc = uv_tcp_bind(&server->tcp, (const struct sockaddr *)addr, 0);
+      }
+    }
+    if (rc == 0) {
+      rc = uv_listen((uv_stream_t *)&server->tcp, SOMAXCONN,
+                     health_connection_cb);
+    }
+    if (rc != 0) {
+      write_log(1, "Failed to listen for health checks on port %d: %s",
+                ntohs(addr->sin_port), error_string(rc));
+      health_close(server);
+      return NULL;
+    }
+  }
+
+  if (path != NULL) {
+    int inherited = (fds != NULL && fds[1] != -1);
+
+    // A socket left behind by a previous run would stop the bind from
+    // succeeding
+
+    if (!inherited) {
+      remove(path);
+    }
+
+    rc = uv_pipe_init(loop, &server->pipe, 0);
+    if (rc == 0) {
+      server->pipe_active = 1;
+      server->open += 1;
+      server->pipe.data = (void *)server;
+      if (inherited) {
+        rc = uv_pipe_open(&server->pipe, fds[1]);
+      } else {
+        rc = upgrade_pipe_bind(&server->pipe, path);
+      }
+    }
+    if (rc == 0) {
+      server->path = (char *)malloc(strlen(path)+1);
+      if (server->path != NULL) {
+        strcpy(server->path, path);
+      }
+      rc = uv_listen((uv_stream_t *)&server->pipe, SOMAXCONN,
+                     health_connection_cb);
+    }
+    if (rc != 0) {
+      write_log(1, "Failed to listen for health checks on %s: %s", path,
+                error_string(rc));
+      health_close(server);
+      return NULL;
+    }
+  }
+
+  return server;
+}
+
+// health_close: stop listening. Clients already connected are answered.
+void health_close(health_server *server)
+{
+  if (server == NULL) {
+    return;
+  }
+
+  if (server->open == 0) {
+    free(server);
+    return;
+  }
+
+  if (server->path != NULL) {
+    remove(server->path);
+    free(server->path);
+    server->path = NULL;
+  }
+
+  if (server->tcp_active) {
+    uv_close((uv_handle_t *)&server->tcp, health_server_close_cb);
+  }
+  if (server->pipe_active) {
+    uv_close((uv_handle_t *)&server->pipe, health_server_close_cb);
+  }
+}
+
+// health_fds: get the listening sockets to pass to a new process
+void health_fds(health_server *server, int *fds)
+{
+  fds[0] = -1;
+  fds[1] = -1;
+  if (server == NULL) {
+    return;
+  }
+
+#if !PLATFORM_WINDOWS
+  if (server->tcp_active) {
+    fds[0] = server->tcp.io_watcher.fd;
+  }
+  if (server->pipe_active) {
+    fds[1] = server->pipe.io_watcher.fd;
+  }
+#endif
+}
+
+// health_release_path: leave the Unix socket for the new process to remove
+void health_release_path(health_server *server)
+{
+  if (server == NULL) {
+    return;
+  }
+
+  free(server->path);
+  server->path = NULL;
+}
@@ -0,0 +1,65 @@
+// kssl_health.h: plaintext health endpoint
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_HEALTH
+#define INCLUDED_KSSL_HEALTH 1
+
+#include <uv.h>
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// The health endpoint lets a load balancer or orchestrator check
+// keyless without a TLS handshake or a key operation. It is served by
+// the main thread and answers from state the workers already publish in
+// their metrics shards, so a worker whose loop is stuck is reported
+// rather than being needed to answer.
+//
+// A client that sends an HTTP GET or HEAD gets 200 if keyless is ready
+// and 503 if it is degraded. Any other line (or just closing its side of
+// the connection) gets the body alone. The body is "ready" or
+// "degraded" on the first line followed by one line per reason.
+
+// Called to check health. Appends a line to b for each reason keyless
+// is degraded and returns 1 if it is ready, 0 if not.
+
+typedef int (*health_check_cb)(metrics_buffer *b);
+
+// Opaque handle for a listening health endpoint
+
+typedef struct health_server_ health_server;
+
+// health_init: set the loop lag (in ms) and the number of responses
+// waiting to be written in a worker above which it is degraded. 0
+// disables the queue check.
+void health_init(unsigned int lag_ms, unsigned int queued);
+
+// health_check_workers: check the count shards against the thresholds
+// set by health_init, appending a line to b for each problem. Returns 1
+// if all the workers are healthy.
+int health_check_workers(metrics_buffer *b, kssl_metrics *shards, int count);
+
+// health_listen: start answering health checks on addr (if not NULL)
+// and/or the Unix socket at path (if not NULL). If fds is not NULL then
+// fds[0] and fds[1] are listening sockets for addr and path passed from
+// another process by health_fds, used instead of binding unless they are
+// -1. Returns NULL on failure.
+health_server *health_listen(uv_loop_t *loop, const struct sockaddr_in *addr,
+                             const char *path, const int *fds,
+                             health_check_cb check);
+
+// health_close: stop listening, remove the Unix socket and free a
+// health_server once its handles are closed
+void health_close(health_server *server);
+
+// health_fds: store the listening sockets for the address and path of
+// server (or -1) in fds[0] and fds[1] to pass to another process
+void health_fds(health_server *server, int *fds);
+
+// health_release_path: once the process given the sockets by health_fds
+// is serving, stop health_close removing the Unix socket's path, which
+// that process now owns
+void health_release_path(health_server *server);
+
+#endif // INCLUDED_KSSL_HEALTH
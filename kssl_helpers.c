@@ -498,53 +498,48 @@ const char *errstring(BYTE err) {
   return "UNKNOWN";
 }
 
-static void print_ip(kssl_operation *op, char *ip_string) {
-  if (op == NULL) return;
-  if (op->is_ip_set) {
-    // IPv4 printing
-    if (op->ip_len == 4) {
-      struct in_addr ip;
-      memcpy((void *)&ip.s_addr, op->ip, 4);
-      PRINT_IP(AF_INET, &ip, ip_string, INET_ADDRSTRLEN);
-    }
-    if (op->ip_len == 16) {
-      struct in6_addr ip;
-      memcpy((void *)ip.s6_addr, op->ip, 16);
-      PRINT_IP(AF_INET6, &ip, ip_string, INET6_ADDRSTRLEN);
-    }
+// print_ip: format an IPv4 (ip_len 4) or IPv6 (ip_len 16) address into
+// ip_string which must have room for INET6_ADDRSTRLEN bytes
+void print_ip(BYTE *ip, int ip_len, char *ip_string) {
+  // IPv4 printing
+  if (ip_len == 4) {
+    struct in_addr addr;
+    memcpy((void *)&addr.s_addr, ip, 4);
+    PRINT_IP(AF_INET, &addr, ip_string, INET_ADDRSTRLEN);
+  }
+  if (ip_len == 16) {
+    struct in6_addr addr;
+    memcpy((void *)addr.s6_addr, ip, 16);
+    PRINT_IP(AF_INET6, &addr, ip_string, INET6_ADDRSTRLEN);
   }
 }
 
-// log_operation: write out a KSSL operation to the log
-void log_operation(kssl_header *header, kssl_operation *op) {
-  char ip_string[INET6_ADDRSTRLEN] = {0};
-
-  // The \n at the end of the ctime return is chopped off here.
-
-  time_t now = time(NULL); 
-  char nowstring[32]; // ctime_r documentation says there must be
-                      // room here for 26 bytes.
-  ctime_r(&now, &nowstring[0]);
+// thread_cpu_ns: returns the CPU time used by the calling thread in
+// nanoseconds or 0 if it is not available
+uint64_t thread_cpu_ns(void) {
+#if PLATFORM_WINDOWS
+  FILETIME created, exited, kernel, user;
+  ULARGE_INTEGER k, u;
 
-  // Strip the trailing \n
+  if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel,
+                      &user)) {
+    return 0;
+  }
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
 
-  nowstring[strlen(nowstring)-1] = '\0';
+  // FILETIME is in units of 100ns
 
-  print_ip(op, ip_string);
-  
-  write_log(0, "version:%d.%d, id:%d, op:%s, ip <%s>, time %s",
-    header->version_maj, header->version_min, header->id,
-    opstring(op->opcode), ip_string, nowstring);
-}
+  return (k.QuadPart + u.QuadPart) * 100;
+#else
+  struct timespec ts;
 
-// log_error: log an error of the operation
-void log_error(DWORD id, BYTE code) {
-  time_t now = time(NULL); 
-  char nowstring[32]; // ctime_r documentation says there must be
-                      // room here for 26 bytes.
-  ctime_r(&now, &nowstring[0]);
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
 
-  write_log(1, "id:%d, error:%s, time:%s",
-    id, errstring(code), nowstring);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
 }
-
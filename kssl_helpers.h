@@ -14,6 +14,26 @@
 #define PLATFORM_WINDOWS 0
 #endif
 
+// Storage class for variables that have a separate copy in each thread
+
+#ifdef _MSC_VER
+#define KSSL_THREAD_LOCAL __declspec(thread)
+#else
+#define KSSL_THREAD_LOCAL __thread
+#endif
+
+// Loads and stores used to pass data between threads without locks. On
+// MSVC volatile accesses have acquire and release semantics. These are
+// only used on unsigned int.
+
+#ifdef _MSC_VER
+#define KSSL_LOAD_ACQUIRE(p) (*(volatile unsigned int *)(p))
+#define KSSL_STORE_RELEASE(p, v) (*(volatile unsigned int *)(p) = (v))
+#else
+#define KSSL_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define KSSL_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
 // Helper macros for known sizes of V1 items
 #define KSSL_OPCODE_ITEM_SIZE (KSSL_ITEM_HEADER_SIZE + 1)
 #define KSSL_ERROR_ITEM_SIZE (KSSL_ITEM_HEADER_SIZE + 1)
@@ -103,13 +123,25 @@ kssl_error_code add_padding(WORD size,      // Length of padding
 // Log a summary of the operation
 void log_operation(kssl_header *header, kssl_operation *op);
 
+// Write the printable form of an IPv4 (ip_len 4) or IPv6 (ip_len 16)
+// address into ip_string which must have room for INET6_ADDRSTRLEN
+// bytes. Other lengths leave ip_string unchanged.
+void print_ip(BYTE *ip, int ip_len, char *ip_string);
+
 // Log an error of the operation
 void log_error(DWORD id, BYTE code);
 
 // Map an opcode to the corresponding string
 const char *opstring(BYTE op);
 
+// Map a KSSL error code to the corresponding string
+const char *errstring(BYTE err);
+
 // Map an error code to a string
 const char * error_string(int e);
 
+// Returns the CPU time used by the calling thread in nanoseconds (0 if
+// not available)
+uint64_t thread_cpu_ns(void);
+
 #endif // INCLUDED_KSSL_HELPERS
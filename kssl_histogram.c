@@ -0,0 +1,117 @@
+// kssl_histogram.c: log-linear latency histograms
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include "kssl_histogram.h"
+
+// msb: returns the index of the most significant set bit in a non-zero
+// value
+static int msb(uint64_t v)
+{
+#if __GNUC__
+  return 63 - __builtin_clzll(v);
+#else
+  int i = 0;
+  while (v >>= 1) {
+    i++;
+  }
+  return i;
+#endif
+}
+
+// histogram_index: returns the bucket index for a value. Small values map
+// directly to a bucket, larger values map to one of KSSL_HIST_SUB_BUCKETS
+// buckets within their power of two.
+int histogram_index(uint64_t value)
+{
+  int shift;
+
+  if (value < KSSL_HIST_SUB_BUCKETS) {
+    return (int)value;
+  }
+
+  if (value >> KSSL_HIST_MAX_BITS) {
+    return KSSL_HIST_BUCKETS - 1;
+  }
+
+  shift = msb(value) - KSSL_HIST_SUB_BITS;
+
+  return ((shift + 1) << KSSL_HIST_SUB_BITS) +
+         (int)((value >> shift) & (KSSL_HIST_SUB_BUCKETS - 1));
+}
+
+// histogram_lower: returns the smallest value that falls into a bucket
+uint64_t histogram_lower(int index)
+{
+  int shift;
+
+  if (index < KSSL_HIST_SUB_BUCKETS) {
+    return (uint64_t)index;
+  }
+
+  shift = (index >> KSSL_HIST_SUB_BITS) - 1;
+
+  return (uint64_t)(KSSL_HIST_SUB_BUCKETS +
+                    (index & (KSSL_HIST_SUB_BUCKETS - 1))) << shift;
+}
+
+// histogram_upper: returns the largest value that falls into a bucket
+uint64_t histogram_upper(int index)
+{
+  if (index < KSSL_HIST_SUB_BUCKETS) {
+    return (uint64_t)index;
+  }
+
+  return histogram_lower(index) +
+         ((uint64_t)1 << ((index >> KSSL_HIST_SUB_BITS) - 1)) - 1;
+}
+
+// histogram_record: add a single value to a histogram
+void histogram_record(kssl_histogram *h, uint64_t value)
+{
+  h->buckets[histogram_index(value)] += 1;
+  h->count += 1;
+  h->sum += value;
+}
+
+// histogram_merge: add all the values in from into into
+void histogram_merge(kssl_histogram *into, const kssl_histogram *from)
+{
+  int i;
+
+  for (i = 0; i < KSSL_HIST_BUCKETS; i++) {
+    into->buckets[i] += from->buckets[i];
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+}
+
+// histogram_percentile: returns an estimate of the value at percentile
+// p. The estimate is the midpoint of the bucket containing the value.
+uint64_t histogram_percentile(const kssl_histogram *h, double p)
+{
+  uint64_t target;
+  uint64_t seen = 0;
+  int i;
+
+  if (h->count == 0) {
+    return 0;
+  }
+
+  target = (uint64_t)((p / 100.0) * (double)h->count + 0.5);
+  if (target < 1) {
+    target = 1;
+  }
+  if (target > h->count) {
+    target = h->count;
+  }
+
+  for (i = 0; i < KSSL_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= target) {
+      return histogram_lower(i) + (histogram_upper(i) - histogram_lower(i)) / 2;
+    }
+  }
+
+  return histogram_upper(KSSL_HIST_BUCKETS - 1);
+}
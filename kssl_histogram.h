@@ -0,0 +1,52 @@
+// kssl_histogram.h: log-linear latency histograms
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_HISTOGRAM
+#define INCLUDED_KSSL_HISTOGRAM 1
+
+#include "kssl.h"
+
+// Values (nanoseconds) are bucketed HDR-style: the first
+// KSSL_HIST_SUB_BUCKETS values each get their own bucket and every
+// power of two above that is split into KSSL_HIST_SUB_BUCKETS linear
+// buckets. With 3 bits of sub-bucket the relative error of any bucket
+// is at most 12.5%.
+
+#define KSSL_HIST_SUB_BITS 3
+#define KSSL_HIST_SUB_BUCKETS (1 << KSSL_HIST_SUB_BITS)
+
+// Values of 2^KSSL_HIST_MAX_BITS nanoseconds (about 18 minutes) or more
+// are recorded in the last bucket
+
+#define KSSL_HIST_MAX_BITS 40
+#define KSSL_HIST_BUCKETS ((KSSL_HIST_MAX_BITS - KSSL_HIST_SUB_BITS + 1) * \
+                           KSSL_HIST_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t count;                      // Number of recorded values
+  uint64_t sum;                        // Sum of recorded values
+  uint64_t buckets[KSSL_HIST_BUCKETS]; // Per bucket counts
+} kssl_histogram;
+
+// histogram_index: returns the bucket index for a value
+int histogram_index(uint64_t value);
+
+// histogram_lower: returns the smallest value that falls into a bucket
+uint64_t histogram_lower(int index);
+
+// histogram_upper: returns the largest value that falls into a bucket
+uint64_t histogram_upper(int index);
+
+// histogram_record: add a single value to a histogram. This is the
+// only function that should be called on the request path.
+void histogram_record(kssl_histogram *h, uint64_t value);
+
+// histogram_merge: add all the values in from into into
+void histogram_merge(kssl_histogram *into, const kssl_histogram *from);
+
+// histogram_percentile: returns an estimate of the value at percentile p
+// (0 to 100). Returns 0 for an empty histogram.
+uint64_t histogram_percentile(const kssl_histogram *h, double p);
+
+#endif // INCLUDED_KSSL_HISTOGRAM
@@ -0,0 +1,224 @@
+// kssl_locks.c: OpenSSL locking callbacks and lock contention profiling
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include <openssl/crypto.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_locks.h"
+
+// Profile of a single lock. The counters for a lock are only updated
+// while that lock is held so they need no synchronization of their own.
+// Each is padded to a cache line so that updating the counters of one
+// lock does not slow down threads using its neighbours.
+
+typedef struct {
+  uint64_t acquisitions; // Times the lock was taken
+  uint64_t contended;    // Times the lock was already held
+  uint64_t wait;         // Total ns spent waiting for the lock
+  char pad[40];
+} lock_profile;
+
+static uv_mutex_t *locks = NULL;
+static lock_profile *profiles = NULL;
+static int lock_count = 0;
+
+// thread_id_cb: used by OpenSSL to get the currently running thread's
+// ID
+static unsigned long thread_id_cb(void)
+{
+  return (unsigned long)uv_thread_self();
+}
+
+// locking_cb: used by OpenSSL to lock its internal data
+static void locking_cb(int mode, int type, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK) {
+    uv_mutex_lock(&locks[type]);
+  } else {
+    uv_mutex_unlock(&locks[type]);
+  }
+}
+
+// profiling_locking_cb: as locking_cb but records the lock profile. An
+// uncontended lock costs one trylock; only contended locks are timed.
+static void profiling_locking_cb(int mode, int type, const char *file,
+                                 int line)
+{
+  if (mode & CRYPTO_LOCK) {
+    if (uv_mutex_trylock(&locks[type]) == 0) {
+      profiles[type].acquisitions += 1;
+    } else {
+      uint64_t start = uv_hrtime();
+
+      uv_mutex_lock(&locks[type]);
+      profiles[type].wait += uv_hrtime() - start;
+      profiles[type].contended += 1;
+      profiles[type].acquisitions += 1;
+    }
+  } else {
+    uv_mutex_unlock(&locks[type]);
+  }
+}
+
+// locks_init: allocate mutexes and install the callbacks
+int locks_init(int profile)
+{
+  int i;
+
+  lock_count = CRYPTO_num_locks();
+  locks = (uv_mutex_t *)malloc(lock_count * sizeof(uv_mutex_t));
+  if (locks == NULL) {
+    return 1;
+  }
+
+  if (profile) {
+    profiles = (lock_profile *)calloc(lock_count, sizeof(lock_profile));
+    if (profiles == NULL) {
+      free(locks);
+      locks = NULL;
+      return 1;
+    }
+  }
+
+  for (i = 0; i < lock_count; i++) {
+    if (uv_mutex_init(&locks[i]) != 0) {
+      while (i-- > 0) {
+        uv_mutex_destroy(&locks[i]);
+      }
+      free(locks);
+      free(profiles);
+      locks = NULL;
+      profiles = NULL;
+      return 1;
+    }
+  }
+
+  CRYPTO_set_id_callback(thread_id_cb);
+  CRYPTO_set_locking_callback(profile?profiling_locking_cb:locking_cb);
+
+  return 0;
+}
+
+// locks_cleanup: remove the callbacks and free the mutexes
+void locks_cleanup(void)
+{
+  int i;
+
+  if (locks == NULL) {
+    return;
+  }
+
+  CRYPTO_set_locking_callback(NULL);
+  CRYPTO_set_id_callback(NULL);
+
+  for (i = 0; i < lock_count; i++) {
+    uv_mutex_destroy(&locks[i]);
+  }
+  free(locks);
+  free(profiles);
+  locks = NULL;
+  profiles = NULL;
+}
+
+// lock_name: returns the OpenSSL name of a lock
+static const char *lock_name(int type)
+{
+  const char *name = CRYPTO_get_lock_name(type);
+
+  return (name != NULL)?name:"unknown";
+}
+
+// locks_render: append lock profile counters to a metrics response
+void locks_render(metrics_buffer *b)
+{
+  int i;
+
+  if (profiles == NULL) {
+    return;
+  }
+
+  metrics_printf(b, "# HELP keyless_openssl_lock_acquisitions_total OpenSSL lock acquisitions\n");
+  metrics_printf(b, "# TYPE keyless_openssl_lock_acquisitions_total counter\n");
+  for (i = 0; i < lock_count; i++) {
+    if (profiles[i].acquisitions != 0) {
+      metrics_printf(b, "keyless_openssl_lock_acquisitions_total{lock=\"%s\"} %llu\n",
+                     lock_name(i),
+                     (unsigned long long)profiles[i].acquisitions);
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_openssl_lock_contended_total OpenSSL lock acquisitions that had to wait\n");
+  metrics_printf(b, "# TYPE keyless_openssl_lock_contended_total counter\n");
+  for (i = 0; i < lock_count; i++) {
+    if (profiles[i].acquisitions != 0) {
+      metrics_printf(b, "keyless_openssl_lock_contended_total{lock=\"%s\"} %llu\n",
+                     lock_name(i),
+                     (unsigned long long)profiles[i].contended);
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_openssl_lock_wait_seconds_total Time spent waiting for OpenSSL locks\n");
+  metrics_printf(b, "# TYPE keyless_openssl_lock_wait_seconds_total counter\n");
+  for (i = 0; i < lock_count; i++) {
+    if (profiles[i].acquisitions != 0) {
+      metrics_printf(b, "keyless_openssl_lock_wait_seconds_total{lock=\"%s\"} %.9f\n",
+                     lock_name(i), (double)profiles[i].wait / 1e9);
+    }
+  }
+}
+
+// compare_wait: qsort comparator putting the most waited for lock first
+static int compare_wait(const void *a, const void *b)
+{
+  uint64_t wa = profiles[*(const int *)a].wait;
+  uint64_t wb = profiles[*(const int *)b].wait;
+
+  return (wa < wb)?1:((wa > wb)?-1:0);
+}
+
+// locks_dump: log the lock profile
+void locks_dump(void)
+{
+  int *order;
+  int i;
+
+  if (profiles == NULL) {
+    return;
+  }
+
+  order = (int *)malloc(lock_count * sizeof(int));
+  if (order == NULL) {
+    write_log(1, "Failed to allocate memory for lock profile");
+    return;
+  }
+  for (i = 0; i < lock_count; i++) {
+    order[i] = i;
+  }
+  qsort(order, lock_count, sizeof(int), compare_wait);
+
+  write_log(1, "OpenSSL lock profile (lock, acquisitions, contended, "
+            "wait):");
+  for (i = 0; i < lock_count; i++) {
+    lock_profile *p = &profiles[order[i]];
+
+    if (p->acquisitions == 0) {
+      continue;
+    }
+
+    write_log(1, "lock:%s, acquisitions:%llu, contended:%llu (%.2f%%), "
+              "wait:%.3fms", lock_name(order[i]),
+              (unsigned long long)p->acquisitions,
+              (unsigned long long)p->contended,
+              100.0 * (double)p->contended / (double)p->acquisitions,
+              (double)p->wait / 1e6);
+  }
+
+  free(order);
+}
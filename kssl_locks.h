@@ -0,0 +1,29 @@
+// kssl_locks.h: OpenSSL locking callbacks and lock contention profiling
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_LOCKS
+#define INCLUDED_KSSL_LOCKS 1
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// locks_init: allocate the CRYPTO_num_locks() mutexes that OpenSSL needs
+// when used from multiple threads and install the locking and thread ID
+// callbacks. If profile is set every lock acquisition is counted and the
+// time spent waiting for contended locks is measured. Returns 0 on
+// success.
+int locks_init(int profile);
+
+// locks_cleanup: remove the callbacks and free the mutexes
+void locks_cleanup(void);
+
+// locks_render: append lock profile counters to a metrics response. Does
+// nothing if profiling is not enabled.
+void locks_render(metrics_buffer *b);
+
+// locks_dump: log the lock profile, one line per lock that has been used,
+// most waited for first. Does nothing if profiling is not enabled.
+void locks_dump(void);
+
+#endif // INCLUDED_KSSL_LOCKS
@@ -6,69 +6,619 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "kssl_log.h"
 
-#if PLATFORM_WINDOWS == 0
+#if PLATFORM_WINDOWS
+#include <ws2tcpip.h>
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 46
+#endif
+#else
 #include <syslog.h>
+#include <arpa/inet.h>
 #endif
 
 int silent = 0;
 int verbose = 0;
+int log_sample = 1;
 
 #if PLATFORM_WINDOWS == 0
 int use_syslog = 0;
 #endif
 
-// write_log: call to log a message. If syslog is not enabled then error
-// message are written to STDERR, other messages are written to STDOUT.  If
-// syslog is enabled then error messages are sent with LOG_ERR, other messages
-// with LOG_INFO. syslog messages are sent with the LOG_USER facility.
-void write_log(int e,                // If set this is an error message
-               const char *fmt, ...) // printf style
-{
-  // Note the use of [] here. When syslogging, syslog will strip them off and
-  // create a message using that as the name of the program.
+// Threads that call log_thread_init do not write log lines themselves.
+// Instead they put fixed size binary records into a single producer,
+// single consumer ring that is drained by a background thread which does
+// all the formatting and I/O. Access log records (the common case) are
+// stored unformatted and only turned into text by the background thread.
 
-  char * name = "[kssl_server] ";
-  char * newfmt;
-  va_list l;
+#define LOG_RECORD_TEXT   0 // Preformatted text from write_log
+#define LOG_RECORD_ACCESS 1 // An operation (see log_operation)
+#define LOG_RECORD_ERROR  2 // An error response (see log_error)
+
+#define LOG_TEXT_SIZE 480
+
+typedef struct {
+  BYTE type;           // One of LOG_RECORD_*
+  BYTE e;              // Set if this is an error message
+  BYTE version_maj;    // Access: protocol version
+  BYTE version_min;
+  BYTE opcode;         // Access: opcode requested
+  BYTE code;           // Error: kssl_error_code sent
+  BYTE ip_len;         // Access: length of ip (0, 4 or 16)
+  BYTE ip[16];         // Access: client IP address
+  DWORD id;            // Access and error: request ID
+  int64_t time;        // Wall clock time in milliseconds
+  char text[LOG_TEXT_SIZE]; // Text: the formatted message
+} log_record;
+
+// The number of records in a ring. Must be a power of two.
+
+#define LOG_RING_SIZE 1024
+
+// Binary records (see log_binary) are written at the request rate so each
+// channel has a ring of its own holding fixed size records. They are
+// copied once into the ring and handed to the channel's writer in place,
+// and cannot be lost behind (or crowd out) log lines. The number of
+// records in a binary ring must be a power of two.
+
+#define LOG_BINARY_RING_SIZE 4096
+
+typedef struct {
+  BYTE data[LOG_BINARY_SIZE];
+} log_binary_record;
+
+typedef struct {
+  unsigned int head;      // Next record to write, written by producer
+  char pad1[60];
+  unsigned int tail;      // Next record to read, written by consumer
+  unsigned int reported;  // Value of dropped last reported by consumer
+  char pad2[56];
+  unsigned int dropped;   // Records lost because the ring was full
+  log_binary_record *records; // NULL if the channel had no writer when
+                              // the ring was created
+} log_binary_ring;
+
+// The head and tail are kept on separate cache lines so that the
+// producer and consumer do not contend.
+
+typedef struct {
+  unsigned int head;      // Next record to write, written by producer
+  char pad1[60];
+  unsigned int tail;      // Next record to read, written by consumer
+  unsigned int reported;  // Value of dropped last reported by consumer
+  char pad2[56];
+  unsigned int dropped;   // Records lost because the ring was full
+  int countdown;          // Access records until the next sampled one
+  uv_loop_t *loop;        // Loop whose cached time is used
+  int64_t offset;         // Added to uv_now() to give wall clock time
+  log_record records[LOG_RING_SIZE];
+  log_binary_ring binary[LOG_BINARY_CHANNELS];
+} log_ring;
+
+#define LOG_MAX_RINGS 64
+
+static log_ring *rings[LOG_MAX_RINGS];
+static unsigned int ring_count = 0;
+static uv_mutex_t rings_lock;
+
+static KSSL_THREAD_LOCAL log_ring *thread_ring = NULL;
+
+// State of the background thread. log_running is only changed while no
+// other thread is logging (at start up and shut down).
+
+static int log_running = 0;
+static int log_stopping = 0;
+static uv_thread_t log_thread;
+static uv_mutex_t log_lock;
+static uv_cond_t log_cond;
+
+// Used for sampling access records on threads without a ring
+
+static int sync_countdown = 0;
+
+// Set by log_binary_writer
+
+static log_binary_cb binary_write[LOG_BINARY_CHANNELS];
+static log_tick_cb binary_tick[LOG_BINARY_CHANNELS];
 
+// Binary records dropped by rings that have been freed by log_stop
+
+static uint64_t binary_dropped[LOG_BINARY_CHANNELS];
+
+static const char *binary_names[LOG_BINARY_CHANNELS] = {
+  "access", "capture"
+};
+
+// log_enabled: returns 1 if a message at this level would be written
+int log_enabled(int e)
+{
 #if PLATFORM_WINDOWS == 0
   if (silent && !use_syslog) {
-	  return;
+    return 0;
   }
 #endif
   if (!e && !verbose) {
-	  return;
+    return 0;
   }
 
-  // +1 for the terminating 0
-  // +1 for the \n we append in non-syslog mode
-
-  newfmt = (char *)malloc(strlen(fmt)+1+strlen(name)+1);
-  if (newfmt == NULL) {
-    return;
-  }
+  return 1;
+}
 
-  strcpy(newfmt, name);
-  strcat(newfmt, fmt);
+// emit_line: write a single formatted line. If syslog is not enabled
+// then error message are written to STDERR, other messages are written
+// to STDOUT. If syslog is enabled then error messages are sent with
+// LOG_ERR, other messages with LOG_INFO. syslog messages are sent with
+// the LOG_USER facility.
+static void emit_line(int e, const char *line)
+{
+  // Note the use of [] here. When syslogging, syslog will strip them off
+  // and create a message using that as the name of the program.
 
-  va_start(l, fmt);
+  const char *name = "[kssl_server] ";
 
-  // Note the syntax abuse below. Be careful to look at the dandling 
+  // Note the syntax abuse below. Be careful to look at the dandling
   // } else
 
 #if PLATFORM_WINDOWS == 0
   if (use_syslog) {
-    vsyslog(LOG_USER | (e?LOG_ERR:LOG_INFO), newfmt, l);
+    syslog(LOG_USER | (e?LOG_ERR:LOG_INFO), "%s%s", name, line);
   } else
 #endif
   {
-    strcat(newfmt, "\n");
-    vfprintf(e?stderr:stdout, newfmt, l);
+    fprintf(e?stderr:stdout, "%s%s\n", name, line);
+  }
+}
+
+// log_wall_time: returns the current wall clock time in milliseconds
+// using the thread's loop time if it has a ring
+int64_t log_wall_time(void)
+{
+  if (thread_ring != NULL) {
+    return thread_ring->offset + (int64_t)uv_now(thread_ring->loop);
+  }
+
+  return (int64_t)time(NULL) * 1000;
+}
+
+// reserve: returns the next free record in the calling thread's ring or
+// NULL if the ring is full (the record is counted as dropped). The
+// record is not visible to the consumer until commit is called.
+static log_record *reserve(void)
+{
+  log_ring *ring = thread_ring;
+  unsigned int tail = KSSL_LOAD_ACQUIRE(&ring->tail);
+
+  if (ring->head - tail == LOG_RING_SIZE) {
+    ring->dropped += 1;
+    return NULL;
+  }
+
+  return &ring->records[ring->head & (LOG_RING_SIZE - 1)];
+}
+
+// commit: publish the record returned by reserve
+static void commit(void)
+{
+  KSSL_STORE_RELEASE(&thread_ring->head, thread_ring->head + 1);
+}
+
+// format_record: turn a record into a log line and write it
+static void format_record(log_record *r)
+{
+  char line[LOG_TEXT_SIZE + 64];
+  char nowstring[32]; // ctime_r documentation says there must be
+                      // room here for 26 bytes.
+  time_t now = (time_t)(r->time / 1000);
+
+  if (r->type == LOG_RECORD_TEXT) {
+    emit_line(r->e, r->text);
+    return;
+  }
+
+  ctime_r(&now, &nowstring[0]);
+
+  // Strip the trailing \n
+
+  nowstring[strlen(nowstring)-1] = '\0';
+
+  if (r->type == LOG_RECORD_ACCESS) {
+    char ip_string[INET6_ADDRSTRLEN] = {0};
+
+    print_ip(r->ip, r->ip_len, ip_string);
+
+    snprintf(line, sizeof(line),
+             "version:%d.%d, id:%d, op:%s, ip <%s>, time %s",
+             r->version_maj, r->version_min, r->id, opstring(r->opcode),
+             ip_string, nowstring);
+  } else {
+    snprintf(line, sizeof(line), "id:%d, error:%s, time:%s",
+             r->id, errstring(r->code), nowstring);
+  }
+
+  emit_line(r->e, line);
+}
+
+// drain_binary: pass every record waiting in a binary ring to the
+// channel's writer. Records are passed in runs that are contiguous in the
+// ring.
+static void drain_binary(log_binary_ring *ring, int channel)
+{
+  unsigned int head = KSSL_LOAD_ACQUIRE(&ring->head);
+  unsigned int dropped = ring->dropped;
+
+  while (ring->tail != head) {
+    unsigned int at = ring->tail & (LOG_BINARY_RING_SIZE - 1);
+    unsigned int run = head - ring->tail;
+
+    if (run > LOG_BINARY_RING_SIZE - at) {
+      run = LOG_BINARY_RING_SIZE - at;
+    }
+
+    binary_write[channel](&ring->records[at], (int)run);
+    KSSL_STORE_RELEASE(&ring->tail, ring->tail + run);
+  }
+
+  if (dropped != ring->reported) {
+    char line[80];
+
+    snprintf(line, sizeof(line),
+             "Binary %s queue full, dropped %u records",
+             binary_names[channel], dropped - ring->reported);
+    emit_line(1, line);
+    ring->reported = dropped;
+  }
+}
+
+// drain: format and write every record waiting in every ring. Only
+// called by the background thread (or by log_stop once it has exited).
+static void drain(void)
+{
+  unsigned int count = KSSL_LOAD_ACQUIRE(&ring_count);
+  unsigned int i;
+  int j;
+
+  for (i = 0; i < count; i++) {
+    log_ring *ring = rings[i];
+    unsigned int head = KSSL_LOAD_ACQUIRE(&ring->head);
+    unsigned int dropped = ring->dropped;
+
+    while (ring->tail != head) {
+      format_record(&ring->records[ring->tail & (LOG_RING_SIZE - 1)]);
+      KSSL_STORE_RELEASE(&ring->tail, ring->tail + 1);
+    }
+
+    if (dropped != ring->reported) {
+      char line[64];
+
+      snprintf(line, sizeof(line), "Log queue full, dropped %u log lines",
+               dropped - ring->reported);
+      emit_line(1, line);
+      ring->reported = dropped;
+    }
+
+    for (j = 0; j < LOG_BINARY_CHANNELS; j++) {
+      if (ring->binary[j].records != NULL && binary_write[j] != NULL) {
+        drain_binary(&ring->binary[j], j);
+      }
+    }
+  }
+
+  for (j = 0; j < LOG_BINARY_CHANNELS; j++) {
+    if (binary_tick[j] != NULL) {
+      binary_tick[j]();
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+}
+
+// log_thread_entry: body of the background thread. Wakes up every 10ms
+// to drain the rings. Producers never signal so that logging costs them
+// no system calls.
+static void log_thread_entry(void *data)
+{
+  uv_mutex_lock(&log_lock);
+  while (!log_stopping) {
+    uv_mutex_unlock(&log_lock);
+    drain();
+    uv_mutex_lock(&log_lock);
+    if (!log_stopping) {
+      uv_cond_timedwait(&log_cond, &log_lock, 10 * 1000000);
+    }
+  }
+  uv_mutex_unlock(&log_lock);
+}
+
+// log_start: start the background log thread
+int log_start(void)
+{
+  if (uv_mutex_init(&rings_lock) != 0) {
+    return 1;
+  }
+  if (uv_mutex_init(&log_lock) != 0) {
+    uv_mutex_destroy(&rings_lock);
+    return 1;
+  }
+  if (uv_cond_init(&log_cond) != 0) {
+    uv_mutex_destroy(&log_lock);
+    uv_mutex_destroy(&rings_lock);
+    return 1;
+  }
+
+  log_stopping = 0;
+  if (uv_thread_create(&log_thread, log_thread_entry, NULL) != 0) {
+    uv_cond_destroy(&log_cond);
+    uv_mutex_destroy(&log_lock);
+    uv_mutex_destroy(&rings_lock);
+    return 1;
+  }
+
+  log_running = 1;
+  return 0;
+}
+
+// log_stop: write any queued log lines and stop the background thread.
+// Must only be called once every thread with a ring has stopped logging.
+void log_stop(void)
+{
+  unsigned int i;
+  int j;
+
+  if (!log_running) {
+    return;
+  }
+
+  uv_mutex_lock(&log_lock);
+  log_stopping = 1;
+  uv_cond_signal(&log_cond);
+  uv_mutex_unlock(&log_lock);
+  uv_thread_join(&log_thread);
+
+  drain();
+
+  log_running = 0;
+  thread_ring = NULL;
+
+  for (i = 0; i < ring_count; i++) {
+    for (j = 0; j < LOG_BINARY_CHANNELS; j++) {
+      binary_dropped[j] += rings[i]->binary[j].dropped;
+      free(rings[i]->binary[j].records);
+    }
+    free(rings[i]);
+  }
+  ring_count = 0;
+
+  uv_cond_destroy(&log_cond);
+  uv_mutex_destroy(&log_lock);
+  uv_mutex_destroy(&rings_lock);
+}
+
+// free_binary: free a ring that was never registered along with its
+// binary rings
+static void free_binary(log_ring *ring)
+{
+  int i;
+
+  for (i = 0; i < LOG_BINARY_CHANNELS; i++) {
+    free(ring->binary[i].records);
+  }
+  free(ring);
+}
+
+// log_thread_init: give the calling thread its own ring. If the
+// background thread is not running, or there are already too many
+// rings, the thread logs synchronously.
+void log_thread_init(uv_loop_t *loop)
+{
+  log_ring *ring;
+  int i;
+
+  if (!log_running || thread_ring != NULL) {
+    return;
+  }
+
+  ring = (log_ring *)calloc(1, sizeof(log_ring));
+  if (ring == NULL) {
+    return;
+  }
+
+  // Binary rings are only needed for channels that are being written
+
+  for (i = 0; i < LOG_BINARY_CHANNELS; i++) {
+    if (binary_write[i] != NULL) {
+      ring->binary[i].records = (log_binary_record *)malloc(
+          LOG_BINARY_RING_SIZE * sizeof(log_binary_record));
+      if (ring->binary[i].records == NULL) {
+        free_binary(ring);
+        return;
+      }
+    }
+  }
+
+  ring->loop = loop;
+  ring->countdown = log_sample;
+  uv_update_time(loop);
+  ring->offset = (int64_t)time(NULL) * 1000 - (int64_t)uv_now(loop);
+
+  uv_mutex_lock(&rings_lock);
+  if (ring_count == LOG_MAX_RINGS) {
+    uv_mutex_unlock(&rings_lock);
+    free_binary(ring);
+    return;
+  }
+  rings[ring_count] = ring;
+  KSSL_STORE_RELEASE(&ring_count, ring_count + 1);
+  uv_mutex_unlock(&rings_lock);
+
+  thread_ring = ring;
+}
+
+// write_log: call to log a message. The level is checked before any
+// formatting is done. If the calling thread has a ring then the message
+// is formatted into it and written by the background thread, otherwise
+// it is written immediately (see emit_line).
+void write_log(int e,                // If set this is an error message
+               const char *fmt, ...) // printf style
+{
+  va_list l;
+
+  if (!log_enabled(e)) {
+    return;
+  }
+
+  va_start(l, fmt);
+
+  if (thread_ring != NULL) {
+    log_record *r = reserve();
+
+    if (r != NULL) {
+      r->type = LOG_RECORD_TEXT;
+      r->e = e;
+      vsnprintf(r->text, sizeof(r->text), fmt, l);
+      commit();
+    }
+  } else {
+    char line[LOG_TEXT_SIZE];
+
+    vsnprintf(line, sizeof(line), fmt, l);
+    emit_line(e, line);
   }
 
   va_end(l);
-  free(newfmt);
+}
+
+// log_operation: write out a KSSL operation to the access log. Only one
+// in log_sample operations is logged.
+void log_operation(kssl_header *header, kssl_operation *op)
+{
+  log_record local;
+  log_record *r = &local;
+  int *countdown = (thread_ring != NULL)?&thread_ring->countdown:
+                                         &sync_countdown;
+
+  if (!log_enabled(0)) {
+    return;
+  }
+
+  if (log_sample > 1) {
+    *countdown -= 1;
+    if (*countdown > 0) {
+      return;
+    }
+    *countdown = log_sample;
+  }
+
+  if (thread_ring != NULL) {
+    r = reserve();
+    if (r == NULL) {
+      return;
+    }
+  }
+
+  r->type = LOG_RECORD_ACCESS;
+  r->e = 0;
+  r->version_maj = header->version_maj;
+  r->version_min = header->version_min;
+  r->id = header->id;
+  r->opcode = op->opcode;
+  r->ip_len = 0;
+  if (op->is_ip_set && (op->ip_len == 4 || op->ip_len == 16)) {
+    r->ip_len = (BYTE)op->ip_len;
+    memcpy(r->ip, op->ip, op->ip_len);
+  }
+  r->time = log_wall_time();
+
+  if (thread_ring != NULL) {
+    commit();
+  } else {
+    format_record(r);
+  }
+}
+
+// log_error: log an error of the operation
+void log_error(DWORD id, BYTE code)
+{
+  log_record local;
+  log_record *r = &local;
+
+  if (!log_enabled(1)) {
+    return;
+  }
+
+  if (thread_ring != NULL) {
+    r = reserve();
+    if (r == NULL) {
+      return;
+    }
+  }
+
+  r->type = LOG_RECORD_ERROR;
+  r->e = 1;
+  r->id = id;
+  r->code = code;
+  r->time = log_wall_time();
+
+  if (thread_ring != NULL) {
+    commit();
+  } else {
+    format_record(r);
+  }
+}
+
+// log_binary_writer: set the functions called by the background thread
+// for records queued with log_binary on channel
+void log_binary_writer(int channel, log_binary_cb write, log_tick_cb tick)
+{
+  binary_write[channel] = write;
+  binary_tick[channel] = tick;
+}
+
+// log_binary: queue a record for the binary writer. Unlike other records
+// these are not subject to the log level.
+void log_binary(int channel, void *data)
+{
+  log_binary_ring *ring;
+  unsigned int tail;
+
+  if (binary_write[channel] == NULL) {
+    return;
+  }
+
+  // Threads without a ring, and threads that started before the channel
+  // had a writer, hand the record over directly
+
+  if (thread_ring == NULL || thread_ring->binary[channel].records == NULL) {
+    binary_write[channel](data, 1);
+    return;
+  }
+
+  ring = &thread_ring->binary[channel];
+  tail = KSSL_LOAD_ACQUIRE(&ring->tail);
+  if (ring->head - tail == LOG_BINARY_RING_SIZE) {
+    ring->dropped += 1;
+    return;
+  }
+
+  memcpy(&ring->records[ring->head & (LOG_BINARY_RING_SIZE - 1)], data,
+         LOG_BINARY_SIZE);
+  KSSL_STORE_RELEASE(&ring->head, ring->head + 1);
+}
+
+// log_binary_dropped: returns the number of records sent on channel that
+// were lost because a thread's binary ring was full
+uint64_t log_binary_dropped(int channel)
+{
+  uint64_t dropped = binary_dropped[channel];
+  unsigned int count = log_running?KSSL_LOAD_ACQUIRE(&ring_count):0;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    dropped += rings[i]->binary[channel].dropped;
+  }
+
+  return dropped;
 }
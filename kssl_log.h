@@ -5,15 +5,76 @@
 #ifndef INCLUDED_KSSL_LOG
 #define INCLUDED_KSSL_LOG 1
 
+#include <uv.h>
+
 #include "kssl_helpers.h"
 
 extern int silent;
 extern int verbose;
 
+// Only one in log_sample access log records is written (1 means all)
+
+extern int log_sample;
+
 #if PLATFORM_WINDOWS == 0
 extern int use_syslog;
 #endif
 
 void write_log(int e, const char *fmt, ...);
 
+// log_enabled: returns 1 if a message at this level (e set for errors)
+// would be written. Used to avoid formatting messages that would be
+// discarded.
+int log_enabled(int e);
+
+// log_start: start the background thread that formats and writes log
+// lines queued by threads that have called log_thread_init. Returns 0 on
+// success. Until this is called all logging is synchronous.
+int log_start(void);
+
+// log_stop: write any queued log lines and stop the background thread
+void log_stop(void);
+
+// log_thread_init: give the calling thread its own queue of log records
+// so that logging never blocks it. Timestamps are taken from the loop's
+// cached time (updated once per loop iteration) rather than a syscall.
+void log_thread_init(uv_loop_t *loop);
+
+// log_wall_time: returns the wall clock time in milliseconds. On threads
+// that have called log_thread_init this uses the loop's cached time.
+int64_t log_wall_time(void);
+
+// The size of every record passed to log_binary
+
+#define LOG_BINARY_SIZE 64
+
+// Binary records are sent on a channel and each channel has its own
+// writer
+
+#define LOG_BINARY_ACCESS   0 // Binary access log (see kssl_binlog.h)
+#define LOG_BINARY_CAPTURE  1 // Request capture (see kssl_capture.h)
+#define LOG_BINARY_CHANNELS 2
+
+// Called by the background thread with count consecutive records of
+// LOG_BINARY_SIZE bytes queued by log_binary, and once after each time it
+// has drained the queues
+
+typedef void (*log_binary_cb)(void *records, int count);
+typedef void (*log_tick_cb)(void);
+
+// log_binary_writer: set the functions that handle binary records sent on
+// channel. Must be called before any worker threads start or after they
+// have stopped.
+void log_binary_writer(int channel, log_binary_cb write, log_tick_cb tick);
+
+// log_binary: queue a record of LOG_BINARY_SIZE bytes to be passed to
+// channel's writer on the background thread. Each thread that has called
+// log_thread_init has a separate queue per channel. Dropped if the channel
+// has no writer or the queue is full.
+void log_binary(int channel, void *data);
+
+// log_binary_dropped: returns the number of records sent on channel that
+// were dropped because a queue was full
+uint64_t log_binary_dropped(int channel);
+
 #endif // INCLUDED_KSSL_LOG
@@ -0,0 +1,722 @@
+// kssl_loopback.c: in-process full stack harness for the server
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// Usage: kssl_loopback [OPTIONS]
+//
+// Runs the server's connection handling (connection_open and
+// connection_read from kssl_thread.c, and so do_ssl, kssl_operate and
+// the response path) against an in-process client SSL object. The two
+// are joined by copying bytes between their memory BIOs: there are no
+// sockets, no event loop and no other threads, so runs are repeatable
+// and small changes in the cost of the server path are not lost in
+// kernel noise.
+//
+// After a mutually authenticated handshake each --ops opcode is sent
+// --requests times, --batch requests at a time. Every response is
+// checked (a ping must echo its payload and every other operation must
+// succeed) so the harness also works as a test: it exits with 1 on the
+// first wrong response.
+//
+// For each opcode the mean cost of a request is reported in CPU cycles
+// (measured with the time stamp counter on x86, otherwise in ns) broken
+// down by stage:
+//
+// client_write:  client SSL_write of the request and copying it to the
+//                server
+// server_read:   TLS decryption and reading the header and payload (the
+//                queue stage of the server's metrics)
+// server_crypto: the private key operation (the crypto stage)
+// server_other:  everything else in the server: parsing, key lookup,
+//                building the response, TLS encryption and the write
+// client_read:   copying the response to the client, SSL_read and
+//                parsing it
+//
+// Results are written to stdout as a single JSON object.
+//
+// --server-cert, --server-key, --ca-file
+//
+// The server's certificate and key and the CA that signs client
+// certificates, as for keyless (default the files in testing/)
+//
+// --client-cert, --client-key, --client-ca-file
+//
+// The client's certificate and key and the CA that signs the server
+// certificate (default the files in testing/)
+//
+// --private-key=FILE
+//
+// A private key the server holds. May be given more than once (default
+// testing/keys/rsa.key and testing/keys/ec.key).
+//
+// --ops=OP,...
+//
+// Opcodes to send: any of ping, rsa-decrypt, rsa-sign-sha256 and
+// ecdsa-sign-sha256 (default all of them)
+//
+// --requests=N
+//
+// Requests of each opcode (default 1000000)
+//
+// --batch=N
+//
+// Requests written by the client before the server reads them (default
+// 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <uv.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+
+#include "kssl.h"
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+#include "kssl_metrics.h"
+#include "kssl_thread.h"
+#include "kssl_getopt.h"
+
+#define MAX_KEYS  16
+#define MAX_BATCH 16
+
+// The private keys and their lock, which kssl_thread.c expects the
+// server to provide
+
+pk_list privates = NULL;
+uv_rwlock_t *pk_lock = NULL;
+
+// An opcode that can be sent
+
+typedef struct {
+  const char *name;
+  BYTE opcode;
+  int type;        // EVP_PKEY_RSA, EVP_PKEY_EC or 0 for no key
+  int digest_len;  // Length of a sign payload (0 for decrypt and ping)
+} loopback_op;
+
+static const loopback_op ops[] = {
+  {"ping",              KSSL_OP_PING,              0,            0},
+  {"rsa-decrypt",       KSSL_OP_RSA_DECRYPT,       EVP_PKEY_RSA, 0},
+  {"rsa-sign-sha256",   KSSL_OP_RSA_SIGN_SHA256,   EVP_PKEY_RSA, 32},
+  {"ecdsa-sign-sha256", KSSL_OP_ECDSA_SIGN_SHA256, EVP_PKEY_EC,  32},
+};
+
+#define OPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+static int op_enabled[OPS];
+
+// The --private-key keys as read by the client, in the order they were
+// added to privates
+
+static EVP_PKEY *pkeys[MAX_KEYS];
+static int pkey_count = 0;
+
+// The two ends of the connection
+
+static SSL *client;
+static BIO *client_read_bio;
+static BIO *client_write_bio;
+static connection_state *server;
+static worker_data worker;
+
+// Buffer bytes are copied between the BIOs through
+
+static char transfer[16384];
+
+// fatal_error: call to print an error message to STDERR and exit
+void fatal_error(const char *fmt, ...)
+{
+  va_list l;
+  va_start(l, fmt);
+  vfprintf(stderr, fmt, l);
+  va_end(l);
+  fprintf(stderr, "\n");
+
+  exit(1);
+}
+
+// ssl_error: print OpenSSL's errors and exit
+static void ssl_error(void)
+{
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+// log_ssl_error: log an SSL error and clear the OpenSSL error buffer
+void log_ssl_error(SSL *ssl, int rc)
+{
+  const char *err = ERR_error_string(SSL_get_error(ssl, rc), 0);
+  write_log(1, "SSL error: %s", err);
+  ERR_clear_error();
+}
+
+// log_err_error: log an OpenSSL error and clear the OpenSSL error buffer
+void log_err_error(void)
+{
+  const char *err = ERR_error_string(ERR_get_error(), 0);
+  write_log(1, "SSL error: %s", err);
+  ERR_clear_error();
+}
+
+// error_string: converts an error return code from libuv into a string
+const char *error_string(int e)
+{
+  return uv_strerror(e);
+}
+
+// cycles: returns the time stamp counter where there is one, otherwise
+// uv_hrtime()
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return uv_hrtime();
+#endif
+}
+
+// to_server: copy everything the client has written to the server and
+// let it process it. Returns the bytes copied.
+static int to_server(void)
+{
+  int total = 0;
+  int n;
+
+  while ((n = BIO_read(client_write_bio, transfer, sizeof(transfer))) > 0) {
+    if (!connection_read(server, transfer, n)) {
+      fatal_error("The server terminated the connection");
+    }
+    total += n;
+  }
+
+  return total;
+}
+
+// to_client: copy everything the server has written to the client.
+// Returns the bytes copied.
+static int to_client(void)
+{
+  int total = 0;
+  int n;
+
+  while ((n = BIO_read(server->write_bio, transfer, sizeof(transfer))) > 0) {
+    BIO_write(client_read_bio, transfer, n);
+    total += n;
+  }
+
+  return total;
+}
+
+// handshake: complete the TLS handshake between client and server
+static void handshake(void)
+{
+  int rounds;
+
+  for (rounds = 0; rounds < 16; rounds++) {
+    int rc = SSL_do_handshake(client);
+
+    if (rc == 1 && server->connected) {
+      return;
+    }
+    if (rc != 1) {
+      int err = SSL_get_error(client, rc);
+
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        ssl_error();
+      }
+    }
+
+    to_server();
+    if (!connection_read(server, NULL, 0)) {
+      fatal_error("The server failed the handshake");
+    }
+    to_client();
+  }
+
+  fatal_error("The handshake did not complete");
+}
+
+// new_ctx: returns a new SSL_CTX using cert, key and the CA file ca
+static SSL_CTX *new_ctx(const SSL_METHOD *method, const char *cert,
+                        const char *key, const char *ca)
+{
+  SSL_CTX *ctx = SSL_CTX_new(method);
+
+  if (ctx == NULL) {
+    ssl_error();
+  }
+
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                     0);
+  if (SSL_CTX_load_verify_locations(ctx, ca, 0) != 1) {
+    fatal_error("Failed to load CA file %s", ca);
+  }
+  if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) != 1) {
+    fatal_error("Failed to load certificate from %s", cert);
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+    fatal_error("Failed to load private key from %s", key);
+  }
+  if (SSL_CTX_check_private_key(ctx) != 1) {
+    fatal_error("Private key %s and certificate %s do not match", key, cert);
+  }
+
+  return ctx;
+}
+
+// server_ctx: returns an SSL_CTX set up as keyless sets up its own
+static SSL_CTX *server_ctx(const char *cert, const char *key, const char *ca)
+{
+  SSL_CTX *ctx = new_ctx(TLSv1_2_server_method(), cert, key, ca);
+  STACK_OF(X509_NAME) *names;
+  EC_KEY *ecdh;
+
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+  if (SSL_CTX_set_cipher_list(ctx, "ECDHE-ECDSA-AES256-GCM-SHA384:"
+                              "ECDHE-RSA-AES256-GCM-SHA384") == 0) {
+    ssl_error();
+  }
+
+  ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (ecdh == NULL || SSL_CTX_set_tmp_ecdh(ctx, ecdh) != 1) {
+    ssl_error();
+  }
+  EC_KEY_free(ecdh);
+
+  names = SSL_load_client_CA_file(ca);
+  if (names == NULL) {
+    fatal_error("Failed to load CA file %s", ca);
+  }
+  SSL_CTX_set_client_CA_list(ctx, names);
+
+  return ctx;
+}
+
+// build_request: serialize a request for op with id and its key, if it
+// needs one, from privates. The request is written to *out.
+static void build_request(const loopback_op *op, DWORD id, int *key_id,
+                          BYTE **out, int *out_len)
+{
+  static BYTE ip[4] = {127, 0, 0, 1};
+  kssl_header header;
+  kssl_operation req;
+  BYTE payload[512];
+  int payload_len = 32;
+  int i;
+
+  header.version_maj = KSSL_VERSION_MAJ;
+  header.version_min = KSSL_VERSION_MIN;
+  header.id = id;
+
+  zero_operation(&req);
+  req.is_opcode_set = 1;
+  req.opcode = op->opcode;
+  req.is_ip_set = 1;
+  req.ip = ip;
+  req.ip_len = sizeof(ip);
+
+  for (i = 0; i < payload_len; i++) {
+    payload[i] = (BYTE)(id + i);
+  }
+
+  *key_id = -1;
+  if (op->type != 0) {
+    EVP_PKEY *pkey = NULL;
+
+    for (i = 0; i < pkey_count; i++) {
+      if (EVP_PKEY_type(pkeys[i]->type) == op->type) {
+        pkey = pkeys[i];
+        *key_id = i;
+        break;
+      }
+    }
+    if (pkey == NULL) {
+      fatal_error("No --private-key of the right type for %s", op->name);
+    }
+
+    if (op->digest_len != 0) {
+      payload_len = op->digest_len;
+    } else {
+      RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+
+      payload_len = RSA_public_encrypt(48, payload + 256, payload, rsa,
+                                       RSA_PKCS1_PADDING);
+      RSA_free(rsa);
+      if (payload_len <= 0 || payload_len > 256) {
+        ssl_error();
+      }
+    }
+
+    req.is_digest_set = 1;
+    req.digest = key_digest(privates, *key_id);
+  }
+
+  req.is_payload_set = 1;
+  req.payload = payload;
+  req.payload_len = payload_len;
+
+  if (flatten_operation(&header, &req, out, out_len) != KSSL_ERROR_NONE) {
+    fatal_error("Failed to serialize %s request", op->name);
+  }
+}
+
+// check_response: fail unless response is a good answer to request
+static void check_response(const loopback_op *op, BYTE *request,
+                           BYTE *response, int len)
+{
+  kssl_header h, rh;
+  kssl_operation req, resp;
+
+  parse_header(request, &h);
+  parse_header(response, &rh);
+  if (len < (int)KSSL_HEADER_SIZE || rh.id != h.id ||
+      (int)KSSL_HEADER_SIZE + rh.length != len) {
+    fatal_error("Malformed response to %s request %u", op->name, h.id);
+  }
+
+  zero_operation(&req);
+  zero_operation(&resp);
+  parse_message_payload(request + KSSL_HEADER_SIZE, h.length, &req);
+  if (parse_message_payload(response + KSSL_HEADER_SIZE, rh.length, &resp) !=
+      KSSL_ERROR_NONE) {
+    fatal_error("Unparseable response to %s request %u", op->name, h.id);
+  }
+
+  if (op->opcode == KSSL_OP_PING) {
+    if (resp.opcode != KSSL_OP_PONG || resp.payload_len != req.payload_len ||
+        memcmp(resp.payload, req.payload, req.payload_len) != 0) {
+      fatal_error("Bad pong to request %u", h.id);
+    }
+  } else if (resp.opcode != KSSL_OP_RESPONSE || !resp.is_payload_set ||
+             resp.payload_len == 0) {
+    fatal_error("%s request %u failed", op->name, h.id);
+  }
+}
+
+// mean: returns the mean of a histogram
+static double mean(kssl_histogram *h)
+{
+  return (h->count == 0)?0.0:(double)h->sum / h->count;
+}
+
+// run: send op requests times, batch at a time, and report the cost of
+// each stage
+static void run(const loopback_op *op, int requests, int batch, int first)
+{
+  BYTE *request[MAX_BATCH];
+  int request_len[MAX_BATCH];
+  BYTE response[2048];
+  uint64_t client_write = 0, client_read = 0, server_total = 0;
+  uint64_t c0, h0, c1, h1;
+  double per_ns;
+  kssl_histogram *stages;
+  int slot = metrics_op_slot(op->opcode);
+  int key_id;
+  int sent;
+  int i;
+
+  for (i = 0; i < batch; i++) {
+    build_request(op, (DWORD)i, &key_id, &request[i], &request_len[i]);
+  }
+
+  memset(worker.metrics, 0, sizeof(kssl_metrics));
+  c0 = cycles();
+  h0 = uv_hrtime();
+
+  for (sent = 0; sent < requests; sent += batch) {
+    uint64_t t0, t1, t2, t3;
+
+    t0 = cycles();
+    for (i = 0; i < batch; i++) {
+      if (SSL_write(client, request[i], request_len[i]) != request_len[i]) {
+        ssl_error();
+      }
+    }
+    t1 = cycles();
+    to_server();
+    t2 = cycles();
+    to_client();
+    for (i = 0; i < batch; i++) {
+      int got = 0;
+
+      while (got < (int)KSSL_HEADER_SIZE) {
+        int n = SSL_read(client, response + got, KSSL_HEADER_SIZE - got);
+
+        if (n <= 0) {
+          fatal_error("Missing response to %s request", op->name);
+        }
+        got += n;
+      }
+      while (got < (int)KSSL_HEADER_SIZE +
+             ((response[2] << 8) | response[3])) {
+        int n = SSL_read(client, response + got,
+                         (int)sizeof(response) - got);
+
+        if (n <= 0) {
+          fatal_error("Truncated response to %s request", op->name);
+        }
+        got += n;
+      }
+      check_response(op, request[i], response, got);
+    }
+    t3 = cycles();
+
+    client_write += t1 - t0;
+    server_total += t2 - t1;
+    client_read += t3 - t2;
+  }
+
+  c1 = cycles();
+  h1 = uv_hrtime();
+  per_ns = (double)(c1 - c0) / (double)(h1 - h0);
+
+  stages = worker.metrics->latency[slot];
+  printf("%s{\"op\":\"%s\",\"key\":%d,\"requests\":%d,"
+         "\"client_write\":%.0f,\"server_read\":%.0f,\"server_crypto\":%.0f,"
+         "\"server_other\":%.0f,\"client_read\":%.0f,\"total\":%.0f,"
+         "\"requests_per_sec\":%.1f}", first?"":",", op->name, key_id, sent,
+         (double)client_write / sent,
+         mean(&stages[KSSL_STAGE_QUEUE]) * per_ns,
+         mean(&stages[KSSL_STAGE_CRYPTO]) * per_ns,
+         (double)server_total / sent -
+         (mean(&stages[KSSL_STAGE_QUEUE]) +
+          mean(&stages[KSSL_STAGE_CRYPTO])) * per_ns,
+         (double)client_read / sent, (double)(c1 - c0) / sent,
+         sent * 1e9 / (double)(h1 - h0));
+  fflush(stdout);
+
+  for (i = 0; i < batch; i++) {
+    free(request[i]);
+  }
+}
+
+// enable_ops: set op_enabled from a comma separated list
+static void enable_ops(char *list)
+{
+  char *item;
+  int i;
+
+  memset(op_enabled, 0, sizeof(op_enabled));
+  for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    for (i = 0; i < OPS; i++) {
+      if (strcmp(item, ops[i].name) == 0) {
+        op_enabled[i] = 1;
+        break;
+      }
+    }
+    if (i == OPS) {
+      fatal_error("Unknown opcode %s in --ops", item);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *server_cert = "testing/server-cert/ecdsa/ecdsa-server.pem";
+  const char *server_key = "testing/server-cert/ecdsa/ecdsa-server-key.pem";
+  const char *ca_file = "testing/CAs/testca-keyless.pem";
+  const char *client_cert = "testing/client-cert/ecdsa/ecdsa-client.pem";
+  const char *client_key = "testing/client-cert/ecdsa/ecdsa-client-key.pem";
+  const char *client_ca_file = "testing/CAs/testca-keyserver.pem";
+  const char *keys[MAX_KEYS];
+  int keys_given = 0;
+  int requests = 1000000;
+  int batch = 1;
+  SSL_CTX *sctx, *cctx;
+  int first = 1;
+  int i;
+
+  const struct option long_options[] = {
+    {"server-cert",    required_argument, 0, 0},
+    {"server-key",     required_argument, 0, 1},
+    {"ca-file",        required_argument, 0, 2},
+    {"client-cert",    required_argument, 0, 3},
+    {"client-key",     required_argument, 0, 4},
+    {"client-ca-file", required_argument, 0, 5},
+    {"private-key",    required_argument, 0, 6},
+    {"ops",            required_argument, 0, 7},
+    {"requests",       required_argument, 0, 8},
+    {"batch",          required_argument, 0, 9},
+    {"help",           no_argument,       0, 10},
+    {0, 0, 0, 0}
+  };
+
+  for (i = 0; i < OPS; i++) {
+    op_enabled[i] = 1;
+  }
+
+  optind = 1;
+  while (1) {
+    int c = getopt_long(argc, argv, "", long_options, 0);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 0:
+      server_cert = optarg;
+      break;
+
+    case 1:
+      server_key = optarg;
+      break;
+
+    case 2:
+      ca_file = optarg;
+      break;
+
+    case 3:
+      client_cert = optarg;
+      break;
+
+    case 4:
+      client_key = optarg;
+      break;
+
+    case 5:
+      client_ca_file = optarg;
+      break;
+
+    case 6:
+      if (keys_given == MAX_KEYS) {
+        fatal_error("At most %d --private-key parameters may be given",
+                    MAX_KEYS);
+      }
+      keys[keys_given++] = optarg;
+      break;
+
+    case 7:
+      enable_ops(optarg);
+      break;
+
+    case 8:
+      requests = atoi(optarg);
+      if (requests <= 0) {
+        fatal_error("--requests must be positive");
+      }
+      break;
+
+    case 9:
+      batch = atoi(optarg);
+      if (batch <= 0 || batch > MAX_BATCH) {
+        fatal_error("--batch must be between 1 and %d", MAX_BATCH);
+      }
+      break;
+
+    case 10:
+    default:
+      fprintf(stderr, "Usage: kssl_loopback [--server-cert=FILE] "
+              "[--server-key=FILE] [--ca-file=FILE] [--client-cert=FILE] "
+              "[--client-key=FILE] [--client-ca-file=FILE] "
+              "[--private-key=FILE]... [--ops=OP,...] [--requests=N] "
+              "[--batch=N]\n");
+      exit(c == 10 ? 0 : 1);
+    }
+  }
+
+  if (keys_given == 0) {
+    keys[keys_given++] = "testing/keys/rsa.key";
+    keys[keys_given++] = "testing/keys/ec.key";
+  }
+
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  privates = new_pk_list(keys_given);
+  if (privates == NULL) {
+    fatal_error("Failed to allocate room for private keys");
+  }
+  for (i = 0; i < keys_given; i++) {
+    FILE *f;
+
+    if (add_key_from_file(keys[i], privates) != KSSL_ERROR_NONE) {
+      fatal_error("Failed to load private key %s", keys[i]);
+    }
+
+    f = fopen(keys[i], "r");
+    if (f == NULL) {
+      fatal_error("Failed to open %s", keys[i]);
+    }
+    pkeys[pkey_count] = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+    fclose(f);
+    if (pkeys[pkey_count] == NULL) {
+      ssl_error();
+    }
+    pkey_count++;
+  }
+  pk_lock = (uv_rwlock_t *)malloc(sizeof(uv_rwlock_t));
+  if (pk_lock == NULL || uv_rwlock_init(pk_lock) != 0) {
+    fatal_error("Can't initialize lock");
+  }
+
+  sctx = server_ctx(server_cert, server_key, ca_file);
+  cctx = new_ctx(TLSv1_2_client_method(), client_cert, client_key,
+                 client_ca_file);
+
+  memset(&worker, 0, sizeof(worker));
+  worker.ctx = sctx;
+  worker.metrics = metrics_new(1);
+  if (worker.metrics == NULL) {
+    fatal_error("Failed to allocate metrics");
+  }
+
+  server = connection_open(&worker, NULL);
+  if (server == NULL) {
+    fatal_error("Failed to create the server connection");
+  }
+
+  client = SSL_new(cctx);
+  client_read_bio = BIO_new(BIO_s_mem());
+  client_write_bio = BIO_new(BIO_s_mem());
+  if (client == NULL || client_read_bio == NULL || client_write_bio == NULL) {
+    ssl_error();
+  }
+  BIO_set_mem_eof_return(client_read_bio, -1);
+  BIO_set_mem_eof_return(client_write_bio, -1);
+  SSL_set_bio(client, client_read_bio, client_write_bio);
+  SSL_set_connect_state(client);
+
+  handshake();
+
+  printf("{\"unit\":\"%s\",\"batch\":%d,\"results\":[",
+#if defined(__x86_64__) || defined(__i386__)
+         "cycles",
+#else
+         "ns",
+#endif
+         batch);
+
+  for (i = 0; i < OPS; i++) {
+    if (op_enabled[i]) {
+      run(&ops[i], requests, batch, first);
+      first = 0;
+    }
+  }
+
+  printf("]}\n");
+
+  worker.active = NULL;
+  connection_free(server);
+  SSL_free(client);
+  SSL_CTX_free(cctx);
+  SSL_CTX_free(sctx);
+  metrics_free(worker.metrics);
+  free_pk_list(privates);
+  for (i = 0; i < pkey_count; i++) {
+    EVP_PKEY_free(pkeys[i]);
+  }
+  uv_rwlock_destroy(pk_lock);
+  free(pk_lock);
+
+  return 0;
+}
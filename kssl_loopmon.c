@@ -0,0 +1,160 @@
+// kssl_loopmon.c: event loop lag and utilization monitor
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <uv.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_loopmon.h"
+
+// Warnings about lag are logged at most this often per worker (ns)
+
+#define KSSL_LOOPMON_WARN_EVERY 10000000000ULL
+
+// Thresholds in ns set by loop_monitor_init. 0 disables.
+
+static uint64_t warn_ns = 0;
+static uint64_t reject_ns = 0;
+
+// loop_monitor_init: set the warning and rejection thresholds
+void loop_monitor_init(unsigned int warn_ms, unsigned int reject_ms)
+{
+  warn_ns = (uint64_t)warn_ms * 1000000;
+  reject_ns = (uint64_t)reject_ms * 1000000;
+}
+
+// timer_cb: measure how late the timer fired
+static void timer_cb(uv_timer_t *handle)
+{
+  kssl_loop_monitor *m = (kssl_loop_monitor *)handle->data;
+  uint64_t now = uv_hrtime();
+  uint64_t lag = elapsed_ns(m->expected, now);
+
+  m->expected = now + (uint64_t)KSSL_LOOPMON_INTERVAL * 1000000;
+  m->metrics->loop_lag = lag;
+  m->metrics->loop_measured = now;
+  histogram_record(&m->metrics->loop_lag_histogram, lag);
+  stats_loop(m->live, m->metrics, now);
+
+  if (warn_ns != 0 && lag >= warn_ns &&
+      (m->warned == 0 || now - m->warned >= KSSL_LOOPMON_WARN_EVERY)) {
+    m->warned = now;
+    write_log(1, "Worker %d event loop lag %llums", m->worker,
+              (unsigned long long)(lag / 1000000));
+  }
+}
+
+// prepare_cb: the loop is about to poll for I/O. Everything since the
+// last poll ended was busy time.
+static void prepare_cb(uv_prepare_t *handle)
+{
+  kssl_loop_monitor *m = (kssl_loop_monitor *)handle->data;
+  uint64_t now = uv_hrtime();
+
+  m->metrics->loop_busy += elapsed_ns(m->checked, now);
+  m->polling = now;
+  m->callbacks = 0;
+}
+
+// check_cb: the loop has finished polling for I/O. Time spent in I/O
+// callbacks during the poll is busy, the remainder is idle.
+static void check_cb(uv_check_t *handle)
+{
+  kssl_loop_monitor *m = (kssl_loop_monitor *)handle->data;
+  uint64_t now = uv_hrtime();
+  uint64_t poll = elapsed_ns(m->polling, now);
+
+  if (m->callbacks > poll) {
+    m->callbacks = poll;
+  }
+
+  m->metrics->loop_busy += m->callbacks;
+  m->metrics->loop_idle += poll - m->callbacks;
+  m->checked = now;
+}
+
+// loop_monitor_start: start monitoring loop
+int loop_monitor_start(kssl_loop_monitor *m, uv_loop_t *loop,
+                       kssl_metrics *metrics, kssl_live_stats *live,
+                       int worker)
+{
+  int rc;
+
+  m->metrics = NULL;
+  m->live = live;
+  m->worker = worker;
+  m->polling = 0;
+  m->checked = uv_hrtime();
+  m->callbacks = 0;
+  m->warned = 0;
+  m->expected = m->checked + (uint64_t)KSSL_LOOPMON_INTERVAL * 1000000;
+
+  m->timer.data = (void *)m;
+  m->prepare.data = (void *)m;
+  m->check.data = (void *)m;
+
+  rc = uv_timer_init(loop, &m->timer);
+  if (rc != 0) {
+    return rc;
+  }
+  rc = uv_prepare_init(loop, &m->prepare);
+  if (rc != 0) {
+    uv_close((uv_handle_t *)&m->timer, NULL);
+    return rc;
+  }
+  rc = uv_check_init(loop, &m->check);
+  if (rc != 0) {
+    uv_close((uv_handle_t *)&m->timer, NULL);
+    uv_close((uv_handle_t *)&m->prepare, NULL);
+    return rc;
+  }
+
+  uv_timer_start(&m->timer, timer_cb, KSSL_LOOPMON_INTERVAL,
+                 KSSL_LOOPMON_INTERVAL);
+  uv_prepare_start(&m->prepare, prepare_cb);
+  uv_check_start(&m->check, check_cb);
+
+  uv_unref((uv_handle_t *)&m->timer);
+  uv_unref((uv_handle_t *)&m->prepare);
+  uv_unref((uv_handle_t *)&m->check);
+
+  m->metrics = metrics;
+  return 0;
+}
+
+// loop_monitor_stop: close the monitor's handles
+void loop_monitor_stop(kssl_loop_monitor *m)
+{
+  if (m->metrics == NULL) {
+    return;
+  }
+
+  uv_close((uv_handle_t *)&m->timer, NULL);
+  uv_close((uv_handle_t *)&m->prepare, NULL);
+  uv_close((uv_handle_t *)&m->check, NULL);
+  m->metrics = NULL;
+}
+
+// loop_monitor_busy: account for an I/O callback
+void loop_monitor_busy(kssl_loop_monitor *m, uint64_t start)
+{
+  if (m->metrics != NULL) {
+    m->callbacks += elapsed_ns(start, uv_hrtime());
+  }
+}
+
+// loop_saturated: returns 1 if the loop's lag is above the rejection
+// threshold
+int loop_saturated(kssl_loop_monitor *m)
+{
+  uint64_t overdue;
+
+  if (reject_ns == 0 || m->metrics == NULL) {
+    return 0;
+  }
+
+  overdue = elapsed_ns(m->expected, uv_hrtime());
+
+  return (m->metrics->loop_lag >= reject_ns || overdue >= reject_ns);
+}
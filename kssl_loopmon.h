@@ -0,0 +1,64 @@
+// kssl_loopmon.h: event loop lag and utilization monitor
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_LOOPMON
+#define INCLUDED_KSSL_LOOPMON 1
+
+#include <uv.h>
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+#include "kssl_stats.h"
+
+// Monitors a single worker's loop. Lag is measured by a repeating timer:
+// the time by which it fires late is the time the loop was too busy to
+// notice it. Busy and idle time are measured with prepare and check
+// handles which run immediately before and after the loop polls for I/O.
+// In this version of libuv I/O callbacks run inside the poll so their
+// time is reported separately with loop_monitor_busy and moved from idle
+// to busy.
+
+// How often (in ms) lag is measured
+
+#define KSSL_LOOPMON_INTERVAL 100
+
+typedef struct {
+  uv_timer_t   timer;     // Fires every KSSL_LOOPMON_INTERVAL ms
+  uv_prepare_t prepare;   // Runs before polling for I/O
+  uv_check_t   check;     // Runs after polling for I/O
+  uint64_t     expected;  // uv_hrtime() at which timer should next fire
+  uint64_t     polling;   // uv_hrtime() when the current poll started
+  uint64_t     checked;   // uv_hrtime() when the last poll ended
+  uint64_t     callbacks; // Time spent in I/O callbacks in this poll
+  uint64_t     warned;    // uv_hrtime() of the last lag warning
+  kssl_metrics *metrics;  // Shard that results are written to
+  kssl_live_stats *live;  // Entry results are published to (or NULL)
+  int          worker;    // Worker index (for log messages)
+} kssl_loop_monitor;
+
+// loop_monitor_init: set the lag (in ms) above which a warning is logged
+// and above which new connections are rejected. 0 disables either.
+void loop_monitor_init(unsigned int warn_ms, unsigned int reject_ms);
+
+// loop_monitor_start: start monitoring loop. Results are written to
+// metrics and, each time lag is measured, published to live if it is
+// not NULL. The monitor's handles do not keep the loop alive. Returns 0
+// on success.
+int loop_monitor_start(kssl_loop_monitor *m, uv_loop_t *loop,
+                       kssl_metrics *metrics, kssl_live_stats *live,
+                       int worker);
+
+// loop_monitor_stop: close the monitor's handles
+void loop_monitor_stop(kssl_loop_monitor *m);
+
+// loop_monitor_busy: called at the end of an I/O callback that started
+// at uv_hrtime() start
+void loop_monitor_busy(kssl_loop_monitor *m, uint64_t start);
+
+// loop_saturated: returns 1 if the loop's lag is above the rejection
+// threshold. Includes the time by which the timer is currently overdue
+// so that a loop that has just been blocked is caught straight away.
+int loop_saturated(kssl_loop_monitor *m);
+
+#endif // INCLUDED_KSSL_LOOPMON
@@ -0,0 +1,320 @@
+// kssl_memory.c: OpenSSL allocation accounting and per-thread caching
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include <openssl/crypto.h>
+
+#include "kssl_helpers.h"
+#include "kssl_memory.h"
+
+// Small allocations are rounded up to one of these size classes: 16, 32,
+// 64 ... 2048 bytes. Larger allocations go straight to malloc.
+
+#define MEMORY_CLASSES        8
+#define MEMORY_SMALLEST_SHIFT 4
+#define MEMORY_LARGE          MEMORY_CLASSES
+
+// The most blocks of each size class a thread will keep
+
+#define MEMORY_CACHE_DEPTH 256
+
+// Most threads whose counters are reported
+
+#define MEMORY_MAX_THREADS 128
+
+// In KSSL_MEMORY_CACHE mode every block starts with this header so that
+// its size class is known when it is freed. It is 16 bytes so that the
+// memory returned keeps malloc's alignment.
+
+typedef union {
+  struct {
+    size_t size; // Size requested
+    int    cls;  // Size class or MEMORY_LARGE
+  } h;
+  char pad[16];
+} memory_header;
+
+// A free block in a thread's cache
+
+typedef struct memory_block_ {
+  struct memory_block_ *next;
+} memory_block;
+
+// Per thread state. Only written by the owning thread; read by
+// memory_render.
+
+typedef struct {
+  uint64_t allocations;
+  uint64_t bytes;
+  uint64_t cache_hits;
+  memory_block *free[MEMORY_CLASSES];
+  int depth[MEMORY_CLASSES];
+} memory_thread;
+
+static int memory_mode = KSSL_MEMORY_DEFAULT;
+static KSSL_THREAD_LOCAL memory_thread *current = NULL;
+
+static memory_thread *threads[MEMORY_MAX_THREADS];
+static unsigned int thread_count = 0;
+static uv_mutex_t threads_lock;
+
+// this_thread: returns the calling thread's state, creating it on first
+// use. Returns NULL if memory cannot be allocated.
+static memory_thread *this_thread(void)
+{
+  if (current == NULL) {
+    current = (memory_thread *)calloc(1, sizeof(memory_thread));
+    if (current == NULL) {
+      return NULL;
+    }
+
+    // Threads beyond MEMORY_MAX_THREADS still cache but are not counted
+    // in memory_render
+
+    uv_mutex_lock(&threads_lock);
+    if (thread_count < MEMORY_MAX_THREADS) {
+      threads[thread_count] = current;
+      KSSL_STORE_RELEASE(&thread_count, thread_count + 1);
+    }
+    uv_mutex_unlock(&threads_lock);
+  }
+
+  return current;
+}
+
+// count: add an allocation to the calling thread's totals
+static memory_thread *count(size_t size)
+{
+  memory_thread *t = this_thread();
+
+  if (t != NULL) {
+    t->allocations += 1;
+    t->bytes += size;
+  }
+
+  return t;
+}
+
+// count_malloc, count_realloc: allocate with the system allocator and
+// count the allocation
+static void *count_malloc(size_t size)
+{
+  count(size);
+  return malloc(size);
+}
+
+static void *count_realloc(void *p, size_t size)
+{
+  count(size);
+  return realloc(p, size);
+}
+
+// class_for: returns the size class for an allocation of size bytes
+static int class_for(size_t size)
+{
+  int cls = 0;
+
+  while (cls < MEMORY_CLASSES &&
+         ((size_t)1 << (cls + MEMORY_SMALLEST_SHIFT)) < size) {
+    cls++;
+  }
+
+  return cls;
+}
+
+// cache_alloc: returns a block of at least size bytes, from the calling
+// thread's cache if possible
+static void *cache_alloc(memory_thread *t, size_t size)
+{
+  int cls = class_for(size);
+  memory_header *h;
+
+  if (cls != MEMORY_LARGE && t != NULL && t->free[cls] != NULL) {
+    memory_block *b = t->free[cls];
+
+    t->free[cls] = b->next;
+    t->depth[cls] -= 1;
+    t->cache_hits += 1;
+    h = (memory_header *)b;
+  } else {
+    size_t bytes = (cls == MEMORY_LARGE)?size:
+                   ((size_t)1 << (cls + MEMORY_SMALLEST_SHIFT));
+
+    h = (memory_header *)malloc(sizeof(memory_header) + bytes);
+    if (h == NULL) {
+      return NULL;
+    }
+    h->h.cls = cls;
+  }
+
+  h->h.size = size;
+  return (void *)(h + 1);
+}
+
+// cache_free: return a block to the calling thread's cache or, if it is
+// large or the cache is full, to the system
+static void cache_free(void *p)
+{
+  memory_header *h;
+  memory_thread *t;
+  int cls;
+
+  if (p == NULL) {
+    return;
+  }
+
+  h = (memory_header *)p - 1;
+  cls = h->h.cls;
+  t = current;
+
+  if (cls != MEMORY_LARGE && t != NULL &&
+      t->depth[cls] < MEMORY_CACHE_DEPTH) {
+    memory_block *b = (memory_block *)h;
+
+    b->next = t->free[cls];
+    t->free[cls] = b;
+    t->depth[cls] += 1;
+  } else {
+    free(h);
+  }
+}
+
+// cache_malloc, cache_realloc: the OpenSSL allocation functions used in
+// KSSL_MEMORY_CACHE mode
+static void *cache_malloc(size_t size)
+{
+  return cache_alloc(count(size), size);
+}
+
+static void *cache_realloc(void *p, size_t size)
+{
+  memory_thread *t = count(size);
+  memory_header *h;
+  void *n;
+
+  if (p == NULL) {
+    return cache_alloc(t, size);
+  }
+
+  // If the block is already big enough it can be reused as is
+
+  h = (memory_header *)p - 1;
+  if (h->h.cls != MEMORY_LARGE &&
+      size <= ((size_t)1 << (h->h.cls + MEMORY_SMALLEST_SHIFT))) {
+    h->h.size = size;
+    return p;
+  }
+
+  n = cache_alloc(t, size);
+  if (n == NULL) {
+    return NULL;
+  }
+  memcpy(n, p, (h->h.size < size)?h->h.size:size);
+  cache_free(p);
+
+  return n;
+}
+
+// memory_init: install OpenSSL memory functions for the mode
+int memory_init(int mode)
+{
+  int rc = 1;
+
+  if (mode == KSSL_MEMORY_DEFAULT) {
+    return 0;
+  }
+
+  if (uv_mutex_init(&threads_lock) != 0) {
+    return 1;
+  }
+
+  if (mode == KSSL_MEMORY_COUNT) {
+    rc = CRYPTO_set_mem_functions(count_malloc, count_realloc, free);
+  } else if (mode == KSSL_MEMORY_CACHE) {
+    rc = CRYPTO_set_mem_functions(cache_malloc, cache_realloc, cache_free);
+  }
+
+  // CRYPTO_set_mem_functions returns 0 if OpenSSL has already allocated
+  // memory
+
+  if (rc == 0) {
+    uv_mutex_destroy(&threads_lock);
+    return 1;
+  }
+
+  memory_mode = mode;
+  return 0;
+}
+
+// memory_thread_totals: get the allocation totals for the calling thread
+void memory_thread_totals(kssl_memory_totals *totals)
+{
+  if (current != NULL) {
+    totals->allocations = current->allocations;
+    totals->bytes = current->bytes;
+  } else {
+    totals->allocations = 0;
+    totals->bytes = 0;
+  }
+}
+
+// memory_thread_cleanup: return any cached blocks to the system
+void memory_thread_cleanup(void)
+{
+  int cls;
+
+  if (current == NULL) {
+    return;
+  }
+
+  for (cls = 0; cls < MEMORY_CLASSES; cls++) {
+    while (current->free[cls] != NULL) {
+      memory_block *b = current->free[cls];
+
+      current->free[cls] = b->next;
+      free(b);
+    }
+    current->depth[cls] = 0;
+  }
+}
+
+// memory_render: append process wide allocation counters
+void memory_render(metrics_buffer *b)
+{
+  unsigned int count = KSSL_LOAD_ACQUIRE(&thread_count);
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t hits = 0;
+  unsigned int i;
+
+  if (memory_mode == KSSL_MEMORY_DEFAULT) {
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    allocations += threads[i]->allocations;
+    bytes += threads[i]->bytes;
+    hits += threads[i]->cache_hits;
+  }
+
+  metrics_printf(b, "# HELP keyless_openssl_memory_allocations_total Allocations made by OpenSSL in all threads\n");
+  metrics_printf(b, "# TYPE keyless_openssl_memory_allocations_total counter\n");
+  metrics_printf(b, "keyless_openssl_memory_allocations_total %llu\n",
+                 (unsigned long long)allocations);
+  metrics_printf(b, "# HELP keyless_openssl_memory_allocated_bytes_total Bytes allocated by OpenSSL in all threads\n");
+  metrics_printf(b, "# TYPE keyless_openssl_memory_allocated_bytes_total counter\n");
+  metrics_printf(b, "keyless_openssl_memory_allocated_bytes_total %llu\n",
+                 (unsigned long long)bytes);
+
+  if (memory_mode == KSSL_MEMORY_CACHE) {
+    metrics_printf(b, "# HELP keyless_openssl_memory_cache_hits_total OpenSSL allocations served from a thread cache\n");
+    metrics_printf(b, "# TYPE keyless_openssl_memory_cache_hits_total counter\n");
+    metrics_printf(b, "keyless_openssl_memory_cache_hits_total %llu\n",
+                   (unsigned long long)hits);
+  }
+}
@@ -0,0 +1,41 @@
+// kssl_memory.h: OpenSSL allocation accounting and per-thread caching
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_MEMORY
+#define INCLUDED_KSSL_MEMORY 1
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// Modes for memory_init
+
+#define KSSL_MEMORY_DEFAULT 0 // OpenSSL uses malloc directly
+#define KSSL_MEMORY_COUNT   1 // Count allocations made by OpenSSL
+#define KSSL_MEMORY_CACHE   2 // Count and serve small allocations from
+                              // per-thread size class caches
+
+// Allocation counts for the calling thread since it started
+
+typedef struct {
+  uint64_t allocations; // Calls to malloc and realloc
+  uint64_t bytes;       // Bytes requested by those calls
+} kssl_memory_totals;
+
+// memory_init: install OpenSSL memory functions for the mode. Must be
+// called before any other OpenSSL function. Returns 0 on success.
+int memory_init(int mode);
+
+// memory_thread_totals: get the allocation totals for the calling
+// thread. Zero if memory_init was not called with a counting mode.
+void memory_thread_totals(kssl_memory_totals *totals);
+
+// memory_thread_cleanup: return any blocks cached by the calling thread
+// to the system allocator. Call before a thread that uses OpenSSL exits.
+void memory_thread_cleanup(void);
+
+// memory_render: append process wide allocation counters to a metrics
+// response. Does nothing in KSSL_MEMORY_DEFAULT mode.
+void memory_render(metrics_buffer *b);
+
+#endif // INCLUDED_KSSL_MEMORY
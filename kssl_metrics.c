@@ -0,0 +1,1107 @@
+// kssl_metrics.c: request counters, latency histograms and the
+// Prometheus metrics endpoint
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "kssl_helpers.h"
+
+#if !PLATFORM_WINDOWS
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "kssl_log.h"
+#include "kssl_metrics.h"
+#include "kssl_upgrade.h"
+
+// Opcode for each counter slot (see metrics_op_slot). Slot 0 has opcode
+// 0 which opstring() turns into UNKNOWN.
+
+static const BYTE slot_opcodes[KSSL_METRICS_OPS] = {
+  0,
+  KSSL_OP_PING,
+  KSSL_OP_RSA_DECRYPT,
+  KSSL_OP_RSA_DECRYPT_RAW,
+  KSSL_OP_RSA_SIGN_MD5SHA1,
+  KSSL_OP_RSA_SIGN_SHA1,
+  KSSL_OP_RSA_SIGN_SHA224,
+  KSSL_OP_RSA_SIGN_SHA256,
+  KSSL_OP_RSA_SIGN_SHA384,
+  KSSL_OP_RSA_SIGN_SHA512,
+  KSSL_OP_ECDSA_SIGN_MD5SHA1,
+  KSSL_OP_ECDSA_SIGN_SHA1,
+  KSSL_OP_ECDSA_SIGN_SHA224,
+  KSSL_OP_ECDSA_SIGN_SHA256,
+  KSSL_OP_ECDSA_SIGN_SHA384,
+  KSSL_OP_ECDSA_SIGN_SHA512
+};
+
+static const char *stage_names[KSSL_STAGES] = {
+  "queue",
+  "crypto",
+  "total",
+  "socket",
+  "arrival_total"
+};
+
+// metrics_new: allocate count zeroed shards
+kssl_metrics *metrics_new(int count)
+{
+  return (kssl_metrics *)calloc(count, sizeof(kssl_metrics));
+}
+
+// metrics_free: free shards allocated with metrics_new
+void metrics_free(kssl_metrics *shards)
+{
+  free(shards);
+}
+
+#if !PLATFORM_WINDOWS
+// shared_file: returns a descriptor for an anonymous file or -1. Memory
+// mapped from it stays shared with children across exec, which memory
+// from MAP_ANONYMOUS does not.
+static int shared_file(void)
+{
+  int fd = -1;
+  char path[] = "/tmp/keyless-metrics-XXXXXX";
+
+#if defined(__linux__) && defined(__NR_memfd_create)
+  fd = (int)syscall(__NR_memfd_create, "keyless-metrics", 0);
+#endif
+
+  if (fd == -1) {
+    fd = mkstemp(path);
+    if (fd != -1) {
+      unlink(path);
+    }
+  }
+
+  return fd;
+}
+#endif
+
+// metrics_new_shared: allocate count zeroed shards in shared memory
+kssl_metrics *metrics_new_shared(int count, int *fd)
+{
+#if !PLATFORM_WINDOWS
+  kssl_metrics *shards;
+
+  *fd = shared_file();
+  if (*fd == -1) {
+    return NULL;
+  }
+
+  if (ftruncate(*fd, (off_t)count * sizeof(kssl_metrics)) != 0) {
+    close(*fd);
+    *fd = -1;
+    return NULL;
+  }
+
+  shards = metrics_map(*fd, count);
+  if (shards == NULL) {
+    close(*fd);
+    *fd = -1;
+  }
+
+  return shards;
+#else
+  *fd = -1;
+  return NULL;
+#endif
+}
+
+// metrics_map: map the count shards shared through fd
+kssl_metrics *metrics_map(int fd, int count)
+{
+#if !PLATFORM_WINDOWS
+  void *p = mmap(NULL, count * sizeof(kssl_metrics),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  return (p == MAP_FAILED)?NULL:(kssl_metrics *)p;
+#else
+  return NULL;
+#endif
+}
+
+// metrics_unmap: unmap shards from metrics_new_shared or metrics_map
+void metrics_unmap(kssl_metrics *shards, int count)
+{
+#if !PLATFORM_WINDOWS
+  if (shards != NULL) {
+    munmap(shards, count * sizeof(kssl_metrics));
+  }
+#endif
+}
+
+// metrics_op_slot: map an opcode to its counter slot
+int metrics_op_slot(BYTE opcode)
+{
+  if (opcode == KSSL_OP_PING) {
+    return 1;
+  }
+  if (opcode == KSSL_OP_RSA_DECRYPT) {
+    return 2;
+  }
+  if (opcode == KSSL_OP_RSA_DECRYPT_RAW) {
+    return 3;
+  }
+  if (opcode >= KSSL_OP_RSA_SIGN_MD5SHA1 &&
+      opcode <= KSSL_OP_RSA_SIGN_SHA512) {
+    return 4 + opcode - KSSL_OP_RSA_SIGN_MD5SHA1;
+  }
+  if (opcode >= KSSL_OP_ECDSA_SIGN_MD5SHA1 &&
+      opcode <= KSSL_OP_ECDSA_SIGN_SHA512) {
+    return 10 + opcode - KSSL_OP_ECDSA_SIGN_MD5SHA1;
+  }
+
+  return 0;
+}
+
+// metrics_slot_opcode: returns the opcode counted in slot
+BYTE metrics_slot_opcode(int slot)
+{
+  return slot_opcodes[slot];
+}
+
+// elapsed_ns: returns to - from or 0 if either time is missing
+uint64_t elapsed_ns(uint64_t from, uint64_t to)
+{
+  if (from == 0 || to < from) {
+    return 0;
+  }
+
+  return to - from;
+}
+
+// last: returns the later of two times
+static uint64_t last(uint64_t a, uint64_t b)
+{
+  return (a > b)?a:b;
+}
+
+// step: set the start and end of a step
+static void step(kssl_step *s, uint64_t from, uint64_t to)
+{
+  s->from = from;
+  s->to = to;
+}
+
+// request_steps: break a completed request down into its steps
+void request_steps(kssl_op_info *info, kssl_request_times *times,
+                   kssl_step *steps)
+{
+  uint64_t respond_from;
+
+  // The response is built after whichever of these steps was the last
+  // one the request reached
+
+  respond_from = last(last(times->locked, info->parsed),
+                      last(info->lookup, info->crypto_end));
+
+  step(&steps[KSSL_STEP_QUEUE], times->read, times->start);
+  step(&steps[KSSL_STEP_LOCK], times->start, times->locked);
+  step(&steps[KSSL_STEP_PARSE], times->locked, info->parsed);
+  step(&steps[KSSL_STEP_LOOKUP], info->parsed, info->lookup);
+  step(&steps[KSSL_STEP_CRYPTO], info->crypto_start, info->crypto_end);
+  step(&steps[KSSL_STEP_RESPOND], respond_from, times->queued);
+  step(&steps[KSSL_STEP_FLUSH], times->queued, times->flushed);
+}
+
+// request_step_name: returns the short name of a step
+const char *request_step_name(int step)
+{
+  static const char *names[KSSL_STEPS] = KSSL_STEP_NAMES;
+
+  return (step >= 0 && step < KSSL_STEPS)?names[step]:"unknown";
+}
+
+// metrics_record: record a completed request
+void metrics_record(kssl_metrics *m, kssl_op_info *info,
+                    kssl_request_times *times)
+{
+  int slot = metrics_op_slot(info->opcode);
+  kssl_histogram *latency = m->latency[slot];
+
+  m->requests[slot] += 1;
+  if (info->error != KSSL_ERROR_NONE && info->error < KSSL_METRICS_ERRORS) {
+    m->errors[info->error] += 1;
+  }
+
+  histogram_record(&latency[KSSL_STAGE_QUEUE],
+                   elapsed_ns(times->read, times->start));
+  if (info->crypto_end != 0) {
+    histogram_record(&latency[KSSL_STAGE_CRYPTO],
+                     elapsed_ns(info->crypto_start, info->crypto_end));
+  }
+  histogram_record(&latency[KSSL_STAGE_TOTAL],
+                   elapsed_ns(times->read, times->flushed));
+
+  // Only known with --rx-timestamps
+
+  if (times->arrived != 0) {
+    histogram_record(&latency[KSSL_STAGE_SOCKET],
+                     elapsed_ns(times->arrived, times->read));
+    histogram_record(&latency[KSSL_STAGE_ARRIVAL_TOTAL],
+                     elapsed_ns(times->arrived, times->flushed));
+  }
+}
+
+// metrics_record_error: count an error response generated outside
+// kssl_operate
+void metrics_record_error(kssl_metrics *m, kssl_error_code err)
+{
+  if (err < KSSL_METRICS_ERRORS) {
+    m->errors[err] += 1;
+  }
+}
+
+// metrics_record_memory: add the OpenSSL allocations made by a request
+void metrics_record_memory(kssl_metrics *m, BYTE opcode,
+                           uint64_t allocations, uint64_t bytes)
+{
+  int slot = metrics_op_slot(opcode);
+
+  m->allocations[slot] += allocations;
+  m->allocated[slot] += bytes;
+}
+
+// metrics_record_perf: add the performance counters used by one stage
+// of a request
+void metrics_record_perf(kssl_metrics *m, int stage, BYTE opcode,
+                         int key_bits, kssl_perf_sample *s)
+{
+  kssl_perf_bucket *p;
+  int i;
+
+  p = &m->perf[stage][metrics_op_slot(opcode)][perf_key_bucket(key_bits)];
+  p->count += 1;
+  for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+    p->totals[i] += s->values[i];
+  }
+}
+
+// merge_perf: sum one performance counter bucket across count shards
+static void merge_perf(kssl_perf_bucket *merged, kssl_metrics *shards,
+                       int count, int stage, int slot, int key)
+{
+  int i, j;
+
+  memset(merged, 0, sizeof(*merged));
+  for (i = 0; i < count; i++) {
+    kssl_perf_bucket *p = &shards[i].perf[stage][slot][key];
+
+    merged->count += p->count;
+    for (j = 0; j < KSSL_PERF_COUNTERS; j++) {
+      merged->totals[j] += p->totals[j];
+    }
+  }
+}
+
+// render_perf: write out the performance counters merged across
+// workers. Counter -1 is the number of samples.
+static void render_perf(metrics_buffer *b, kssl_metrics *shards, int count,
+                        int counter)
+{
+  kssl_perf_bucket merged;
+  int stage, slot, key;
+
+  for (stage = 0; stage < KSSL_PERF_STAGES; stage++) {
+    for (slot = 0; slot < KSSL_METRICS_OPS; slot++) {
+      for (key = 0; key < KSSL_PERF_KEYS; key++) {
+        merge_perf(&merged, shards, count, stage, slot, key);
+        if (merged.count == 0) {
+          continue;
+        }
+
+        metrics_printf(b, "keyless_request_%s_total{op=\"%s\",key_bits=\"%s\",stage=\"%s\"} %llu\n",
+                       (counter == -1)?"counted":perf_counter_name(counter),
+                       opstring(slot_opcodes[slot]), perf_key_name(key),
+                       perf_stage_name(stage),
+                       (unsigned long long)((counter == -1)?merged.count:
+                                            merged.totals[counter]));
+      }
+    }
+  }
+}
+
+// metrics_dump_perf: log the mean performance counters per request
+void metrics_dump_perf(kssl_metrics *shards, int count)
+{
+  kssl_perf_bucket merged;
+  int stage, slot, key;
+
+  if (!perf_enabled()) {
+    return;
+  }
+
+  write_log(1, "Performance counters per request (op, key bits, stage, "
+            "requests, %s, %s, %s, %s):", perf_counter_name(0),
+            perf_counter_name(1), perf_counter_name(2),
+            perf_counter_name(3));
+  for (slot = 0; slot < KSSL_METRICS_OPS; slot++) {
+    for (key = 0; key < KSSL_PERF_KEYS; key++) {
+      for (stage = 0; stage < KSSL_PERF_STAGES; stage++) {
+        double n;
+
+        merge_perf(&merged, shards, count, stage, slot, key);
+        if (merged.count == 0) {
+          continue;
+        }
+
+        n = (double)merged.count;
+        write_log(1, "op:%s, key_bits:%s, stage:%s, requests:%llu, "
+                  "%.1f, %.1f, %.2f, %.2f", opstring(slot_opcodes[slot]),
+                  perf_key_name(key), perf_stage_name(stage),
+                  (unsigned long long)merged.count,
+                  (double)merged.totals[0] / n,
+                  (double)merged.totals[1] / n,
+                  (double)merged.totals[2] / n,
+                  (double)merged.totals[3] / n);
+      }
+    }
+  }
+}
+
+// metrics_vprintf: append vprintf formatted text to a metrics_buffer. If
+// memory cannot be allocated the text is dropped.
+void metrics_vprintf(metrics_buffer *b, const char *fmt, va_list args)
+{
+  va_list l;
+  int n;
+
+  while (1) {
+    size_t space = b->allocated - b->len;
+
+    va_copy(l, args);
+    n = vsnprintf(b->data?(b->data + b->len):NULL, b->data?space:0, fmt, l);
+    va_end(l);
+
+    if (n < 0) {
+      return;
+    }
+
+    if (b->data && (size_t)n < space) {
+      b->len += n;
+      return;
+    } else {
+      size_t size = b->allocated?b->allocated:4096;
+      char *data;
+
+      while (size < b->len + n + 1) {
+        size *= 2;
+      }
+
+      data = (char *)realloc(b->data, size);
+      if (data == NULL) {
+        return;
+      }
+
+      b->data = data;
+      b->allocated = size;
+    }
+  }
+}
+
+// metrics_printf: append printf formatted text to a metrics_buffer
+void metrics_printf(metrics_buffer *b, const char *fmt, ...)
+{
+  va_list l;
+
+  va_start(l, fmt);
+  metrics_vprintf(b, fmt, l);
+  va_end(l);
+}
+
+// render_histogram: write out a histogram in Prometheus format. labels
+// is inserted before the le label of each bucket and may be empty. Only
+// buckets that contain values are listed; Prometheus buckets are
+// cumulative so omitting empty ones loses nothing.
+static void render_histogram(metrics_buffer *b, const char *name,
+                             const char *labels, kssl_histogram *h)
+{
+  uint64_t cumulative = 0;
+  const char *sep = (labels[0] != '\0')?",":"";
+  int bucket;
+
+  for (bucket = 0; bucket < KSSL_HIST_BUCKETS; bucket++) {
+    if (h->buckets[bucket] == 0) {
+      continue;
+    }
+    cumulative += h->buckets[bucket];
+    metrics_printf(b, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                   (double)histogram_upper(bucket) / 1e9,
+                   (unsigned long long)cumulative);
+  }
+  metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+                 (unsigned long long)h->count);
+  metrics_printf(b, "%s_sum{%s} %.9f\n", name, labels, (double)h->sum / 1e9);
+  metrics_printf(b, "%s_count{%s} %llu\n", name, labels,
+                 (unsigned long long)h->count);
+}
+
+// metrics_render_log: render the number of binary records dropped
+// because a worker's queue was full
+void metrics_render_log(metrics_buffer *b)
+{
+  metrics_printf(b, "# HELP keyless_binary_records_dropped_total Binary access log and capture records dropped because a queue was full\n");
+  metrics_printf(b, "# TYPE keyless_binary_records_dropped_total counter\n");
+  metrics_printf(b, "keyless_binary_records_dropped_total{channel=\"access\"} %llu\n",
+                 (unsigned long long)log_binary_dropped(LOG_BINARY_ACCESS));
+  metrics_printf(b, "keyless_binary_records_dropped_total{channel=\"capture\"} %llu\n",
+                 (unsigned long long)log_binary_dropped(LOG_BINARY_CAPTURE));
+}
+
+// metrics_render: render count shards in Prometheus text format
+void metrics_render(metrics_buffer *b, kssl_metrics *shards, int count)
+{
+  kssl_histogram merged;
+  int i, j, k;
+
+  metrics_printf(b, "# HELP keyless_connections_total Connections accepted\n");
+  metrics_printf(b, "# TYPE keyless_connections_total counter\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_connections_total{worker=\"%d\"} %llu\n", i,
+                   (unsigned long long)shards[i].connections);
+  }
+
+  metrics_printf(b, "# HELP keyless_requests_total Requests processed\n");
+  metrics_printf(b, "# TYPE keyless_requests_total counter\n");
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < KSSL_METRICS_OPS; j++) {
+      if (shards[i].requests[j] != 0) {
+        metrics_printf(b, "keyless_requests_total{worker=\"%d\",op=\"%s\"} %llu\n",
+                       i, opstring(slot_opcodes[j]),
+                       (unsigned long long)shards[i].requests[j]);
+      }
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_errors_total Error responses sent\n");
+  metrics_printf(b, "# TYPE keyless_errors_total counter\n");
+  for (i = 0; i < count; i++) {
+    for (j = KSSL_ERROR_NONE + 1; j < KSSL_METRICS_ERRORS; j++) {
+      metrics_printf(b, "keyless_errors_total{worker=\"%d\",error=\"%s\"} %llu\n",
+                     i, errstring((BYTE)j),
+                     (unsigned long long)shards[i].errors[j]);
+    }
+  }
+
+  // Allocation counters are only non-zero if OpenSSL allocations are
+  // being counted (see --openssl-memory)
+
+  metrics_printf(b, "# HELP keyless_request_allocations_total OpenSSL allocations made while processing requests\n");
+  metrics_printf(b, "# TYPE keyless_request_allocations_total counter\n");
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < KSSL_METRICS_OPS; j++) {
+      if (shards[i].allocations[j] != 0) {
+        metrics_printf(b, "keyless_request_allocations_total{worker=\"%d\",op=\"%s\"} %llu\n",
+                       i, opstring(slot_opcodes[j]),
+                       (unsigned long long)shards[i].allocations[j]);
+      }
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_request_allocated_bytes_total Bytes OpenSSL allocated while processing requests\n");
+  metrics_printf(b, "# TYPE keyless_request_allocated_bytes_total counter\n");
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < KSSL_METRICS_OPS; j++) {
+      if (shards[i].allocated[j] != 0) {
+        metrics_printf(b, "keyless_request_allocated_bytes_total{worker=\"%d\",op=\"%s\"} %llu\n",
+                       i, opstring(slot_opcodes[j]),
+                       (unsigned long long)shards[i].allocated[j]);
+      }
+    }
+  }
+
+  // Histograms are only output for opcodes that have been seen
+
+  metrics_printf(b, "# HELP keyless_request_duration_seconds Request latency by stage\n");
+  metrics_printf(b, "# TYPE keyless_request_duration_seconds histogram\n");
+  for (j = 0; j < KSSL_METRICS_OPS; j++) {
+    for (k = 0; k < KSSL_STAGES; k++) {
+      char labels[128];
+
+      memset(&merged, 0, sizeof(merged));
+      for (i = 0; i < count; i++) {
+        histogram_merge(&merged, &shards[i].latency[j][k]);
+      }
+
+      if (merged.count == 0) {
+        continue;
+      }
+
+      snprintf(labels, sizeof(labels), "op=\"%s\",stage=\"%s\"",
+               opstring(slot_opcodes[j]), stage_names[k]);
+      render_histogram(b, "keyless_request_duration_seconds", labels,
+                       &merged);
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_rejected_connections_total Connections refused because the worker loop was saturated\n");
+  metrics_printf(b, "# TYPE keyless_rejected_connections_total counter\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_rejected_connections_total{worker=\"%d\"} %llu\n",
+                   i, (unsigned long long)shards[i].rejected);
+  }
+
+  metrics_printf(b, "# HELP keyless_loop_lag_seconds Most recent event loop lag\n");
+  metrics_printf(b, "# TYPE keyless_loop_lag_seconds gauge\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_loop_lag_seconds{worker=\"%d\"} %.9f\n", i,
+                   (double)shards[i].loop_lag / 1e9);
+  }
+
+  metrics_printf(b, "# HELP keyless_queued_responses Responses waiting to be written\n");
+  metrics_printf(b, "# TYPE keyless_queued_responses gauge\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_queued_responses{worker=\"%d\"} %llu\n", i,
+                   (unsigned long long)shards[i].queued);
+  }
+
+  metrics_printf(b, "# HELP keyless_loop_busy_seconds_total Time the event loop spent running callbacks\n");
+  metrics_printf(b, "# TYPE keyless_loop_busy_seconds_total counter\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_loop_busy_seconds_total{worker=\"%d\"} %.9f\n",
+                   i, (double)shards[i].loop_busy / 1e9);
+  }
+
+  metrics_printf(b, "# HELP keyless_loop_idle_seconds_total Time the event loop spent waiting for I/O\n");
+  metrics_printf(b, "# TYPE keyless_loop_idle_seconds_total counter\n");
+  for (i = 0; i < count; i++) {
+    metrics_printf(b, "keyless_loop_idle_seconds_total{worker=\"%d\"} %.9f\n",
+                   i, (double)shards[i].loop_idle / 1e9);
+  }
+
+  metrics_printf(b, "# HELP keyless_loop_lag_distribution_seconds Event loop lag measurements\n");
+  metrics_printf(b, "# TYPE keyless_loop_lag_distribution_seconds histogram\n");
+  for (i = 0; i < count; i++) {
+    char labels[32];
+
+    if (shards[i].loop_lag_histogram.count == 0) {
+      continue;
+    }
+
+    snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+    render_histogram(b, "keyless_loop_lag_distribution_seconds", labels,
+                     &shards[i].loop_lag_histogram);
+  }
+
+  // Performance counters are only collected with --perf-counters. They
+  // are merged across workers; the counter names depend on which
+  // counters the machine provides (see kssl_perf.h).
+
+  if (perf_enabled()) {
+    metrics_printf(b, "# HELP keyless_request_counted_total Request stages measured with performance counters\n");
+    metrics_printf(b, "# TYPE keyless_request_counted_total counter\n");
+    render_perf(b, shards, count, -1);
+
+    for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+      metrics_printf(b, "# HELP keyless_request_%s_total Performance counter %s by request stage\n",
+                     perf_counter_name(i), perf_counter_name(i));
+      metrics_printf(b, "# TYPE keyless_request_%s_total counter\n",
+                     perf_counter_name(i));
+      render_perf(b, shards, count, i);
+    }
+  }
+}
+
+// key_total: returns the total number of operations on a key
+static uint64_t key_total(kssl_key_stats *s)
+{
+  uint64_t total = 0;
+  int j;
+
+  for (j = 0; j < KSSL_KEY_OPS; j++) {
+    total += s->ops[j];
+  }
+
+  return total;
+}
+
+// ski_hex: write a key's SKI in hex into ski and return it
+static char *ski_hex(pk_list list, int key_id, char *ski)
+{
+  BYTE *k = key_ski(list, key_id);
+  int i;
+
+  for (i = 0; i < KSSL_SKI_SIZE; i++) {
+    snprintf(&ski[i * 2], 3, "%02x", k[i]);
+  }
+
+  return ski;
+}
+
+// metrics_render_keys: render the statistics of the top busiest keys.
+// The busiest keys are found with an insertion sort into an array of top
+// entries, which is cheap because top is small.
+void metrics_render_keys(metrics_buffer *b, pk_list list, int top)
+{
+  char ski[KSSL_SKI_SIZE * 2 + 1];
+  kssl_key_stats s;
+  int *busiest;
+  uint64_t *totals;
+  int found = 0;
+  int i, j;
+
+  if (top <= 0) {
+    return;
+  }
+
+  busiest = (int *)malloc(top * sizeof(int));
+  totals = (uint64_t *)malloc(top * sizeof(uint64_t));
+  if (busiest == NULL || totals == NULL) {
+    free(busiest);
+    free(totals);
+    return;
+  }
+
+  for (i = 0; i < key_count(list); i++) {
+    uint64_t total;
+
+    if (key_stats_get(list, i, &s) != 0) {
+      break;
+    }
+
+    total = key_total(&s);
+    if (total == 0 || (found == top && total <= totals[top-1])) {
+      continue;
+    }
+
+    j = (found < top)?found++:top-1;
+    while (j > 0 && totals[j-1] < total) {
+      busiest[j] = busiest[j-1];
+      totals[j] = totals[j-1];
+      j--;
+    }
+    busiest[j] = i;
+    totals[j] = total;
+  }
+
+  // Prometheus requires every sample of a metric to be together so the
+  // busiest keys are walked once per metric
+
+  metrics_printf(b, "# HELP keyless_key_requests_total Private key operations on the busiest keys\n");
+  metrics_printf(b, "# TYPE keyless_key_requests_total counter\n");
+  for (i = 0; i < found; i++) {
+    key_stats_get(list, busiest[i], &s);
+    for (j = 0; j < KSSL_KEY_OPS; j++) {
+      if (s.ops[j] != 0) {
+        metrics_printf(b, "keyless_key_requests_total{ski=\"%s\",op=\"%s\"} %llu\n",
+                       ski_hex(list, busiest[i], ski),
+                       opstring(key_stats_opcode(j)),
+                       (unsigned long long)s.ops[j]);
+      }
+    }
+  }
+
+  metrics_printf(b, "# HELP keyless_key_errors_total Failed private key operations on the busiest keys\n");
+  metrics_printf(b, "# TYPE keyless_key_errors_total counter\n");
+  for (i = 0; i < found; i++) {
+    key_stats_get(list, busiest[i], &s);
+    metrics_printf(b, "keyless_key_errors_total{ski=\"%s\"} %llu\n",
+                   ski_hex(list, busiest[i], ski),
+                   (unsigned long long)s.errors);
+  }
+
+  metrics_printf(b, "# HELP keyless_key_crypto_seconds_total Time spent in private key operations on the busiest keys\n");
+  metrics_printf(b, "# TYPE keyless_key_crypto_seconds_total counter\n");
+  for (i = 0; i < found; i++) {
+    key_stats_get(list, busiest[i], &s);
+    metrics_printf(b, "keyless_key_crypto_seconds_total{ski=\"%s\"} %.9f\n",
+                   ski_hex(list, busiest[i], ski),
+                   (double)s.crypto_ns / 1e9);
+  }
+
+  free(busiest);
+  free(totals);
+}
+
+// The metrics endpoint is a minimal HTTP/1.0 server. It reads a request
+// header, renders the metrics and closes the connection once the
+// response has been written.
+
+#define METRICS_MAX_REQUEST 2048
+
+// A scraper that has not sent a complete request after this many ms is
+// disconnected so that an idle connection cannot keep the loop running
+
+#define METRICS_TIMEOUT 2000
+
+typedef struct metrics_client_ metrics_client;
+
+struct metrics_server_ {
+  uv_tcp_t tcp;             // Listener on 127.0.0.1 (if tcp_active)
+  uv_pipe_t pipe;           // Listener on a Unix socket (if pipe_active)
+  int tcp_active;
+  int pipe_active;
+  int open;                 // Number of listeners not yet closed
+  char *path;               // Removed on close unless passed on
+  metrics_render_cb render; // Produces the response body
+  metrics_client *clients;  // Connected scrapers
+};
+
+struct metrics_client_ {
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  } handle;                 // Connection to the scraper
+  uv_timer_t timer;         // Disconnects a scraper that is too slow
+  uv_write_t write_req;
+  metrics_render_cb render; // Copied so the server can close first
+  metrics_client *next;     // In the server's list of clients
+  metrics_client **prev;    // NULL once removed from the list
+  char request[METRICS_MAX_REQUEST];
+  size_t request_len;
+  int open;                 // Number of handles not yet closed
+  int closing;
+  char header[256];         // Response status line and headers
+  metrics_buffer body;      // Response body
+};
+
+// metrics_client_close_cb: frees a client once its handles are closed
+static void metrics_client_close_cb(uv_handle_t *handle)
+{
+  metrics_client *client = (metrics_client *)handle->data;
+
+  client->open -= 1;
+  if (client->open == 0) {
+    free(client->body.data);
+    free(client);
+  }
+}
+
+// metrics_client_close: close a client's connection and timer and
+// remove it from the server's list
+static void metrics_client_close(metrics_client *client)
+{
+  if (client->closing) {
+    return;
+  }
+
+  client->closing = 1;
+  if (client->prev != NULL) {
+    *client->prev = client->next;
+    if (client->next != NULL) {
+      client->next->prev = client->prev;
+    }
+    client->prev = NULL;
+  }
+
+  uv_close((uv_handle_t *)&client->timer, metrics_client_close_cb);
+  uv_close((uv_handle_t *)&client->handle, metrics_client_close_cb);
+}
+
+// metrics_write_cb: the response has been sent so close the connection
+static void metrics_write_cb(uv_write_t *req, int status)
+{
+  metrics_client_close((metrics_client *)req->data);
+}
+
+// metrics_respond: render and send the response to a complete request
+static void metrics_respond(metrics_client *client)
+{
+  uv_buf_t bufs[2];
+  const char *status = "200 OK";
+  int rc;
+
+  uv_timer_stop(&client->timer);
+
+  if (strncmp(client->request, "GET ", 4) == 0) {
+    client->render(&client->body);
+  } else {
+    status = "405 Method Not Allowed";
+  }
+
+  snprintf(client->header, sizeof(client->header),
+           "HTTP/1.0 %s\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %lu\r\n"
+           "Connection: close\r\n\r\n",
+           status, (unsigned long)client->body.len);
+
+  bufs[0] = uv_buf_init(client->header, strlen(client->header));
+  bufs[1] = uv_buf_init(client->body.data, client->body.len);
+
+  client->write_req.data = (void *)client;
+  rc = uv_write(&client->write_req, (uv_stream_t *)&client->handle, bufs,
+                client->body.len?2:1, metrics_write_cb);
+  if (rc != 0) {
+    write_log(1, "Failed to write metrics response: %s", error_string(rc));
+    metrics_client_close(client);
+  }
+}
+
+// metrics_timer_cb: the scraper took too long to send its request
+static void metrics_timer_cb(uv_timer_t *handle)
+{
+  metrics_client_close((metrics_client *)handle->data);
+}
+
+// metrics_alloc_cb: read directly into the client's request buffer
+static void metrics_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  metrics_client *client = (metrics_client *)handle->data;
+
+  buf->base = client->request + client->request_len;
+  buf->len = sizeof(client->request) - 1 - client->request_len;
+}
+
+// metrics_read_cb: accumulate the request until the end of the header
+static void metrics_read_cb(uv_stream_t *stream, ssize_t nread,
+                            const uv_buf_t *buf)
+{
+  metrics_client *client = (metrics_client *)stream->data;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    uv_read_stop(stream);
+    metrics_client_close(client);
+    return;
+  }
+
+  client->request_len += nread;
+  client->request[client->request_len] = '\0';
+
+  if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")) {
+    uv_read_stop(stream);
+    metrics_respond(client);
+  } else if (client->request_len == sizeof(client->request) - 1) {
+    uv_read_stop(stream);
+    metrics_client_close(client);
+  }
+}
+
+// metrics_connection_cb: a scraper has connected to a listener
+static void metrics_connection_cb(uv_stream_t *listener, int status)
+{
+  metrics_server *server = (metrics_server *)listener->data;
+  metrics_client *client;
+  int rc;
+
+  if (status != 0) {
+    return;
+  }
+
+  client = (metrics_client *)calloc(1, sizeof(metrics_client));
+  if (client == NULL) {
+    write_log(1, "Memory allocation error");
+    return;
+  }
+
+  client->render = server->render;
+
+  if (listener->type == UV_TCP) {
+    rc = uv_tcp_init(listener->loop, &client->handle.tcp);
+  } else {
+    rc = uv_pipe_init(listener->loop, &client->handle.pipe, 0);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to create metrics connection: %s", error_string(rc));
+    free(client);
+    return;
+  }
+
+  client->handle.tcp.data = (void *)client;
+  client->open = 1;
+
+  rc = uv_timer_init(listener->loop, &client->timer);
+  if (rc != 0) {
+    write_log(1, "Failed to create metrics timer: %s", error_string(rc));
+    client->closing = 1;
+    uv_close((uv_handle_t *)&client->handle, metrics_client_close_cb);
+    return;
+  }
+
+  client->timer.data = (void *)client;
+  client->open = 2;
+
+  client->next = server->clients;
+  client->prev = &server->clients;
+  if (server->clients != NULL) {
+    server->clients->prev = &client->next;
+  }
+  server->clients = client;
+
+  rc = uv_accept(listener, (uv_stream_t *)&client->handle);
+  if (rc == 0) {
+    rc = uv_timer_start(&client->timer, metrics_timer_cb, METRICS_TIMEOUT,
+                        0);
+  }
+  if (rc == 0) {
+    rc = uv_read_start((uv_stream_t *)&client->handle, metrics_alloc_cb,
+                       metrics_read_cb);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to accept metrics connection: %s", error_string(rc));
+    metrics_client_close(client);
+  }
+}
+
+// metrics_server_close_cb: frees the server once all listeners are
+// closed
+static void metrics_server_close_cb(uv_handle_t *handle)
+{
+  metrics_server *server = (metrics_server *)handle->data;
+
+  server->open -= 1;
+  if (server->open == 0) {
+    free(server);
+  }
+}
+
+// metrics_listen: start serving metrics on a local port and/or Unix
+// socket, bound here or inherited in fds
+metrics_server *metrics_listen(uv_loop_t *loop, int port, const char *path,
+                               const int *fds, metrics_render_cb render)
+{
+  metrics_server *server;
+  int rc;
+
+  server = (metrics_server *)calloc(1, sizeof(metrics_server));
+  if (server == NULL) {
+    return NULL;
+  }
+
+  server->render = render;
+
+  if (port != 0) {
+    struct sockaddr_in addr;
+
+    rc = uv_ip4_addr("127.0.0.1", port, &addr);
+    if (rc == 0) {
+      rc = uv_tcp_init(loop, &server->tcp);
+    }
+    if (rc == 0) {
+      server->tcp_active = 1;
+      server->open += 1;
+      server->tcp.data = (void *)server;
+      if (fds != NULL && fds[0] != -1) {
+        rc = uv_tcp_open(&server->tcp, fds[0]);
+      } else {
+        rc = uv_tcp_bind(&server->tcp, (const struct sockaddr *)&addr, 0);
+      }
+    }
+    if (rc == 0) {
+      rc = uv_listen((uv_stream_t *)&server->tcp, SOMAXCONN,
+                     metrics_connection_cb);
+    }
+    if (rc != 0) {
+      write_log(1, "Failed to listen for metrics on port %d: %s", port,
+                error_string(rc));
+      metrics_close(server);
+      return NULL;
+    }
+  }
+
+  if (path != NULL) {
+    int inherited = (fds != NULL && fds[1] != -1);
+
+    // A socket left behind by a previous run would stop the bind from
+    // succeeding
+
+    if (!inherited) {
+      remove(path);
+    }
+
+    rc = uv_pipe_init(loop, &server->pipe, 0);
+    if (rc == 0) {
+      server->pipe_active = 1;
+      server->open += 1;
+      server->pipe.data = (void *)server;
+      if (inherited) {
+        rc = uv_pipe_open(&server->pipe, fds[1]);
+      } else {
+        rc = upgrade_pipe_bind(&server->pipe, path);
+      }
+    }
+    if (rc == 0) {
+      server->path = (char *)malloc(strlen(path)+1);
+      if (server->path != NULL) {
+        strcpy(server->path, path);
+      }
+      rc = uv_listen((uv_stream_t *)&server->pipe, SOMAXCONN,
+                     metrics_connection_cb);
+    }
+    if (rc != 0) {
+      write_log(1, "Failed to listen for metrics on %s: %s", path,
+                error_string(rc));
+      metrics_close(server);
+      return NULL;
+    }
+  }
+
+  return server;
+}
+
+// metrics_close: stop listening and disconnect any scrapers. The server
+// is freed once libuv has closed its handles.
+void metrics_close(metrics_server *server)
+{
+  if (server == NULL) {
+    return;
+  }
+
+  while (server->clients != NULL) {
+    metrics_client_close(server->clients);
+  }
+
+  if (server->open == 0) {
+    free(server);
+    return;
+  }
+
+  if (server->path != NULL) {
+    remove(server->path);
+    free(server->path);
+    server->path = NULL;
+  }
+
+  if (server->tcp_active) {
+    uv_close((uv_handle_t *)&server->tcp, metrics_server_close_cb);
+  }
+  if (server->pipe_active) {
+    uv_close((uv_handle_t *)&server->pipe, metrics_server_close_cb);
+  }
+}
+
+// metrics_fds: get the listening sockets to pass to a new process
+void metrics_fds(metrics_server *server, int *fds)
+{
+  fds[0] = -1;
+  fds[1] = -1;
+  if (server == NULL) {
+    return;
+  }
+
+#if !PLATFORM_WINDOWS
+  if (server->tcp_active) {
+    fds[0] = server->tcp.io_watcher.fd;
+  }
+  if (server->pipe_active) {
+    fds[1] = server->pipe.io_watcher.fd;
+  }
+#endif
+}
+
+// metrics_release_path: leave the Unix socket for the new process to remove
+void metrics_release_path(metrics_server *server)
+{
+  if (server == NULL) {
+    return;
+  }
+
+  free(server->path);
+  server->path = NULL;
+}
@@ -0,0 +1,224 @@
+// kssl_metrics.h: request counters, latency histograms and the
+// Prometheus metrics endpoint
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_METRICS
+#define INCLUDED_KSSL_METRICS 1
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <uv.h>
+
+#include "kssl.h"
+#include "kssl_private_key.h"
+#include "kssl_core.h"
+#include "kssl_histogram.h"
+#include "kssl_perf.h"
+
+// Requests are counted in a small number of opcode slots rather than by
+// raw opcode byte to keep each shard compact. Slot 0 is used for any
+// opcode that is not a request opcode (see metrics_op_slot).
+
+#define KSSL_METRICS_OPS 16
+
+// Every kssl_error_code has a counter
+
+#define KSSL_METRICS_ERRORS (KSSL_ERROR_INTERNAL + 1)
+
+// Latency is recorded for each of these stages of a request
+
+#define KSSL_STAGE_QUEUE  0 // Read from the network to start of processing
+#define KSSL_STAGE_CRYPTO 1 // The private key operation
+#define KSSL_STAGE_TOTAL  2 // Read from the network to response flushed
+#define KSSL_STAGE_SOCKET 3 // Arrival at the socket to read from the network
+#define KSSL_STAGE_ARRIVAL_TOTAL 4 // Arrival at the socket to response
+                                   // flushed
+#define KSSL_STAGES       5
+
+// Times (from uv_hrtime()) at which a request passed through each stage
+// of processing in the worker. Stages inside kssl_operate are recorded
+// in kssl_op_info.
+
+typedef struct {
+  uint64_t arrived; // Request bytes arrived at the socket (kernel receive
+                    // timestamp) or 0 if not known
+  uint64_t read;    // Request bytes read from the network
+  uint64_t start;   // Processing began (before taking pk_lock)
+  uint64_t locked;  // pk_lock acquired
+  uint64_t queued;  // Response queued for write
+  uint64_t flushed; // Response flushed to the network
+} kssl_request_times;
+
+// The consecutive steps of a request as broken down by the slow request
+// log (kssl_trace.h) and the binary access log (kssl_binlog.h). Steps a
+// request did not reach have a zero from or to.
+
+#define KSSL_STEP_QUEUE   0 // Read from the network to start of processing
+#define KSSL_STEP_LOCK    1 // Waiting for pk_lock
+#define KSSL_STEP_PARSE   2 // Parsing the payload
+#define KSSL_STEP_LOOKUP  3 // Finding the private key
+#define KSSL_STEP_CRYPTO  4 // The private key operation
+#define KSSL_STEP_RESPOND 5 // Building and queueing the response
+#define KSSL_STEP_FLUSH   6 // Queued to flushed to the network
+#define KSSL_STEPS        7
+
+// Initializer for an array of the names of the steps, in order. Used by
+// request_step_name and by keyless-logdump to label the stages of the
+// binary access log.
+
+#define KSSL_STEP_NAMES \
+  { "queue", "lock", "parse", "lookup", "crypto", "respond", "flush" }
+
+typedef struct {
+  uint64_t from; // uv_hrtime() at which the step began
+  uint64_t to;   // uv_hrtime() at which the step ended
+} kssl_step;
+
+// A metrics shard. There is one of these per worker and it is only ever
+// written by that worker's thread so no locking or atomic operations
+// are needed on the request path. Shards are merged when scraped; the
+// scraper may see a shard mid-update which at worst makes a histogram
+// count disagree with its buckets by one.
+
+typedef struct {
+  uint64_t connections;                  // Connections accepted
+  uint64_t requests[KSSL_METRICS_OPS];   // Requests by opcode slot
+  uint64_t errors[KSSL_METRICS_ERRORS];  // Errors by kssl_error_code
+  uint64_t allocations[KSSL_METRICS_OPS]; // OpenSSL allocations by opcode
+  uint64_t allocated[KSSL_METRICS_OPS];   // Bytes OpenSSL allocated
+  kssl_histogram latency[KSSL_METRICS_OPS][KSSL_STAGES];
+
+  // Event loop health (see kssl_loopmon.h)
+
+  uint64_t rejected;                     // Connections refused at accept
+  uint64_t loop_lag;                     // Most recent loop lag (ns)
+  uint64_t loop_measured;                // uv_hrtime() when loop_lag was
+                                         // measured
+  uint64_t loop_busy;                    // Time spent running callbacks (ns)
+  uint64_t loop_idle;                    // Time spent waiting for I/O (ns)
+  kssl_histogram loop_lag_histogram;     // All loop lag measurements (ns)
+  uint64_t queued;                       // Responses waiting to be written
+
+  // Performance counters by stage, opcode slot and key size (only
+  // written if perf_enabled())
+
+  kssl_perf_bucket perf[KSSL_PERF_STAGES][KSSL_METRICS_OPS][KSSL_PERF_KEYS];
+} kssl_metrics;
+
+// Growable buffer into which metrics are rendered
+
+typedef struct {
+  char  *data;      // NUL terminated contents
+  size_t len;       // Length of data excluding the NUL
+  size_t allocated; // Bytes allocated for data
+} metrics_buffer;
+
+// Called to render the body of a response to a scrape
+
+typedef void (*metrics_render_cb)(metrics_buffer *b);
+
+// Opaque handle for a listening metrics endpoint
+
+typedef struct metrics_server_ metrics_server;
+
+// metrics_new: allocate count zeroed shards. Returns NULL on failure.
+kssl_metrics *metrics_new(int count);
+
+// metrics_free: free shards allocated with metrics_new
+void metrics_free(kssl_metrics *shards);
+
+// metrics_new_shared: allocate count zeroed shards in shared memory
+// that other processes can map through *fd with metrics_map. Returns
+// NULL on failure. Not available on Windows.
+kssl_metrics *metrics_new_shared(int count, int *fd);
+
+// metrics_map: map the count shards shared through fd. Returns NULL on
+// failure.
+kssl_metrics *metrics_map(int fd, int count);
+
+// metrics_unmap: unmap shards from metrics_new_shared or metrics_map
+void metrics_unmap(kssl_metrics *shards, int count);
+
+// metrics_op_slot: map an opcode to its counter slot
+int metrics_op_slot(BYTE opcode);
+
+// metrics_slot_opcode: returns the opcode counted in slot (0 for slot 0)
+BYTE metrics_slot_opcode(int slot);
+
+// elapsed_ns: returns to - from or 0 if from is missing or after to
+uint64_t elapsed_ns(uint64_t from, uint64_t to);
+
+// request_steps: break a completed request down into its KSSL_STEPS
+// steps
+void request_steps(kssl_op_info *info, kssl_request_times *times,
+                   kssl_step *steps);
+
+// request_step_name: returns the short name of a step (e.g. "queue")
+const char *request_step_name(int step);
+
+// metrics_record: record a completed request
+void metrics_record(kssl_metrics *m, kssl_op_info *info,
+                    kssl_request_times *times);
+
+// metrics_record_error: count an error response that was generated
+// outside kssl_operate (e.g. a version mismatch)
+void metrics_record_error(kssl_metrics *m, kssl_error_code err);
+
+// metrics_record_memory: add the OpenSSL allocations made while
+// processing a request (see kssl_memory.h)
+void metrics_record_memory(kssl_metrics *m, BYTE opcode,
+                           uint64_t allocations, uint64_t bytes);
+
+// metrics_record_perf: add the performance counters used by one stage
+// of a request on a key of key_bits bits (0 for no key)
+void metrics_record_perf(kssl_metrics *m, int stage, BYTE opcode,
+                         int key_bits, kssl_perf_sample *s);
+
+// metrics_printf: append printf formatted text to a metrics_buffer
+void metrics_printf(metrics_buffer *b, const char *fmt, ...);
+
+// metrics_vprintf: append vprintf formatted text to a metrics_buffer
+void metrics_vprintf(metrics_buffer *b, const char *fmt, va_list args);
+
+// metrics_render: render count shards in Prometheus text format.
+// Counters are per worker, histograms are merged across workers.
+void metrics_render(metrics_buffer *b, kssl_metrics *shards, int count);
+
+// metrics_render_log: render the number of binary access log and
+// capture records dropped because a worker's queue was full (see
+// log_binary)
+void metrics_render_log(metrics_buffer *b);
+
+// metrics_dump_perf: log the mean performance counters per request
+// merged across count shards
+void metrics_dump_perf(kssl_metrics *shards, int count);
+
+// metrics_render_keys: render per key statistics (see key_stats_enable)
+// for the top busiest keys in list, busiest first. The caller must hold
+// pk_lock.
+void metrics_render_keys(metrics_buffer *b, pk_list list, int top);
+
+// metrics_listen: start serving HTTP on 127.0.0.1:port (if port is not
+// 0) and/or the Unix socket at path (if path is not NULL). If fds is not
+// NULL then fds[0] and fds[1] are listening sockets for the port and
+// path passed from another process by metrics_fds, used instead of
+// binding unless they are -1. Every GET is answered with the output of
+// render. Returns NULL on failure.
+metrics_server *metrics_listen(uv_loop_t *loop, int port, const char *path,
+                               const int *fds, metrics_render_cb render);
+
+// metrics_close: stop listening, disconnect any scrapers, remove the
+// Unix socket and free a metrics_server
+void metrics_close(metrics_server *server);
+
+// metrics_fds: store the listening sockets for the port and path of
+// server (or -1) in fds[0] and fds[1] to pass to another process
+void metrics_fds(metrics_server *server, int *fds);
+
+// metrics_release_path: once the process given the sockets by
+// metrics_fds is serving, stop metrics_close removing the Unix socket's
+// path, which that process now owns
+void metrics_release_path(metrics_server *server);
+
+#endif // INCLUDED_KSSL_METRICS
@@ -0,0 +1,259 @@
+// kssl_perf.c: per-thread hardware performance counters
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "kssl_helpers.h"
+#include "kssl_perf.h"
+
+// A counter that may be used in a slot
+
+typedef struct {
+  const char *name;
+  unsigned int type;    // PERF_TYPE_*
+  unsigned long config; // PERF_COUNT_*
+} perf_counter;
+
+#ifdef __linux__
+
+// The counters wanted in each slot and their substitutes if the
+// hardware counter cannot be opened
+
+static const perf_counter hardware[KSSL_PERF_COUNTERS] = {
+  {"cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"llc_misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+static const perf_counter software[KSSL_PERF_COUNTERS] = {
+  {"task_clock_ns",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {"page_faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  {"cpu_migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS}
+};
+
+#endif
+
+static const char *key_names[KSSL_PERF_KEYS] = {
+  "none",
+  "256",
+  "384",
+  "521",
+  "2048",
+  "3072",
+  "4096"
+};
+
+static const char *stage_names[KSSL_PERF_STAGES] = {
+  "tls_read",
+  "crypto",
+  "tls_write"
+};
+
+// Counters chosen by perf_init
+
+static const perf_counter *counters[KSSL_PERF_COUNTERS];
+static int enabled = 0;
+
+// The calling thread's group leader or -1 and the descriptors of all
+// the counters in the group (leader first)
+
+static KSSL_THREAD_LOCAL int group = -1;
+static KSSL_THREAD_LOCAL int members[KSSL_PERF_COUNTERS];
+
+#ifdef __linux__
+
+// Layout of a read() of a group opened with PERF_FORMAT_GROUP
+
+typedef struct {
+  uint64_t nr;
+  uint64_t values[KSSL_PERF_COUNTERS];
+} perf_group_read;
+
+// perf_open: open counter for the calling thread in group (-1 to make
+// it a group leader). Returns the file descriptor or -1 with errno set.
+static int perf_open(const perf_counter *counter, int leader)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counter->type;
+  attr.config = counter->config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  if (leader == -1) {
+    attr.read_format = PERF_FORMAT_GROUP;
+  }
+
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+#endif
+
+// perf_init: choose the counters to use
+int perf_init(void)
+{
+#ifdef __linux__
+  int i;
+
+  for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+    int fd = perf_open(&hardware[i], -1);
+
+    counters[i] = &hardware[i];
+    if (fd == -1) {
+      fd = perf_open(&software[i], -1);
+      counters[i] = &software[i];
+    }
+    if (fd == -1) {
+      return errno;
+    }
+    close(fd);
+  }
+
+  enabled = 1;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// perf_enabled: returns 1 if perf_init succeeded
+int perf_enabled(void)
+{
+  return enabled;
+}
+
+// perf_counter_name: returns the name of the counter in slot i
+const char *perf_counter_name(int i)
+{
+  return enabled?counters[i]->name:"none";
+}
+
+// perf_thread_start: open the counters for the calling thread. They all
+// count from now on and are read together.
+int perf_thread_start(void)
+{
+#ifdef __linux__
+  int i, j;
+
+  if (!enabled) {
+    return ENOSYS;
+  }
+
+  for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+    members[i] = perf_open(counters[i], (i == 0)?-1:members[0]);
+    if (members[i] == -1) {
+      int err = errno;
+
+      for (j = i - 1; j >= 0; j--) {
+        close(members[j]);
+      }
+      return err;
+    }
+  }
+
+  group = members[0];
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// perf_thread_stop: close the calling thread's counters
+void perf_thread_stop(void)
+{
+#ifdef __linux__
+  int i;
+
+  if (group == -1) {
+    return;
+  }
+
+  for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+    close(members[i]);
+  }
+  group = -1;
+#endif
+}
+
+// perf_read: read the calling thread's counters
+int perf_read(kssl_perf_sample *s)
+{
+#ifdef __linux__
+  perf_group_read r;
+
+  if (group == -1) {
+    return 0;
+  }
+
+  if (read(group, &r, sizeof(r)) != (ssize_t)sizeof(r) ||
+      r.nr != KSSL_PERF_COUNTERS) {
+    return 0;
+  }
+
+  memcpy(s->values, r.values, sizeof(s->values));
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// perf_add: add to - from to total
+void perf_add(kssl_perf_sample *total, kssl_perf_sample *from,
+              kssl_perf_sample *to)
+{
+  int i;
+
+  for (i = 0; i < KSSL_PERF_COUNTERS; i++) {
+    total->values[i] += to->values[i] - from->values[i];
+  }
+}
+
+// perf_key_bucket: returns the bucket for a key of bits bits. ECDSA and
+// RSA key sizes do not overlap so the size alone identifies the kind of
+// key.
+int perf_key_bucket(int bits)
+{
+  if (bits <= 0) {
+    return 0;
+  }
+  if (bits <= 256) {
+    return 1;
+  }
+  if (bits <= 384) {
+    return 2;
+  }
+  if (bits <= 521) {
+    return 3;
+  }
+  if (bits <= 2048) {
+    return 4;
+  }
+  if (bits <= 3072) {
+    return 5;
+  }
+
+  return 6;
+}
+
+// perf_key_name: returns the label for a key bucket
+const char *perf_key_name(int bucket)
+{
+  return key_names[bucket];
+}
+
+// perf_stage_name: returns the label for one of KSSL_PERF_*
+const char *perf_stage_name(int stage)
+{
+  return stage_names[stage];
+}
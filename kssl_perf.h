@@ -0,0 +1,85 @@
+// kssl_perf.h: per-thread hardware performance counters
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_PERF
+#define INCLUDED_KSSL_PERF 1
+
+#include "kssl.h"
+
+// When enabled (see perf_init) each worker thread opens a group of
+// perf_event_open counters that count only that thread's user space
+// execution. Reading the group around a piece of work gives the cycles,
+// instructions, last level cache misses and branch misses it cost. A
+// hardware counter that is not available (as is common in virtual
+// machines) is replaced by the software counter in the same slot: task
+// clock, page faults, context switches and CPU migrations.
+//
+// Counters are only available on Linux. Every read is a system call so
+// this is an instrumentation mode, not something to leave on.
+
+#define KSSL_PERF_COUNTERS 4
+
+// Parts of a request that counters are attributed to
+
+#define KSSL_PERF_TLS_READ  0 // SSL_read of the request
+#define KSSL_PERF_CRYPTO    1 // The private key operation
+#define KSSL_PERF_TLS_WRITE 2 // SSL_write of the response
+#define KSSL_PERF_STAGES    3
+
+// Requests are also divided by the size of the key used (see
+// perf_key_bucket)
+
+#define KSSL_PERF_KEYS 7
+
+// A reading of (or difference between two readings of) the calling
+// thread's counters
+
+typedef struct {
+  uint64_t values[KSSL_PERF_COUNTERS];
+} kssl_perf_sample;
+
+// Counter totals for one stage, opcode and key size
+
+typedef struct {
+  uint64_t count;                       // Samples added
+  uint64_t totals[KSSL_PERF_COUNTERS];  // Sum of the samples
+} kssl_perf_bucket;
+
+// perf_init: choose the counters to use and check that they can be
+// opened. Must be called before the worker threads start. Returns 0 on
+// success or an errno value.
+int perf_init(void);
+
+// perf_enabled: returns 1 if perf_init succeeded
+int perf_enabled(void);
+
+// perf_counter_name: returns the name of the counter in slot i
+const char *perf_counter_name(int i);
+
+// perf_thread_start: open the counters for the calling thread. Returns
+// 0 on success or an errno value.
+int perf_thread_start(void);
+
+// perf_thread_stop: close the calling thread's counters
+void perf_thread_stop(void);
+
+// perf_read: read the calling thread's counters into s. Returns 1 on
+// success, 0 if the thread has no counters.
+int perf_read(kssl_perf_sample *s);
+
+// perf_add: add to - from to total
+void perf_add(kssl_perf_sample *total, kssl_perf_sample *from,
+              kssl_perf_sample *to);
+
+// perf_key_bucket: returns the bucket for a key of bits bits (0 if no
+// key was used)
+int perf_key_bucket(int bits);
+
+// perf_key_name: returns the label for a key bucket
+const char *perf_key_name(int bucket);
+
+// perf_stage_name: returns the label for one of KSSL_PERF_*
+const char *perf_stage_name(int stage);
+
+#endif // INCLUDED_KSSL_PERF
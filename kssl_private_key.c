@@ -15,6 +15,7 @@
 #include "kssl_log.h"
 #include "kssl_private_key.h"
 #include "kssl_core.h"
+#include "kssl_probes.h"
 
 extern int silent;
 
@@ -30,6 +31,27 @@ struct pk_list_ {
   int current;           // Number of entries in privates
   int allocated;         // Size of the privates array
   private_key *privates; // Array of private_key
+  int shards;            // Number of statistics shards
+  kssl_key_stats *stats; // shards rows of allocated entries or NULL
+};
+
+// Opcode counted in each kssl_key_stats ops slot
+
+static const BYTE key_stats_opcodes[KSSL_KEY_OPS] = {
+  KSSL_OP_RSA_DECRYPT,
+  KSSL_OP_RSA_DECRYPT_RAW,
+  KSSL_OP_RSA_SIGN_MD5SHA1,
+  KSSL_OP_RSA_SIGN_SHA1,
+  KSSL_OP_RSA_SIGN_SHA224,
+  KSSL_OP_RSA_SIGN_SHA256,
+  KSSL_OP_RSA_SIGN_SHA384,
+  KSSL_OP_RSA_SIGN_SHA512,
+  KSSL_OP_ECDSA_SIGN_MD5SHA1,
+  KSSL_OP_ECDSA_SIGN_SHA1,
+  KSSL_OP_ECDSA_SIGN_SHA224,
+  KSSL_OP_ECDSA_SIGN_SHA256,
+  KSSL_OP_ECDSA_SIGN_SHA384,
+  KSSL_OP_ECDSA_SIGN_SHA512
 };
 
 // Private functions
@@ -152,7 +174,9 @@ static int constant_time_eq(BYTE *x, BYTE *y, int len) {
 
 // add_key_from_bio: adds an RSA key from a BIO pointer, returns
 // KSSL_ERROR_NONE if successful, or a KSSL_ERROR_* if a problem
-// occurs. Adds the private key to the list if successful.
+// occurs. Adds the private key to the list if successful. A key that
+// cannot be read is an error rather than fatal because keys can be
+// added while running (see copy_pk_list).
 static kssl_error_code add_key_from_bio(BIO *key_bp,     // BIO Key value in PEM format
                                         pk_list list) {  // Array of private keys 
   EVP_PKEY *local_key;
@@ -160,17 +184,26 @@ static kssl_error_code add_key_from_bio(BIO *key_bp,     // BIO Key value in PEM
 
   local_key = PEM_read_bio_PrivateKey(key_bp, 0, 0, 0);
   if (local_key == NULL) {
-    ssl_error();
+    write_log(1, "Failed to read private key: %s",
+              ERR_error_string(ERR_get_error(), NULL));
+    ERR_clear_error();
+    return KSSL_ERROR_INTERNAL;
   }
 
   if (list->current >= list->allocated) {
     write_log(1, "Private key list maximum reached");
+    EVP_PKEY_free(local_key);
     return KSSL_ERROR_INTERNAL;
   }
 
   if (local_key->type == EVP_PKEY_RSA) {
+    int ok;
+
     rsa = EVP_PKEY_get1_RSA(local_key);
-    if (rsa == NULL || RSA_check_key(rsa) != 1) {
+    ok = (rsa != NULL && RSA_check_key(rsa) == 1);
+    RSA_free(rsa);
+    if (!ok) {
+      EVP_PKEY_free(local_key);
       return KSSL_ERROR_INTERNAL;
     }
   }
@@ -178,10 +211,12 @@ static kssl_error_code add_key_from_bio(BIO *key_bp,     // BIO Key value in PEM
   list->privates[list->current].key = local_key;
 
   if(get_ski(local_key, list->privates[list->current].ski) != 0) {
+    EVP_PKEY_free(local_key);
     return KSSL_ERROR_INTERNAL;
   }
 
   if(digest_public_key(local_key, list->privates[list->current].digest) != 0) {
+    EVP_PKEY_free(local_key);
     return KSSL_ERROR_INTERNAL;
   }
 
@@ -212,6 +247,8 @@ pk_list new_pk_list(int count) {
 
   list->current = 0;
   list->allocated = count;
+  list->shards = 0;
+  list->stats = NULL;
 
   return list;
 }
@@ -228,10 +265,47 @@ void free_pk_list(pk_list list) {
       }
       free(list->privates);
     }
+    free(list->stats);
     free(list);
   }
 }
 
+// copy_pk_list: returns a copy of from with room for extra more keys.
+// The copy shares the EVP keys, which are reference counted.
+pk_list copy_pk_list(pk_list from, int extra) {
+  pk_list list = new_pk_list(from->current + extra);
+  int j;
+
+  if (list == NULL) {
+    return NULL;
+  }
+
+  for (j = 0; j < from->current; j++) {
+    list->privates[j] = from->privates[j];
+    CRYPTO_add(&list->privates[j].key->references, 1, CRYPTO_LOCK_EVP_PKEY);
+  }
+  list->current = from->current;
+
+  return list;
+}
+
+// remove_private_key: remove the key with the given SKI from list. The
+// keys after it move down so their ids change.
+int remove_private_key(pk_list list, BYTE *ski) {
+  int j = find_private_key(list, ski, NULL);
+
+  if (j < 0) {
+    return -1;
+  }
+
+  EVP_PKEY_free(list->privates[j].key);
+  memmove(&list->privates[j], &list->privates[j + 1],
+          (list->current - j - 1) * sizeof(private_key));
+  list->current -= 1;
+
+  return 0;
+}
+
 // add_key_from_file: adds a private key from a file location, returns
 // KSSL_ERROR_NONE if successful, or a KSSL_ERROR_* if a problem
 // occurs. Adds the private key to the list if successful.
@@ -249,6 +323,7 @@ kssl_error_code add_key_from_file(const char *path, // Path to file containing k
   rc = BIO_read_filename(bp, path);
   if (!rc) {
     write_log(1, "Failed to open private key file %s", path);
+    BIO_free(bp);
     return KSSL_ERROR_INTERNAL;
   }
 
@@ -327,14 +402,12 @@ int find_private_key(pk_list list,   // Array of private keys from new_pk_list
   return j;
 }
 
-// private_key_operation: perform a private key operation
-kssl_error_code private_key_operation(pk_list list,         // Private key array from new_pk_list
-                                      int key_id,           // ID of key in pk_list from find_private_key
-                                      int opcode,           // Opcode from a KSSL message indicating the operation
-                                      int length,           // Length of data in message
-                                      BYTE *message,        // Bytes to perform operation on
-                                      BYTE *out,            // Buffer into which operation output is written
-                                      unsigned int *size) { // Size of returned data written here
+// do_private_key_operation: perform a private key operation (see
+// private_key_operation)
+static kssl_error_code do_private_key_operation(pk_list list, int key_id,
+                                                int opcode, int length,
+                                                BYTE *message, BYTE *out,
+                                                unsigned int *size) {
   RSA *rsa;
   EC_KEY *ec_key;
   int digest_nid;
@@ -388,8 +461,193 @@ kssl_error_code private_key_operation(pk_list list,         // Private key array
   return KSSL_ERROR_NONE;
 }
 
+// private_key_operation: perform a private key operation
+kssl_error_code private_key_operation(pk_list list,         // Private key array from new_pk_list
+                                      int key_id,           // ID of key in pk_list from find_private_key
+                                      int opcode,           // Opcode from a KSSL message indicating the operation
+                                      int length,           // Length of data in message
+                                      BYTE *message,        // Bytes to perform operation on
+                                      BYTE *out,            // Buffer into which operation output is written
+                                      unsigned int *size) { // Size of returned data written here
+  kssl_error_code err;
+
+  KSSL_PROBE3(crypto__start, opcode, key_id, length);
+  err = do_private_key_operation(list, key_id, opcode, length, message, out,
+                                 size);
+  KSSL_PROBE4(crypto__done, opcode, key_id,
+              (err == KSSL_ERROR_NONE)?*size:0, err);
+
+  return err;
+}
+
 // key_size: returns the size of an RSA key in bytes
 int key_size(pk_list list,  // Array of private keys from new_pk_list
              int key_id) {  // ID of key from find_private_key
   return EVP_PKEY_size(list->privates[key_id].key);
 }
+
+// key_bits: returns the size of a key in bits
+int key_bits(pk_list list, int key_id) {
+  return EVP_PKEY_bits(list->privates[key_id].key);
+}
+
+// key_count: returns the number of keys in the list
+int key_count(pk_list list) {
+  return list->current;
+}
+
+// key_ski: returns the SKI of a key
+BYTE *key_ski(pk_list list, int key_id) {
+  return list->privates[key_id].ski;
+}
+
+// key_digest: returns the public key digest of a key
+BYTE *key_digest(pk_list list, int key_id) {
+  return list->privates[key_id].digest;
+}
+
+// key_stats_enable: allocate zeroed statistics for shards threads
+int key_stats_enable(pk_list list, int shards) {
+  list->stats = (kssl_key_stats *)calloc((size_t)shards * list->allocated,
+                                         sizeof(kssl_key_stats));
+  if (list->stats == NULL) {
+    return 1;
+  }
+
+  list->shards = shards;
+  return 0;
+}
+
+// key_stats_slot: returns the ops slot for opcode or -1 if it is not a
+// private key operation
+static int key_stats_slot(BYTE opcode) {
+  if (opcode == KSSL_OP_RSA_DECRYPT) {
+    return 0;
+  }
+  if (opcode == KSSL_OP_RSA_DECRYPT_RAW) {
+    return 1;
+  }
+  if (opcode >= KSSL_OP_RSA_SIGN_MD5SHA1 &&
+      opcode <= KSSL_OP_RSA_SIGN_SHA512) {
+    return 2 + opcode - KSSL_OP_RSA_SIGN_MD5SHA1;
+  }
+  if (opcode >= KSSL_OP_ECDSA_SIGN_MD5SHA1 &&
+      opcode <= KSSL_OP_ECDSA_SIGN_SHA512) {
+    return 8 + opcode - KSSL_OP_ECDSA_SIGN_MD5SHA1;
+  }
+
+  return -1;
+}
+
+// key_stats_opcode: returns the opcode counted in ops[slot]
+BYTE key_stats_opcode(int slot) {
+  return key_stats_opcodes[slot];
+}
+
+// key_stats_record: count an operation on a key
+void key_stats_record(pk_list list, int shard, int key_id, BYTE opcode,
+                      int failed, uint64_t ns) {
+  kssl_key_stats *s;
+  int slot = key_stats_slot(opcode);
+
+  if (list->stats == NULL || shard < 0 || shard >= list->shards ||
+      key_id < 0 || key_id >= list->current || slot < 0) {
+    return;
+  }
+
+  s = &list->stats[(size_t)shard * list->allocated + key_id];
+  s->ops[slot] += 1;
+  if (failed) {
+    s->errors += 1;
+  }
+  s->crypto_ns += ns;
+}
+
+// key_stats_get: sum a key's statistics across shards
+int key_stats_get(pk_list list, int key_id, kssl_key_stats *total) {
+  int i, j;
+
+  memset(total, 0, sizeof(kssl_key_stats));
+  if (list->stats == NULL || key_id < 0 || key_id >= list->current) {
+    return 1;
+  }
+
+  for (i = 0; i < list->shards; i++) {
+    kssl_key_stats *s = &list->stats[(size_t)i * list->allocated + key_id];
+
+    for (j = 0; j < KSSL_KEY_OPS; j++) {
+      total->ops[j] += s->ops[j];
+    }
+    total->errors += s->errors;
+    total->crypto_ns += s->crypto_ns;
+  }
+
+  return 0;
+}
+
+// digest_hash: returns a hash table index for a digest. The digest is
+// SHA256 so its leading bytes are already uniformly distributed.
+static unsigned int digest_hash(BYTE *digest, unsigned int mask) {
+  return ((unsigned int)digest[0] | ((unsigned int)digest[1] << 8) |
+          ((unsigned int)digest[2] << 16) |
+          ((unsigned int)digest[3] << 24)) & mask;
+}
+
+// key_stats_migrate: copy the statistics of keys present in both lists.
+// Keys are matched through an open addressing hash table of the old
+// list's digests so that reloading many keys stays linear.
+void key_stats_migrate(pk_list to, pk_list from) {
+  unsigned int size = 1;
+  unsigned int mask;
+  int *table;
+  int shards;
+  int i, j;
+
+  if (to->stats == NULL || from->stats == NULL || from->current == 0) {
+    return;
+  }
+
+  while (size < (unsigned int)from->current * 2) {
+    size <<= 1;
+  }
+  mask = size - 1;
+
+  table = (int *)malloc(size * sizeof(int));
+  if (table == NULL) {
+    write_log(1, "Failed to allocate memory to preserve key statistics");
+    return;
+  }
+  for (i = 0; i < (int)size; i++) {
+    table[i] = -1;
+  }
+
+  for (i = 0; i < from->current; i++) {
+    unsigned int h = digest_hash(from->privates[i].digest, mask);
+
+    while (table[h] != -1) {
+      h = (h + 1) & mask;
+    }
+    table[h] = i;
+  }
+
+  shards = (to->shards < from->shards)?to->shards:from->shards;
+
+  for (i = 0; i < to->current; i++) {
+    unsigned int h = digest_hash(to->privates[i].digest, mask);
+
+    for (; table[h] != -1; h = (h + 1) & mask) {
+      int old = table[h];
+
+      if (memcmp(from->privates[old].digest, to->privates[i].digest,
+                 KSSL_DIGEST_SIZE) == 0) {
+        for (j = 0; j < shards; j++) {
+          to->stats[(size_t)j * to->allocated + i] =
+            from->stats[(size_t)j * from->allocated + old];
+        }
+        break;
+      }
+    }
+  }
+
+  free(table);
+}
@@ -10,6 +10,22 @@
 // public definition of private key list
 typedef struct pk_list_* pk_list;
 
+// Per key statistics are counted for each private key opcode (see
+// key_stats_opcode)
+
+#define KSSL_KEY_OPS 14
+
+// Statistics for a single key. When enabled with key_stats_enable a
+// pk_list has one of these per key per shard. Each shard is written by
+// a single thread so no locking is needed and, because a shard's
+// entries are contiguous, threads do not share cachelines.
+
+typedef struct {
+  uint64_t ops[KSSL_KEY_OPS]; // Operations by opcode
+  uint64_t errors;            // Operations that failed
+  uint64_t crypto_ns;         // Time spent in private key operations
+} kssl_key_stats;
+
 // interface for private key list
 
 // new_pk_list: initializes an array of private keys. Returns a
@@ -21,6 +37,20 @@ pk_list new_pk_list(int count);
 // to new_pk_list
 void free_pk_list(pk_list list);
 
+// copy_pk_list: returns a new list holding the keys of from with room
+// for extra more, or NULL on failure. Used to add or remove a key
+// without reloading them all. Statistics are not copied (see
+// key_stats_migrate).
+pk_list copy_pk_list(
+  pk_list     from,     // Array of private keys from new_pk_list
+  int         extra);   // Number of keys that will be added
+
+// remove_private_key: remove the key with the given SKI (KSSL_SKI_SIZE
+// bytes) from list. Returns 0 if it was removed, -1 if it was not found.
+int remove_private_key(
+  pk_list     list,     // Array of private keys from new_pk_list
+  BYTE       *ski);     // SKI of key to remove
+
 // add_key_from_file: adds an EVP key from a file location, returns
 // KSSL_ERROR_NONE if successful, or a KSSL_ERROR_* if a problem
 // occurs. Adds the private key to the list if successful.
@@ -59,4 +89,59 @@ int key_size(
   pk_list     list,     // Array of private keys from new_pk_list
   int         key_id);  // ID of key from find_private_key
 
+// key_bits: returns the size of a key in bits (the modulus for RSA, the
+// order of the curve for ECDSA)
+int key_bits(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         key_id);  // ID of key from find_private_key
+
+// key_count: returns the number of keys in the list
+int key_count(
+  pk_list     list);    // Array of private keys from new_pk_list
+
+// key_ski: returns the SKI of a key (KSSL_SKI_SIZE bytes)
+BYTE *key_ski(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         key_id);  // ID of key from find_private_key
+
+// key_digest: returns the public key digest of a key (KSSL_DIGEST_SIZE
+// bytes, see digest_public_key)
+BYTE *key_digest(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         key_id);  // ID of key from find_private_key
+
+// key_stats_enable: allocate zeroed statistics for shards threads.
+// Returns 0 on success.
+int key_stats_enable(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         shards);  // Number of threads that will record statistics
+
+// key_stats_record: count an operation on a key. Must only be called
+// by the thread that owns shard. Does nothing if statistics are not
+// enabled or key_id is not valid.
+void key_stats_record(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         shard,    // Shard of the calling thread
+  int         key_id,   // ID of key from find_private_key
+  BYTE        opcode,   // Opcode of the operation
+  int         failed,   // 1 if the operation failed
+  uint64_t    ns);      // Time spent in the private key operation
+
+// key_stats_get: sum a key's statistics across shards into total.
+// Returns 0 on success, 1 if statistics are not enabled.
+int key_stats_get(
+  pk_list     list,     // Array of private keys from new_pk_list
+  int         key_id,   // ID of key from find_private_key
+  kssl_key_stats *total);
+
+// key_stats_opcode: returns the opcode counted in ops[slot]
+BYTE key_stats_opcode(int slot);
+
+// key_stats_migrate: copy the statistics of every key in from that is
+// also in to (compared by public key digest). Used so that counters
+// survive a reload of the private keys.
+void key_stats_migrate(
+  pk_list     to,       // Newly loaded keys with statistics enabled
+  pk_list     from);    // Keys being replaced
+
 #endif // INCLUDED_KSSL_PRIVATE_KEY
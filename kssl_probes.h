@@ -0,0 +1,48 @@
+// kssl_probes.h: USDT static tracepoints
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+//
+// When built with KSSL_USDT defined (the Makefile does this if
+// sys/sdt.h from systemtap is installed) the following probes are
+// placed in the binary under the provider name keyless. Each compiles to
+// a single nop so there is no cost unless a tracer (bpftrace, perf,
+// SystemTap) is attached. For example:
+//
+//   bpftrace -e 'usdt:o/keyless:keyless:crypto__done { @[arg0] = count(); }'
+//
+// accept(worker, conn)                     Connection accepted
+// handshake__start(worker, conn)           TLS handshake started
+// handshake__done(worker, conn, ok)        TLS handshake completed (ok 1)
+//                                          or failed (ok 0)
+// request__parsed(id, opcode, payload_len) Request payload parsed
+// key__lookup(id, opcode, key_id)          Key lookup done (key_id -1 if
+//                                          not found)
+// crypto__start(opcode, key_id, length)    Private key operation starting
+// crypto__done(opcode, key_id, size, err)  Private key operation done
+// response__flushed(id, opcode, len, err)  Response written to the network
+// queue__overflow(worker, conn)            Connection write queue full
+// reload__start()                          Private key reload starting
+// reload__done(count)                      count private keys loaded
+//
+// conn is the address of the connection's connection_state.
+
+#ifndef INCLUDED_KSSL_PROBES
+#define INCLUDED_KSSL_PROBES 1
+
+#if KSSL_USDT
+#include <sys/sdt.h>
+
+#define KSSL_PROBE0(name)             DTRACE_PROBE(keyless, name)
+#define KSSL_PROBE1(name, a)          DTRACE_PROBE1(keyless, name, a)
+#define KSSL_PROBE2(name, a, b)       DTRACE_PROBE2(keyless, name, a, b)
+#define KSSL_PROBE3(name, a, b, c)    DTRACE_PROBE3(keyless, name, a, b, c)
+#define KSSL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(keyless, name, a, b, c, d)
+#else
+#define KSSL_PROBE0(name)
+#define KSSL_PROBE1(name, a)
+#define KSSL_PROBE2(name, a, b)
+#define KSSL_PROBE3(name, a, b, c)
+#define KSSL_PROBE4(name, a, b, c, d)
+#endif
+
+#endif // INCLUDED_KSSL_PROBES
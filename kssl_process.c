@@ -0,0 +1,334 @@
+// kssl_process.c: prefork worker processes sharing the listening port
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kssl_helpers.h"
+
+#if !PLATFORM_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "kssl_log.h"
+#include "kssl_upgrade.h"
+#include "kssl_process.h"
+
+#if !PLATFORM_WINDOWS
+
+extern char **environ;
+
+// A child that exits within RESTART_MIN (ns) of starting is restarted
+// after RESTART_DELAY (ms) so that one that cannot start does not spin.
+// If it has never lasted RESTART_MIN it most likely cannot start at all
+// (bad arguments, keys or permissions) and the supervisor gives up.
+
+#define RESTART_MIN   1000000000ULL
+#define RESTART_DELAY 1000
+
+typedef struct {
+  int index;
+  int fd;                // Listening socket
+  int running;           // 1 from uv_spawn until the handle is closed
+  int lasted;            // 1 once it has run for RESTART_MIN
+  uint64_t started;      // uv_hrtime() when started
+  char env[32];          // KSSL_PROCESS_ENV=index
+  uv_process_t process;
+  uv_timer_t restart;    // Delays restarts (see RESTART_DELAY)
+} child;
+
+static child *children = NULL;
+static int child_count = 0;
+static int stopping = 0;
+
+// Passed to every child
+
+static const char *child_file = NULL;
+static char **child_args = NULL;
+static int child_metrics_fd = -1;
+static process_failed_cb child_failed = NULL;
+
+static void start_child(child *c);
+
+// restart_cb: start a child after RESTART_DELAY
+static void restart_cb(uv_timer_t *timer)
+{
+  start_child((child *)timer->data);
+}
+
+// schedule_restart: start c again, after a delay if it did not last
+static void schedule_restart(child *c)
+{
+  uint64_t ran = uv_hrtime() - c->started;
+
+  if (stopping) {
+    return;
+  }
+
+  if (ran >= RESTART_MIN) {
+    c->lasted = 1;
+    start_child(c);
+    return;
+  }
+
+  // Restarting would only fail again while the sockets accept
+  // connections that nothing serves
+
+  if (!c->lasted) {
+    write_log(1, "Process %d exited within a second of its first start, "
+              "not restarting", c->index);
+    if (child_failed != NULL) {
+      child_failed(c->index);
+    }
+    return;
+  }
+
+  write_log(1, "Process %d exited within a second of starting, "
+            "restarting in %d ms", c->index, RESTART_DELAY);
+  uv_timer_start(&c->restart, restart_cb, RESTART_DELAY, 0);
+}
+
+// child_close_cb: the handle of an exited child has been closed so it
+// may be reused
+static void child_close_cb(uv_handle_t *handle)
+{
+  child *c = (child *)handle->data;
+
+  c->running = 0;
+  schedule_restart(c);
+}
+
+// child_exit_cb: a child has exited
+static void child_exit_cb(uv_process_t *process, int64_t status,
+                          int signal)
+{
+  child *c = (child *)process->data;
+
+  if (!stopping) {
+    write_log(1, "Process %d (pid %d) exited with status %d signal %d",
+              c->index, process->pid, (int)status, signal);
+  }
+
+  uv_close((uv_handle_t *)process, child_close_cb);
+}
+
+// start_child: start the child c. It gets this process's environment
+// with its index added, its listening socket and the shared metrics.
+static void start_child(child *c)
+{
+  int rc, i, n;
+  char **env;
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[KSSL_PROCESS_METRICS_FD + 1];
+
+  for (n = 0; environ[n] != NULL; n++) {
+  }
+  env = (char **)malloc((n + 2) * sizeof(char *));
+  if (env == NULL) {
+    write_log(1, "Failed to start process %d: out of memory", c->index);
+    c->started = uv_hrtime();
+    schedule_restart(c);
+    return;
+  }
+
+  n = 0;
+  for (i = 0; environ[i] != NULL; i++) {
+    if (strncmp(environ[i], KSSL_PROCESS_ENV "=",
+                strlen(KSSL_PROCESS_ENV) + 1) != 0 &&
+        strncmp(environ[i], KSSL_UPGRADE_ENV "=",
+                strlen(KSSL_UPGRADE_ENV) + 1) != 0) {
+      env[n++] = environ[i];
+    }
+  }
+  env[n++] = c->env;
+  env[n] = NULL;
+
+  for (i = 0; i < KSSL_PROCESS_LISTEN_FD; i++) {
+    stdio[i].flags = UV_INHERIT_FD;
+    stdio[i].data.fd = i;
+  }
+  stdio[KSSL_PROCESS_LISTEN_FD].flags = UV_INHERIT_FD;
+  stdio[KSSL_PROCESS_LISTEN_FD].data.fd = c->fd;
+  stdio[KSSL_PROCESS_METRICS_FD].flags = UV_INHERIT_FD;
+  stdio[KSSL_PROCESS_METRICS_FD].data.fd = child_metrics_fd;
+
+  memset(&options, 0, sizeof(options));
+  options.exit_cb = child_exit_cb;
+  options.file = child_file;
+  options.args = child_args;
+  options.env = env;
+  options.stdio_count = KSSL_PROCESS_METRICS_FD + 1;
+  options.stdio = stdio;
+
+  c->started = uv_hrtime();
+  c->running = 1;
+  c->process.data = (void *)c;
+  rc = uv_spawn(c->restart.loop, &c->process, &options);
+  free(env);
+
+  if (rc != 0) {
+    write_log(1, "Failed to start process %d: %s", c->index,
+              error_string(rc));
+    uv_close((uv_handle_t *)&c->process, child_close_cb);
+    return;
+  }
+
+  write_log(0, "Started process %d (pid %d)", c->index, c->process.pid);
+}
+
+#endif
+
+// process_child: returns the index of this process if it is a child
+// started by process_start or -1
+int process_child(void)
+{
+#if !PLATFORM_WINDOWS
+  const char *env = getenv(KSSL_PROCESS_ENV);
+  int index;
+
+  if (env == NULL) {
+    return -1;
+  }
+
+  index = atoi(env);
+  unsetenv(KSSL_PROCESS_ENV);
+
+  // The inherited descriptors must not be passed on and a child must
+  // not outlive its supervisor
+
+  fcntl(KSSL_PROCESS_LISTEN_FD, F_SETFD, FD_CLOEXEC);
+  fcntl(KSSL_PROCESS_METRICS_FD, F_SETFD, FD_CLOEXEC);
+
+#ifdef __linux__
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() == 1) {
+    exit(1);
+  }
+#endif
+
+  return index;
+#else
+  return -1;
+#endif
+}
+
+// process_listen: bind count SO_REUSEPORT listening sockets to addr
+int process_listen(const struct sockaddr_in *addr, int count)
+{
+#if !PLATFORM_WINDOWS && defined(SO_REUSEPORT)
+  int i, on = 1;
+
+  children = (child *)calloc(count, sizeof(child));
+  if (children == NULL) {
+    return ENOMEM;
+  }
+
+  for (i = 0; i < count; i++) {
+    child *c = &children[i];
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    c->index = i;
+    c->fd = fd;
+    snprintf(c->env, sizeof(c->env), "%s=%d", KSSL_PROCESS_ENV, i);
+
+    // The socket starts listening now so that connections queue while
+    // the children load their keys and while one is being restarted
+
+    if (fd == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+      int err = errno;
+
+      for (; i >= 0; i--) {
+        if (children[i].fd != -1) {
+          close(children[i].fd);
+        }
+      }
+      free(children);
+      children = NULL;
+      return err;
+    }
+  }
+
+  child_count = count;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// process_start: start a child for each socket made by process_listen
+int process_start(uv_loop_t *loop, const char *file, char **args,
+                  int metrics_fd, process_failed_cb failed)
+{
+#if !PLATFORM_WINDOWS
+  int i;
+
+  child_file = file;
+  child_args = args;
+  child_metrics_fd = metrics_fd;
+  child_failed = failed;
+
+  for (i = 0; i < child_count; i++) {
+    int rc = uv_timer_init(loop, &children[i].restart);
+    if (rc != 0) {
+      return -rc;
+    }
+    children[i].restart.data = (void *)&children[i];
+  }
+
+  for (i = 0; i < child_count; i++) {
+    start_child(&children[i]);
+  }
+
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// process_signal: send signum to every running child
+void process_signal(int signum)
+{
+#if !PLATFORM_WINDOWS
+  int i;
+
+  for (i = 0; i < child_count; i++) {
+    if (children[i].running) {
+      uv_process_kill(&children[i].process, signum);
+    }
+  }
+#endif
+}
+
+// process_stop: stop the children and close the listening sockets. The
+// children have their own copies so they can drain.
+void process_stop(void)
+{
+#if !PLATFORM_WINDOWS
+  int i;
+
+  stopping = 1;
+  process_signal(SIGTERM);
+
+  for (i = 0; i < child_count; i++) {
+    uv_close((uv_handle_t *)&children[i].restart, NULL);
+    close(children[i].fd);
+  }
+#endif
+}
@@ -0,0 +1,66 @@
+// kssl_process.h: prefork worker processes sharing the listening port
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_PROCESS
+#define INCLUDED_KSSL_PROCESS 1
+
+#include <uv.h>
+
+#include "kssl.h"
+
+// With --processes keyless runs as a supervisor and a number of child
+// processes, each a complete keyless with its own OpenSSL state, keys
+// and workers. OpenSSL 1.0.2 serializes threads on its global locks, so
+// processes scale further than threads. The supervisor binds one
+// listening socket per child with SO_REUSEPORT and keeps them open, so
+// the kernel spreads connections across the children and a restarted
+// child picks up the connections queued for its predecessor.
+//
+// Children are new copies of the executable started with the same
+// arguments. Each finds its index through KSSL_PROCESS_ENV, its
+// listening socket on KSSL_PROCESS_LISTEN_FD and the shared metrics (see
+// metrics_new_shared) on KSSL_PROCESS_METRICS_FD. The supervisor
+// restarts any child that exits until it is stopped, except one that
+// exits straight after its first start.
+//
+// Not available on Windows.
+
+#define KSSL_PROCESS_ENV "KEYLESS_PROCESS"
+#define KSSL_PROCESS_LISTEN_FD 3
+#define KSSL_PROCESS_METRICS_FD 4
+
+#define MAX_PROCESSES 64
+
+// process_child: returns the index of this process if it is a child
+// started by process_start or -1
+int process_child(void);
+
+struct sockaddr_in;
+
+// process_listen: bind count listening sockets to addr with
+// SO_REUSEPORT, one for each child. Returns 0 on success or an errno
+// value.
+int process_listen(const struct sockaddr_in *addr, int count);
+
+// Called when the child index exited within a second of its first
+// start. It is not restarted.
+
+typedef void (*process_failed_cb)(int index);
+
+// process_start: start a child running file with args for each socket
+// made by process_listen, passing each metrics_fd. Children that exit
+// are restarted until process_stop is called, apart from one that fails
+// as soon as it first starts, which is reported to failed instead.
+// Returns 0 on success or an errno value.
+int process_start(uv_loop_t *loop, const char *file, char **args,
+                  int metrics_fd, process_failed_cb failed);
+
+// process_signal: send signum to every running child
+void process_signal(int signum);
+
+// process_stop: send SIGTERM to every child and stop restarting them.
+// The supervisor's loop exits once they have all exited.
+void process_stop(void);
+
+#endif // INCLUDED_KSSL_PROCESS
@@ -0,0 +1,312 @@
+// kssl_stats.c: live statistics published in shared memory
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "kssl_helpers.h"
+
+#if !PLATFORM_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "kssl_stats.h"
+
+// A reader gives up on an entry after this many attempts to copy it
+
+#define SNAPSHOT_TRIES 1000
+
+#if !PLATFORM_WINDOWS
+
+// The file made by stats_open, so that stats_close only removes it if
+// it has not been replaced by a newer keyless
+
+static dev_t stats_dev;
+static ino_t stats_ino;
+static size_t stats_size = 0;
+
+// stats_size_of: returns the size of a file with count entries
+static size_t stats_size_of(int count)
+{
+  return sizeof(kssl_stats_header) + (size_t)count * sizeof(kssl_live_stats);
+}
+
+// write_begin: mark s as being updated. The fence keeps the updates that
+// follow from being seen before seq is odd.
+static void write_begin(kssl_live_stats *s)
+{
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// write_end: mark s as consistent again
+static void write_end(kssl_live_stats *s)
+{
+  KSSL_STORE_RELEASE(&s->seq, s->seq + 1);
+}
+
+#endif
+
+// stats_open: create and map the statistics file. It is created anew
+// rather than truncated because a reader may have the old one mapped.
+kssl_live_stats *stats_open(const char *path, int count,
+                            const BYTE *opcodes)
+{
+#if !PLATFORM_WINDOWS
+  kssl_stats_header *header;
+  kssl_live_stats *stats;
+  struct stat st;
+  size_t size = stats_size_of(count);
+  int fd, i, err;
+  void *p;
+
+  if (unlink(path) != 0 && errno != ENOENT) {
+    return NULL;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  if (ftruncate(fd, (off_t)size) != 0 || fstat(fd, &st) != 0) {
+    err = errno;
+    close(fd);
+    unlink(path);
+    errno = err;
+    return NULL;
+  }
+
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+  if (p == MAP_FAILED) {
+    unlink(path);
+    errno = err;
+    return NULL;
+  }
+
+  stats_dev = st.st_dev;
+  stats_ino = st.st_ino;
+  stats_size = size;
+
+  header = (kssl_stats_header *)p;
+  stats = (kssl_live_stats *)(header + 1);
+  for (i = 0; i < count; i++) {
+    stats[i].worker = i;
+  }
+
+  header->workers = count;
+  header->pid = (uint32_t)getpid();
+  header->ops = KSSL_METRICS_OPS;
+  header->started = (uint64_t)time(NULL) * 1000;
+  memcpy(header->opcodes, opcodes, KSSL_METRICS_OPS);
+  header->version = KSSL_STATS_VERSION;
+
+  // Readers check the magic number first so it is written last
+
+  __atomic_store_n(&header->magic, KSSL_STATS_MAGIC, __ATOMIC_RELEASE);
+
+  return stats;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+// stats_close: unmap the statistics and remove the file if it is still
+// the one made by stats_open
+void stats_close(kssl_live_stats *stats, const char *path)
+{
+#if !PLATFORM_WINDOWS
+  struct stat st;
+
+  if (stats == NULL) {
+    return;
+  }
+
+  if (stat(path, &st) == 0 && st.st_dev == stats_dev &&
+      st.st_ino == stats_ino) {
+    unlink(path);
+  }
+
+  munmap((kssl_stats_header *)stats - 1, stats_size);
+#endif
+}
+
+// stats_map: map a statistics file read only and check its header
+const kssl_stats_header *stats_map(const char *path)
+{
+#if !PLATFORM_WINDOWS
+  kssl_stats_header header;
+  struct stat st;
+  ssize_t n;
+  void *p;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return NULL;
+  }
+
+  n = read(fd, &header, sizeof(header));
+  if (n != sizeof(header) || header.magic != KSSL_STATS_MAGIC ||
+      header.version != KSSL_STATS_VERSION ||
+      header.ops != KSSL_METRICS_OPS || fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < stats_size_of(header.workers)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  p = mmap(NULL, stats_size_of(header.workers), PROT_READ, MAP_SHARED,
+           fd, 0);
+  close(fd);
+
+  return (p == MAP_FAILED)?NULL:(const kssl_stats_header *)p;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+// stats_unmap: unmap a file mapped by stats_map
+void stats_unmap(const kssl_stats_header *header)
+{
+#if !PLATFORM_WINDOWS
+  if (header != NULL) {
+    munmap((void *)header, stats_size_of(header->workers));
+  }
+#endif
+}
+
+// stats_snapshot: copy s while its seq is even and unchanged
+int stats_snapshot(const kssl_live_stats *s, kssl_live_stats *copy)
+{
+#if !PLATFORM_WINDOWS
+  unsigned int seq;
+  int i;
+
+  for (i = 0; i < SNAPSHOT_TRIES; i++) {
+    seq = KSSL_LOAD_ACQUIRE(&s->seq);
+    if (seq & 1) {
+      continue;
+    }
+
+    memcpy(copy, s, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+      return 0;
+    }
+  }
+#endif
+
+  return -1;
+}
+
+#if !PLATFORM_WINDOWS
+
+// stats_accepted: count a connection accepted
+void stats_accepted(kssl_live_stats *s)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->connections += 1;
+    write_end(s);
+  }
+}
+
+// stats_rejected: count a connection refused at accept
+void stats_rejected(kssl_live_stats *s)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->rejected += 1;
+    write_end(s);
+  }
+}
+
+// stats_open_connections: add delta to the connections open
+void stats_open_connections(kssl_live_stats *s, int delta)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->open += delta;
+    write_end(s);
+  }
+}
+
+// stats_handshake: count a TLS handshake completed
+void stats_handshake(kssl_live_stats *s)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->handshakes += 1;
+    write_end(s);
+  }
+}
+
+// stats_queued: add delta to the responses waiting to be written
+void stats_queued(kssl_live_stats *s, int delta)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->queued += delta;
+    write_end(s);
+  }
+}
+
+// stats_request: count a request and any error it was answered with
+void stats_request(kssl_live_stats *s, int slot, int error)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->requests[slot] += 1;
+    if (error) {
+      s->errors += 1;
+    }
+    write_end(s);
+  }
+}
+
+// stats_error: count an error response
+void stats_error(kssl_live_stats *s)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->errors += 1;
+    write_end(s);
+  }
+}
+
+// stats_loop: publish the loop measurements
+void stats_loop(kssl_live_stats *s, kssl_metrics *m, uint64_t now)
+{
+  if (s != NULL) {
+    write_begin(s);
+    s->updated = now;
+    s->loop_lag = m->loop_lag;
+    s->loop_busy = m->loop_busy;
+    s->loop_idle = m->loop_idle;
+    write_end(s);
+  }
+}
+
+#else
+
+// stats_open never succeeds on Windows so there is nothing to update
+
+void stats_accepted(kssl_live_stats *s) {}
+void stats_rejected(kssl_live_stats *s) {}
+void stats_open_connections(kssl_live_stats *s, int delta) {}
+void stats_handshake(kssl_live_stats *s) {}
+void stats_queued(kssl_live_stats *s, int delta) {}
+void stats_request(kssl_live_stats *s, int slot, int error) {}
+void stats_error(kssl_live_stats *s) {}
+void stats_loop(kssl_live_stats *s, kssl_metrics *m, uint64_t now) {}
+
+#endif
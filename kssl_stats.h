@@ -0,0 +1,108 @@
+// kssl_stats.h: live statistics published in shared memory
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_STATS
+#define INCLUDED_KSSL_STATS 1
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// With --stats-file keyless publishes a small set of counters for each
+// worker in a file that other processes map (see keyless_top.c). Each
+// worker updates its own entry in place as things happen, so a reader
+// sees every request and a stalled loop shows up as an entry whose
+// updated time stops moving. Readers never make the server do anything:
+// there are no locks or system calls on the server side.
+//
+// Each entry is a seqlock. The worker makes seq odd, updates the
+// counters with plain stores and makes seq even again. A reader copies
+// the entry and uses the copy only if seq was the same even value
+// before and after (see stats_snapshot).
+//
+// The file is a kssl_stats_header followed by workers kssl_live_stats.
+// Both are multiples of 64 bytes so that no two workers share a cache
+// line.
+
+#define KSSL_STATS_MAGIC   0x544154534c53534bULL // "KSSLSTAT"
+#define KSSL_STATS_VERSION 1
+
+typedef struct {
+  uint64_t magic;                      // KSSL_STATS_MAGIC
+  uint32_t version;                    // KSSL_STATS_VERSION
+  uint32_t workers;                    // Number of entries that follow
+  uint32_t pid;                        // Process writing the file
+  uint32_t ops;                        // KSSL_METRICS_OPS
+  uint64_t started;                    // Wall clock time of start (ms)
+  BYTE     opcodes[KSSL_METRICS_OPS];  // Opcode counted in each slot
+  BYTE     reserved[16];
+} kssl_stats_header;
+
+typedef struct {
+  unsigned int seq;                    // Odd while being updated
+  unsigned int worker;                 // Index of the worker
+  uint64_t updated;                    // uv_hrtime() of the last loop
+                                       // lag measurement
+  uint64_t connections;                // Connections accepted
+  uint64_t rejected;                   // Connections refused at accept
+  uint64_t handshakes;                 // TLS handshakes completed
+  uint64_t open;                       // Connections open
+  uint64_t queued;                     // Responses waiting to be written
+  uint64_t requests[KSSL_METRICS_OPS]; // Requests by opcode slot
+  uint64_t errors;                     // Error responses sent
+  uint64_t loop_lag;                   // Most recent loop lag (ns)
+  uint64_t loop_busy;                  // Time spent running callbacks (ns)
+  uint64_t loop_idle;                  // Time spent waiting for I/O (ns)
+  uint64_t reserved[5];
+} kssl_live_stats;
+
+// stats_open: create the file path holding an entry for each of count
+// workers and map it. opcodes gives the opcode counted in each request
+// slot. Returns the entries or NULL (with errno set) on failure.
+kssl_live_stats *stats_open(const char *path, int count,
+                            const BYTE *opcodes);
+
+// stats_close: unmap the entries made by stats_open and remove path
+// unless another process has replaced it
+void stats_close(kssl_live_stats *stats, const char *path);
+
+// stats_map: map a file written by stats_open for reading. Returns the
+// header (the entries follow it) or NULL (with errno set) on failure.
+const kssl_stats_header *stats_map(const char *path);
+
+// stats_unmap: unmap a file mapped by stats_map
+void stats_unmap(const kssl_stats_header *header);
+
+// stats_snapshot: copy a consistent snapshot of s into copy. Returns 0
+// on success or -1 if the writer was updating it throughout.
+int stats_snapshot(const kssl_live_stats *s, kssl_live_stats *copy);
+
+// The following are called by a worker to update its entry. Each does
+// nothing if s is NULL.
+
+// stats_accepted: count a connection accepted
+void stats_accepted(kssl_live_stats *s);
+
+// stats_rejected: count a connection refused at accept
+void stats_rejected(kssl_live_stats *s);
+
+// stats_open_connections: add delta to the connections open
+void stats_open_connections(kssl_live_stats *s, int delta);
+
+// stats_handshake: count a TLS handshake completed
+void stats_handshake(kssl_live_stats *s);
+
+// stats_queued: add delta to the responses waiting to be written
+void stats_queued(kssl_live_stats *s, int delta);
+
+// stats_request: count a request in opcode slot (see metrics_op_slot)
+// and whether it was answered with an error
+void stats_request(kssl_live_stats *s, int slot, int error);
+
+// stats_error: count an error response not counted by stats_request
+void stats_error(kssl_live_stats *s);
+
+// stats_loop: publish the loop measurements in m taken at now
+void stats_loop(kssl_live_stats *s, kssl_metrics *m, uint64_t now);
+
+#endif // INCLUDED_KSSL_STATS
@@ -19,17 +19,27 @@
 #include <uv.h>
 
 #include <openssl/bio.h>
+#include <openssl/buffer.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 
 #include <stdarg.h>
+#include <string.h>
 
 #include "kssl_log.h"
 #include "kssl_private_key.h"
 #include "kssl_core.h"
 #include "kssl_thread.h"
+#include "kssl_trace.h"
+#include "kssl_binlog.h"
+#include "kssl_capture.h"
+#include "kssl_probes.h"
+#include "kssl_memory.h"
+#include "kssl_perf.h"
+#include "kssl_timestamp.h"
+#include "kssl_stats.h"
 
 // initialize_state: set the initial state on a newly created connection_state
 void initialize_state(connection_state **active, connection_state *state)
@@ -52,8 +62,21 @@ void initialize_state(connection_state **active, connection_state *state)
   state->payload = 0;
   state->qr = 0;
   state->qw = 0;
-  state->fd = 0;
   state->connected = 0;
+  state->worker = 0;
+  state->read_time = 0;
+  state->arrival_time = 0;
+  state->client = NULL;
+  state->capture_id = 0;
+  state->tls_read = NULL;
+}
+
+// count_queued: add delta to the responses waiting to be written on a
+// worker
+static void count_queued(worker_data *worker, int delta)
+{
+  worker->metrics->queued += delta;
+  stats_queued(worker->live, delta);
 }
 
 // queue_write: adds a buffer of dynamically allocated memory to the
@@ -61,7 +84,7 @@ void initialize_state(connection_state **active, connection_state *state)
 void queue_write(connection_state *state, BYTE *b, int len)
 {
   state->q[state->qw].start = b;
-  state->q[state->qw].send = b;
+  state->q[state->qw].sent = 0;
   state->q[state->qw].len = len;
 
   state->qw += 1;
@@ -77,13 +100,17 @@ void queue_write(connection_state *state, BYTE *b, int len)
   // sent.
 
   if (state->qr == state->qw) {
+    KSSL_PROBE2(queue__overflow, state->worker?state->worker->id:-1, state);
     write_log(1, "Connection state queue full. Data lost.");
     state->qw -= 1;
     free(b);
     if (state->qw == -1) {
       state->qw = QUEUE_LENGTH-1;
     }
+    return;
   }
+
+  count_queued(state->worker, 1);
 }
 
 // write_error: queues a KSSL error message for sending.
@@ -94,6 +121,8 @@ void write_error(connection_state *state, DWORD id, BYTE error)
 
   kssl_error_code err = kssl_error(id, error, &resp, &size);
   log_error(id, error);
+  metrics_record_error(state->worker->metrics, (kssl_error_code)error);
+  stats_error(state->worker->live);
   if (err != KSSL_ERROR_INTERNAL) {
     queue_write(state, resp, size);
   }
@@ -114,6 +143,10 @@ void set_get_header_state(connection_state *state)
   state->header.length = 0;
   state->header.id = 0;
   state->header.data = 0;
+
+  if (state->tls_read != NULL) {
+    memset(state->tls_read, 0, sizeof(kssl_perf_sample));
+  }
 }
 
 // set_get_payload_state: puts a connection_state in the state to receive a
@@ -153,15 +186,49 @@ void close_cb(uv_handle_t *tcp)
 
   if (state != NULL) {
     SSL_free(state->ssl);
+    if (state->capture_id != 0) {
+      capture_connection(state->worker->id, &state->worker->captured,
+                         KSSL_CAPTURE_CLOSE, state->capture_id);
+    }
   }
 
   free(tcp);
   if (state != NULL) {
     free_read_state(state);
+    free(state->tls_read);
     free(state);
   }
 }
 
+// connection_close: close a connection's TCP connection and remove it
+// from its worker's active list. Its memory is freed in close_cb.
+static void connection_close(connection_state *state)
+{
+  int rc = uv_read_stop((uv_stream_t *)state->tcp);
+  if (rc != 0) {
+    write_log(1, "Failed to stop TCP read: %s", 
+              error_string(rc));
+  }
+
+  while (state->qr != state->qw) {
+    free(state->q[state->qr].start);
+    count_queued(state->worker, -1);
+
+    state->qr += 1;
+    if (state->qr == QUEUE_LENGTH) {
+      state->qr = 0;
+    }
+  }
+
+  *(state->prev) = state->next;
+  if (state->next) {
+    state->next->prev = state->prev;
+  }
+
+  stats_open_connections(state->worker->live, -1);
+  uv_close((uv_handle_t *)state->tcp, close_cb);
+}
+
 // try_shutdown: calls SSL_shutdown to see if the SSL connection has been
 // terminated. If it has (or a fatal error occurs) then terminate the
 // underlying TCP connection; otherwise we may be in the WANT_READ or
@@ -188,27 +255,7 @@ void try_shutdown(connection_state *state) {
     }
   }
 
-  rc = uv_read_stop((uv_stream_t *)state->tcp);
-  if (rc != 0) {
-    write_log(1, "Failed to stop TCP read: %s", 
-              error_string(rc));
-  }
-
-  while (state->qr != state->qw) {
-    free(state->q[state->qr].start);
-
-    state->qr += 1;
-    if (state->qr == QUEUE_LENGTH) {
-      state->qr = 0;
-    }
-  }
-
-  *(state->prev) = state->next;
-  if (state->next) {
-    state->next->prev = state->prev;
-  }
-
-  uv_close((uv_handle_t *)state->tcp, close_cb);
+  connection_close(state);
 }
 
 // connection_terminate: terminate an SSL connection by marking it as
@@ -229,17 +276,18 @@ kssl_error_code write_queued_messages(connection_state *state)
   int rc;
   while ((state->qr != state->qw) && (state->q[state->qr].len > 0)) {
     queued *q = &state->q[state->qr];
-    rc = SSL_write(ssl, q->send, q->len);
+    rc = SSL_write(ssl, q->start + q->sent, q->len);
 
     if (rc > 0) {
       q->len -= rc;
-      q->send += rc;
+      q->sent += rc;
 
       // If the entire buffer has been sent then it should be removed from
       // the queue and its memory freed
 
       if (q->len == 0) {
         free(q->start);
+        count_queued(state->worker, -1);
         state->qr += 1;
         if (state->qr == QUEUE_LENGTH) {
           state->qr = 0;
@@ -303,6 +351,13 @@ int flush_write(connection_state *state)
   char b[BUF_SIZE];
   int n;
 
+  // A connection that is not on a socket leaves its output in the write
+  // BIO for its owner (see connection_open)
+
+  if (state->tcp == NULL) {
+    return 1;
+  }
+
   while ((n = BIO_read(state->write_bio, &b[0], BUF_SIZE)) > 0) {
     uv_write_t *req = (uv_write_t *)malloc(sizeof(uv_write_t));
     if (req == NULL) {
@@ -320,6 +375,64 @@ int flush_write(connection_state *state)
   return 1;
 }
 
+// release_bio: free the buffer of an empty memory BIO. OpenSSL grows a
+// memory BIO's buffer to the most that has ever been written to it and
+// never shrinks it, which would leave every idle connection holding
+// buffers sized for its busiest moment. Buffers of up to BIO_KEEP bytes
+// are kept to avoid reallocating them for every request.
+
+#define BIO_KEEP 2048
+
+static void release_bio(BIO *bio)
+{
+  BUF_MEM *b = NULL;
+
+  BIO_get_mem_ptr(bio, &b);
+  if (b != NULL && b->length == 0 && b->max > BIO_KEEP) {
+    OPENSSL_free(b->data);
+    b->data = NULL;
+    b->max = 0;
+  }
+}
+
+// connection_idle: returns 1 if a connection is waiting for its next
+// request with nothing left to send
+static int connection_idle(connection_state *state)
+{
+  return state->state == CONNECTION_STATE_GET_HEADER &&
+         state->need == KSSL_HEADER_SIZE && state->qr == state->qw;
+}
+
+// release_idle_buffers: release the buffers of an idle connection.
+// OpenSSL releases its own record buffers (SSL_MODE_RELEASE_BUFFERS is
+// set on the context).
+static void release_idle_buffers(connection_state *state)
+{
+  if (!connection_idle(state)) {
+    return;
+  }
+
+  release_bio(state->read_bio);
+  release_bio(state->write_bio);
+}
+
+// record_perf: attribute the performance counters used by a request to
+// its opcode and key size. written is what SSL_write of the response
+// used.
+static void record_perf(connection_state *state, kssl_op_info *info,
+                        int bits, kssl_perf_sample *written)
+{
+  kssl_metrics *m = state->worker->metrics;
+
+  metrics_record_perf(m, KSSL_PERF_TLS_READ, info->opcode, bits,
+                      state->tls_read);
+  if (info->crypto_counted) {
+    metrics_record_perf(m, KSSL_PERF_CRYPTO, info->opcode, bits,
+                        &info->crypto_counters);
+  }
+  metrics_record_perf(m, KSSL_PERF_TLS_WRITE, info->opcode, bits, written);
+}
+
 // do_ssl: process pending data from OpenSSL and send any data that's
 // waiting. Returns 1 if ok, 0 if the connection should be terminated
 int do_ssl(connection_state *state)
@@ -327,6 +440,11 @@ int do_ssl(connection_state *state)
   BYTE *response = NULL;
   int response_len = 0;
   kssl_error_code err;
+  kssl_op_info info;
+  kssl_request_times times;
+  kssl_memory_totals before, after;
+  kssl_perf_sample perf_before, perf_after, written;
+  int counted, bits;
 
   // First determine whether the SSL_accept has completed. If not then any
   // data on the TCP connection is related to the handshake and is not
@@ -344,6 +462,7 @@ int do_ssl(connection_state *state)
           return 1;
           
         default:
+          KSSL_PROBE3(handshake__done, state->worker->id, state, 0);
           log_ssl_error(state->ssl, rc);
           return 0;
         }
@@ -351,12 +470,26 @@ int do_ssl(connection_state *state)
     }
 
     state->connected = 1;
+    KSSL_PROBE3(handshake__done, state->worker->id, state, 1);
+    stats_handshake(state->worker->live);
+    if (state->worker->clients != NULL) {
+      state->client = clients_find(state->worker->clients, state->ssl);
+    }
+    state->capture_id = capture_connection(state->worker->id,
+                                           &state->worker->captured,
+                                           KSSL_CAPTURE_OPEN, 0);
   }
 
   // Read whatever data needs to be read (controlled by state->need)
 
   while (state->need > 0) {
-    int read = SSL_read(state->ssl, state->current, state->need);
+    int read;
+
+    counted = perf_read(&perf_before);
+    read = SSL_read(state->ssl, state->current, state->need);
+    if (counted && perf_read(&perf_after)) {
+      perf_add(state->tls_read, &perf_before, &perf_after);
+    }
 
     if (read <= 0) {
       int err = SSL_get_error(state->ssl, read);
@@ -458,14 +591,30 @@ int do_ssl(connection_state *state)
     // When we reach here state->header is valid and filled in and if
     // necessary state->start points to the payload.
 
+    times.arrived = state->arrival_time;
+    times.read = state->read_time;
+    times.start = uv_hrtime();
     uv_rwlock_rdlock(pk_lock);
-    err = kssl_operate(&state->header, state->start, privates, &response,
-                       &response_len);
+    times.locked = uv_hrtime();
+    memory_thread_totals(&before);
+    err = kssl_operate_ex(&state->header, state->start, privates, &response,
+                          &response_len, &info);
+    memory_thread_totals(&after);
     if (err != KSSL_ERROR_NONE) {
       log_err_error();
     } else  {
       queue_write(state, response, response_len);
     }
+    times.queued = uv_hrtime();
+    key_stats_record(privates, state->worker->id, info.key_id, info.opcode,
+                     info.error != KSSL_ERROR_NONE,
+                     elapsed_ns(info.crypto_start, info.crypto_end));
+    capture_request(state->worker->id, state->capture_id, &state->header,
+                    state->start, &info, privates);
+    bits = 0;
+    if (perf_enabled() && info.key_id >= 0) {
+      bits = key_bits(privates, info.key_id);
+    }
     uv_rwlock_rdunlock(pk_lock);
 
     // When this point is reached a complete header (and optional payload)
@@ -473,9 +622,32 @@ int do_ssl(connection_state *state)
     // write the queued messages and then free the allocated memory and get
     // ready to receive another header.
 
+    counted = perf_read(&perf_before);
     write_queued_messages(state);
+    if (counted && perf_read(&perf_after)) {
+      memset(&written, 0, sizeof(written));
+      perf_add(&written, &perf_before, &perf_after);
+      record_perf(state, &info, bits, &written);
+    }
     flush_write(state);
 
+    times.flushed = uv_hrtime();
+    KSSL_PROBE4(response__flushed, state->header.id, info.opcode,
+                response_len, err);
+    metrics_record(state->worker->metrics, &info, &times);
+    stats_request(state->worker->live, metrics_op_slot(info.opcode),
+                  info.error != KSSL_ERROR_NONE);
+    metrics_record_memory(state->worker->metrics, info.opcode,
+                          after.allocations - before.allocations,
+                          after.bytes - before.bytes);
+    trace_request(state->worker->id, &state->worker->trace_countdown,
+                  &state->header, &info, &times);
+    binlog_request(state->worker->id, &state->header, &info, &times);
+    if (state->client != NULL) {
+      clients_record(state->client, &info,
+                     KSSL_HEADER_SIZE + state->header.length, response_len);
+    }
+
     free_read_state(state);
     set_get_header_state(state);
 
@@ -486,11 +658,37 @@ int do_ssl(connection_state *state)
   return 1;
 }
 
+// connection_read: pass len bytes read from the network to OpenSSL,
+// process any complete requests and send the responses. Returns 1 if
+// ok, 0 if the connection should be terminated.
+int connection_read(connection_state *state, const char *data, int len)
+{
+  if (len > 0) {
+    state->read_time = uv_hrtime();
+
+    // If there's data to read then pass it to OpenSSL via the BIO
+    // TODO: check return value
+
+    BIO_write(state->read_bio, data, len);
+  }
+
+  if (!do_ssl(state)) {
+    return 0;
+  }
+
+  write_queued_messages(state);
+  flush_write(state);
+  release_idle_buffers(state);
+  return 1;
+}
+
 // read_cb: a TCP connection is readable so read the bytes that are on
 // it and pass them to OpenSSL
 void read_cb(uv_stream_t *s, ssize_t nread, const uv_buf_t *buf)
 {
   connection_state *state = (connection_state *)s->data;
+  worker_data *worker = state->worker;
+  uint64_t start = uv_hrtime();
 
   // If the connection is terminating then call try_shutdown to see if the
   // connection is now actually shutdown.
@@ -500,23 +698,10 @@ void read_cb(uv_stream_t *s, ssize_t nread, const uv_buf_t *buf)
     return;
   }
 
-  if (nread > 0) {
-
-    // If there's data to read then pass it to OpenSSL via the BIO
-    // TODO: check return value
-
-    BIO_write(state->read_bio, buf->base, nread);
-  }
-
   if ((nread == UV_EOF) || (nread < 0)) {
     connection_terminate(state->tcp);
-  } else {
-    if (do_ssl(state)) {
-      write_queued_messages(state);
-      flush_write(state);
-    } else {
-      connection_terminate(state->tcp);
-    }
+  } else if (!connection_read(state, buf->base, (int)nread)) {
+    connection_terminate(state->tcp);
   }
 
   // Buffer was previously allocated by us in a call to
@@ -525,12 +710,24 @@ void read_cb(uv_stream_t *s, ssize_t nread, const uv_buf_t *buf)
   if (buf) {
     free(buf->base);
   }
+
+  loop_monitor_busy(&worker->monitor, start);
 }
 
 // allocate_cb: libuv needs buffer space so allocate it. We are
-// responsible for freeing this buffer.
+// responsible for freeing this buffer. This is called just before libuv
+// reads so it is also where the kernel's receive timestamp of the data
+// about to be read is picked up.
 void allocate_cb(uv_handle_t *h, size_t s, uv_buf_t *buf)
 {
+  connection_state *state = (connection_state *)h->data;
+
+  if (state != NULL && timestamp_enabled()) {
+    uint64_t waiting = timestamp_waiting((uv_tcp_t *)h);
+
+    state->arrival_time = (waiting != 0)?uv_hrtime() - waiting:0;
+  }
+
   buf->base = (char *)malloc(s);
 
   if (buf->base) {
@@ -540,9 +737,82 @@ void allocate_cb(uv_handle_t *h, size_t s, uv_buf_t *buf)
   }
 }
 
-// new_connection_cb: gets called when the listen socket for the
-// server is ready to read (i.e. there's an incoming connection).
-void new_connection_cb(uv_stream_t *server, int status)
+// connection_open: create the state for a new connection on tcp owned
+// by worker, ready for its TLS handshake. tcp may be NULL for a
+// connection that is not on a socket: its owner passes received bytes
+// to connection_read and takes the bytes to send from write_bio. Returns
+// NULL on failure.
+connection_state *connection_open(worker_data *worker, uv_tcp_t *tcp)
+{
+  connection_state *state;
+  kssl_perf_sample *tls_read = NULL;
+  SSL *ssl;
+
+  ssl = SSL_new(worker->ctx);
+  if (!ssl) {
+    write_log(1, "Failed to create SSL context");
+    return NULL;
+  }
+
+  if (perf_enabled()) {
+    tls_read = (kssl_perf_sample *)malloc(sizeof(kssl_perf_sample));
+    if (tls_read == NULL) {
+      SSL_free(ssl);
+      write_log(1, "Memory allocation error");
+      return NULL;
+    }
+  }
+
+  state = (connection_state *)malloc(sizeof(connection_state));
+  if (state == NULL) {
+    free(tls_read);
+    SSL_free(ssl);
+    write_log(1, "Memory allocation error");
+    return NULL;
+  }
+
+  initialize_state(&worker->active, state);
+  state->tcp = tcp;
+  state->worker = worker;
+  state->ssl = ssl;
+  state->tls_read = tls_read;
+  set_get_header_state(state);
+
+  // Set up OpenSSL to use a memory BIO. We'll read and write from this BIO
+  // when the TCP connection has data or is writeable. The BIOs are set to
+  // non-blocking mode.
+
+  state->read_bio = BIO_new(BIO_s_mem());
+  BIO_set_nbio(state->read_bio, 1);
+  state->write_bio = BIO_new(BIO_s_mem());
+  BIO_set_nbio(state->write_bio, 1);
+  SSL_set_bio(ssl, state->read_bio, state->write_bio);
+
+  SSL_set_accept_state(ssl);
+  return state;
+}
+
+// connection_free: free a connection_state that is not on a socket. It
+// must already have been removed from its worker's active list.
+void connection_free(connection_state *state)
+{
+  SSL_free(state->ssl);
+  while (state->qr != state->qw) {
+    free(state->q[state->qr].start);
+
+    state->qr += 1;
+    if (state->qr == QUEUE_LENGTH) {
+      state->qr = 0;
+    }
+  }
+  free_read_state(state);
+  free(state->tls_read);
+  free(state);
+}
+
+// accept_connection: accept a connection and start the TLS handshake
+// (see new_connection_cb)
+static void accept_connection(uv_stream_t *server, int status)
 {
   SSL *ssl;
   uv_tcp_t *client;
@@ -571,48 +841,52 @@ void new_connection_cb(uv_stream_t *server, int status)
     }
   }
 
-  // The TCP connection has been accepted so now pass it off to a worker
-  // thread to handle
+  worker->metrics->connections += 1;
+  stats_accepted(worker->live);
 
-  state = (connection_state *)malloc(sizeof(connection_state));
-  initialize_state(&worker->active, state);
-  state->tcp = client;
-  set_get_header_state(state);
+  // If this worker's loop is saturated then taking on another handshake
+  // will only add to the latency of the connections it already has
 
-  ssl = SSL_new(worker->ctx);
-  if (!ssl) {
+  if (loop_saturated(&worker->monitor)) {
+    worker->metrics->rejected += 1;
+    stats_rejected(worker->live);
     uv_close((uv_handle_t *)client, close_cb);
-    write_log(1, "Failed to create SSL context");
     return;
   }
 
-  state->ssl = ssl;
-
-  // Set up OpenSSL to use a memory BIO. We'll read and write from this BIO
-  // when the TCP connection has data or is writeable. The BIOs are set to
-  // non-blocking mode.
+  // The TCP connection has been accepted so now pass it off to a worker
+  // thread to handle
 
-  state->read_bio = BIO_new(BIO_s_mem());
-  BIO_set_nbio(state->read_bio, 1);
-  state->write_bio = BIO_new(BIO_s_mem());
-  BIO_set_nbio(state->write_bio, 1);
-  SSL_set_bio(ssl, state->read_bio, state->write_bio);
+  state = connection_open(worker, client);
+  if (state == NULL) {
+    uv_close((uv_handle_t *)client, close_cb);
+    return;
+  }
+  ssl = state->ssl;
+  stats_open_connections(worker->live, 1);
+  KSSL_PROBE2(accept, worker->id, state);
 
   client->data = (void *)state;
 
+  if (timestamp_enabled()) {
+    rc = timestamp_socket(client);
+    if (rc != 0) {
+      write_log(1, "Failed to enable receive timestamps: %s", strerror(rc));
+    }
+  }
+
   rc = uv_read_start((uv_stream_t*)client, allocate_cb, read_cb);
   if (rc != 0) {
-    uv_close((uv_handle_t *)client, close_cb);
     write_log(1, "Failed to start reading on client connection: %s", 
               error_string(rc));
+    connection_close(state);
     return;
   }
 
   // Start accepting the TLS connection. This will likely not
   // complete here and will be completed in the read_cb/do_ssl above.
 
-  SSL_set_accept_state(ssl);
-
+  KSSL_PROBE2(handshake__start, worker->id, state);
   rc = SSL_do_handshake(ssl);
   if (rc != 1) {
     switch (SSL_get_error(state->ssl, rc)) {
@@ -622,10 +896,347 @@ void new_connection_cb(uv_stream_t *server, int status)
       break;
 
     default:
+      KSSL_PROBE3(handshake__done, worker->id, state, 0);
       log_ssl_error(ssl, rc);
-      uv_close((uv_handle_t *)client, close_cb);
+      connection_close(state);
       return;
     }
   }
 }
 
+
+// new_connection_cb: gets called when the listen socket for the
+// server is ready to read (i.e. there's an incoming connection).
+void new_connection_cb(uv_stream_t *server, int status)
+{
+  worker_data *worker = (worker_data *)server->data;
+  uint64_t start = uv_hrtime();
+
+  accept_connection(server, status);
+  loop_monitor_busy(&worker->monitor, start);
+}
+
+// connection_quiet: returns 1 if closing a connection now would not cut
+// off a request or a response
+static int connection_quiet(connection_state *state)
+{
+  return connection_idle(state) && state->connected &&
+         state->tcp->write_queue_size == 0;
+}
+
+// connection_hangup: close a connection with a TLS close_notify so its
+// client sees an orderly close
+static void connection_hangup(connection_state *state)
+{
+  state->state = CONNECTION_STATE_TERMINATING;
+  SSL_shutdown(state->ssl);
+  ERR_clear_error();
+  flush_write(state);
+  connection_close(state);
+}
+
+// How often (ms) a draining worker closes connections
+
+#define DRAIN_INTERVAL 100
+
+// drain_cb: close enough quiet connections that the number open falls
+// steadily to zero at the end of the drain
+static void drain_cb(uv_timer_t *timer)
+{
+  worker_data *worker = (worker_data *)timer->data;
+  uint64_t elapsed = uv_hrtime() - worker->drain_start;
+  int expired = (elapsed >= worker->drain_ns);
+  connection_state *state, *next;
+  int open = 0, target = 0;
+
+  for (state = worker->active; state != NULL; state = state->next) {
+    open += 1;
+  }
+
+  if (!expired) {
+    target = worker->drain_total -
+      (int)((uint64_t)worker->drain_total * elapsed / worker->drain_ns);
+  }
+
+  for (state = worker->active; state != NULL && open > target;
+       state = next) {
+    next = state->next;
+
+    if (expired || connection_quiet(state)) {
+      connection_hangup(state);
+      open -= 1;
+    }
+  }
+
+  if (worker->active == NULL) {
+    uv_close((uv_handle_t *)timer, NULL);
+  }
+}
+
+// worker_drain: close the worker's connections over worker->drain_ns
+void worker_drain(worker_data *worker, uv_loop_t *loop)
+{
+  connection_state *state;
+  int rc;
+
+  worker->drain_start = uv_hrtime();
+  worker->drain_total = 0;
+  for (state = worker->active; state != NULL; state = state->next) {
+    worker->drain_total += 1;
+  }
+
+  rc = uv_timer_init(loop, &worker->drainer);
+  if (rc != 0) {
+    write_log(1, "Failed to create drain timer in thread: %s",
+              error_string(rc));
+    return;
+  }
+
+  worker->drainer.data = (void *)worker;
+  rc = uv_timer_start(&worker->drainer, drain_cb, 0, DRAIN_INTERVAL);
+  if (rc != 0) {
+    write_log(1, "Failed to start drain timer in thread: %s",
+              error_string(rc));
+    uv_close((uv_handle_t *)&worker->drainer, NULL);
+  }
+}
+
+// start_listening: reopen the worker's listening handle on paused_fd
+static void start_listening(worker_data *worker)
+{
+#if !PLATFORM_WINDOWS
+  int fd = dup(worker->paused_fd);
+  int rc;
+
+  if (fd == -1) {
+    write_log(1, "Failed to resume accepting in thread: %s",
+              strerror(errno));
+    worker->listen_wanted = 0;
+    return;
+  }
+
+  rc = uv_tcp_init(worker->control.loop, &worker->server);
+  if (rc != 0) {
+    write_log(1, "Failed to resume accepting in thread: %s",
+              error_string(rc));
+    close(fd);
+    worker->listen_wanted = 0;
+    return;
+  }
+
+  worker->server.data = (void *)worker;
+  worker->listening = 1;
+
+  rc = uv_tcp_open(&worker->server, fd);
+  if (rc == 0) {
+    rc = uv_listen((uv_stream_t *)&worker->server, SOMAXCONN,
+                   new_connection_cb);
+  } else {
+    close(fd);
+  }
+  if (rc != 0) {
+    write_log(1, "Failed to resume accepting in thread: %s",
+              error_string(rc));
+    worker->listen_wanted = 0;
+    worker->listening = 0;
+    uv_close((uv_handle_t *)&worker->server, NULL);
+    return;
+  }
+
+  close(worker->paused_fd);
+  worker->paused_fd = -1;
+#endif
+}
+
+// server_close_cb: the listening handle has closed. It is reopened if
+// accepting was turned back on while it was closing.
+static void server_close_cb(uv_handle_t *handle)
+{
+  worker_data *worker = (worker_data *)handle->data;
+
+  if (worker->listen_wanted && !worker->listening) {
+    start_listening(worker);
+  }
+}
+
+// stop_listening: close the worker's listening handle, keeping a copy of
+// the socket so that it can be reopened. Other workers keep accepting on
+// the same socket.
+static void stop_listening(worker_data *worker)
+{
+#if !PLATFORM_WINDOWS
+  worker->paused_fd = dup(worker->server.io_watcher.fd);
+  if (worker->paused_fd == -1) {
+    write_log(1, "Failed to stop accepting in thread: %s", strerror(errno));
+    worker->listen_wanted = 1;
+    return;
+  }
+
+  worker->listening = 0;
+  uv_close((uv_handle_t *)&worker->server, server_close_cb);
+#endif
+}
+
+// worker_report: write the worker's totals and optionally a line per
+// connection to out
+static void worker_report(worker_data *worker, metrics_buffer *out,
+                          int report)
+{
+  kssl_metrics *m = worker->metrics;
+  uint64_t requests = 0, errors = 0;
+  uint64_t now = uv_hrtime();
+  connection_state *state;
+  int i;
+
+  for (i = 0; i < KSSL_METRICS_OPS; i++) {
+    requests += m->requests[i];
+  }
+  for (i = KSSL_ERROR_NONE + 1; i < KSSL_METRICS_ERRORS; i++) {
+    errors += m->errors[i];
+  }
+
+  metrics_printf(out, "worker %d accepting %d open %d quiet %d "
+                 "connections %llu requests %llu errors %llu "
+                 "loop_lag_us %llu\n", worker->id, worker->listen_wanted,
+                 worker->request.open, worker->request.quiet,
+                 (unsigned long long)m->connections,
+                 (unsigned long long)requests,
+                 (unsigned long long)errors,
+                 (unsigned long long)(m->loop_lag / 1000));
+
+  if (report != WORKER_REPORT_CONNECTIONS) {
+    return;
+  }
+
+  for (state = worker->active; state != NULL; state = state->next) {
+    struct sockaddr_storage peer;
+    int len = sizeof(peer);
+    char name[64] = "unknown";
+    int port = 0;
+    const char *what;
+
+    if (uv_tcp_getpeername(state->tcp, (struct sockaddr *)&peer,
+                           &len) == 0) {
+      if (peer.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&peer;
+
+        uv_ip4_name(in, name, sizeof(name));
+        port = ntohs(in->sin_port);
+      } else if (peer.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&peer;
+
+        uv_ip6_name(in6, name, sizeof(name));
+        port = ntohs(in6->sin6_port);
+      }
+    }
+
+    if (state->state == CONNECTION_STATE_TERMINATING) {
+      what = "closing";
+    } else if (!state->connected) {
+      what = "handshake";
+    } else if (state->qr != state->qw) {
+      what = "writing";
+    } else if (connection_idle(state)) {
+      what = "idle";
+    } else {
+      what = "reading";
+    }
+
+    metrics_printf(out, "  %s:%d %s queued %d last_read_ms %llu\n", name,
+                   port, what, (state->qw - state->qr + QUEUE_LENGTH) %
+                   QUEUE_LENGTH,
+                   (unsigned long long)(elapsed_ns(state->read_time, now) /
+                                        1000000));
+  }
+}
+
+// control_cb: carry out the request from the main thread
+static void control_cb(uv_async_t *handle)
+{
+  worker_data *worker = (worker_data *)handle->data;
+  worker_request *r = &worker->request;
+  connection_state *state, *next;
+
+  if (KSSL_LOAD_ACQUIRE(&r->finished)) {
+    return;
+  }
+
+  if (r->accept != worker->listen_wanted) {
+    worker->listen_wanted = r->accept;
+    if (r->accept && !worker->listening && worker->paused_fd != -1) {
+      start_listening(worker);
+    } else if (!r->accept && worker->listening) {
+      stop_listening(worker);
+    }
+  }
+
+  r->closed = 0;
+  for (state = worker->active; state != NULL && r->closed < r->close;
+       state = next) {
+    next = state->next;
+    if (connection_quiet(state)) {
+      connection_hangup(state);
+      r->closed += 1;
+    }
+  }
+
+  r->open = 0;
+  r->quiet = 0;
+  for (state = worker->active; state != NULL; state = state->next) {
+    r->open += 1;
+    r->quiet += connection_quiet(state);
+  }
+
+  if (r->report != WORKER_REPORT_NONE) {
+    worker_report(worker, r->out, r->report);
+  }
+
+  KSSL_STORE_RELEASE(&r->finished, 1);
+  if (r->done != NULL) {
+    uv_async_send(r->done);
+  }
+}
+
+// worker_control_init: set up the worker's control handle
+int worker_control_init(worker_data *worker, uv_loop_t *loop)
+{
+  int rc;
+
+  worker->listening = 0;
+  worker->listen_wanted = 1;
+  worker->paused_fd = -1;
+
+  worker->control.data = (void *)worker;
+  rc = uv_async_init(loop, &worker->control, control_cb);
+  if (rc != 0) {
+    return rc;
+  }
+  uv_unref((uv_handle_t *)&worker->control);
+
+  return 0;
+}
+
+// worker_control: wake the worker to carry out worker->request
+int worker_control(worker_data *worker)
+{
+  return uv_async_send(&worker->control);
+}
+
+// worker_control_stop: close the worker's listening and control handles
+void worker_control_stop(worker_data *worker)
+{
+  worker->listen_wanted = 0;
+  uv_close((uv_handle_t *)&worker->control, NULL);
+
+  if (worker->listening) {
+    worker->listening = 0;
+    uv_close((uv_handle_t *)&worker->server, NULL);
+  }
+
+#if !PLATFORM_WINDOWS
+  if (worker->paused_fd != -1) {
+    close(worker->paused_fd);
+    worker->paused_fd = -1;
+  }
+#endif
+}
@@ -6,6 +6,10 @@
 #define INCLUDED_KSSL_THREAD 1
 
 #include "kssl.h"
+#include "kssl_metrics.h"
+#include "kssl_stats.h"
+#include "kssl_loopmon.h"
+#include "kssl_clients.h"
 
 extern void allocate_cb(uv_handle_t *h, size_t s, uv_buf_t *buf);
 extern void new_connection_cb(uv_stream_t *server, int status);
@@ -40,12 +44,14 @@ extern uv_rwlock_t *pk_lock;
 
 typedef struct {
   BYTE *start; // Start of the buffer (used for free())
-  BYTE *send;  // Pointer to portion of buffer to send
+  int sent;    // Number of bytes of the buffer already sent
   int len;     // Remaining number of bytes to send
 } queued;
 
 // This is the state of an individual SSL connection and is used for buffering
-// of data received by SSL_read
+// of data received by SSL_read. There is one of these for every
+// connection, most of which are idle, so fields are ordered to avoid
+// padding.
 
 typedef struct _connection_state {
   // Used to implement a doubly-linked list of connections that are
@@ -64,10 +70,6 @@ typedef struct _connection_state {
   BYTE *payload; // Allocated for payload when necessary
   queued q[QUEUE_LENGTH];
 
-  // File descriptor of the file this connection is on
-
-  int fd;
-
   // These implement a circular buffer in q. qw points to the next entry
   // in the q that can be used to queue a buffer to send. qr points to
   // the next entry to be sent.
@@ -77,6 +79,15 @@ typedef struct _connection_state {
   int qr;
   int qw;
 
+  // Set to true when the TLS connection is set up
+
+  int connected;
+
+  // Identifies this connection in the capture file or 0 if it is not
+  // being captured (see kssl_capture.h)
+
+  uint32_t capture_id;
+
   // Back link just used when cleaning up. This points to the TCP
   // connection that points to this connection_state through its data
   // pointer
@@ -88,19 +99,122 @@ typedef struct _connection_state {
   BIO *read_bio;
   BIO *write_bio;
 
-  // Set to true when the TLS connection is set up
+  // The worker that owns this connection
 
-  int connected;
+  struct _worker_data *worker;
+
+  // uv_hrtime() when data was last read from the network. This is when
+  // the current request's bytes became available.
+
+  uint64_t read_time;
+
+  // uv_hrtime() at which the oldest data in the last read arrived at the
+  // socket according to the kernel or 0 if not known (see
+  // kssl_timestamp.h)
+
+  uint64_t arrival_time;
+
+  // Totals for the client certificate presented on this connection or
+  // NULL if client accounting is off or the handshake is not complete
+
+  kssl_client_stats *client;
+
+  // Performance counters used by SSL_read for the current request. Only
+  // allocated if perf_enabled() so that connections do not carry them
+  // otherwise.
+
+  kssl_perf_sample *tls_read;
 } connection_state;
 
+// What a worker reports in answer to a worker_request
+
+#define WORKER_REPORT_NONE        0
+#define WORKER_REPORT_SUMMARY     1 // One line of totals
+#define WORKER_REPORT_CONNECTIONS 2 // Totals and a line per connection
+
+// A request from the main thread to a worker (see worker_control). The
+// main thread sets the inputs and clears finished before sending it and
+// must not touch it again until finished is set. finished is stored with
+// KSSL_STORE_RELEASE and read with KSSL_LOAD_ACQUIRE so that the outputs
+// written before it are visible to the other thread.
+
 typedef struct {
+  int accept;           // 1 to accept new connections, 0 to stop
+  int close;            // Number of quiet connections to close
+  int report;           // WORKER_REPORT_*
+  metrics_buffer *out;  // Where a report is written
+  uv_async_t *done;     // Sent once the request has been carried out
+
+  // Set by the worker
+
+  int open;             // Connections open
+  int quiet;            // Connections that could be closed (see close)
+  int closed;           // Connections closed for close
+  unsigned int finished; // 1 once the request has been carried out
+} worker_request;
+
+typedef struct _worker_data {
   uv_sem_t    semaphore;    // Semaphore used in thread startup
   uv_thread_t thread;       // The thread handle
   uv_tcp_t    server;       // The TCP server listen handle
   uv_async_t  stopper;      // Used to terminate threads
   SSL_CTX *   ctx;          // The OpenSSL context
   connection_state *active; // Active connection list
+  kssl_metrics *metrics;    // Metrics shard written only by this worker
+  kssl_live_stats *live;    // Entry in the --stats-file (NULL if not used)
+  int         id;           // Index of this worker
+  int         trace_countdown; // Requests until next traced request
+  kssl_loop_monitor monitor; // Loop lag and utilization
+  kssl_client_table *clients; // Per client totals (NULL if not enabled)
+  unsigned int captured;    // Connections captured (see capture_connection)
+  uv_timer_t  drainer;      // Closes connections while draining
+  uint64_t    drain_start;  // uv_hrtime() when draining started
+  uint64_t    drain_ns;     // Time over which to close connections when
+                            // stopped or 0 to leave them open
+  int         drain_total;  // Connections open when draining started
+  uv_async_t  control;      // Wakes the worker to carry out request
+  worker_request request;   // Written by the main thread
+  int         listening;    // 1 while server is open
+  int         listen_wanted; // Reopen server once it has closed
+  int         paused_fd;    // Copy of the listening socket while server
+                            // is closed or -1
 } worker_data;
 
+// connection_open: create the state for a new connection on tcp owned
+// by worker, ready for its TLS handshake. tcp may be NULL for a
+// connection that is not on a socket (see kssl_loopback.c): its owner
+// passes received bytes to connection_read and takes the bytes to send
+// from write_bio. Returns NULL on failure.
+connection_state *connection_open(worker_data *worker, uv_tcp_t *tcp);
+
+// connection_read: pass len bytes received on a connection to OpenSSL,
+// process any complete requests and send the responses. Returns 1 if
+// ok, 0 if the connection should be terminated.
+int connection_read(connection_state *state, const char *data, int len);
+
+// connection_free: free a connection_state that is not on a socket. It
+// must already have been removed from its worker's active list.
+void connection_free(connection_state *state);
+
+// worker_control_init: set up the handle through which the main thread
+// sends requests to worker. Must be called in the worker's thread before
+// it accepts connections. Returns 0 on success.
+int worker_control_init(worker_data *worker, uv_loop_t *loop);
+
+// worker_control: ask worker to carry out worker->request. Called in
+// the main thread.
+int worker_control(worker_data *worker);
+
+// worker_control_stop: close the worker's listening and control handles.
+// Must be called in the worker's thread.
+void worker_control_stop(worker_data *worker);
+
+// worker_drain: close the connections of worker, which has stopped
+// accepting new ones, over worker->drain_ns. Connections are closed in
+// between requests so none is cut off mid request and their clients
+// reconnect gradually rather than all at once. Any still open at the
+// end are closed regardless. Must be called in the worker's thread.
+void worker_drain(worker_data *worker, uv_loop_t *loop);
+
 #endif // INCLUDED_KSSL_THREAD
 
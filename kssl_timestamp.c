@@ -0,0 +1,115 @@
+// kssl_timestamp.c: kernel receive timestamps for measuring the time
+// requests wait in the socket
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "kssl_timestamp.h"
+
+static int enabled = 0;
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+// socket_fd: returns the descriptor of tcp's socket. This version of
+// libuv has no uv_fileno.
+static int socket_fd(uv_tcp_t *tcp)
+{
+  return tcp->io_watcher.fd;
+}
+#endif
+
+// timestamp_init: turn receive timestamps on or off
+int timestamp_init(int on)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  enabled = on;
+  return 0;
+#else
+  if (on) {
+    return ENOSYS;
+  }
+  return 0;
+#endif
+}
+
+// timestamp_enabled: returns 1 if receive timestamps are on
+int timestamp_enabled(void)
+{
+  return enabled;
+}
+
+// timestamp_socket: ask the kernel for software receive timestamps
+int timestamp_socket(uv_tcp_t *tcp)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+  if (setsockopt(socket_fd(tcp), SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                 sizeof(flags)) != 0) {
+    return errno;
+  }
+
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// timestamp_waiting: peek at the first unread byte on tcp and return how
+// long ago the kernel received it. Software timestamps are taken from
+// CLOCK_REALTIME so the wait is measured against that clock.
+uint64_t timestamp_waiting(uv_tcp_t *tcp)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  char byte;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct timespec now;
+
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(socket_fd(tcp), &msg, MSG_PEEK | MSG_DONTWAIT) != 1) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SO_TIMESTAMPING) {
+      struct scm_timestamping ts;
+      uint64_t received, current;
+
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      received = (uint64_t)ts.ts[0].tv_sec * 1000000000ULL +
+                 (uint64_t)ts.ts[0].tv_nsec;
+      current = (uint64_t)now.tv_sec * 1000000000ULL +
+                (uint64_t)now.tv_nsec;
+
+      if (received == 0 || received > current) {
+        return 0;
+      }
+      return current - received;
+    }
+  }
+#endif
+
+  return 0;
+}
@@ -0,0 +1,39 @@
+// kssl_timestamp.h: kernel receive timestamps for measuring the time
+// requests wait in the socket
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_TIMESTAMP
+#define INCLUDED_KSSL_TIMESTAMP 1
+
+#include <uv.h>
+
+#include "kssl.h"
+
+// Server side latency is measured from the moment a worker reads a
+// request, which misses the time the request sat in the socket's receive
+// queue while the worker was busy. With SO_TIMESTAMPING the kernel
+// records when each packet arrived. libuv reads with read() which cannot
+// return those timestamps, so just before libuv reads a connection a
+// single byte is peeked with recvmsg(): its timestamp is the arrival
+// time of the oldest unread data.
+//
+// Only available on Linux.
+
+// timestamp_init: turn receive timestamps on or off. Returns 0 on
+// success or an errno value if they are not supported.
+int timestamp_init(int on);
+
+// timestamp_enabled: returns 1 if receive timestamps are on
+int timestamp_enabled(void);
+
+// timestamp_socket: ask the kernel to timestamp data received on tcp.
+// Returns 0 on success or an errno value.
+int timestamp_socket(uv_tcp_t *tcp);
+
+// timestamp_waiting: returns the time (ns) for which the oldest unread
+// data on tcp has been waiting in its receive queue or 0 if that is not
+// known (for example because there is no data)
+uint64_t timestamp_waiting(uv_tcp_t *tcp);
+
+#endif // INCLUDED_KSSL_TIMESTAMP
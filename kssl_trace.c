@@ -0,0 +1,148 @@
+// kssl_trace.c: slow request logging and sampled request tracing
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include "kssl_helpers.h"
+#include "kssl_log.h"
+#include "kssl_trace.h"
+
+// Requests slower than this many nanoseconds are logged. 0 disables.
+
+static uint64_t slow_ns = 0;
+
+// The Chrome trace file (NULL if tracing is disabled), the sampling rate
+// and the number of events written so far. Workers share the file so
+// writes are serialized by trace_lock; only sampled requests take it.
+
+static FILE *trace_fp = NULL;
+static int trace_sample = 1;
+static int trace_events = 0;
+static uv_mutex_t trace_lock;
+
+// trace_init: set the slow request threshold and open the trace file
+int trace_init(unsigned int slow_ms, const char *path, int sample)
+{
+  slow_ns = (uint64_t)slow_ms * 1000000;
+
+  if (path == NULL) {
+    return 0;
+  }
+
+  if (uv_mutex_init(&trace_lock) != 0) {
+    return 1;
+  }
+
+  trace_fp = fopen(path, "w");
+  if (trace_fp == NULL) {
+    uv_mutex_destroy(&trace_lock);
+    return 1;
+  }
+
+  trace_sample = (sample > 0)?sample:1;
+
+  // The JSON array format allows the closing ] to be missing so the file
+  // is usable even if keyless does not exit cleanly
+
+  fprintf(trace_fp, "[\n");
+
+  return 0;
+}
+
+// trace_set_slow: change the slow request threshold
+void trace_set_slow(unsigned int slow_ms)
+{
+  slow_ns = (uint64_t)slow_ms * 1000000;
+}
+
+// trace_set_sample: change the sampling rate. Each worker picks it up
+// after its next sampled request.
+void trace_set_sample(int sample)
+{
+  trace_sample = (sample > 0)?sample:1;
+}
+
+// trace_cleanup: terminate and close the trace file
+void trace_cleanup(void)
+{
+  if (trace_fp != NULL) {
+    fprintf(trace_fp, "\n]\n");
+    fclose(trace_fp);
+    trace_fp = NULL;
+    uv_mutex_destroy(&trace_lock);
+  }
+}
+
+// us: convert an interval between two uv_hrtime() values to microseconds
+static double us(uint64_t from, uint64_t to)
+{
+  return (double)elapsed_ns(from, to) / 1000.0;
+}
+
+// trace_event: write a single complete ("X") event. Must be called with
+// trace_lock held.
+static void trace_event(const char *name, int worker, kssl_header *header,
+                        uint64_t from, uint64_t to)
+{
+  if (from == 0 || to == 0) {
+    return;
+  }
+
+  fprintf(trace_fp, "%s{\"name\":\"%s\",\"cat\":\"kssl\",\"ph\":\"X\","
+          "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"id\":%u}}",
+          trace_events?",\n":"", name, (double)from / 1000.0, us(from, to),
+          worker, header->id);
+  trace_events += 1;
+}
+
+// trace_request: log the request if it was slow and write it to the
+// trace file if it is sampled
+void trace_request(int worker, int *countdown, kssl_header *header,
+                   kssl_op_info *info, kssl_request_times *times)
+{
+  kssl_step steps[KSSL_STEPS];
+  int i;
+
+  if (slow_ns == 0 && trace_fp == NULL) {
+    return;
+  }
+
+  request_steps(info, times, steps);
+
+  if (slow_ns != 0 && elapsed_ns(times->read, times->flushed) >= slow_ns) {
+    write_log(1, "slow request: id:%u, op:%s, key:%d, worker:%d, "
+              "total:%.0fus, queue:%.0fus, lock:%.0fus, parse:%.0fus, "
+              "lookup:%.0fus, crypto:%.0fus, respond:%.0fus, flush:%.0fus",
+              header->id, opstring(info->opcode), info->key_id, worker,
+              us(times->read, times->flushed),
+              us(steps[KSSL_STEP_QUEUE].from, steps[KSSL_STEP_QUEUE].to),
+              us(steps[KSSL_STEP_LOCK].from, steps[KSSL_STEP_LOCK].to),
+              us(steps[KSSL_STEP_PARSE].from, steps[KSSL_STEP_PARSE].to),
+              us(steps[KSSL_STEP_LOOKUP].from, steps[KSSL_STEP_LOOKUP].to),
+              us(steps[KSSL_STEP_CRYPTO].from, steps[KSSL_STEP_CRYPTO].to),
+              us(steps[KSSL_STEP_RESPOND].from, steps[KSSL_STEP_RESPOND].to),
+              us(steps[KSSL_STEP_FLUSH].from, steps[KSSL_STEP_FLUSH].to));
+  }
+
+  if (trace_fp != NULL) {
+    *countdown -= 1;
+    if (*countdown > 0) {
+      return;
+    }
+    *countdown = trace_sample;
+
+    uv_mutex_lock(&trace_lock);
+    trace_event(opstring(info->opcode), worker, header, times->read,
+                times->flushed);
+    for (i = 0; i < KSSL_STEPS; i++) {
+      trace_event(request_step_name(i), worker, header, steps[i].from,
+                  steps[i].to);
+    }
+    uv_mutex_unlock(&trace_lock);
+  }
+}
@@ -0,0 +1,34 @@
+// kssl_trace.h: slow request logging and sampled request tracing
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_TRACE
+#define INCLUDED_KSSL_TRACE 1
+
+#include "kssl.h"
+#include "kssl_metrics.h"
+
+// trace_init: any request that takes longer than slow_ms (if not 0)
+// will be logged with a breakdown of the time spent in each stage. If
+// path is not NULL then one in sample requests is written to path in
+// Chrome trace event format (load it in chrome://tracing). Returns 0 on
+// success.
+int trace_init(unsigned int slow_ms, const char *path, int sample);
+
+// trace_set_slow: change the slow request threshold (0 to stop logging
+// slow requests). Used by the admin socket.
+void trace_set_slow(unsigned int slow_ms);
+
+// trace_set_sample: change the trace file sampling rate. Used by the
+// admin socket.
+void trace_set_sample(int sample);
+
+// trace_cleanup: terminate and close the trace file
+void trace_cleanup(void);
+
+// trace_request: called once a request has been flushed. countdown is
+// private to the calling worker and is used to pick sampled requests.
+void trace_request(int worker, int *countdown, kssl_header *header,
+                   kssl_op_info *info, kssl_request_times *times);
+
+#endif // INCLUDED_KSSL_TRACE
@@ -0,0 +1,425 @@
+// kssl_upgrade.c: handing the listening sockets to a new keyless
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kssl_helpers.h"
+
+#if !PLATFORM_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "kssl_log.h"
+#include "kssl_upgrade.h"
+
+#if !PLATFORM_WINDOWS
+
+extern char **environ;
+
+// The new process finds its end of the upgrade socket on this descriptor
+
+#define UPGRADE_CHILD_FD 3
+#define UPGRADE_CHILD_ENV KSSL_UPGRADE_ENV "=3"
+
+// Sent by the new process once it is accepting connections
+
+#define UPGRADE_READY 'R'
+
+// In the new process: the socket to the old process or -1
+
+static int parent = -1;
+
+// In the old process: the socket to the new process and the callback to
+// make when it is ready (NULL if no upgrade is in progress)
+
+static uv_pipe_t *channel = NULL;
+static upgrade_cb ready_cb = NULL;
+static char channel_buffer[16];
+
+// send_fds: send the count descriptors in fds over the Unix socket
+// sock. One byte is sent for each, 1 if it is not -1 and so is sent.
+static int send_fds(int sock, int *fds, int count)
+{
+  char present[UPGRADE_FDS];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+  int i, n = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+
+  for (i = 0; i < count; i++) {
+    present[i] = (fds[i] != -1);
+    if (present[i]) {
+      memcpy(CMSG_DATA(cmsg) + n * sizeof(int), &fds[i], sizeof(int));
+      n += 1;
+    }
+  }
+
+  iov.iov_base = present;
+  iov.iov_len = count;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+
+  if (sendmsg(sock, &msg, 0) != count) {
+    return errno?errno:EPROTO;
+  }
+
+  return 0;
+}
+
+// recv_fds: receive count descriptors sent with send_fds on sock into
+// fds. Those that were not sent are set to -1.
+static int recv_fds(int sock, int *fds, int count)
+{
+  char present[UPGRADE_FDS];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+  ssize_t n;
+  int i, received = 0, used = 0;
+
+  iov.iov_base = present;
+  iov.iov_len = count;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  do {
+    n = recvmsg(sock, &msg, 0);
+  } while (n == -1 && errno == EINTR);
+
+  if (n == -1) {
+    return errno;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  }
+
+  for (i = 0; i < count; i++) {
+    fds[i] = -1;
+    if (i < n && present[i] && used < received) {
+      memcpy(&fds[i], CMSG_DATA(cmsg) + used * sizeof(int), sizeof(int));
+      used += 1;
+    }
+  }
+
+  // Every descriptor must have arrived and been placed or none of them
+  // can be trusted
+
+  if (n != count || used != received) {
+    for (i = 0; i < count; i++) {
+      if (fds[i] != -1) {
+        close(fds[i]);
+        fds[i] = -1;
+      }
+    }
+    for (; used < received; used++) {
+      int fd;
+
+      memcpy(&fd, CMSG_DATA(cmsg) + used * sizeof(int), sizeof(int));
+      close(fd);
+    }
+    return EPROTO;
+  }
+
+  return 0;
+}
+
+// upgrade_close_cb: free a handle once libuv has closed it
+static void upgrade_close_cb(uv_handle_t *handle)
+{
+  free(handle);
+}
+
+// finish: the new process is ready or has failed
+static void finish(int ok)
+{
+  upgrade_cb cb = ready_cb;
+
+  uv_close((uv_handle_t *)channel, upgrade_close_cb);
+  channel = NULL;
+  ready_cb = NULL;
+
+  cb(ok);
+}
+
+// channel_alloc_cb: provide the buffer the ready byte is read into
+static void channel_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+  buf->base = channel_buffer;
+  buf->len = sizeof(channel_buffer);
+}
+
+// channel_read_cb: the new process has written to the upgrade socket or
+// it has been closed because the new process exited
+static void channel_read_cb(uv_stream_t *stream, ssize_t nread,
+                            const uv_buf_t *buf)
+{
+  if (nread > 0) {
+    finish(buf->base[0] == UPGRADE_READY);
+  } else if (nread < 0) {
+    finish(0);
+  }
+}
+
+// process_exit_cb: the new process has exited. When it daemonizes this
+// is the parent that forked, so the upgrade socket (not the exit status)
+// decides whether the upgrade worked.
+static void process_exit_cb(uv_process_t *process, int64_t status,
+                            int signal)
+{
+  if (status != 0 || signal != 0) {
+    write_log(1, "Upgraded process %d exited with status %d signal %d",
+              process->pid, (int)status, signal);
+  }
+
+  uv_close((uv_handle_t *)process, upgrade_close_cb);
+}
+
+#endif
+
+// upgrade_inherit: if started by upgrade_start receive the listening
+// sockets
+int upgrade_inherit(int *fds)
+{
+#if !PLATFORM_WINDOWS
+  const char *env = getenv(KSSL_UPGRADE_ENV);
+#endif
+  int rc, i;
+
+  for (i = 0; i < UPGRADE_FDS; i++) {
+    fds[i] = -1;
+  }
+
+#if !PLATFORM_WINDOWS
+  if (env == NULL) {
+    return 0;
+  }
+
+  // Neither the descriptor nor the variable should be passed on to
+  // processes this one starts
+
+  parent = atoi(env);
+  unsetenv(KSSL_UPGRADE_ENV);
+  if (fcntl(parent, F_SETFD, FD_CLOEXEC) == -1) {
+    rc = errno;
+    parent = -1;
+    return rc;
+  }
+
+  rc = recv_fds(parent, fds, UPGRADE_FDS);
+  if (rc == 0) {
+    for (i = 0; i < UPGRADE_FDS; i++) {
+      if (fds[i] != -1) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+      }
+    }
+  }
+  return rc;
+#else
+  return 0;
+#endif
+}
+
+// upgrade_ready: tell the old process this one is accepting connections
+void upgrade_ready(void)
+{
+#if !PLATFORM_WINDOWS
+  char byte = UPGRADE_READY;
+
+  if (parent == -1) {
+    return;
+  }
+
+  if (write(parent, &byte, 1) != 1) {
+    write_log(1, "Failed to notify the previous keyless that this one is "
+              "ready");
+  }
+  close(parent);
+  parent = -1;
+#endif
+}
+
+// upgrade_start: start the new process and pass it the listening
+// sockets. They are written before the process starts so the new process
+// can read them as soon as it likes.
+int upgrade_start(uv_loop_t *loop, const char *file, char **args, int *fds,
+                  upgrade_cb cb)
+{
+#if !PLATFORM_WINDOWS
+  int sv[2];
+  int rc, i, n;
+  char **env;
+  uv_process_t *process;
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[UPGRADE_CHILD_FD + 1];
+
+  if (ready_cb != NULL) {
+    return EALREADY;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    return errno;
+  }
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+  rc = send_fds(sv[0], fds, UPGRADE_FDS);
+  if (rc != 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return rc;
+  }
+
+  // The new process gets this process's environment (without any
+  // KSSL_UPGRADE_ENV it was itself started with) and its end of the
+  // socket as UPGRADE_CHILD_FD
+
+  for (n = 0; environ[n] != NULL; n++) {
+  }
+  env = (char **)malloc((n + 2) * sizeof(char *));
+  process = (uv_process_t *)malloc(sizeof(uv_process_t));
+  channel = (uv_pipe_t *)malloc(sizeof(uv_pipe_t));
+  if (env == NULL || process == NULL || channel == NULL) {
+    free(env);
+    free(process);
+    free(channel);
+    channel = NULL;
+    close(sv[0]);
+    close(sv[1]);
+    return ENOMEM;
+  }
+
+  n = 0;
+  for (i = 0; environ[i] != NULL; i++) {
+    if (strncmp(environ[i], KSSL_UPGRADE_ENV "=",
+                strlen(KSSL_UPGRADE_ENV) + 1) != 0) {
+      env[n++] = environ[i];
+    }
+  }
+  env[n++] = UPGRADE_CHILD_ENV;
+  env[n] = NULL;
+
+  for (i = 0; i < UPGRADE_CHILD_FD; i++) {
+    stdio[i].flags = UV_INHERIT_FD;
+    stdio[i].data.fd = i;
+  }
+  stdio[UPGRADE_CHILD_FD].flags = UV_INHERIT_FD;
+  stdio[UPGRADE_CHILD_FD].data.fd = sv[1];
+
+  memset(&options, 0, sizeof(options));
+  options.exit_cb = process_exit_cb;
+  options.file = file;
+  options.args = args;
+  options.env = env;
+  options.flags = UV_PROCESS_DETACHED;
+  options.stdio_count = UPGRADE_CHILD_FD + 1;
+  options.stdio = stdio;
+
+  rc = uv_spawn(loop, process, &options);
+  free(env);
+  close(sv[1]);
+  if (rc != 0) {
+    uv_close((uv_handle_t *)process, upgrade_close_cb);
+    free(channel);
+    channel = NULL;
+    close(sv[0]);
+    return -rc;
+  }
+
+  // The new process outlives this one so it must not keep the loop
+  // running
+
+  uv_unref((uv_handle_t *)process);
+
+  rc = uv_pipe_init(loop, channel, 0);
+  if (rc != 0) {
+    free(channel);
+    channel = NULL;
+    close(sv[0]);
+  } else if ((rc = uv_pipe_open(channel, sv[0])) != 0) {
+    close(sv[0]);
+    uv_close((uv_handle_t *)channel, upgrade_close_cb);
+    channel = NULL;
+  } else if ((rc = uv_read_start((uv_stream_t *)channel, channel_alloc_cb,
+                                 channel_read_cb)) != 0) {
+    uv_close((uv_handle_t *)channel, upgrade_close_cb);
+    channel = NULL;
+  }
+
+  // Without the socket there is no way to know when the new process is
+  // ready, but it has been started and has the listening sockets
+
+  if (rc != 0) {
+    write_log(1, "Failed to watch upgraded process %d: %s", process->pid,
+              error_string(rc));
+    return -rc;
+  }
+
+  ready_cb = cb;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+// upgrade_pipe_bind: bind and listen on a Unix socket without libuv
+// knowing its path, as libuv removes the path of a pipe it bound when the
+// pipe is closed
+int upgrade_pipe_bind(uv_pipe_t *pipe, const char *path)
+{
+#if !PLATFORM_WINDOWS
+  struct sockaddr_un addr;
+  int fd, rc;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return UV_ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -errno;
+  }
+
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+      bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    rc = -errno;
+    close(fd);
+    return rc;
+  }
+
+  rc = uv_pipe_open(pipe, fd);
+  if (rc != 0) {
+    close(fd);
+  }
+  return rc;
+#else
+  return uv_pipe_bind(pipe, path);
+#endif
+}
@@ -0,0 +1,62 @@
+// kssl_upgrade.h: handing the listening sockets to a new keyless
+//
+// Copyright (c) 2014 CloudFlare, Inc.
+
+#ifndef INCLUDED_KSSL_UPGRADE
+#define INCLUDED_KSSL_UPGRADE 1
+
+#include <uv.h>
+
+#include "kssl.h"
+
+// A running keyless upgrades itself by starting a new copy of its
+// executable with the same arguments. The two are connected by a Unix
+// socket which the new process finds through KSSL_UPGRADE_ENV. The old
+// process sends its listening sockets over it (SCM_RIGHTS) so the new
+// process never binds and no connection is refused. The new process
+// loads its keys and starts its workers while the old one keeps
+// serving, then writes a single byte back to say it is accepting
+// connections. Only then does the old process stop accepting and drain.
+// Until then both processes answer on the metrics and health endpoints.
+//
+// Not available on Windows.
+
+#define KSSL_UPGRADE_ENV "KEYLESS_UPGRADE_FD"
+
+// The listening sockets passed to the new process. Each is -1 if the old
+// process does not have it.
+
+#define UPGRADE_LISTEN         0 // Key server
+#define UPGRADE_METRICS        1 // Metrics endpoint TCP port
+#define UPGRADE_METRICS_SOCKET 2 // Metrics endpoint Unix socket
+#define UPGRADE_HEALTH         3 // Health endpoint TCP port
+#define UPGRADE_HEALTH_SOCKET  4 // Health endpoint Unix socket
+#define UPGRADE_FDS            5
+
+// Called in the old process when the new one is accepting connections
+// (ok is 1) or has exited or failed before it was ready (ok is 0)
+
+typedef void (*upgrade_cb)(int ok);
+
+// upgrade_inherit: if this process was started by upgrade_start, receive
+// the UPGRADE_FDS listening sockets into fds. Otherwise they are all set
+// to -1. Returns 0 on success or an errno value.
+int upgrade_inherit(int *fds);
+
+// upgrade_ready: tell the process that started this one (if any) that
+// this one is now accepting connections
+void upgrade_ready(void);
+
+// upgrade_start: start a new process running file with args, pass it
+// the UPGRADE_FDS listening sockets in fds and call cb once it is ready
+// or has failed. Returns 0 on success or an errno value. Only one
+// upgrade may be in progress.
+int upgrade_start(uv_loop_t *loop, const char *file, char **args, int *fds,
+                  upgrade_cb cb);
+
+// upgrade_pipe_bind: like uv_pipe_bind except that closing pipe does not
+// remove path, which a process started by upgrade_start may still be
+// listening on. Returns 0 on success or a libuv error.
+int upgrade_pipe_bind(uv_pipe_t *pipe, const char *path);
+
+#endif // INCLUDED_KSSL_UPGRADE